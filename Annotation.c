@@ -0,0 +1,117 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "Annotation.h"
+#include "Log.h"
+#include "Port.h"
+#include "Recovery.h"
+
+static void expandAnnotation(const char *text, char *result, size_t size);
+
+/**
+ * Apply the configured annotation to the camera control port, whatever was applied before.
+ *
+ * This is used when the camera is configured, or when the annotation configuration changes.
+ *
+ * @param context global state
+ * @return non-zero on success; zero on error
+ */
+int applyAnnotation(PicamContext *context) {
+    expandAnnotation(context->config.annotation.text, context->annotationText, sizeof(context->annotationText));
+    return setAnnotation(context->cameraComponent->control, &context->config.annotation, context->annotationText);
+}
+
+/**
+ * Bring the annotation up-to-date immediately before a capture.
+ *
+ * Timestamp conversions in the text are expanded with the current time, and the annotation is sent
+ * to the camera only if the text that results differs from what was last applied, so a static
+ * annotation costs nothing per capture and a timestamp changes at most once a second.
+ *
+ * The caller must hold the pipeline lock.
+ *
+ * @param context global state
+ * @return non-zero on success; zero on error
+ */
+int refreshAnnotation(PicamContext *context) {
+    char text[ANNOTATION_MAX_TEXT];
+    expandAnnotation(context->config.annotation.text, text, sizeof(text));
+
+    if (strcmp(text, context->annotationText) == 0) {
+        return 1;
+    }
+
+    strcpy(context->annotationText, text);
+    return setAnnotation(context->cameraComponent->control, &context->config.annotation, context->annotationText);
+}
+
+/**
+ * Change the annotation text, without reconfiguring the camera.
+ *
+ * The other annotation settings are unchanged. The new text is rendered from the next frame, it is
+ * also kept in the configuration so it survives a pipeline recovery.
+ *
+ * @param context global state
+ * @param text new annotation text, which may contain strftime conversions; or empty for none
+ * @return non-zero on success; zero on error
+ */
+int setAnnotationText(PicamContext *context, const char *text) {
+    int result = lockPipeline(context);
+
+    pthread_mutex_lock(&context->configMutex);
+    snprintf(context->config.annotation.text, sizeof(context->config.annotation.text), "%s", text);
+    pthread_mutex_unlock(&context->configMutex);
+
+    if (result && !(result = refreshAnnotation(context))) {
+        logWarn("Failed to set annotation text");
+    }
+
+    unlockPipeline(context);
+
+    return result;
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Expand any strftime conversions in annotation text with the current local time.
+ *
+ * @param text annotation text
+ * @param result buffer to receive the expanded text
+ * @param size size of the buffer
+ */
+static void expandAnnotation(const char *text, char *result, size_t size) {
+    if (!strchr(text, '%')) {
+        snprintf(result, size, "%s", text);
+        return;
+    }
+
+    time_t    now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+
+    // Zero means either an empty result or an overflow, either way there is no usable text
+    if (strftime(result, size, text, &local) == 0) {
+        result[0] = '\0';
+    }
+}
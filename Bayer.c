@@ -0,0 +1,192 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+
+#include "Bayer.h"
+#include "Capture.h"
+#include "Log.h"
+
+/**
+ * Properties of a known sensor that are not recorded in the raw block header.
+ */
+typedef struct BayerSensor {
+    const char *name;
+    uint32_t    bitDepth;
+    uint32_t    blackLevel;
+} BayerSensor;
+
+static const BayerSensor bayerSensors[] = {
+    { "ov5647", 10, 16  },
+    { "imx219", 10, 64  },
+    { "imx477", 12, 256 }
+};
+
+static char *extractBayer(PicamContext *context, const PictureDelivery *delivery, bool demosaic, BayerFrame *frame);
+static const BayerSensor *findSensor(const char *name);
+
+/**
+ * Capture a picture with the sensor-raw Bayer data, and deliver the unpacked data.
+ *
+ * The firmware is asked to append the raw data to a JPEG, which is collected natively rather than
+ * delivered to a picture capture handler. The raw block is located after the end of the JPEG, and
+ * the packed 10 or 12-bit data is unpacked to 16 bits per pixel and optionally demosaiced to RGB.
+ * Both steps are split across cores, and use NEON where the CPU has it, see BayerUnpack.c.
+ *
+ * The bit depth and black level come from a table of known sensors, for an unknown sensor the bit
+ * depth is inferred from the row stride and the black level is reported as zero.
+ *
+ * @param context global state
+ * @param demosaic true to also deliver demosaiced RGB data; false for the raw data only
+ * @param sink receives the raw data
+ * @param userdata passed to the sink
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *captureBayer(PicamContext *context, bool demosaic, BayerSink sink, void *userdata) {
+    EncoderConfig jpeg = {
+        .encoding = MMAL_ENCODING_JPEG,
+        .quality  = context->config.encoder.quality
+    };
+
+    PictureDelivery delivery = {
+        .data = &context->pictureData,
+        .raw  = true
+    };
+
+    char *captureFailure = performCaptureWithRetries(context, OUTPUT_ENCODED, &jpeg, &delivery);
+    if (captureFailure) {
+        return captureFailure;
+    }
+
+    BayerFrame frame;
+
+    char *extractFailure = extractBayer(context, &delivery, demosaic, &frame);
+    if (extractFailure) {
+        return extractFailure;
+    }
+
+    sink(userdata, &frame);
+
+    return NULL;
+}
+
+/**
+ * Destroy the raw capture buffers.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param context global state
+ */
+void destroyBayer(PicamContext *context) {
+    freeBytes(&context->pictureData);
+    freeBytes(&context->bayerRaw);
+    freeBytes(&context->bayerRgb);
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Locate the raw block in the collected picture data, and unpack (and demosaic) it.
+ *
+ * @param context global state
+ * @param delivery delivery the picture was collected by
+ * @param demosaic true to demosaic
+ * @param frame set to describe the unpacked data
+ * @return NULL on success; otherwise a description of the failure
+ */
+static char *extractBayer(PicamContext *context, const PictureDelivery *delivery, bool demosaic, BayerFrame *frame) {
+    const JpegInfo *info = &delivery->info;
+    const Bytes    *data = delivery->data;
+
+    if (!info->valid || info->length > data->length) {
+        return "Captured picture is not a valid JPEG";
+    }
+
+    const uint8_t *block = memmem(data->data + info->length, data->length - info->length, "BRCM", 4);
+    if (!block) {
+        return "Captured picture does not contain raw data";
+    }
+
+    BayerHeader header;
+
+    if (!readBayerHeader(block, data->length - (block - data->data), &header)) {
+        return "Raw data header is truncated";
+    }
+
+    uint32_t width      = header.width;
+    uint32_t height     = header.height;
+    uint32_t bayerOrder = header.bayerOrder;
+
+    const BayerSensor *sensor = findSensor(header.name);
+    if (!sensor) {
+        sensor = findSensor(context->sensor.name);
+    }
+
+    uint32_t bitDepth;
+    if (sensor) {
+        bitDepth = sensor->bitDepth;
+    } else {
+        bitDepth = header.packedLength >= (size_t) bayerStride(&header, 12) * height ? 12 : 10;
+    }
+
+    uint32_t stride = bayerStride(&header, bitDepth);
+
+    if (width < 2 || height < 2 || bayerOrder > BAYER_ORDER_GRBG || header.packedLength < (size_t) stride * height) {
+        logError("Bad raw data: sensor %s, %ux%u+%u, order %u, %u bits, %zu bytes", header.name, width, height, header.paddingRight, bayerOrder, bitDepth, header.packedLength);
+        return "Raw data is not valid";
+    }
+
+    size_t pixels = (size_t) width * height;
+
+    if (!reserveBytes(&context->bayerRaw, pixels * sizeof(uint16_t)) || (demosaic && !reserveBytes(&context->bayerRgb, pixels * 3 * sizeof(uint16_t)))) {
+        return "Failed to allocate raw data buffers";
+    }
+
+    uint16_t *raw = (uint16_t *) context->bayerRaw.data;
+    uint16_t *rgb = demosaic ? (uint16_t *) context->bayerRgb.data : NULL;
+
+    unpackBayer(header.packed, stride, width, height, bitDepth, raw);
+
+    if (demosaic) {
+        demosaicBayer(raw, width, height, bayerOrder, rgb);
+    }
+
+    frame->width      = width;
+    frame->height     = height;
+    frame->bitDepth   = bitDepth;
+    frame->bayerOrder = bayerOrder;
+    frame->blackLevel = sensor ? sensor->blackLevel : 0;
+    frame->raw        = raw;
+    frame->rgb        = rgb;
+
+    logDebug("Raw data: sensor %s, %ux%u+%u, order %u, %u bits", header.name, width, height, header.paddingRight, bayerOrder, bitDepth);
+
+    return NULL;
+}
+
+static const BayerSensor *findSensor(const char *name) {
+    for (size_t i = 0; i < sizeof(bayerSensors) / sizeof(bayerSensors[0]); i++) {
+        if (strncmp(name, bayerSensors[i].name, strlen(bayerSensors[i].name)) == 0) {
+            return &bayerSensors[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,183 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * NEON raw Bayer unpack and demosaic row kernels.
+ *
+ * This file is compiled with NEON enabled, and the kernels are only called after checking the CPU
+ * at runtime. If NEON is not available to the compiler at all, the kernels are simply left out.
+ *
+ * Each unpack step unpacks eight pixels from a sixteen byte load, so the vector loop stops while
+ * there are still enough packed bytes left in the row for the load, and the rest of the row is
+ * unpacked a pixel at a time.
+ *
+ * Each demosaic step demosaics eight pixels, which needs the neighbours either side, so the first
+ * pixel and the tail of the row (where the neighbours are mirrored) are demosaiced a pixel at a
+ * time. The results must match the generic kernel in BayerUnpack.c exactly.
+ */
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+
+void unpackRaw10Neon(const uint8_t *packed, uint32_t width, uint16_t *out);
+void unpackRaw12Neon(const uint8_t *packed, uint32_t width, uint16_t *out);
+void demosaicRowNeon(const uint16_t *above, const uint16_t *row, const uint16_t *below, uint32_t width, const uint8_t *colours, uint16_t *out);
+
+static void demosaicPixel(const uint16_t *above, const uint16_t *row, const uint16_t *below, uint32_t width, const uint8_t *colours, uint32_t x, uint16_t *out);
+
+void unpackRaw10Neon(const uint8_t *packed, uint32_t width, uint16_t *out) {
+    static const uint8_t highIndex[8] = { 0, 1, 2, 3, 5, 6, 7, 8 };
+    static const uint8_t lowIndex [8] = { 4, 4, 4, 4, 9, 9, 9, 9 };
+    static const int8_t  lowShift [8] = { 0, -2, -4, -6, 0, -2, -4, -6 };
+
+    const uint8x8_t high  = vld1_u8(highIndex);
+    const uint8x8_t low   = vld1_u8(lowIndex);
+    const int8x8_t  shift = vld1_s8(lowShift);
+    const uint8x8_t mask  = vdup_n_u8(0x3);
+
+    uint32_t packedLength = width / 4 * 5;
+    uint32_t x = 0;
+
+    for (; x + 8 <= width && x / 4 * 5 + 16 <= packedLength; x += 8) {
+        const uint8_t *group = packed + x / 4 * 5;
+
+        uint8x8x2_t bytes = {{ vld1_u8(group), vld1_u8(group + 8) }};
+
+        uint8x8_t highBits = vtbl2_u8(bytes, high);
+        uint8x8_t lowBits  = vand_u8(vshl_u8(vtbl2_u8(bytes, low), shift), mask);
+
+        vst1q_u16(out + x, vorrq_u16(vshll_n_u8(highBits, 2), vmovl_u8(lowBits)));
+    }
+
+    for (; x < width; x++) {
+        const uint8_t *group = packed + (x / 4) * 5;
+        out[x] = (uint16_t) (group[x % 4] << 2 | ((group[4] >> ((x % 4) * 2)) & 0x3));
+    }
+}
+
+void unpackRaw12Neon(const uint8_t *packed, uint32_t width, uint16_t *out) {
+    static const uint8_t highIndex[8] = { 0, 1, 3, 4, 6, 7, 9, 10 };
+    static const uint8_t lowIndex [8] = { 2, 2, 5, 5, 8, 8, 11, 11 };
+    static const int8_t  lowShift [8] = { 0, -4, 0, -4, 0, -4, 0, -4 };
+
+    const uint8x8_t high  = vld1_u8(highIndex);
+    const uint8x8_t low   = vld1_u8(lowIndex);
+    const int8x8_t  shift = vld1_s8(lowShift);
+    const uint8x8_t mask  = vdup_n_u8(0xF);
+
+    uint32_t packedLength = width / 2 * 3;
+    uint32_t x = 0;
+
+    for (; x + 8 <= width && x / 2 * 3 + 16 <= packedLength; x += 8) {
+        const uint8_t *group = packed + x / 2 * 3;
+
+        uint8x8x2_t bytes = {{ vld1_u8(group), vld1_u8(group + 8) }};
+
+        uint8x8_t highBits = vtbl2_u8(bytes, high);
+        uint8x8_t lowBits  = vand_u8(vshl_u8(vtbl2_u8(bytes, low), shift), mask);
+
+        vst1q_u16(out + x, vorrq_u16(vshll_n_u8(highBits, 4), vmovl_u8(lowBits)));
+    }
+
+    for (; x < width; x++) {
+        const uint8_t *group = packed + (x / 2) * 3;
+        out[x] = (uint16_t) (group[x % 2] << 4 | ((group[2] >> ((x % 2) * 4)) & 0xF));
+    }
+}
+
+void demosaicRowNeon(const uint16_t *above, const uint16_t *row, const uint16_t *below, uint32_t width, const uint8_t *colours, uint16_t *out) {
+    // Lanes holding an odd x, the vector loop always starts at an odd x
+    static const uint16_t oddLanes[8] = { 0xFFFF, 0, 0xFFFF, 0, 0xFFFF, 0, 0xFFFF, 0 };
+
+    // One of the two sites on a row is green, the other is the red or blue "row colour"
+    const bool       greenOdd  = colours[1] == 1;
+    const bool       redRow    = (greenOdd ? colours[0] : colours[1]) == 0;
+    const uint16x8_t odd       = vld1q_u16(oddLanes);
+    const uint16x8_t greenMask = greenOdd ? odd : vmvnq_u16(odd);
+
+    demosaicPixel(above, row, below, width, colours, 0, out);
+
+    uint32_t x = 1;
+
+    for (; x + 8 < width; x += 8) {
+        uint16x8_t centre     = vld1q_u16(row + x);
+        uint16x8_t left       = vld1q_u16(row + x - 1);
+        uint16x8_t right      = vld1q_u16(row + x + 1);
+        uint16x8_t up         = vld1q_u16(above + x);
+        uint16x8_t down       = vld1q_u16(below + x);
+        uint16x8_t upLeft     = vld1q_u16(above + x - 1);
+        uint16x8_t upRight    = vld1q_u16(above + x + 1);
+        uint16x8_t downLeft   = vld1q_u16(below + x - 1);
+        uint16x8_t downRight  = vld1q_u16(below + x + 1);
+
+        // Sums of four samples of at most 14 bits can not overflow
+        uint16x8_t horizontal = vrhaddq_u16(left, right);
+        uint16x8_t vertical   = vrhaddq_u16(up, down);
+        uint16x8_t edges      = vrshrq_n_u16(vaddq_u16(vaddq_u16(left, right), vaddq_u16(up, down)), 2);
+        uint16x8_t corners    = vrshrq_n_u16(vaddq_u16(vaddq_u16(upLeft, upRight), vaddq_u16(downLeft, downRight)), 2);
+
+        // Green sites take the row colour from the row, and the other from the column
+        uint16x8_t rowColour   = vbslq_u16(greenMask, horizontal, centre);
+        uint16x8_t otherColour = vbslq_u16(greenMask, vertical, corners);
+
+        uint16x8x3_t rgb;
+        rgb.val[0] = redRow ? rowColour : otherColour;
+        rgb.val[1] = vbslq_u16(greenMask, centre, edges);
+        rgb.val[2] = redRow ? otherColour : rowColour;
+
+        vst3q_u16(out + x * 3, rgb);
+    }
+
+    for (; x < width; x++) {
+        demosaicPixel(above, row, below, width, colours, x, out);
+    }
+}
+
+/**
+ * Demosaic a single pixel, as the generic kernel does.
+ */
+static void demosaicPixel(const uint16_t *above, const uint16_t *row, const uint16_t *below, uint32_t width, const uint8_t *colours, uint32_t x, uint16_t *out) {
+    uint32_t left   = x > 0 ? x - 1 : x + 1;
+    uint32_t right  = x + 1 < width ? x + 1 : x - 1;
+    uint32_t colour = colours[x & 1];
+
+    out += x * 3;
+
+    if (colour == 1) {
+        uint32_t horizontal = (row[left] + row[right] + 1) >> 1;
+        uint32_t vertical   = (above[x] + below[x] + 1) >> 1;
+        uint32_t rowColour  = colours[(x + 1) & 1];
+
+        out[0] = rowColour == 0 ? horizontal : vertical;
+        out[1] = row[x];
+        out[2] = rowColour == 0 ? vertical : horizontal;
+    } else {
+        uint32_t edges   = (row[left] + row[right] + above[x] + below[x] + 2) >> 2;
+        uint32_t corners = (above[left] + above[right] + below[left] + below[right] + 2) >> 2;
+
+        out[colour    ] = row[x];
+        out[1         ] = edges;
+        out[2 - colour] = corners;
+    }
+}
+
+#endif
@@ -0,0 +1,294 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <string.h>
+
+#include "BayerUnpack.h"
+#include "Cpu.h"
+#include "Parallel.h"
+
+/**
+ * Layout of the raw block the firmware appends to the JPEG.
+ *
+ * The block starts with a "BRCM" tag and a fixed size header, the packed Bayer data follows the
+ * header. Each row of the packed data holds the image width plus the right padding reported in
+ * the header, packed in whole groups of pixels, and is then padded to a multiple of 32 bytes.
+ */
+#define BRCM_HEADER_SIZE          32768
+#define BRCM_INFO_OFFSET          176
+#define BRCM_WIDTH_OFFSET         (BRCM_INFO_OFFSET + 32)
+#define BRCM_HEIGHT_OFFSET        (BRCM_INFO_OFFSET + 34)
+#define BRCM_PADDING_RIGHT_OFFSET (BRCM_INFO_OFFSET + 36)
+#define BRCM_ORDER_OFFSET         (BRCM_INFO_OFFSET + 68)
+#define BRCM_ROW_ALIGN            32
+
+/**
+ * An unpack, shared by every band.
+ */
+typedef struct UnpackTask {
+    const uint8_t   *packed;
+    uint32_t         stride;
+    uint32_t         width;
+    uint16_t        *raw;
+    UnpackRowKernel  kernel;
+} UnpackTask;
+
+/**
+ * A demosaic, shared by every band.
+ */
+typedef struct DemosaicTask {
+    const uint16_t    *raw;
+    uint32_t           width;
+    uint32_t           height;
+    uint32_t           bayerOrder;
+    uint16_t          *rgb;
+    DemosaicRowKernel  kernel;
+} DemosaicTask;
+
+/**
+ * NEON row kernels, only present if the library was built with the NEON sources.
+ */
+extern void unpackRaw10Neon(const uint8_t *packed, uint32_t width, uint16_t *out) __attribute__((weak));
+extern void unpackRaw12Neon(const uint8_t *packed, uint32_t width, uint16_t *out) __attribute__((weak));
+extern void demosaicRowNeon(const uint16_t *above, const uint16_t *row, const uint16_t *below, uint32_t width, const uint8_t *colours, uint16_t *out) __attribute__((weak));
+
+static UnpackRowKernel selectUnpackKernel(uint32_t bitDepth);
+static DemosaicRowKernel selectDemosaicKernel(void);
+static void unpackRaw10Generic(const uint8_t *packed, uint32_t width, uint16_t *out);
+static void unpackRaw12Generic(const uint8_t *packed, uint32_t width, uint16_t *out);
+static void demosaicRowGeneric(const uint16_t *above, const uint16_t *row, const uint16_t *below, uint32_t width, const uint8_t *colours, uint16_t *out);
+static void unpackBand(void *userdata, uint32_t startRow, uint32_t endRow);
+static void demosaicBand(void *userdata, uint32_t startRow, uint32_t endRow);
+static uint32_t read16(const uint8_t *data);
+
+/**
+ * Read the header of a raw block.
+ *
+ * The header fields are only read, not checked - the caller must check them against the length of
+ * the packed data once the bit depth is known.
+ *
+ * @param block raw block, starting with the "BRCM" tag
+ * @param length length of the raw block, including the packed data
+ * @param header set to the header fields
+ * @return non-zero on success; zero if the block is too short to hold the header
+ */
+int readBayerHeader(const uint8_t *block, size_t length, BayerHeader *header) {
+    if (length < BRCM_HEADER_SIZE) {
+        return 0;
+    }
+
+    memset(header->name, 0, sizeof(header->name));
+    memcpy(header->name, block + BRCM_INFO_OFFSET, BAYER_NAME_LENGTH);
+
+    header->width        = read16(block + BRCM_WIDTH_OFFSET);
+    header->height       = read16(block + BRCM_HEIGHT_OFFSET);
+    header->paddingRight = read16(block + BRCM_PADDING_RIGHT_OFFSET);
+    header->bayerOrder   = block[BRCM_ORDER_OFFSET];
+    header->packed       = block + BRCM_HEADER_SIZE;
+    header->packedLength = length - BRCM_HEADER_SIZE;
+
+    return 1;
+}
+
+/**
+ * Get the distance between rows of the packed data.
+ *
+ * @param header raw block header
+ * @param bitDepth bits per pixel, 10 or 12
+ * @return row stride, in bytes
+ */
+uint32_t bayerStride(const BayerHeader *header, uint32_t bitDepth) {
+    uint32_t pixels = header->width + header->paddingRight;
+    // Pixels are packed in whole groups, including any partial group at the end of the row
+    uint32_t bytes  = bitDepth == 12 ? (pixels + 1) / 2 * 3 : (pixels + 3) / 4 * 5;
+    return (bytes + BRCM_ROW_ALIGN - 1) / BRCM_ROW_ALIGN * BRCM_ROW_ALIGN;
+}
+
+/**
+ * Unpack packed 10 or 12-bit Bayer data to 16 bits per pixel.
+ *
+ * The work is split into horizontal bands across several threads, and the row kernel is selected
+ * at runtime for the CPU.
+ *
+ * @param packed packed data
+ * @param stride distance between packed rows, in bytes
+ * @param width image width, in pixels
+ * @param height image height, in pixels
+ * @param bitDepth bits per pixel, 10 or 12
+ * @param raw unpacked data, width times height pixels
+ */
+void unpackBayer(const uint8_t *packed, uint32_t stride, uint32_t width, uint32_t height, uint32_t bitDepth, uint16_t *raw) {
+    UnpackTask task = {
+        .packed = packed,
+        .stride = stride,
+        .width  = width,
+        .raw    = raw,
+        .kernel = selectUnpackKernel(bitDepth)
+    };
+
+    runParallel(height, 1, unpackBand, &task);
+}
+
+/**
+ * Bilinear demosaic of unpacked Bayer data to 16-bit RGB.
+ *
+ * Each missing colour is the average of the nearest pixels of that colour - the four edge or four
+ * corner neighbours for red and blue sites, the two horizontal or two vertical neighbours for
+ * green sites. Neighbours outside the image are mirrored, which keeps the colour pattern intact.
+ *
+ * The work is split into horizontal bands across several threads, and the row kernel is selected
+ * at runtime for the CPU.
+ *
+ * @param raw unpacked data, at most 14 bits per pixel
+ * @param width image width, at least 2 pixels
+ * @param height image height, at least 2 pixels
+ * @param bayerOrder Bayer order of the data
+ * @param rgb demosaiced data, three samples per pixel
+ */
+void demosaicBayer(const uint16_t *raw, uint32_t width, uint32_t height, uint32_t bayerOrder, uint16_t *rgb) {
+    DemosaicTask task = {
+        .raw        = raw,
+        .width      = width,
+        .height     = height,
+        .bayerOrder = bayerOrder,
+        .rgb        = rgb,
+        .kernel     = selectDemosaicKernel()
+    };
+
+    runParallel(height, 2, demosaicBand, &task);
+}
+
+// === Private implementation =====================================================================
+
+static UnpackRowKernel selectUnpackKernel(uint32_t bitDepth) {
+    bool neon = cpuHasFeature(CPU_FEATURE_NEON);
+    if (bitDepth == 12) {
+        return unpackRaw12Neon && neon ? unpackRaw12Neon : unpackRaw12Generic;
+    }
+    return unpackRaw10Neon && neon ? unpackRaw10Neon : unpackRaw10Generic;
+}
+
+static DemosaicRowKernel selectDemosaicKernel(void) {
+    if (demosaicRowNeon && cpuHasFeature(CPU_FEATURE_NEON)) {
+        return demosaicRowNeon;
+    }
+    return demosaicRowGeneric;
+}
+
+/**
+ * Unpack one row of 10-bit data - every four pixels are packed in five bytes, the high eight bits
+ * of each pixel followed by a byte holding the low two bits of all four.
+ *
+ * @param packed packed row
+ * @param width number of pixels in the row
+ * @param out unpacked row
+ */
+static void unpackRaw10Generic(const uint8_t *packed, uint32_t width, uint16_t *out) {
+    for (uint32_t x = 0; x < width; x++) {
+        const uint8_t *group = packed + (x / 4) * 5;
+        out[x] = (uint16_t) (group[x % 4] << 2 | ((group[4] >> ((x % 4) * 2)) & 0x3));
+    }
+}
+
+/**
+ * Unpack one row of 12-bit data - every two pixels are packed in three bytes, the high eight bits
+ * of each pixel followed by a byte holding the low four bits of both.
+ *
+ * @param packed packed row
+ * @param width number of pixels in the row
+ * @param out unpacked row
+ */
+static void unpackRaw12Generic(const uint8_t *packed, uint32_t width, uint16_t *out) {
+    for (uint32_t x = 0; x < width; x++) {
+        const uint8_t *group = packed + (x / 2) * 3;
+        out[x] = (uint16_t) (group[x % 2] << 4 | ((group[2] >> ((x % 2) * 4)) & 0xF));
+    }
+}
+
+/**
+ * Demosaic one row.
+ *
+ * The arithmetic must match the SIMD kernels exactly, so results do not depend on the CPU.
+ *
+ * @param above row above, mirrored at the top of the image
+ * @param row row to demosaic
+ * @param below row below, mirrored at the bottom of the image
+ * @param width number of pixels in the row
+ * @param colours colour of the even and odd sites in the row: 0 red, 1 green, 2 blue
+ * @param out demosaiced row, three samples per pixel
+ */
+static void demosaicRowGeneric(const uint16_t *above, const uint16_t *row, const uint16_t *below, uint32_t width, const uint8_t *colours, uint16_t *out) {
+    for (uint32_t x = 0; x < width; x++, out += 3) {
+        uint32_t left   = x > 0 ? x - 1 : x + 1;
+        uint32_t right  = x + 1 < width ? x + 1 : x - 1;
+        uint32_t colour = colours[x & 1];
+
+        if (colour == 1) {
+            uint32_t horizontal = (row[left] + row[right] + 1) >> 1;
+            uint32_t vertical   = (above[x] + below[x] + 1) >> 1;
+            // The horizontal neighbours are the other colour on this row
+            uint32_t rowColour  = colours[(x + 1) & 1];
+
+            out[0] = rowColour == 0 ? horizontal : vertical;
+            out[1] = row[x];
+            out[2] = rowColour == 0 ? vertical : horizontal;
+        } else {
+            uint32_t edges   = (row[left] + row[right] + above[x] + below[x] + 2) >> 2;
+            uint32_t corners = (above[left] + above[right] + below[left] + below[right] + 2) >> 2;
+
+            out[colour    ] = row[x];
+            out[1         ] = edges;
+            out[2 - colour] = corners;
+        }
+    }
+}
+
+static void unpackBand(void *userdata, uint32_t startRow, uint32_t endRow) {
+    UnpackTask *task = (UnpackTask *) userdata;
+    for (uint32_t row = startRow; row < endRow; row++) {
+        task->kernel(task->packed + (size_t) row * task->stride, task->width, task->raw + (size_t) row * task->width);
+    }
+}
+
+static void demosaicBand(void *userdata, uint32_t startRow, uint32_t endRow) {
+    // Colour of each site in the top-left 2x2 pixels, for each Bayer order: 0 red, 1 green, 2 blue
+    static const uint8_t patterns[4][4] = {
+        { 0, 1, 1, 2 },
+        { 1, 2, 0, 1 },
+        { 2, 1, 1, 0 },
+        { 1, 0, 2, 1 }
+    };
+
+    DemosaicTask  *task    = (DemosaicTask *) userdata;
+    const uint8_t *pattern = patterns[task->bayerOrder];
+    uint32_t       width   = task->width;
+    uint32_t       height  = task->height;
+
+    for (uint32_t y = startRow; y < endRow; y++) {
+        const uint16_t *row   = task->raw + (size_t) y * width;
+        const uint16_t *above = task->raw + (size_t) (y > 0 ? y - 1 : y + 1) * width;
+        const uint16_t *below = task->raw + (size_t) (y + 1 < height ? y + 1 : y - 1) * width;
+
+        task->kernel(above, row, below, width, pattern + (y & 1) * 2, task->rgb + (size_t) y * width * 3);
+    }
+}
+
+static uint32_t read16(const uint8_t *data) {
+    return (uint32_t) data[0] | (uint32_t) data[1] << 8;
+}
@@ -0,0 +1,67 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_BAYER_UNPACK_H
+#define _PICAM_BAYER_UNPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Bayer orders, as reported in the raw block header - the colours of the top-left 2x2 pixels.
+ */
+#define BAYER_ORDER_RGGB 0
+#define BAYER_ORDER_GBRG 1
+#define BAYER_ORDER_BGGR 2
+#define BAYER_ORDER_GRBG 3
+
+/**
+ * Maximum length of the sensor name in the raw block header.
+ */
+#define BAYER_NAME_LENGTH 32
+
+/**
+ * The fields of the raw block header, see BayerUnpack.c.
+ */
+typedef struct BayerHeader {
+    char           name[BAYER_NAME_LENGTH + 1];
+    uint32_t       width;
+    uint32_t       height;
+    uint32_t       paddingRight;
+    uint32_t       bayerOrder;
+    const uint8_t *packed;
+    size_t         packedLength;
+} BayerHeader;
+
+/**
+ * Row kernel that unpacks packed Bayer data, see BayerUnpack.c.
+ */
+typedef void (*UnpackRowKernel)(const uint8_t *packed, uint32_t width, uint16_t *out);
+
+/**
+ * Row kernel that demosaics one row of Bayer data, see BayerUnpack.c.
+ */
+typedef void (*DemosaicRowKernel)(const uint16_t *above, const uint16_t *row, const uint16_t *below, uint32_t width, const uint8_t *colours, uint16_t *out);
+
+int readBayerHeader(const uint8_t *block, size_t length, BayerHeader *header);
+uint32_t bayerStride(const BayerHeader *header, uint32_t bitDepth);
+void unpackBayer(const uint8_t *packed, uint32_t stride, uint32_t width, uint32_t height, uint32_t bitDepth, uint16_t *raw);
+void demosaicBayer(const uint16_t *raw, uint32_t width, uint32_t height, uint32_t bayerOrder, uint16_t *rgb);
+
+#endif // _PICAM_BAYER_UNPACK_H
@@ -0,0 +1,173 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <string.h>
+
+#include "Bracket.h"
+#include "Camera.h"
+#include "Capture.h"
+#include "Fusion.h"
+#include "Log.h"
+#include "RawCapture.h"
+
+static char *captureBracketFrames(PicamContext *context, const BracketSetting *settings, uint32_t count, uint32_t settle);
+static char *deliverImage(PicamContext *context, const Image *image, uint32_t index, bool encode, RegionSink sink, void *userdata, bool *more);
+
+/**
+ * Capture a bracket of differently exposed frames back-to-back.
+ *
+ * Each exposure is applied to the live camera between frames, so the pipeline is never rebuilt,
+ * and the frames are captured raw. The configured exposure, or the locked exposure if it is locked,
+ * is restored afterwards whether or not the bracket succeeded.
+ *
+ * When fused, the frames are merged natively into a single picture; otherwise each frame is
+ * delivered in turn. The total time taken for the bracket, including any merge, is recorded in the
+ * statistics.
+ *
+ * @param context global state
+ * @param settings exposure for each frame
+ * @param count number of frames, at most BRACKET_MAX_FRAMES
+ * @param settle time to wait, in milliseconds, for each new exposure to take effect before capturing
+ * @param fuse true to deliver a single fused picture; false to deliver each frame
+ * @param encode true to encode the output with the configured encoding; false for I420 data
+ * @param sink receives the output, tagged with the frame index, or zero when fused
+ * @param userdata passed to the sink
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *captureBracket(PicamContext *context, const BracketSetting *settings, uint32_t count, uint32_t settle, bool fuse, bool encode, RegionSink sink, void *userdata) {
+    if (count == 0 || count > BRACKET_MAX_FRAMES) {
+        return "Invalid number of bracket exposures";
+    }
+
+    uint64_t start = vcos_getmicrosecs64();
+
+    char *captureFailure = captureBracketFrames(context, settings, count, settle);
+
+    if (!restoreLiveExposure(context)) {
+        logWarn("Failed to restore exposure after bracket");
+    }
+
+    if (captureFailure) {
+        return captureFailure;
+    }
+
+    char *failure = NULL;
+    bool  more    = true;
+
+    if (fuse) {
+        if (fuseExposures(context->bracketFrames, count, &context->regionImage)) {
+            failure = deliverImage(context, &context->regionImage, 0, encode, sink, userdata, &more);
+        } else {
+            failure = "Failed to fuse bracket exposures";
+        }
+    } else {
+        for (uint32_t i = 0; i < count && more && !failure; i++) {
+            failure = deliverImage(context, &context->bracketFrames[i], i, encode, sink, userdata, &more);
+        }
+    }
+
+    context->stats.lastBracketTime = vcos_getmicrosecs64() - start;
+
+    logDebug("Bracket of %u took %lluus", count, (unsigned long long) context->stats.lastBracketTime);
+
+    return failure;
+}
+
+/**
+ * Destroy the bracket frames.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param context global state
+ */
+void destroyBracket(PicamContext *context) {
+    for (int i = 0; i < BRACKET_MAX_FRAMES; i++) {
+        freeImage(&context->bracketFrames[i]);
+    }
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Capture each frame of the bracket, copying it out of the raw frame.
+ *
+ * @param context global state
+ * @param settings exposure for each frame
+ * @param count number of frames
+ * @param settle time to wait, in milliseconds, for each new exposure to take effect
+ * @return NULL on success; otherwise a description of the failure
+ */
+static char *captureBracketFrames(PicamContext *context, const BracketSetting *settings, uint32_t count, uint32_t settle) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (!applyLiveExposure(context, settings[i].exposureCompensation, settings[i].shutterSpeed)) {
+            return "Failed to apply bracket exposure";
+        }
+
+        if (settle) {
+            vcos_sleep(settle);
+        }
+
+        char *captureFailure = performCaptureWithRetries(context, OUTPUT_RAW, NULL, NULL);
+        if (captureFailure) {
+            return captureFailure;
+        }
+
+        if (!rawFrameComplete(context)) {
+            return "Raw capture did not deliver a complete frame";
+        }
+
+        const Image *frame = &context->rawFrame;
+        Image       *copy  = &context->bracketFrames[i];
+
+        if (!allocateImage(copy, frame->width, frame->height, frame->stride, frame->sliceHeight)) {
+            return "Failed to allocate bracket frame";
+        }
+
+        memcpy(copy->data, frame->data, imageSize(frame));
+    }
+    return NULL;
+}
+
+/**
+ * Deliver one output image, encoding it first if required.
+ *
+ * @param context global state
+ * @param image image to deliver
+ * @param index output index passed to the sink
+ * @param encode true to encode the image; false for I420 data
+ * @param sink receives the output
+ * @param userdata passed to the sink
+ * @param more set to false if the sink does not want any more output
+ * @return NULL on success; otherwise a description of the failure
+ */
+static char *deliverImage(PicamContext *context, const Image *image, uint32_t index, bool encode, RegionSink sink, void *userdata, bool *more) {
+    const uint8_t *data   = image->data;
+    size_t         length = imageSize(image);
+
+    if (encode) {
+        char *encodeFailure = encodeImage(context, image, &data, &length);
+        if (encodeFailure) {
+            return encodeFailure;
+        }
+    }
+
+    *more = sink(userdata, index, data, length) != 0;
+
+    return NULL;
+}
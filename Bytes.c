@@ -0,0 +1,91 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Bytes.h"
+
+/**
+ * Make sure a byte buffer has at least the given capacity.
+ *
+ * @param bytes byte buffer
+ * @param capacity required capacity
+ * @return non-zero on success; zero if the memory could not be allocated
+ */
+int reserveBytes(Bytes *bytes, size_t capacity) {
+    if (capacity <= bytes->capacity) {
+        return 1;
+    }
+
+    size_t newCapacity = bytes->capacity ? bytes->capacity : 65536;
+    while (newCapacity < capacity) {
+        newCapacity *= 2;
+    }
+
+    uint8_t *data = realloc(bytes->data, newCapacity);
+    if (!data) {
+        return 0;
+    }
+
+    bytes->data     = data;
+    bytes->capacity = newCapacity;
+
+    return 1;
+}
+
+/**
+ * Append data to a byte buffer, growing it if necessary.
+ *
+ * @param bytes byte buffer
+ * @param data data to append
+ * @param length length of the data
+ * @return non-zero on success; zero if the memory could not be allocated
+ */
+int appendBytes(Bytes *bytes, const uint8_t *data, size_t length) {
+    if (!reserveBytes(bytes, bytes->length + length)) {
+        return 0;
+    }
+
+    memcpy(bytes->data + bytes->length, data, length);
+    bytes->length += length;
+
+    return 1;
+}
+
+/**
+ * Empty a byte buffer, retaining its memory.
+ *
+ * @param bytes byte buffer
+ */
+void resetBytes(Bytes *bytes) {
+    bytes->length = 0;
+}
+
+/**
+ * Free the memory used by a byte buffer.
+ *
+ * @param bytes byte buffer
+ */
+void freeBytes(Bytes *bytes) {
+    free(bytes->data);
+    bytes->data     = NULL;
+    bytes->length   = 0;
+    bytes->capacity = 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_BYTES_H
+#define _PICAM_BYTES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Growable byte buffer.
+ *
+ * The memory is retained when the buffer is reset, so a buffer that is reused for each capture
+ * only allocates until it reaches the size of the largest picture.
+ */
+typedef struct Bytes {
+    uint8_t *data;
+    size_t   length;
+    size_t   capacity;
+} Bytes;
+
+int reserveBytes(Bytes *bytes, size_t capacity);
+int appendBytes(Bytes *bytes, const uint8_t *data, size_t length);
+void resetBytes(Bytes *bytes);
+void freeBytes(Bytes *bytes);
+
+#endif // _PICAM_BYTES_H
@@ -17,8 +17,19 @@
  * Copyright 2016-2019 Caprica Software Limited.
  */
 
+#include <string.h>
+
+#include "Annotation.h"
 #include "Camera.h"
+#include "Capture.h"
+#include "ExposureLock.h"
+#include "Log.h"
 #include "Port.h"
+#include "Probes.h"
+#include "Recovery.h"
+#include "Sensor.h"
+#include "Threads.h"
+#include "Trace.h"
 
 #include "interface/mmal/util/mmal_util.h"
 #include "interface/mmal/util/mmal_util_params.h"
@@ -30,10 +41,14 @@
 #define STILLS_FRAME_RATE_NUM 0
 #define STILLS_FRAME_RATE_DEN 1
 
+#define PREVIEW_WIDTH  320
+#define PREVIEW_HEIGHT 240
+
 static void cameraControlCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
 static int applyCameraPreConfiguration(PicamContext *context);
 static int applyCameraConfiguration(PicamContext *context);
-static int applyCameraCapturePortFormat(PicamContext *context);
+static int sameAnnotation(const AnnotationConfig *a, const AnnotationConfig *b);
+static int createCameraComponent(PicamContext *context);
 
 /**
  * Create a camera component.
@@ -42,27 +57,261 @@ static int applyCameraCapturePortFormat(PicamContext *context);
  * @return non-zero on success; zero on error
  */
 int createCamera(PicamContext *context) {
+    probe1(create__begin, "camera");
+    int result = createCameraComponent(context);
+    probe2(create__end, "camera", result);
+    return result;
+}
+
+/**
+ * Destroy the camera component and all associated resources.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param context global state
+ */
+void destroyCamera(PicamContext *context) {
+    probe1(destroy__begin, "camera");
+    if (context->cameraComponent) {
+        mmal_component_disable(context->cameraComponent);
+        mmal_component_destroy(context->cameraComponent);
+        context->cameraComponent = NULL;
+    }
+    probe1(destroy__end, "camera");
+}
+
+/**
+ * Re-apply the camera configuration to a live camera, setting only the parameters that differ from
+ * a previous configuration.
+ *
+ * Only parameters that can be changed while the camera is enabled are considered, the caller must
+ * make sure nothing else differs.
+ *
+ * @param context global state, holding the new configuration
+ * @param previous configuration currently applied to the camera
+ * @return non-zero on success; zero on error
+ */
+int updateCameraConfiguration(PicamContext *context, const PicamConfig *previous) {
+    MMAL_PORT_T         *controlPort = context->cameraComponent->control;
+    MMAL_PORT_T         *capturePort = context->cameraComponent->output[MMAL_CAMERA_CAPTURE_PORT];
+    const ControlConfig *control     = &context->config.control;
+    const ControlConfig *was         = &previous->control;
+    const CaptureConfig *capture     = &context->config.capture;
+
+    int result = 1;
+
+    if (control->brightness != was->brightness) {
+        result &= setRational(controlPort, MMAL_PARAMETER_BRIGHTNESS, control->brightness, 100);
+    }
+    if (control->contrast != was->contrast) {
+        result &= setRational(controlPort, MMAL_PARAMETER_CONTRAST, control->contrast, 100);
+    }
+    if (control->saturation != was->saturation) {
+        result &= setRational(controlPort, MMAL_PARAMETER_SATURATION, control->saturation, 100);
+    }
+    if (control->sharpness != was->sharpness) {
+        result &= setRational(controlPort, MMAL_PARAMETER_SHARPNESS, control->sharpness, 100);
+    }
+    if (control->videoStabilisation != was->videoStabilisation) {
+        result &= setBoolean(controlPort, MMAL_PARAMETER_VIDEO_STABILISATION, control->videoStabilisation);
+    }
+    if (control->shutterSpeed != was->shutterSpeed) {
+        result &= setUInt32(controlPort, MMAL_PARAMETER_SHUTTER_SPEED, control->shutterSpeed);
+        result &= setFpsRange(capturePort, control->shutterSpeed);
+        context->shutterSpeed = control->shutterSpeed;
+    }
+    if (control->iso != was->iso) {
+        result &= setUInt32(controlPort, MMAL_PARAMETER_ISO, control->iso);
+    }
+    if (control->exposureMode != was->exposureMode) {
+        result &= setExposureMode(controlPort, control->exposureMode);
+    }
+    if (control->exposureMeteringMode != was->exposureMeteringMode) {
+        result &= setExposureMeteringMode(controlPort, control->exposureMeteringMode);
+    }
+    if (control->exposureCompensation != was->exposureCompensation) {
+        result &= setInt32(controlPort, MMAL_PARAMETER_EXPOSURE_COMP, control->exposureCompensation);
+    }
+    if (control->dynamicRangeCompressionStrength != was->dynamicRangeCompressionStrength) {
+        result &= setDynamicRangeCompression(controlPort, control->dynamicRangeCompressionStrength);
+    }
+    if (control->automaticWhiteBalanceMode != was->automaticWhiteBalanceMode) {
+        result &= setAutomaticWhiteBalanceMode(controlPort, control->automaticWhiteBalanceMode);
+    }
+    if (control->automaticWhiteBalanceRedGain != was->automaticWhiteBalanceRedGain || control->automaticWhiteBalanceBlueGain != was->automaticWhiteBalanceBlueGain) {
+        result &= setAutomaticWhiteBalanceGains(controlPort, control->automaticWhiteBalanceRedGain, control->automaticWhiteBalanceBlueGain);
+    }
+    if (control->imageEffect != was->imageEffect) {
+        result &= setImageEffect(controlPort, control->imageEffect);
+    }
+    if (control->colourEffect != was->colourEffect || control->u != was->u || control->v != was->v) {
+        result &= setColourEffect(controlPort, control->colourEffect, control->u, control->v);
+    }
+    if (control->cropX != was->cropX || control->cropY != was->cropY || control->cropW != was->cropW || control->cropH != was->cropH) {
+        result &= setCrop(controlPort, control->cropX, control->cropY, control->cropW, control->cropH);
+    }
+    if (!sameAnnotation(&context->config.annotation, &previous->annotation)) {
+        result &= applyAnnotation(context);
+    }
+    if (capture->mirror != previous->capture.mirror) {
+        result &= setMirror(capturePort, capture->mirror);
+    }
+    if (capture->rotation != previous->capture.rotation) {
+        result &= setInt32(capturePort, MMAL_PARAMETER_ROTATION, capture->rotation);
+    }
+
+    // Any exposure parameter that changed must not undo a lock
+    result &= applyExposureLock(context);
+
+    return result;
+}
+
+/**
+ * Set the format of the camera capture port.
+ *
+ * The capture port is normally opaque, tunnelled to the image encoder, but it may be switched to a
+ * raw format to deliver the uncompressed picture to the host. The port must not be enabled.
+ *
+ * @param context global state
+ * @param encoding MMAL encoding for the port, e.g. MMAL_ENCODING_OPAQUE or MMAL_ENCODING_I420
+ * @return non-zero on success; zero on error
+ */
+int setCapturePortFormat(PicamContext *context, MMAL_FOURCC_T encoding) {
+    uint32_t width  = context->config.camera.width;
+    uint32_t height = context->config.camera.height;
+
+    MMAL_PORT_T *cameraCapturePort = context->cameraComponent->output[MMAL_CAMERA_CAPTURE_PORT];
+
+    cameraCapturePort->format->encoding                 = encoding;
+    cameraCapturePort->format->es->video.width          = VCOS_ALIGN_UP(width, ALIGN_WIDTH);
+    cameraCapturePort->format->es->video.height         = VCOS_ALIGN_UP(height, ALIGN_HEIGHT);
+    cameraCapturePort->format->es->video.crop.x         = 0;
+    cameraCapturePort->format->es->video.crop.y         = 0;
+    cameraCapturePort->format->es->video.crop.width     = width;
+    cameraCapturePort->format->es->video.crop.height    = height;
+    cameraCapturePort->format->es->video.frame_rate.num = STILLS_FRAME_RATE_NUM;
+    cameraCapturePort->format->es->video.frame_rate.den = STILLS_FRAME_RATE_DEN;
+
+    return mmal_port_format_commit(cameraCapturePort) == MMAL_SUCCESS ? 1: 0;
+}
+
+/**
+ * Set the exposure of a live camera, without changing the configuration.
+ *
+ * This is used to step through exposures between frames, the configured exposure can be restored
+ * afterwards with another call using the configured values.
+ *
+ * @param context global state
+ * @param exposureCompensation exposure compensation
+ * @param shutterSpeed shutter speed in microseconds, zero for automatic
+ * @return non-zero on success; zero on error
+ */
+int setExposure(PicamContext *context, int32_t exposureCompensation, uint32_t shutterSpeed) {
+    MMAL_PORT_T *controlPort = context->cameraComponent->control;
+    MMAL_PORT_T *capturePort = context->cameraComponent->output[MMAL_CAMERA_CAPTURE_PORT];
+
+    context->shutterSpeed = shutterSpeed;
+
+    return
+        setInt32   (controlPort, MMAL_PARAMETER_EXPOSURE_COMP, exposureCompensation) &&
+        setUInt32  (controlPort, MMAL_PARAMETER_SHUTTER_SPEED, shutterSpeed) &&
+        setFpsRange(capturePort, shutterSpeed);
+}
+
+/**
+ * Apply an exposure to the live camera, taking the pipeline lock.
+ *
+ * @param context global state
+ * @param exposureCompensation exposure compensation
+ * @param shutterSpeed shutter speed in microseconds, zero for automatic
+ * @return non-zero on success; zero on error
+ */
+int applyLiveExposure(PicamContext *context, int32_t exposureCompensation, uint32_t shutterSpeed) {
+    if (!lockPipeline(context)) {
+        unlockPipeline(context);
+        return 0;
+    }
+
+    int result = setExposure(context, exposureCompensation, shutterSpeed);
+
+    unlockPipeline(context);
+
+    return result;
+}
+
+/**
+ * Restore the configured exposure to the live camera, or the locked exposure if the exposure is
+ * locked, taking the pipeline lock.
+ *
+ * @param context global state
+ * @return non-zero on success; zero on error
+ */
+int restoreLiveExposure(PicamContext *context) {
+    const ControlConfig *control = &context->config.control;
+
+    if (!lockPipeline(context)) {
+        unlockPipeline(context);
+        return 0;
+    }
+
+    int result = setExposure(context, control->exposureCompensation, control->shutterSpeed) && applyExposureLock(context);
+
+    unlockPipeline(context);
+
+    return result;
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Create and configure the camera component, one phase after another.
+ *
+ * @param context global state
+ * @return non-zero on success; zero on error
+ */
+static int createCameraComponent(PicamContext *context) {
+    configureSensorMode(context);
+    probe2(create__phase, "camera", "sensor");
+
     if (MMAL_SUCCESS != mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &context->cameraComponent)) {
+        logError("Failed to create camera component");
         return 0;
     }
+    probe2(create__phase, "camera", "component");
 
     if (!applyCameraPreConfiguration(context)) {
+        logError("Failed to apply camera pre-configuration");
         return 0;
     }
+    probe2(create__phase, "camera", "pre-configuration");
+
+    context->cameraComponent->control->userdata = (struct MMAL_PORT_USERDATA_T *) context;
 
     if (MMAL_SUCCESS != mmal_port_enable(context->cameraComponent->control, cameraControlCallback)) {
+        logError("Failed to enable camera control port");
         return 0;
     }
 
+    // Not fatal, the settings can still be asked for directly when the exposure is locked
+    if (!requestCameraSettings(context)) {
+        logWarn("Failed to request camera settings events");
+    }
+    probe2(create__phase, "camera", "control");
+
     if (!applyCameraConfiguration(context)) {
+        logError("Failed to apply camera configuration");
         return 0;
     }
+    probe2(create__phase, "camera", "configuration");
 
-    if (!applyCameraCapturePortFormat(context)) {
+    if (!setCapturePortFormat(context, MMAL_ENCODING_OPAQUE)) {
+        logError("Failed to set camera capture port format");
         return 0;
     }
+    probe2(create__phase, "camera", "format");
 
     if (MMAL_SUCCESS != mmal_component_enable(context->cameraComponent)) {
+        logError("Failed to enable camera component");
         return 0;
     }
 
@@ -70,32 +319,52 @@ int createCamera(PicamContext *context) {
 }
 
 /**
- * Destroy the camera component and all associated resources.
+ * Camera control callback.
  *
- * It is safe to call this method no matter what the state is.
+ * An error event means the pipeline can no longer be trusted - any capture currently waiting is
+ * woken immediately (rather than waiting for its timeout, or forever) and a pipeline recovery is
+ * requested.
  *
- * @param context global state
+ * @param port
+ * @param buffer
  */
-void destroyCamera(PicamContext *context) {
-    if (context->cameraComponent) {
-        mmal_component_disable(context->cameraComponent);
-        mmal_component_destroy(context->cameraComponent);
-        context->cameraComponent = NULL;
-    }
-}
+static void cameraControlCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    PicamContext *context = (PicamContext *) port->userdata;
 
-// === Private implementation =====================================================================
+    uint64_t cpuStart = enterCallbackThread(context);
 
-static void cameraControlCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
-    printf("cameraControlCallback 0x%08x\n", buffer->cmd); fflush(stdout);
+    MMAL_STATUS_T status = buffer->cmd == MMAL_EVENT_ERROR && buffer->length >= sizeof(MMAL_STATUS_T) ? *(MMAL_STATUS_T *) buffer->data : MMAL_SUCCESS;
+
+    probe2(control__event, buffer->cmd, status);
+
+    if (tracing(context)) {
+        TraceRecord record = {
+            .type  = TRACE_CONTROL_EVENT,
+            .flags = status,
+            .value = buffer->cmd
+        };
+        traceRecord(context, &record, NULL);
+    }
 
     if (buffer->cmd == MMAL_EVENT_ERROR) {
-        printf("Error received in camera control callback\n"); fflush(stdout);
+        logError("Error %d received in camera control callback", status);
+
+        context->stats.errorEvents++;
+
+        requestRecovery(context);
+        signalCaptureError(context);
+    } else if (buffer->cmd == MMAL_EVENT_PARAMETER_CHANGED) {
+        MMAL_EVENT_PARAMETER_CHANGED_T *changed = (MMAL_EVENT_PARAMETER_CHANGED_T *) buffer->data;
+        if (changed->hdr.id == MMAL_PARAMETER_CAMERA_SETTINGS) {
+            cameraSettingsReported(context, (MMAL_PARAMETER_CAMERA_SETTINGS_T *) changed);
+        }
     } else {
-        printf("Unexpected command in camera control callback 0x%08x\n", buffer->cmd); fflush(stdout);
+        logWarn("Unexpected command in camera control callback 0x%08x", buffer->cmd);
     }
 
     mmal_buffer_header_release(buffer);
+
+    leaveCallbackThread(context, cpuStart);
 }
 
 /**
@@ -111,10 +380,11 @@ static int applyCameraPreConfiguration(PicamContext *context) {
     CameraConfig  *camera      = &context->config.camera;
     CaptureConfig *capture     = &context->config.capture;
 
+    // The sensor mode comes from the context, it may have been selected automatically
     return
         setStereoscopicMode(capturePort, capture->stereoscopicMode, capture->decimate, capture->swapEyes) &&
         setInt32           (controlPort, MMAL_PARAMETER_CAMERA_NUM                 , camera->cameraNumber) &&
-        setUInt32          (controlPort, MMAL_PARAMETER_CAMERA_CUSTOM_SENSOR_CONFIG, camera->customSensorConfig);
+        setUInt32          (controlPort, MMAL_PARAMETER_CAMERA_CUSTOM_SENSOR_CONFIG, context->sensor.mode);
 }
 
 /**
@@ -130,13 +400,19 @@ static int applyCameraConfiguration(PicamContext *context) {
     ControlConfig *control     = &context->config.control;
     CaptureConfig *capture     = &context->config.capture;
 
+    // The video port is only used for recording, otherwise the preview size is just a placeholder
+    uint32_t videoWidth  = context->recorder.active ? context->config.recording.width  : PREVIEW_WIDTH;
+    uint32_t videoHeight = context->recorder.active ? context->config.recording.height : PREVIEW_HEIGHT;
+
+    context->shutterSpeed = control->shutterSpeed;
+
     return
-        setCameraConfig              (controlPort, camera->width, camera->height) &&
+        setCameraConfig              (controlPort, camera->width, camera->height, videoWidth, videoHeight) &&
 
         setRational                  (controlPort, MMAL_PARAMETER_BRIGHTNESS         , control->brightness, 100) &&
         setRational                  (controlPort, MMAL_PARAMETER_CONTRAST           , control->contrast, 100) &&
         setRational                  (controlPort, MMAL_PARAMETER_SATURATION         , control->saturation, 100) &&
-        setRational                  (controlPort, MMAL_PARAMETER_CONTRAST           , control->sharpness, 100) &&
+        setRational                  (controlPort, MMAL_PARAMETER_SHARPNESS          , control->sharpness, 100) &&
         setBoolean                   (controlPort, MMAL_PARAMETER_VIDEO_STABILISATION, control->videoStabilisation) &&
         setUInt32                    (controlPort, MMAL_PARAMETER_SHUTTER_SPEED      , control->shutterSpeed) &&
         setUInt32                    (controlPort, MMAL_PARAMETER_ISO                , control->iso) &&
@@ -149,27 +425,30 @@ static int applyCameraConfiguration(PicamContext *context) {
         setImageEffect               (controlPort                                    , control->imageEffect) &&
         setColourEffect              (controlPort                                    , control->colourEffect, control->u, control->v) &&
         setCrop                      (controlPort                                    , control->cropX, control->cropY, control->cropW, control->cropH) &&
+        applyAnnotation              (context) &&
 
         setMirror                    (capturePort                                    , capture->mirror) &&
         setInt32                     (capturePort, MMAL_PARAMETER_ROTATION           , capture->rotation) &&
-        setFpsRange                  (capturePort, control->shutterSpeed);
-}
-
-static int applyCameraCapturePortFormat(PicamContext *context) {
-    uint32_t width  = context->config.camera.width;
-    uint32_t height = context->config.camera.height;
-
-    MMAL_PORT_T *cameraCapturePort = context->cameraComponent->output[MMAL_CAMERA_CAPTURE_PORT];
+        setFpsRange                  (capturePort, control->shutterSpeed) &&
 
-    cameraCapturePort->format->encoding                 = MMAL_ENCODING_OPAQUE;
-    cameraCapturePort->format->es->video.width          = VCOS_ALIGN_UP(width, ALIGN_WIDTH);
-    cameraCapturePort->format->es->video.height         = VCOS_ALIGN_UP(height, ALIGN_HEIGHT);
-    cameraCapturePort->format->es->video.crop.x         = 0;
-    cameraCapturePort->format->es->video.crop.y         = 0;
-    cameraCapturePort->format->es->video.crop.width     = width;
-    cameraCapturePort->format->es->video.crop.height    = height;
-    cameraCapturePort->format->es->video.frame_rate.num = STILLS_FRAME_RATE_NUM;
-    cameraCapturePort->format->es->video.frame_rate.den = STILLS_FRAME_RATE_DEN;
+        applyExposureLock            (context);
+}
 
-    return mmal_port_format_commit(cameraCapturePort) == MMAL_SUCCESS ? 1: 0;
+/**
+ * Check whether two annotation configurations are the same.
+ *
+ * @param a annotation configuration
+ * @param b annotation configuration
+ * @return non-zero if they are the same; zero if they are not
+ */
+static int sameAnnotation(const AnnotationConfig *a, const AnnotationConfig *b) {
+    return
+        strcmp(a->text, b->text) == 0                &&
+        a->showFrameNumber  == b->showFrameNumber    &&
+        a->textSize         == b->textSize           &&
+        a->textColour       == b->textColour         &&
+        a->backgroundColour == b->backgroundColour   &&
+        a->justify          == b->justify            &&
+        a->x                == b->x                  &&
+        a->y                == b->y;
 }
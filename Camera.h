@@ -24,5 +24,10 @@
 
 int createCamera(PicamContext* context);
 void destroyCamera(PicamContext *context);
+int updateCameraConfiguration(PicamContext *context, const PicamConfig *previous);
+int setCapturePortFormat(PicamContext *context, MMAL_FOURCC_T encoding);
+int setExposure(PicamContext *context, int32_t exposureCompensation, uint32_t shutterSpeed);
+int applyLiveExposure(PicamContext *context, int32_t exposureCompensation, uint32_t shutterSpeed);
+int restoreLiveExposure(PicamContext *context);
 
 #endif // _PICAM_CAMERA_H
\ No newline at end of file
@@ -0,0 +1,588 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include "Annotation.h"
+#include "Capture.h"
+#include "Encoder.h"
+#include "Log.h"
+#include "Probes.h"
+#include "RateControl.h"
+#include "RawCapture.h"
+#include "Recovery.h"
+#include "Trace.h"
+
+#include "interface/mmal/util/mmal_util_params.h"
+
+/**
+ * Time in milliseconds, on top of the exposure, to wait for a capture before it is treated as
+ * stalled when no capture timeout is configured.
+ */
+#define STALL_MARGIN 10000
+
+typedef enum {
+    WAIT_COMPLETED,
+    WAIT_ERROR,
+    WAIT_TIMEOUT
+} WaitResult;
+
+static uint32_t beginGeneration(PicamContext *context);
+static void cancelGeneration(PicamContext *context, uint32_t generation);
+static WaitResult awaitGeneration(PicamContext *context, uint32_t generation, uint32_t timeout);
+static uint32_t captureTimeout(PicamContext *context);
+static void abandonGeneration(PicamContext *context, uint32_t generation);
+static int setRawCapture(PicamContext *context, bool enable);
+
+/**
+ * Create the capture tracker.
+ *
+ * Every triggered capture is allocated a new generation id. Frames are produced by the encoder in
+ * the same order that captures were triggered, so the first buffer of each frame is matched with
+ * the oldest triggered generation that has not yet started. Buffers belonging to a generation that
+ * is no longer being waited for (because its capture timed out) are discarded, never delivered.
+ *
+ * @param context global state
+ * @return non-zero on success; zero on error
+ */
+int createCaptureTracker(PicamContext *context) {
+    CaptureTracker *tracker = &context->tracker;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    int result = pthread_mutex_init(&tracker->mutex, NULL) == 0;
+    if (result) {
+        result = pthread_cond_init(&tracker->completed, &attr) == 0;
+        if (!result) {
+            pthread_mutex_destroy(&tracker->mutex);
+        }
+    }
+
+    pthread_condattr_destroy(&attr);
+
+    if (result) {
+        tracker->lastGeneration = 0;
+        resetCaptureTracker(context);
+        tracker->created = true;
+    }
+
+    return result;
+}
+
+/**
+ * Destroy the capture tracker.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param context global state
+ */
+void destroyCaptureTracker(PicamContext *context) {
+    CaptureTracker *tracker = &context->tracker;
+
+    if (tracker->created) {
+        pthread_cond_destroy(&tracker->completed);
+        pthread_mutex_destroy(&tracker->mutex);
+        tracker->created = false;
+    }
+}
+
+/**
+ * Forget all outstanding generations, used when the pipeline is re-created and nothing from the
+ * old pipeline can arrive any more.
+ *
+ * Generation ids are never re-used, even after a reset.
+ *
+ * @param context global state
+ */
+void resetCaptureTracker(PicamContext *context) {
+    CaptureTracker *tracker = &context->tracker;
+
+    pthread_mutex_lock(&tracker->mutex);
+
+    tracker->pendingHead         = 0;
+    tracker->pendingCount        = 0;
+    tracker->frameGeneration     = 0;
+    tracker->awaitedGeneration   = 0;
+    tracker->completedGeneration = 0;
+    tracker->delivering          = false;
+
+    context->errorPending = false;
+
+    pthread_mutex_unlock(&tracker->mutex);
+}
+
+/**
+ * Trigger a single capture and wait for it to finish.
+ *
+ * An error event from the camera, a stalled capture, or a failure to trigger the capture, will
+ * cause a pipeline recovery to be requested - so the next capture (or a retry of this one) will
+ * be made with a freshly created pipeline.
+ *
+ * The delivery for an encoded capture is installed, and the length and JPEG info recorded in it,
+ * only while the pipeline is locked - so it is never affected by a capture on another thread.
+ *
+ * @param context global state
+ * @param outputMode OUTPUT_ENCODED to deliver the encoded picture, or OUTPUT_RAW to fill the raw
+ *                   frame in the context
+ * @param encoder encoding and quality for this capture, or NULL for the configured encoding and
+ *                quality - ignored for a raw capture
+ * @param delivery where the encoded picture goes, must not be NULL for an encoded capture - ignored
+ *                 for a raw capture
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *performCapture(PicamContext *context, int outputMode, const EncoderConfig *encoder, PictureDelivery *delivery) {
+    char    *captureFailure = NULL;
+    bool     rateControlled = false;
+    uint32_t quality        = 0;
+
+    context->stats.captures++;
+
+    if (!lockPipeline(context)) {
+        unlockPipeline(context);
+        context->stats.captureFailures++;
+        return "Camera pipeline is not available, recovery failed";
+    }
+
+    if (!setOutputMode(context, outputMode)) {
+        context->stats.captureFailures++;
+        requestRecovery(context);
+        unlockPipeline(context);
+        return "Failed to change camera output mode";
+    }
+
+    if (outputMode == OUTPUT_ENCODED) {
+        if (!encoder) {
+            encoder = &context->config.encoder;
+        }
+
+        // With rate control, the quality is chosen from the sizes of recent captures
+        rateControlled = encoder->targetSize && encoder->encoding == MMAL_ENCODING_JPEG;
+        quality        = rateControlled ? chooseQuality(context, encoder) : encoder->quality;
+
+        if (!selectEncoder(context, encoder->encoding, quality)) {
+            context->stats.captureFailures++;
+            requestRecovery(context);
+            unlockPipeline(context);
+            return "Failed to select encoder";
+        }
+    }
+
+    if (!refreshAnnotation(context)) {
+        context->stats.captureFailures++;
+        requestRecovery(context);
+        unlockPipeline(context);
+        return "Failed to update annotation";
+    }
+
+    if (outputMode != OUTPUT_ENCODED) {
+        delivery = NULL;
+    }
+
+    if (delivery) {
+        if (delivery->data) {
+            resetBytes(delivery->data);
+        }
+        delivery->length    = 0;
+        delivery->chunkSize = 0;
+
+        if (delivery->raw && !setRawCapture(context, true)) {
+            context->stats.captureFailures++;
+            requestRecovery(context);
+            unlockPipeline(context);
+            return "Failed to enable raw capture";
+        }
+    }
+
+    context->delivery       = delivery;
+    context->bytesDelivered = 0;
+
+    resetJpegParser(&context->jpegParser, outputMode == OUTPUT_ENCODED && encoder->encoding == MMAL_ENCODING_JPEG);
+
+    uint32_t generation = beginGeneration(context);
+
+    if (tracing(context)) {
+        TraceRecord record = {
+            .type  = TRACE_CAPTURE_BEGIN,
+            .flags = outputMode == OUTPUT_ENCODED ? (uint32_t) encoder->encoding : 0,
+            .value = generation
+        };
+        traceRecord(context, &record, NULL);
+    }
+
+    probe2(capture__trigger, generation, outputMode == OUTPUT_ENCODED ? encoder->encoding : 0);
+
+    if (mmal_port_parameter_set_boolean(context->cameraComponent->output[MMAL_CAMERA_CAPTURE_PORT], MMAL_PARAMETER_CAPTURE, 1) == MMAL_SUCCESS) {
+        switch (awaitGeneration(context, generation, captureTimeout(context))) {
+            case WAIT_COMPLETED:
+                break;
+            case WAIT_ERROR:
+                captureFailure = "Camera reported an error during capture";
+                break;
+            case WAIT_TIMEOUT:
+                captureFailure = "Timed-out waiting for capture to finish";
+                context->stats.stalledCaptures++;
+                break;
+        }
+        if (captureFailure) {
+            abandonGeneration(context, generation);
+        }
+    } else {
+        cancelGeneration(context, generation);
+        captureFailure = "Failed to trigger capture";
+    }
+
+    if (captureFailure) {
+        logWarn("Capture %u failed: %s", generation, captureFailure);
+        context->stats.captureFailures++;
+        requestRecovery(context);
+    } else if (rateControlled) {
+        recordQuality(context, encoder, quality, context->bytesDelivered);
+    }
+
+    if (tracing(context)) {
+        TraceRecord record = {
+            .type   = TRACE_CAPTURE_END,
+            .length = context->bytesDelivered,
+            .flags  = captureFailure != NULL,
+            .value  = generation
+        };
+        traceRecord(context, &record, NULL);
+    }
+
+    probe3(capture__end, generation, captureFailure != NULL, context->bytesDelivered);
+
+    if (delivery) {
+        delivery->length = context->bytesDelivered;
+        delivery->info   = context->jpegParser.info;
+
+        if (delivery->raw && !setRawCapture(context, false)) {
+            logWarn("Failed to disable raw capture");
+            requestRecovery(context);
+        }
+    }
+
+    context->delivery = NULL;
+
+    unlockPipeline(context);
+
+    return captureFailure;
+}
+
+/**
+ * Get the pipeline ready for a capture ahead of time - recovering it if necessary, and switching
+ * the camera to the output mode - so that a capture made shortly afterwards is triggered at once.
+ *
+ * @param context global state
+ * @param outputMode OUTPUT_ENCODED or OUTPUT_RAW
+ * @return non-zero if the pipeline is ready; zero if it is not, the capture itself will retry
+ */
+int prepareCapture(PicamContext *context, int outputMode) {
+    int ready = lockPipeline(context);
+
+    if (ready && !(ready = setOutputMode(context, outputMode))) {
+        requestRecovery(context);
+    }
+
+    unlockPipeline(context);
+
+    return ready;
+}
+
+/**
+ * Perform a capture, retrying a failed capture up to the configured number of times.
+ *
+ * A failed encoded capture is retried only if the pipeline was recovered and nothing at all was
+ * delivered to the handler, otherwise the handler would see a corrupt picture. A raw capture is
+ * delivered to the handler only after it completes, so it can always be retried.
+ *
+ * @param context global state
+ * @param outputMode OUTPUT_ENCODED or OUTPUT_RAW
+ * @param encoder encoding and quality for this capture, or NULL for the configured encoding and quality
+ * @param delivery where the encoded picture goes, ignored for a raw capture
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *performCaptureWithRetries(PicamContext *context, int outputMode, const EncoderConfig *encoder, PictureDelivery *delivery) {
+    char *captureFailure;
+
+    for (uint32_t attempt = 0; ; attempt++) {
+        captureFailure = performCapture(context, outputMode, encoder, delivery);
+        if (!captureFailure || attempt >= context->config.camera.captureRetries || (outputMode == OUTPUT_ENCODED && delivery->length)) {
+            break;
+        }
+        context->stats.captureRetries++;
+    }
+
+    return captureFailure;
+}
+
+/**
+ * Determine the capture generation that the current encoder buffer belongs to.
+ *
+ * This is invoked on the encoder callback thread for each buffer that has data or ends a frame.
+ *
+ * @param context global state
+ * @param current set to true if the generation is still being waited for, and so the buffer should be delivered
+ * @return generation id, or zero if the buffer does not belong to any triggered capture
+ */
+uint32_t bufferGeneration(PicamContext *context, bool *current) {
+    CaptureTracker *tracker = &context->tracker;
+
+    pthread_mutex_lock(&tracker->mutex);
+
+    if (!tracker->frameGeneration && tracker->pendingCount) {
+        tracker->frameGeneration = tracker->pending[tracker->pendingHead];
+        tracker->pendingHead = (tracker->pendingHead + 1) % CAPTURE_QUEUE_SIZE;
+        tracker->pendingCount--;
+    }
+
+    uint32_t generation = tracker->frameGeneration;
+    *current = generation && generation == tracker->awaitedGeneration;
+
+    // The capture can not give up on the buffer, and so remove its delivery, until bufferDone
+    tracker->delivering = *current;
+
+    pthread_mutex_unlock(&tracker->mutex);
+
+    return generation;
+}
+
+/**
+ * Finish with the current buffer, invoked on the encoder callback thread after bufferGeneration.
+ *
+ * @param context global state
+ */
+void bufferDone(PicamContext *context) {
+    CaptureTracker *tracker = &context->tracker;
+
+    pthread_mutex_lock(&tracker->mutex);
+    if (tracker->delivering) {
+        tracker->delivering = false;
+        pthread_cond_broadcast(&tracker->completed);
+    }
+    pthread_mutex_unlock(&tracker->mutex);
+}
+
+/**
+ * Finish delivery for a generation, either because the frame ended or because the handler asked
+ * for no more data.
+ *
+ * @param context global state
+ * @param generation generation id, as returned by bufferGeneration
+ * @param frameEnd true if the encoder signalled the end of the frame
+ */
+void finishGeneration(PicamContext *context, uint32_t generation, bool frameEnd) {
+    CaptureTracker *tracker = &context->tracker;
+
+    pthread_mutex_lock(&tracker->mutex);
+
+    if (frameEnd) {
+        tracker->frameGeneration = 0;
+    }
+
+    if (generation && generation == tracker->awaitedGeneration) {
+        tracker->awaitedGeneration   = 0;
+        tracker->completedGeneration = generation;
+        probe1(wait__post, generation);
+        pthread_cond_broadcast(&tracker->completed);
+    }
+
+    pthread_mutex_unlock(&tracker->mutex);
+}
+
+/**
+ * Wake any capture that is waiting, failing it because the camera reported an error.
+ *
+ * @param context global state
+ */
+void signalCaptureError(PicamContext *context) {
+    CaptureTracker *tracker = &context->tracker;
+
+    pthread_mutex_lock(&tracker->mutex);
+    context->errorPending = true;
+    probe1(wait__post, 0);
+    pthread_cond_broadcast(&tracker->completed);
+    pthread_mutex_unlock(&tracker->mutex);
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Allocate a new generation for a capture that is about to be triggered.
+ *
+ * If the queue of pending generations is somehow full, the oldest is dropped - that frame is long
+ * overdue and will be discarded if it does ever arrive.
+ *
+ * @param context global state
+ * @return generation id, never zero
+ */
+static uint32_t beginGeneration(PicamContext *context) {
+    CaptureTracker *tracker = &context->tracker;
+
+    pthread_mutex_lock(&tracker->mutex);
+
+    if (++tracker->lastGeneration == 0) {
+        tracker->lastGeneration = 1;
+    }
+
+    uint32_t generation = tracker->lastGeneration;
+
+    if (tracker->pendingCount == CAPTURE_QUEUE_SIZE) {
+        tracker->pendingHead = (tracker->pendingHead + 1) % CAPTURE_QUEUE_SIZE;
+        tracker->pendingCount--;
+    }
+
+    tracker->pending[(tracker->pendingHead + tracker->pendingCount) % CAPTURE_QUEUE_SIZE] = generation;
+    tracker->pendingCount++;
+
+    tracker->awaitedGeneration = generation;
+    context->errorPending = false;
+
+    pthread_mutex_unlock(&tracker->mutex);
+
+    return generation;
+}
+
+/**
+ * Withdraw a generation that was never triggered, so no frame will ever be matched to it.
+ *
+ * @param context global state
+ * @param generation generation id
+ */
+static void cancelGeneration(PicamContext *context, uint32_t generation) {
+    CaptureTracker *tracker = &context->tracker;
+
+    pthread_mutex_lock(&tracker->mutex);
+
+    uint32_t tail = (tracker->pendingHead + tracker->pendingCount + CAPTURE_QUEUE_SIZE - 1) % CAPTURE_QUEUE_SIZE;
+    if (tracker->pendingCount && tracker->pending[tail] == generation) {
+        tracker->pendingCount--;
+    }
+
+    if (tracker->awaitedGeneration == generation) {
+        tracker->awaitedGeneration = 0;
+    }
+
+    pthread_mutex_unlock(&tracker->mutex);
+}
+
+/**
+ * Wait for a generation to complete.
+ *
+ * @param context global state
+ * @param generation generation id
+ * @param timeout maximum time to wait in milliseconds, or zero to wait indefinitely
+ * @return wait result
+ */
+static WaitResult awaitGeneration(PicamContext *context, uint32_t generation, uint32_t timeout) {
+    CaptureTracker *tracker = &context->tracker;
+
+    struct timespec deadline;
+    if (timeout) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec  += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    WaitResult result = WAIT_COMPLETED;
+
+    probe2(wait__begin, generation, timeout);
+
+    pthread_mutex_lock(&tracker->mutex);
+
+    while (tracker->completedGeneration != generation) {
+        if (context->errorPending) {
+            result = WAIT_ERROR;
+            break;
+        }
+        if (timeout) {
+            if (pthread_cond_timedwait(&tracker->completed, &tracker->mutex, &deadline) == ETIMEDOUT && tracker->completedGeneration != generation) {
+                result = WAIT_TIMEOUT;
+                break;
+            }
+        } else {
+            pthread_cond_wait(&tracker->completed, &tracker->mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&tracker->mutex);
+
+    probe2(wait__end, generation, result);
+
+    return result;
+}
+
+/**
+ * Get the time to wait for a capture to complete.
+ *
+ * Without a configured capture timeout, a capture whose frame never arrives (and for which the
+ * camera reports no error) must still not wait forever, so it is treated as stalled once the
+ * exposure applied to the camera plus a generous margin has passed.
+ *
+ * @param context global state
+ * @return maximum time to wait in milliseconds
+ */
+static uint32_t captureTimeout(PicamContext *context) {
+    if (context->config.camera.captureTimeout) {
+        return context->config.camera.captureTimeout;
+    }
+    return context->shutterSpeed / 1000 + STALL_MARGIN;
+}
+
+/**
+ * Stop waiting for a generation - anything that arrives for it later will be discarded.
+ *
+ * A buffer already being delivered for the generation is allowed to finish first, so the delivery
+ * is never in use once this returns.
+ *
+ * @param context global state
+ * @param generation generation id
+ */
+static void abandonGeneration(PicamContext *context, uint32_t generation) {
+    CaptureTracker *tracker = &context->tracker;
+
+    pthread_mutex_lock(&tracker->mutex);
+    if (tracker->awaitedGeneration == generation) {
+        tracker->awaitedGeneration = 0;
+        while (tracker->delivering) {
+            pthread_cond_wait(&tracker->completed, &tracker->mutex);
+        }
+    }
+    pthread_mutex_unlock(&tracker->mutex);
+}
+
+/**
+ * Ask the camera to append the sensor-raw data to the encoded picture, or stop asking.
+ *
+ * Must only be invoked with the pipeline locked.
+ *
+ * @param context global state
+ * @param enable true to append the raw data
+ * @return non-zero on success; zero on error
+ */
+static int setRawCapture(PicamContext *context, bool enable) {
+    MMAL_PORT_T *capturePort = context->cameraComponent->output[MMAL_CAMERA_CAPTURE_PORT];
+    return mmal_port_parameter_set_boolean(capturePort, MMAL_PARAMETER_ENABLE_RAW_CAPTURE, enable) == MMAL_SUCCESS;
+}
@@ -0,0 +1,36 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_CAPTURE_H
+#define _PICAM_CAPTURE_H
+
+#include "Picam.h"
+
+int createCaptureTracker(PicamContext *context);
+void destroyCaptureTracker(PicamContext *context);
+void resetCaptureTracker(PicamContext *context);
+int prepareCapture(PicamContext *context, int outputMode);
+char *performCapture(PicamContext *context, int outputMode, const EncoderConfig *encoder, PictureDelivery *delivery);
+char *performCaptureWithRetries(PicamContext *context, int outputMode, const EncoderConfig *encoder, PictureDelivery *delivery);
+uint32_t bufferGeneration(PicamContext *context, bool *current);
+void bufferDone(PicamContext *context);
+void finishGeneration(PicamContext *context, uint32_t generation, bool frameEnd);
+void signalCaptureError(PicamContext *context);
+
+#endif // _PICAM_CAPTURE_H
@@ -0,0 +1,191 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Capture.h"
+#include "CaptureQueue.h"
+#include "Log.h"
+
+static SharedCapture *findPendingCapture(CaptureQueue *queue, const EncoderConfig *encoder);
+static void runCapture(PicamContext *context, SharedCapture *capture);
+
+/**
+ * Initialise the capture queue, once for the lifetime of the context.
+ *
+ * @param context global state
+ */
+void initCaptureQueue(PicamContext *context) {
+    CaptureQueue *queue = &context->captureQueue;
+
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+
+    queue->head = queue->tail = NULL;
+}
+
+/**
+ * Destroy the capture queue, no capture may be outstanding.
+ *
+ * @param context global state
+ */
+void destroyCaptureQueue(PicamContext *context) {
+    CaptureQueue *queue = &context->captureQueue;
+
+    pthread_cond_destroy(&queue->changed);
+    pthread_mutex_destroy(&queue->mutex);
+}
+
+/**
+ * Request an encoded capture, waiting until it is done.
+ *
+ * Requests from different threads are coalesced - a request for the same encoder configuration as
+ * a capture that is queued, or already under way, joins that capture rather than queueing another
+ * one. A capture can be joined right up until its picture is handed out, so a request that arrives
+ * during an exposure gets that picture. Other requests are queued, and performed in the order they
+ * were made, each by the thread that first requested it. So many simultaneous requests for the same
+ * encoding cost one capture.
+ *
+ * The picture is collected natively, and the caller delivers it from its own thread. The caller
+ * must always release the capture afterwards, whether it succeeded or not.
+ *
+ * @param context global state
+ * @param encoder encoding and quality for the capture, or NULL for the configured encoding and quality
+ * @return capture, with a NULL failure on success; or NULL if the capture could not be requested
+ */
+SharedCapture *requestCapture(PicamContext *context, const EncoderConfig *encoder) {
+    CaptureQueue *queue = &context->captureQueue;
+
+    EncoderConfig configured;
+    if (!encoder) {
+        pthread_mutex_lock(&context->configMutex);
+        configured = context->config.encoder;
+        pthread_mutex_unlock(&context->configMutex);
+        encoder = &configured;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+
+    SharedCapture *capture = findPendingCapture(queue, encoder);
+    if (capture) {
+        capture->references++;
+        context->stats.coalescedCaptures++;
+    } else {
+        capture = calloc(1, sizeof(SharedCapture));
+        if (!capture) {
+            pthread_mutex_unlock(&queue->mutex);
+            logError("Failed to allocate shared capture");
+            return NULL;
+        }
+
+        capture->encoder    = *encoder;
+        capture->references = 1;
+
+        if (queue->tail) {
+            queue->tail->next = capture;
+            context->stats.queuedCaptures++;
+        } else {
+            queue->head = capture;
+        }
+        queue->tail = capture;
+    }
+
+    while (!capture->done) {
+        // Only the capture at the head of the queue runs, so captures never overlap
+        if (capture == queue->head && !capture->started) {
+            capture->started = true;
+            pthread_mutex_unlock(&queue->mutex);
+
+            runCapture(context, capture);
+
+            pthread_mutex_lock(&queue->mutex);
+            capture->done = true;
+            queue->head = capture->next;
+            if (!queue->head) {
+                queue->tail = NULL;
+            }
+            pthread_cond_broadcast(&queue->changed);
+        } else {
+            pthread_cond_wait(&queue->changed, &queue->mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&queue->mutex);
+
+    return capture;
+}
+
+/**
+ * Release a capture previously returned by requestCapture.
+ *
+ * The picture data is freed when the last request sharing the capture releases it.
+ *
+ * @param context global state
+ * @param capture capture to release
+ */
+void releaseCapture(PicamContext *context, SharedCapture *capture) {
+    CaptureQueue *queue = &context->captureQueue;
+
+    pthread_mutex_lock(&queue->mutex);
+    bool last = --capture->references == 0;
+    pthread_mutex_unlock(&queue->mutex);
+
+    if (last) {
+        freeBytes(&capture->data);
+        free(capture);
+    }
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Find a capture that a request can join, either queued or under way.
+ *
+ * A capture is taken off the queue, with the queue locked, at the same time as it is marked done -
+ * so every capture still on the queue has yet to hand out its picture.
+ *
+ * @param queue capture queue
+ * @param encoder encoder configuration of the request
+ * @return capture; or NULL if there is none
+ */
+static SharedCapture *findPendingCapture(CaptureQueue *queue, const EncoderConfig *encoder) {
+    for (SharedCapture *capture = queue->head; capture; capture = capture->next) {
+        if (!capture->done && memcmp(&capture->encoder, encoder, sizeof(EncoderConfig)) == 0) {
+            return capture;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Perform a capture, collecting the picture straight into the capture.
+ *
+ * @param context global state
+ * @param capture capture to perform
+ */
+static void runCapture(PicamContext *context, SharedCapture *capture) {
+    PictureDelivery delivery = {
+        .data = &capture->data
+    };
+
+    capture->failure   = performCaptureWithRetries(context, OUTPUT_ENCODED, &capture->encoder, &delivery);
+    capture->chunkSize = delivery.chunkSize;
+    capture->info      = delivery.info;
+}
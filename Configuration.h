@@ -20,10 +20,13 @@
 #ifndef _PICAM_CONFIGURATION_H
 #define _PICAM_CONFIGURATION_H
 
-#include <jni.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  * Configuration pertaining to the camera itself.
  */
@@ -33,6 +36,8 @@ typedef struct CameraConfig {
     uint32_t width;
     uint32_t height;
     uint32_t captureTimeout;
+    uint32_t captureRetries;
+    uint32_t keepAlive;
 } CameraConfig;
 
 /**
@@ -63,6 +68,30 @@ typedef struct ControlConfig {
     double   cropH;
 } ControlConfig;
 
+/**
+ * Maximum length of annotation text, including the terminator.
+ */
+#define ANNOTATION_MAX_TEXT 256
+
+/**
+ * Configuration pertaining to the annotation rendered into every frame, applied on the camera
+ * control port.
+ *
+ * The text may contain strftime conversions, which are expanded with the local time when each
+ * picture is captured. Colours are 0xRRGGBB, or -1 for the firmware default (for the background,
+ * no background at all).
+ */
+typedef struct AnnotationConfig {
+    char     text[ANNOTATION_MAX_TEXT];
+    bool     showFrameNumber;
+    uint32_t textSize;
+    int32_t  textColour;
+    int32_t  backgroundColour;
+    int32_t  justify;
+    uint32_t x;
+    uint32_t y;
+} AnnotationConfig;
+
 /**
  * Configuration pertaining to the camera capture port.
  */
@@ -76,22 +105,74 @@ typedef struct CaptureConfig {
 
 /**
  * Configuration pertaining to the image encoder.
+ *
+ * A non-zero target size selects rate control for JPEG - the quality is then chosen for each
+ * capture, between the minimum and maximum, to land the picture just under the target size in
+ * bytes. A zero minimum or maximum means no limit.
  */
 typedef struct EncoderConfig {
     int32_t  encoding;
     uint32_t quality;
+    uint32_t targetSize;
+    uint32_t minimumQuality;
+    uint32_t maximumQuality;
 } EncoderConfig;
 
+/**
+ * Configuration pertaining to H.264 recording from the camera video port.
+ */
+typedef struct RecordingConfig {
+    uint32_t width;
+    uint32_t height;
+    uint32_t frameRate;
+    uint32_t bitrate;
+    uint32_t intraPeriod;
+    uint32_t preRoll;
+    uint32_t bufferSize;
+} RecordingConfig;
+
+/**
+ * Scheduling policies for native threads - leave the thread alone, the normal time-sharing policy
+ * with a nice value, or one of the real-time policies with a priority.
+ */
+#define THREAD_POLICY_DEFAULT 0
+#define THREAD_POLICY_OTHER   1
+#define THREAD_POLICY_FIFO    2
+#define THREAD_POLICY_RR      3
+
+/**
+ * Configuration pertaining to the scheduling of native threads, see Threads.c.
+ *
+ * The callback threads are the MMAL threads that deliver buffers, and so run the picture data
+ * callback of picamCapture; the worker threads are the background threads of the library, the
+ * logging thread and the threads that process images in parallel. The priority is the nice value
+ * for THREAD_POLICY_OTHER, otherwise the real-time priority. The affinity is a mask of CPUs, zero
+ * for no change.
+ */
+typedef struct ThreadConfig {
+    int32_t  callbackPolicy;
+    int32_t  callbackPriority;
+    uint32_t callbackAffinity;
+    int32_t  workerPolicy;
+    int32_t  workerPriority;
+    uint32_t workerAffinity;
+} ThreadConfig;
+
 /**
  * Configuration;
  */
 typedef struct PicamConfig {
-    CameraConfig  camera;
-    ControlConfig control;
-    CaptureConfig capture;
-    EncoderConfig encoder;
+    CameraConfig     camera;
+    ControlConfig    control;
+    AnnotationConfig annotation;
+    CaptureConfig    capture;
+    EncoderConfig    encoder;
+    RecordingConfig  recording;
+    ThreadConfig     threads;
 } PicamConfig;
 
-void extractConfiguration(JNIEnv *env, jobject obj, PicamConfig *config);
+#ifdef __cplusplus
+}
+#endif
 
 #endif // _PICAM_CONFIGURATION_H
\ No newline at end of file
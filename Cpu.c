@@ -0,0 +1,102 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include "Cpu.h"
+
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/**
+ * Detected features, computed once on first use.
+ *
+ * Detection is idempotent, so a race between two threads on first use is harmless.
+ */
+static volatile uint32_t features;
+static volatile bool     detected;
+
+static uint32_t detectFeatures(void);
+
+/**
+ * Get the features supported by the CPU the library is currently running on.
+ *
+ * SIMD kernels use this to select the best implementation at runtime (function-level dispatch), so
+ * a library built for a baseline architecture can still use NEON, for example, when it is present.
+ *
+ * @return bitmask of CPU_FEATURE_XXX values
+ */
+uint32_t cpuFeatures(void) {
+    if (!detected) {
+        features = detectFeatures();
+        detected = true;
+    }
+    return features;
+}
+
+/**
+ * Test whether the CPU supports a particular feature.
+ *
+ * @param feature CPU_FEATURE_XXX value
+ * @return true if the feature is supported; false if it is not
+ */
+bool cpuHasFeature(uint32_t feature) {
+    return (cpuFeatures() & feature) == feature;
+}
+
+/**
+ * Get the name of the best optimised library variant for the CPU the library is running on.
+ *
+ * This must match the variant names used by the Makefile.
+ *
+ * @return variant name
+ */
+const char *cpuVariant(void) {
+#if defined(__aarch64__)
+    return "aarch64";
+#elif defined(__arm__)
+    return cpuHasFeature(CPU_FEATURE_NEON) ? "armv7" : "armv6";
+#elif defined(__x86_64__)
+    return "x86_64";
+#else
+    return "generic";
+#endif
+}
+
+// === Private implementation =====================================================================
+
+static uint32_t detectFeatures(void) {
+    uint32_t result = 0;
+#if defined(__aarch64__)
+    // Advanced SIMD is mandatory on AArch64
+    result |= CPU_FEATURE_NEON;
+#elif defined(__arm__)
+    if (getauxval(AT_HWCAP) & HWCAP_NEON) {
+        result |= CPU_FEATURE_NEON;
+    }
+#elif defined(__x86_64__)
+    // SSE2 is mandatory on x86_64
+    result |= CPU_FEATURE_SSE2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        result |= CPU_FEATURE_AVX2;
+    }
+#endif
+    return result;
+}
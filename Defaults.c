@@ -27,6 +27,8 @@ void setConfigurationDefaults(PicamConfig* config) {
     config->camera.width                            = 2592;
     config->camera.height                           = 1944;
     config->camera.captureTimeout                   = 0;
+    config->camera.captureRetries                   = 0;
+    config->camera.keepAlive                        = 0;
 
     config->control.brightness                      = 50;
     config->control.contrast                        = 0;
@@ -51,6 +53,15 @@ void setConfigurationDefaults(PicamConfig* config) {
     config->control.cropW                           = 1.0;
     config->control.cropH                           = 1.0;
 
+    config->annotation.text[0]                      = '\0';
+    config->annotation.showFrameNumber              = false;
+    config->annotation.textSize                     = 0;
+    config->annotation.textColour                   = -1;
+    config->annotation.backgroundColour             = -1;
+    config->annotation.justify                      = 0;
+    config->annotation.x                            = 0;
+    config->annotation.y                            = 0;
+
     config->capture.stereoscopicMode                = MMAL_STEREOSCOPIC_MODE_NONE;
     config->capture.decimate                        = MMAL_FALSE;
     config->capture.swapEyes                        = MMAL_FALSE;
@@ -59,4 +70,22 @@ void setConfigurationDefaults(PicamConfig* config) {
 
     config->encoder.encoding                        = MMAL_ENCODING_JPEG;
     config->encoder.quality                         = 85;
+    config->encoder.targetSize                      = 0;
+    config->encoder.minimumQuality                  = 0;
+    config->encoder.maximumQuality                  = 0;
+
+    config->recording.width                         = 1920;
+    config->recording.height                        = 1080;
+    config->recording.frameRate                     = 30;
+    config->recording.bitrate                       = 17000000;
+    config->recording.intraPeriod                   = 30;
+    config->recording.preRoll                       = 10000;
+    config->recording.bufferSize                    = 32 * 1024 * 1024;
+
+    config->threads.callbackPolicy                  = THREAD_POLICY_DEFAULT;
+    config->threads.callbackPriority                = 0;
+    config->threads.callbackAffinity                = 0;
+    config->threads.workerPolicy                    = THREAD_POLICY_DEFAULT;
+    config->threads.workerPriority                  = 0;
+    config->threads.workerAffinity                  = 0;
 }
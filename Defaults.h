@@ -21,7 +21,16 @@
 #define _PICAM_DEFAULTS_H
 
 #include "Configuration.h"
+#include "Export.h"
 
-void setConfigurationDefaults(PicamConfig* config);
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+PICAM_EXPORT void setConfigurationDefaults(PicamConfig* config);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif // _PICAM_DEFAULTS_H
\ No newline at end of file
@@ -0,0 +1,105 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include "Delivery.h"
+#include "Probes.h"
+#include "Trace.h"
+
+static int collectPictureData(PictureDelivery *delivery, const uint8_t *data, uint32_t length);
+
+/**
+ * Deliver a chunk of encoded picture data for the current capture.
+ *
+ * The data goes to the callback of the delivery installed for the capture, or is collected
+ * natively if it has no callback. A JPEG is parsed as it is delivered, so that the capture can be checked for validity
+ * afterwards without decoding it.
+ *
+ * This has no dependency on MMAL, so the trace replay tool can drive exactly the same code.
+ *
+ * @param context global state
+ * @param data picture data
+ * @param length length of the data
+ * @return non-zero if all of the data was accepted; zero if the capture must be abandoned
+ */
+int deliverPictureData(PicamContext *context, const uint8_t *data, uint32_t length) {
+    PictureDelivery *delivery = context->delivery;
+    if (!delivery) {
+        return 0;
+    }
+
+    // Only a callback is an upcall, collecting natively is measured by the encoder buffer records
+    uint64_t start = tracing(context) && delivery->callback ? traceTime() : 0;
+
+    probe1(upcall__start, length);
+
+    int written = delivery->callback ? (int) delivery->callback(delivery->userdata, data, length) : collectPictureData(delivery, data, length);
+
+    probe2(upcall__end, length, written);
+
+    if (start) {
+        TraceRecord record = {
+            .type     = TRACE_UPCALL,
+            .length   = length,
+            .value    = written,
+            .duration = traceTime() - start
+        };
+        traceRecord(context, &record, NULL);
+    }
+
+    if (length > delivery->chunkSize) {
+        delivery->chunkSize = length;
+    }
+
+    if (written > 0) {
+        context->bytesDelivered += written;
+        if (context->jpegParser.enabled) {
+            parseJpeg(&context->jpegParser, data, written);
+        }
+    }
+
+    return written == (int) length;
+}
+
+/**
+ * Finish delivering the picture data for the current capture, at the end of the frame or when the
+ * capture is abandoned.
+ *
+ * @param context global state
+ * @param failed true if the capture failed
+ */
+void finishPictureData(PicamContext *context, bool failed) {
+    finishJpegParser(&context->jpegParser, failed);
+    if (context->jpegParser.enabled && !context->jpegParser.info.valid) {
+        context->stats.invalidPictures++;
+    }
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Collect picture data in native memory, rather than delivering it to a callback.
+ *
+ * @param delivery delivery for the current capture
+ * @param data picture data
+ * @param length length of the data
+ * @return number of bytes collected, zero if there is nowhere to collect it or the memory could not be allocated
+ */
+static int collectPictureData(PictureDelivery *delivery, const uint8_t *data, uint32_t length) {
+    return delivery->data && appendBytes(delivery->data, data, length) ? (int) length : 0;
+}
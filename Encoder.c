@@ -18,35 +18,207 @@
  */
 
 #include "Encoder.h"
+#include "Capture.h"
+#include "Delivery.h"
+#include "Log.h"
+#include "Probes.h"
+#include "Threads.h"
+#include "Trace.h"
 
 #include "interface/mmal/util/mmal_default_components.h"
 #include "interface/mmal/util/mmal_connection.h"
 #include "interface/mmal/util/mmal_util.h"
 #include "interface/mmal/util/mmal_util_params.h"
 
-static int createPicturePool(PicamContext *context);
-static int connectCameraToEncoder(PicamContext *context);
-static int sendBuffersToEncoder(PicamContext *context);
+static int createEncoderComponent(PicamContext *context);
+static int createEncoderSlot(PicamContext *context, EncoderSlot *slot, int32_t encoding, uint32_t quality);
+static void destroyEncoderSlot(EncoderSlot *slot);
+static EncoderSlot *findEncoderSlot(PicamContext *context, int32_t encoding);
+static EncoderSlot *activeEncoderSlot(PicamContext *context);
+static int setEncoderQuality(EncoderSlot *slot, uint32_t quality);
+static MMAL_POOL_T *encoderPortPool(PicamContext *context, MMAL_PORT_T *port);
+static int createPicturePool(EncoderSlot *slot);
+static int sendBuffersToEncoder(EncoderSlot *slot);
+
+static void traceBuffer(PicamContext *context, MMAL_BUFFER_HEADER_T *buffer, uint32_t generation);
 
 static void encoderBufferCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
 
 /**
- * Create an Encoder component.
+ * Create an Encoder component, for the configured encoding and quality, and connect the camera to it.
  *
  * @param context
  * @return non-zero on success; zero on error
  */
 int createEncoder(PicamContext *context) {
-    if (MMAL_SUCCESS != mmal_component_create(MMAL_COMPONENT_DEFAULT_IMAGE_ENCODER, &context->encoderComponent)) {
+    probe1(create__begin, "encoder");
+    int result = createEncoderComponent(context);
+    probe2(create__end, "encoder", result);
+    return result;
+}
+
+void destroyEncoder(PicamContext *context) {
+    probe1(destroy__begin, "encoder");
+
+    if (context->cameraEncoderConnection) {
+        mmal_connection_destroy(context->cameraEncoderConnection);
+        context->cameraEncoderConnection = NULL;
+    }
+
+    for (int i = 0; i < ENCODER_CACHE_SIZE; i++) {
+        destroyEncoderSlot(&context->encoders[i]);
+    }
+
+    context->encoderComponent = NULL;
+
+    probe1(destroy__end, "encoder");
+}
+
+/**
+ * Select the encoding and quality for the next capture.
+ *
+ * The quality is changed on the live encoder. For a different encoding, an encoder component kept
+ * for that encoding is switched onto the tunnel from the camera - one is created the first time an
+ * encoding is used, replacing the least recently used encoder if the cache is full. Switching
+ * encoders never rebuilds the camera.
+ *
+ * The pipeline lock must be held. In raw output mode the selected encoder is connected when the
+ * camera is switched back to encoded output.
+ *
+ * @param context global state
+ * @param encoding MMAL encoding
+ * @param quality JPEG quality factor
+ * @return non-zero on success; zero on error
+ */
+int selectEncoder(PicamContext *context, int32_t encoding, uint32_t quality) {
+    EncoderSlot *slot = activeEncoderSlot(context);
+
+    if (!slot || slot->encoding != encoding) {
+        slot = findEncoderSlot(context, encoding);
+
+        if (!slot->component) {
+            logDebug("Creating encoder for encoding 0x%08x", encoding);
+            if (!createEncoderSlot(context, slot, encoding, quality)) {
+                destroyEncoderSlot(slot);
+                return 0;
+            }
+        }
+
+        if (context->cameraEncoderConnection) {
+            mmal_connection_destroy(context->cameraEncoderConnection);
+            context->cameraEncoderConnection = NULL;
+        }
+
+        context->encoderComponent = slot->component;
+
+        if (context->outputMode == OUTPUT_ENCODED && !connectCameraToEncoder(context)) {
+            logError("Failed to connect camera to encoder for encoding 0x%08x", encoding);
+            return 0;
+        }
+    }
+
+    slot->lastUsed = vcos_getmicrosecs64();
+
+    return setEncoderQuality(slot, quality);
+}
+
+/**
+ * Re-apply the encoder configuration to a live encoder.
+ *
+ * Nothing is done if the configured encoding and quality are unchanged. Every capture selects its
+ * own encoder anyway, this only saves the first capture with a new configuration from doing it.
+ *
+ * @param context global state, holding the new configuration
+ * @param previous configuration currently applied to the encoder
+ * @return non-zero on success; zero on error
+ */
+int updateEncoderConfiguration(PicamContext *context, const PicamConfig *previous) {
+    const EncoderConfig *encoder = &context->config.encoder;
+
+    if (encoder->encoding == previous->encoder.encoding && encoder->quality == previous->encoder.quality) {
+        return 1;
+    }
+
+    return selectEncoder(context, encoder->encoding, encoder->quality);
+}
+
+/**
+ * Connect the camera capture port to the encoder input port, with a tunnelled connection.
+ *
+ * This is used when creating the encoder, when switching encoders, and when the capture port is
+ * switched back from a raw output format.
+ *
+ * @param context global state
+ * @return non-zero on success; zero on error
+ */
+int connectCameraToEncoder(PicamContext *context) {
+    MMAL_PORT_T *cameraCapturePort = context->cameraComponent->output[MMAL_CAMERA_CAPTURE_PORT];
+    MMAL_PORT_T *encoderInputPort  = context->encoderComponent->input[0];
+
+    if (MMAL_SUCCESS != mmal_connection_create(&context->cameraEncoderConnection, cameraCapturePort, encoderInputPort, MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT)) {
+        return 0;
+    }
+
+    if (MMAL_SUCCESS != mmal_connection_enable(context->cameraEncoderConnection)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Create the encoder component for the configured encoding and quality, and connect the camera to
+ * it.
+ *
+ * @param context global state
+ * @return non-zero on success; zero on error
+ */
+static int createEncoderComponent(PicamContext *context) {
+    EncoderSlot *slot = &context->encoders[0];
+
+    if (!createEncoderSlot(context, slot, context->config.encoder.encoding, context->config.encoder.quality)) {
+        return 0;
+    }
+    probe2(create__phase, "encoder", "component");
+
+    context->encoderComponent = slot->component;
+
+    if (!connectCameraToEncoder(context)) {
+        logError("Failed to connect camera to encoder");
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Create an encoder component, with its output port enabled and supplied with buffers, ready to be
+ * connected to the camera.
+ *
+ * @param context global state
+ * @param slot slot to hold the encoder
+ * @param encoding MMAL encoding
+ * @param quality JPEG quality factor
+ * @return non-zero on success; zero on error
+ */
+static int createEncoderSlot(PicamContext *context, EncoderSlot *slot, int32_t encoding, uint32_t quality) {
+    if (MMAL_SUCCESS != mmal_component_create(MMAL_COMPONENT_DEFAULT_IMAGE_ENCODER, &slot->component)) {
+        logError("Failed to create encoder component");
         return 0;
     }
 
-    MMAL_PORT_T *encoderInputPort  = context->encoderComponent->input [0];
-    MMAL_PORT_T *encoderOutputPort = context->encoderComponent->output[0];
+    slot->encoding = encoding;
+    slot->quality  = quality;
+    slot->lastUsed = vcos_getmicrosecs64();
+
+    MMAL_PORT_T *encoderInputPort  = slot->component->input [0];
+    MMAL_PORT_T *encoderOutputPort = slot->component->output[0];
 
     mmal_format_copy(encoderOutputPort->format, encoderInputPort->format);
 
-    encoderOutputPort->format->encoding = context->config.encoder.encoding;
+    encoderOutputPort->format->encoding = encoding;
 
     encoderOutputPort->buffer_size = encoderOutputPort->buffer_size_recommended;
     if (encoderOutputPort->buffer_size < encoderOutputPort->buffer_size_min) {
@@ -59,94 +231,183 @@ int createEncoder(PicamContext *context) {
     }
 
     if (MMAL_SUCCESS != mmal_port_format_commit(encoderOutputPort)) {
+        logError("Failed to set encoder output port format");
         return 0;
     }
+    probe2(create__phase, "encoder", "format");
 
 
-    if (MMAL_SUCCESS != mmal_port_parameter_set_uint32(encoderOutputPort, MMAL_PARAMETER_JPEG_Q_FACTOR, context->config.encoder.quality)) {
+    if (MMAL_SUCCESS != mmal_port_parameter_set_uint32(encoderOutputPort, MMAL_PARAMETER_JPEG_Q_FACTOR, quality)) {
+        logError("Failed to set encoder quality");
         return 0;
     }
+    probe2(create__phase, "encoder", "quality");
 
-    if (MMAL_SUCCESS != mmal_component_enable(context->encoderComponent)) {
+    if (MMAL_SUCCESS != mmal_component_enable(slot->component)) {
+        logError("Failed to enable encoder component");
         return 0;
     }
+    probe2(create__phase, "encoder", "enable");
 
-    if (!createPicturePool(context)) {
-        return 0;
-    }
-
-    if (!connectCameraToEncoder(context)) {
+    if (!createPicturePool(slot)) {
+        logError("Failed to create picture pool");
         return 0;
     }
+    probe2(create__phase, "encoder", "pool");
 
     encoderOutputPort->userdata = (struct MMAL_PORT_USERDATA_T *) context;
 
     if (MMAL_SUCCESS != mmal_port_enable(encoderOutputPort, encoderBufferCallback)) {
+        logError("Failed to enable encoder output port");
         return 0;
     }
+    probe2(create__phase, "encoder", "port");
 
-    if (!sendBuffersToEncoder(context)) {
+    if (!sendBuffersToEncoder(slot)) {
+        logError("Failed to send buffers to encoder");
         return 0;
     }
 
     return 1;
 }
 
-void destroyEncoder(PicamContext *context) {
-    if (context->encoderComponent) {
-        mmal_component_disable(context->encoderComponent);
+/**
+ * Destroy an encoder component and its picture pool.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param slot encoder slot
+ */
+static void destroyEncoderSlot(EncoderSlot *slot) {
+    if (slot->component) {
+        mmal_component_disable(slot->component);
 
-        MMAL_PORT_T *encoderOutputPort = context->encoderComponent->output[0];
+        MMAL_PORT_T *encoderOutputPort = slot->component->output[0];
         if (encoderOutputPort->is_enabled) {
             mmal_port_disable(encoderOutputPort);
         }
 
-        if (context->picturePool) {
-            mmal_port_pool_destroy(context->encoderComponent->output[0], context->picturePool);
-            context->picturePool = NULL;
+        if (slot->pool) {
+            mmal_port_pool_destroy(encoderOutputPort, slot->pool);
+            slot->pool = NULL;
         }
 
-        mmal_component_destroy(context->encoderComponent);
-        context->encoderComponent = NULL;
+        mmal_component_destroy(slot->component);
+        slot->component = NULL;
     }
 }
 
-static int createPicturePool(PicamContext *context) {
-    MMAL_PORT_T *encoderOutputPort = context->encoderComponent->output[0];
+/**
+ * Find the slot for an encoding - either the slot already holding an encoder for it, or an empty
+ * slot, or failing that the least recently used slot (which is emptied).
+ *
+ * The active encoder is never chosen for eviction.
+ *
+ * @param context global state
+ * @param encoding MMAL encoding
+ * @return slot
+ */
+static EncoderSlot *findEncoderSlot(PicamContext *context, int32_t encoding) {
+    EncoderSlot *empty  = NULL;
+    EncoderSlot *oldest = NULL;
+
+    for (int i = 0; i < ENCODER_CACHE_SIZE; i++) {
+        EncoderSlot *slot = &context->encoders[i];
+
+        if (!slot->component) {
+            if (!empty) {
+                empty = slot;
+            }
+            continue;
+        }
 
-    MMAL_POOL_T *picturePool = mmal_port_pool_create(encoderOutputPort, encoderOutputPort->buffer_num, encoderOutputPort->buffer_size);
+        if (slot->encoding == encoding) {
+            return slot;
+        }
 
-    if (!picturePool) {
-        return 0;
+        if (slot->component != context->encoderComponent && (!oldest || slot->lastUsed < oldest->lastUsed)) {
+            oldest = slot;
+        }
+    }
+
+    if (empty) {
+        return empty;
     }
 
-    context->picturePool = picturePool;
+    destroyEncoderSlot(oldest);
 
-    return 1;
+    return oldest;
 }
 
-static int connectCameraToEncoder(PicamContext *context) {
-    MMAL_PORT_T *cameraCapturePort = context->cameraComponent->output[MMAL_CAMERA_CAPTURE_PORT];
-    MMAL_PORT_T *encoderInputPort  = context->encoderComponent->input[0];
+static EncoderSlot *activeEncoderSlot(PicamContext *context) {
+    for (int i = 0; i < ENCODER_CACHE_SIZE; i++) {
+        if (context->encoders[i].component && context->encoders[i].component == context->encoderComponent) {
+            return &context->encoders[i];
+        }
+    }
+    return NULL;
+}
 
-    if (MMAL_SUCCESS != mmal_connection_create(&context->cameraEncoderConnection, cameraCapturePort, encoderInputPort, MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT)) {
+/**
+ * Set the quality on a live encoder, if it differs from the quality already set.
+ *
+ * @param slot encoder slot
+ * @param quality JPEG quality factor
+ * @return non-zero on success; zero on error
+ */
+static int setEncoderQuality(EncoderSlot *slot, uint32_t quality) {
+    if (slot->quality == quality) {
+        return 1;
+    }
+
+    if (MMAL_SUCCESS != mmal_port_parameter_set_uint32(slot->component->output[0], MMAL_PARAMETER_JPEG_Q_FACTOR, quality)) {
+        logError("Failed to set encoder quality %u", quality);
         return 0;
     }
 
-    if (MMAL_SUCCESS != mmal_connection_enable(context->cameraEncoderConnection)) {
+    slot->quality = quality;
+
+    return 1;
+}
+
+/**
+ * Find the picture pool belonging to an encoder output port - buffers must always be returned to
+ * the encoder they came from, which is not necessarily the active encoder.
+ *
+ * @param context global state
+ * @param port encoder output port
+ * @return pool, or NULL if the port does not belong to any cached encoder
+ */
+static MMAL_POOL_T *encoderPortPool(PicamContext *context, MMAL_PORT_T *port) {
+    for (int i = 0; i < ENCODER_CACHE_SIZE; i++) {
+        if (context->encoders[i].component && context->encoders[i].component->output[0] == port) {
+            return context->encoders[i].pool;
+        }
+    }
+    return NULL;
+}
+
+static int createPicturePool(EncoderSlot *slot) {
+    MMAL_PORT_T *encoderOutputPort = slot->component->output[0];
+
+    MMAL_POOL_T *picturePool = mmal_port_pool_create(encoderOutputPort, encoderOutputPort->buffer_num, encoderOutputPort->buffer_size);
+
+    if (!picturePool) {
         return 0;
     }
 
+    slot->pool = picturePool;
+
     return 1;
 }
 
-static int sendBuffersToEncoder(PicamContext *context) {
-    MMAL_PORT_T *encoderOutputPort = context->encoderComponent->output[0];
+static int sendBuffersToEncoder(EncoderSlot *slot) {
+    MMAL_PORT_T *encoderOutputPort = slot->component->output[0];
 
-    unsigned int bufferCount = mmal_queue_length(context->picturePool->queue);
+    unsigned int bufferCount = mmal_queue_length(slot->pool->queue);
 
     for (unsigned int i = 0; i < bufferCount; i++) {
-        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(context->picturePool->queue);
+        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(slot->pool->queue);
 
         if (buffer == NULL) {
             return 0;
@@ -165,6 +426,12 @@ static int sendBuffersToEncoder(PicamContext *context) {
  *
  * Process the picture data supplied by the image encoder.
  *
+ * Each buffer is matched to the capture generation that triggered its frame, and is delivered only
+ * if that capture is still waiting - buffers from a capture that already timed out are discarded.
+ *
+ * The picture data itself is handled by deliverPictureData, see Delivery.c. Each buffer is also
+ * recorded if a trace is running.
+ *
  * Note that when cleaning up, this callback will be invoked with a buffer length of zero, and
  * buffer flags of zero. The implemntation handles this scenario safely.
  *
@@ -173,35 +440,87 @@ static int sendBuffersToEncoder(PicamContext *context) {
  */
 static void encoderBufferCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
     bool finished = false;
-    int written = 0;
+    bool frameEnd = buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED);
+    bool failed   = buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED;
+    uint32_t generation = 0;
 
     PicamContext *context = (PicamContext *) port->userdata;
 
-    if (buffer->length) {
-        mmal_buffer_header_mem_lock(buffer);
-        // looks like we don't need to worry about buffer->offset
-        written = context->pictureDataCallback(buffer->data, buffer->length);
-        mmal_buffer_header_mem_unlock(buffer);
-    }
-
-    if (written != buffer->length) {
-        finished = true;
-    }
+    uint64_t cpuStart = enterCallbackThread(context);
+
+    probe3(buffer__entry, buffer->length, buffer->flags, buffer->pts);
+
+    if (buffer->length || frameEnd) {
+        bool current;
+        generation = bufferGeneration(context, &current);
+
+        if (current) {
+            if (buffer->length) {
+                mmal_buffer_header_mem_lock(buffer);
+                if (tracing(context)) {
+                    traceBuffer(context, buffer, generation);
+                }
+                // looks like we don't need to worry about buffer->offset
+                if (!deliverPictureData(context, buffer->data, buffer->length)) {
+                    finished = true;
+                    failed   = true;
+                }
+                mmal_buffer_header_mem_unlock(buffer);
+            } else if (tracing(context)) {
+                traceBuffer(context, buffer, generation);
+            }
+
+            if (finished || frameEnd) {
+                finishPictureData(context, failed);
+            }
+        } else {
+            if (tracing(context)) {
+                traceBuffer(context, buffer, 0);
+            }
+            if (buffer->length) {
+                context->stats.discardedBuffers++;
+            }
+        }
 
-    if (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED)) {
-        finished = true;
+        bufferDone(context);
     }
 
     mmal_buffer_header_release(buffer);
 
-    if (port->is_enabled) {
-        MMAL_BUFFER_HEADER_T *nextBuffer = mmal_queue_get(context->picturePool->queue);
+    MMAL_POOL_T *pool = encoderPortPool(context, port);
+    if (port->is_enabled && pool) {
+        MMAL_BUFFER_HEADER_T *nextBuffer = mmal_queue_get(pool->queue);
         if (nextBuffer) {
             mmal_port_send_buffer(port, nextBuffer);
         }
     }
 
-    if (finished) {
-        vcos_semaphore_post(&context->captureFinishedSemaphore);
+    if (finished || frameEnd) {
+        finishGeneration(context, generation, frameEnd);
     }
+
+    probe2(buffer__exit, generation, finished || frameEnd);
+
+    leaveCallbackThread(context, cpuStart);
+}
+
+/**
+ * Record an encoder buffer in the trace, with its data if payloads are being recorded and the buffer
+ * belongs to a capture.
+ *
+ * The buffer memory must be locked if it belongs to a capture and has any data.
+ *
+ * @param context global state
+ * @param buffer encoder buffer
+ * @param generation capture generation the buffer belongs to, zero if it is discarded
+ */
+static void traceBuffer(PicamContext *context, MMAL_BUFFER_HEADER_T *buffer, uint32_t generation) {
+    TraceRecord record = {
+        .type   = TRACE_ENCODER_BUFFER,
+        .pts    = buffer->pts,
+        .length = buffer->length,
+        .flags  = buffer->flags,
+        .value  = generation
+    };
+    traceRecord(context, &record, generation && buffer->length ? buffer->data : NULL);
 }
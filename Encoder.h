@@ -24,5 +24,8 @@
 
 int createEncoder(PicamContext* context);
 void destroyEncoder(PicamContext* context);
+int selectEncoder(PicamContext *context, int32_t encoding, uint32_t quality);
+int updateEncoderConfiguration(PicamContext *context, const PicamConfig *previous);
+int connectCameraToEncoder(PicamContext *context);
 
 #endif // _PICAM_ENCODER_H
\ No newline at end of file
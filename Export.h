@@ -0,0 +1,35 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_EXPORT_H
+#define _PICAM_EXPORT_H
+
+/**
+ * Marks a function as part of the public interface of the core library.
+ *
+ * The library is built with hidden visibility, so only functions marked with this are exported
+ * from the shared object - everything else is internal, even if it is not static.
+ */
+#if defined(__GNUC__)
+#define PICAM_EXPORT __attribute__ ((visibility ("default")))
+#else
+#define PICAM_EXPORT
+#endif
+
+#endif // _PICAM_EXPORT_H
@@ -0,0 +1,275 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+/*
+ * Exposure and white balance lock.
+ *
+ * Locking reads the exposure the camera has converged on - shutter speed, analog and digital gain,
+ * and the white balance gains - and switches the camera to exactly those fixed values, with the
+ * automatic exposure and white balance algorithms turned off. Every capture after that has
+ * identical exposure, and no capture waits for the algorithms to settle.
+ *
+ * Both locking and unlocking are applied to the live camera, the pipeline is not rebuilt. A lock
+ * is re-applied if the pipeline is recovered or the configuration is changed, and lasts until it
+ * is unlocked or the camera is closed.
+ */
+
+#include "ExposureLock.h"
+#include "Log.h"
+#include "Port.h"
+#include "Recovery.h"
+
+static int currentExposure(PicamContext *context, ExposureSettings *settings);
+static int restoreExposure(PicamContext *context);
+static double gain(MMAL_RATIONAL_T value);
+
+/**
+ * Initialise the exposure lock state, when the context is created.
+ *
+ * @param context global state
+ */
+void initExposureLock(PicamContext *context) {
+    pthread_mutex_init(&context->exposureLock.mutex, NULL);
+}
+
+/**
+ * Destroy the exposure lock state, when the context is released.
+ *
+ * @param context global state
+ */
+void destroyExposureLock(PicamContext *context) {
+    pthread_mutex_destroy(&context->exposureLock.mutex);
+}
+
+/**
+ * Ask the camera to report its settings on the control port whenever they change.
+ *
+ * This is done for every new camera component, so any settings reported by the previous one -
+ * before a recovery, or for another camera - are forgotten first. The camera control port must be
+ * enabled.
+ *
+ * @param context global state
+ * @return non-zero on success; zero on error
+ */
+int requestCameraSettings(PicamContext *context) {
+    ExposureLock *lock = &context->exposureLock;
+
+    pthread_mutex_lock(&lock->mutex);
+    lock->reported = false;
+    pthread_mutex_unlock(&lock->mutex);
+
+    return requestParameterChanges(context->cameraComponent->control, MMAL_PARAMETER_CAMERA_SETTINGS, true);
+}
+
+/**
+ * Record the settings reported by the camera, called on the camera control port callback.
+ *
+ * @param context global state
+ * @param settings settings reported by the camera
+ */
+void cameraSettingsReported(PicamContext *context, const MMAL_PARAMETER_CAMERA_SETTINGS_T *settings) {
+    ExposureLock *lock = &context->exposureLock;
+
+    pthread_mutex_lock(&lock->mutex);
+
+    lock->current.shutterSpeed = settings->exposure;
+    lock->current.analogGain   = settings->analog_gain;
+    lock->current.digitalGain  = settings->digital_gain;
+    lock->current.redGain      = settings->awb_red_gain;
+    lock->current.blueGain     = settings->awb_blue_gain;
+    lock->reported             = true;
+
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+/**
+ * Lock the exposure and white balance at the values the camera is currently using.
+ *
+ * Locking again replaces the previous lock with the current values.
+ *
+ * @param context global state
+ * @return non-zero on success; zero on error
+ */
+int lockExposure(PicamContext *context) {
+    ExposureLock *lock = &context->exposureLock;
+
+    int result = lockPipeline(context);
+
+    if (result) {
+        ExposureSettings settings;
+        if ((result = currentExposure(context, &settings))) {
+            lock->settings = settings;
+            lock->locked   = true;
+
+            if ((result = applyExposureLock(context))) {
+                logInfo("Exposure locked at %uus, analog gain %.2f, digital gain %.2f, red gain %.2f, blue gain %.2f",
+                    settings.shutterSpeed, gain(settings.analogGain), gain(settings.digitalGain), gain(settings.redGain), gain(settings.blueGain));
+            } else {
+                logWarn("Failed to lock exposure");
+                lock->locked = false;
+                restoreExposure(context);
+            }
+        } else {
+            logWarn("Camera has not reported its exposure yet");
+        }
+    }
+
+    unlockPipeline(context);
+
+    return result;
+}
+
+/**
+ * Unlock the exposure and white balance, restoring the configured exposure and white balance modes.
+ *
+ * @param context global state
+ * @return non-zero on success; zero on error
+ */
+int unlockExposure(PicamContext *context) {
+    int result = lockPipeline(context);
+
+    if (result && context->exposureLock.locked) {
+        context->exposureLock.locked = false;
+        if (!(result = restoreExposure(context))) {
+            logWarn("Failed to unlock exposure");
+        }
+    }
+
+    unlockPipeline(context);
+
+    return result;
+}
+
+/**
+ * Apply the locked exposure and white balance to the camera, if they are locked.
+ *
+ * Used when locking and whenever the camera configuration has been (re-)applied, so the lock
+ * survives a pipeline recovery or a configuration change. The pipeline lock must be held.
+ *
+ * @param context global state
+ * @return non-zero on success, or if nothing is locked; zero on error
+ */
+int applyExposureLock(PicamContext *context) {
+    if (!context->exposureLock.locked) {
+        return 1;
+    }
+
+    MMAL_PORT_T            *controlPort = context->cameraComponent->control;
+    MMAL_PORT_T            *capturePort = context->cameraComponent->output[MMAL_CAMERA_CAPTURE_PORT];
+    const ExposureSettings *settings    = &context->exposureLock.settings;
+
+    context->shutterSpeed = settings->shutterSpeed;
+
+    return
+        setUInt32                    (controlPort, MMAL_PARAMETER_SHUTTER_SPEED, settings->shutterSpeed) &&
+        setRational                  (controlPort, MMAL_PARAMETER_ANALOG_GAIN  , settings->analogGain.num, settings->analogGain.den) &&
+        setRational                  (controlPort, MMAL_PARAMETER_DIGITAL_GAIN , settings->digitalGain.num, settings->digitalGain.den) &&
+        setExposureMode              (controlPort                              , MMAL_PARAM_EXPOSUREMODE_OFF) &&
+        setAutomaticWhiteBalanceMode (controlPort                              , MMAL_PARAM_AWBMODE_OFF) &&
+        setAutomaticWhiteBalanceGains(controlPort                              , gain(settings->redGain), gain(settings->blueGain)) &&
+        setFpsRange                  (capturePort                              , settings->shutterSpeed);
+}
+
+/**
+ * Drop any exposure lock when the camera is closed, restoring the configured values first in case
+ * the pipeline is parked and re-used.
+ *
+ * The camera must not be in use by anything else.
+ *
+ * @param context global state
+ */
+void releaseExposureLock(PicamContext *context) {
+    if (context->exposureLock.locked) {
+        context->exposureLock.locked = false;
+        if (context->cameraComponent) {
+            restoreExposure(context);
+        }
+    }
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Get the exposure and white balance the camera is currently using.
+ *
+ * The settings last reported on the control port are used, failing that the camera is asked
+ * directly.
+ *
+ * @param context global state
+ * @param settings receives the current settings
+ * @return non-zero on success; zero if the settings are not known
+ */
+static int currentExposure(PicamContext *context, ExposureSettings *settings) {
+    ExposureLock *lock = &context->exposureLock;
+
+    pthread_mutex_lock(&lock->mutex);
+    bool reported = lock->reported;
+    *settings = lock->current;
+    pthread_mutex_unlock(&lock->mutex);
+
+    if (!reported) {
+        MMAL_PARAMETER_CAMERA_SETTINGS_T param = {{MMAL_PARAMETER_CAMERA_SETTINGS, sizeof(param)}};
+        if (MMAL_SUCCESS != mmal_port_parameter_get(context->cameraComponent->control, &param.hdr)) {
+            return 0;
+        }
+        settings->shutterSpeed = param.exposure;
+        settings->analogGain   = param.analog_gain;
+        settings->digitalGain  = param.digital_gain;
+        settings->redGain      = param.awb_red_gain;
+        settings->blueGain     = param.awb_blue_gain;
+    }
+
+    // Nothing sensible can be locked until the algorithms have run at least once
+    return settings->shutterSpeed && settings->analogGain.den && settings->digitalGain.den && settings->redGain.den && settings->blueGain.den;
+}
+
+/**
+ * Restore the configured exposure and white balance on the camera.
+ *
+ * The analog and digital gains are not configurable, so are returned to automatic (zero).
+ *
+ * @param context global state
+ * @return non-zero on success; zero on error
+ */
+static int restoreExposure(PicamContext *context) {
+    MMAL_PORT_T         *controlPort = context->cameraComponent->control;
+    MMAL_PORT_T         *capturePort = context->cameraComponent->output[MMAL_CAMERA_CAPTURE_PORT];
+    const ControlConfig *control     = &context->config.control;
+
+    context->shutterSpeed = control->shutterSpeed;
+
+    return
+        setUInt32                    (controlPort, MMAL_PARAMETER_SHUTTER_SPEED, control->shutterSpeed) &&
+        setRational                  (controlPort, MMAL_PARAMETER_ANALOG_GAIN  , 0, 1) &&
+        setRational                  (controlPort, MMAL_PARAMETER_DIGITAL_GAIN , 0, 1) &&
+        setExposureMode              (controlPort                              , control->exposureMode) &&
+        setAutomaticWhiteBalanceMode (controlPort                              , control->automaticWhiteBalanceMode) &&
+        setAutomaticWhiteBalanceGains(controlPort                              , control->automaticWhiteBalanceRedGain, control->automaticWhiteBalanceBlueGain) &&
+        setFpsRange                  (capturePort                              , control->shutterSpeed);
+}
+
+/**
+ * Convert a gain reported by the camera to a floating point value.
+ *
+ * @param value gain
+ * @return gain
+ */
+static double gain(MMAL_RATIONAL_T value) {
+    return value.den ? (double) value.num / value.den : 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include "FrameEncoder.h"
+
+/**
+ * Submit a caller-supplied image to the standalone encoder, without waiting for it to be encoded.
+ *
+ * The standalone encoder is independent of the camera - it is not the encoder the camera is
+ * tunnelled to, nor the one used for regions - so images can be encoded whether or not the camera
+ * is capturing. It is created on first use, and re-created if the encoding or quality changes
+ * while it is idle.
+ *
+ * Up to HOST_ENCODER_PIPELINE images may be in flight, the encoded images are collected with
+ * receiveFrame in the order they were submitted. Submit and receive must be called from the same
+ * thread, or be synchronised by the caller.
+ *
+ * @param context global state
+ * @param encoder encoding and quality for the output
+ * @param format MMAL encoding of the image, MMAL_ENCODING_I420, MMAL_ENCODING_RGB24 or MMAL_ENCODING_RGBA
+ * @param width image width in pixels
+ * @param height image height in pixels
+ * @param data image data, copied before this returns
+ * @param stride row stride of the image (or of the luma plane) in bytes
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *submitFrame(PicamContext *context, const EncoderConfig *encoder, uint32_t format, uint32_t width, uint32_t height, const uint8_t *data, uint32_t stride) {
+    HostEncoder *frameEncoder = &context->frameEncoder;
+
+    if (frameEncoder->component && (frameEncoder->encoding != (uint32_t) encoder->encoding || frameEncoder->quality != encoder->quality)) {
+        if (pendingEncodes(frameEncoder)) {
+            return "Can not change encoding with frames in flight";
+        }
+        destroyHostEncoder(frameEncoder);
+    }
+
+    if (!frameEncoder->component && !createHostEncoder(frameEncoder, encoder->encoding, encoder->quality)) {
+        return "Failed to create frame encoder";
+    }
+
+    if (format == MMAL_ENCODING_I420 && (width & 1 || height & 1)) {
+        return "I420 frame size must be even";
+    }
+
+    if (!submitEncode(frameEncoder, format, width, height, data, stride)) {
+        return "Failed to submit frame to encoder";
+    }
+
+    return NULL;
+}
+
+/**
+ * Wait for the oldest frame submitted to the standalone encoder, and collect the encoded data.
+ *
+ * @param context global state
+ * @param data set to the encoded data, valid until the next frame is received
+ * @param length set to the length of the encoded data
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *receiveFrame(PicamContext *context, const uint8_t **data, size_t *length) {
+    if (!context->frameEncoder.component || !pendingEncodes(&context->frameEncoder)) {
+        return "No frame has been submitted";
+    }
+
+    if (!receiveEncode(&context->frameEncoder, &context->frameData)) {
+        return "Failed to encode frame";
+    }
+
+    *data   = context->frameData.data;
+    *length = context->frameData.length;
+
+    return NULL;
+}
+
+/**
+ * Destroy the standalone encoder, discarding any frames in flight.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param context global state
+ */
+void destroyFrameEncoder(PicamContext *context) {
+    destroyHostEncoder(&context->frameEncoder);
+    freeBytes(&context->frameData);
+}
@@ -0,0 +1,29 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_FRAME_ENCODER_H
+#define _PICAM_FRAME_ENCODER_H
+
+#include "Picam.h"
+
+char *submitFrame(PicamContext *context, const EncoderConfig *encoder, uint32_t format, uint32_t width, uint32_t height, const uint8_t *data, uint32_t stride);
+char *receiveFrame(PicamContext *context, const uint8_t **data, size_t *length);
+void destroyFrameEncoder(PicamContext *context);
+
+#endif // _PICAM_FRAME_ENCODER_H
@@ -0,0 +1,155 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <stdlib.h>
+
+#include "Fusion.h"
+#include "Cpu.h"
+#include "Log.h"
+#include "Parallel.h"
+
+/**
+ * The images being fused, shared by every band.
+ */
+typedef struct FusionTask {
+    const Image   *frames;
+    uint32_t       count;
+    Image         *output;
+    FuseRowKernel  kernel;
+} FusionTask;
+
+/**
+ * NEON row kernel, only present if the library was built with the NEON sources.
+ */
+extern void fuseRowNeon(const uint8_t *const *values, const uint8_t *const *lumas, uint32_t lumaStep, uint32_t count, uint32_t width, uint8_t *out) __attribute__((weak));
+
+static FuseRowKernel selectKernel(void);
+static void fuseRowGeneric(const uint8_t *const *values, const uint8_t *const *lumas, uint32_t lumaStep, uint32_t count, uint32_t width, uint8_t *out);
+static void fuseBand(void *userdata, uint32_t startRow, uint32_t endRow);
+
+/**
+ * Fuse a number of differently exposed images of the same scene into a single image.
+ *
+ * This is a single-scale exposure fusion - each output pixel is the average of the input pixels,
+ * weighted by how well exposed each one is (how close its luma is to mid-grey). The chroma samples
+ * are weighted by the luma of the pixel they are co-sited with. There is no tone-mapping step, the
+ * output is directly displayable.
+ *
+ * The work is split into horizontal bands across several threads, and the row kernel is selected
+ * at runtime for the CPU.
+ *
+ * @param frames images to fuse, all the same size
+ * @param count number of images, at most FUSION_MAX_FRAMES
+ * @param output fused image, (re-)allocated here
+ * @return non-zero on success; zero on error
+ */
+int fuseExposures(const Image *frames, uint32_t count, Image *output) {
+    if (count == 0 || count > FUSION_MAX_FRAMES) {
+        return 0;
+    }
+
+    uint32_t width  = frames[0].width;
+    uint32_t height = frames[0].height;
+
+    if (!allocateImage(output, width, height, width, height)) {
+        return 0;
+    }
+
+    FusionTask task = {
+        .frames = frames,
+        .count  = count,
+        .output = output,
+        .kernel = selectKernel()
+    };
+
+    // Bands must start on an even row so each one owns whole chroma rows
+    runParallel(height, 2, fuseBand, &task);
+
+    return 1;
+}
+
+// === Private implementation =====================================================================
+
+static FuseRowKernel selectKernel(void) {
+    if (fuseRowNeon && cpuHasFeature(CPU_FEATURE_NEON)) {
+        return fuseRowNeon;
+    }
+    return fuseRowGeneric;
+}
+
+/**
+ * Fuse one row of a plane.
+ *
+ * The weight for a sample is 129 - |luma - 128|, so never zero - this must match the SIMD kernels
+ * exactly so results do not depend on the CPU.
+ *
+ * @param values row of the plane being fused, for each image
+ * @param lumas row of the luma plane used for the weights, for each image
+ * @param lumaStep distance between the luma samples for consecutive values, 1 for the luma plane itself or 2 for a chroma plane
+ * @param count number of images
+ * @param width number of samples in the row
+ * @param out output row
+ */
+static void fuseRowGeneric(const uint8_t *const *values, const uint8_t *const *lumas, uint32_t lumaStep, uint32_t count, uint32_t width, uint8_t *out) {
+    for (uint32_t x = 0; x < width; x++) {
+        uint32_t sum   = 0;
+        uint32_t total = 0;
+
+        for (uint32_t i = 0; i < count; i++) {
+            int32_t  luma   = lumas[i][x * lumaStep];
+            uint32_t weight = 129 - abs(luma - 128);
+
+            sum   += weight * values[i][x];
+            total += weight;
+        }
+
+        out[x] = (uint8_t) ((sum + total / 2) / total);
+    }
+}
+
+/**
+ * Fuse every plane of one band of the output image.
+ *
+ * @param userdata fusion task
+ * @param startRow first luma row of the band, always even
+ * @param endRow luma row after the end of the band
+ */
+static void fuseBand(void *userdata, uint32_t startRow, uint32_t endRow) {
+    FusionTask *task = (FusionTask *) userdata;
+
+    const uint8_t *values[FUSION_MAX_FRAMES];
+    const uint8_t *lumas [FUSION_MAX_FRAMES];
+
+    for (int plane = IMAGE_PLANE_Y; plane <= IMAGE_PLANE_V; plane++) {
+        uint32_t shift  = plane == IMAGE_PLANE_Y ? 0 : 1;
+        uint32_t width  = task->output->width >> shift;
+        uint8_t *output = imagePlane(task->output, plane);
+        uint32_t stride = imagePlaneStride(task->output, plane);
+
+        for (uint32_t row = startRow >> shift; row < endRow >> shift; row++) {
+            for (uint32_t i = 0; i < task->count; i++) {
+                const Image *frame = &task->frames[i];
+                values[i] = imagePlane(frame, plane) + (size_t) row * imagePlaneStride(frame, plane);
+                lumas [i] = imagePlane(frame, IMAGE_PLANE_Y) + (size_t) (row << shift) * frame->stride;
+            }
+
+            task->kernel(values, lumas, 1 << shift, task->count, width, output + (size_t) row * stride);
+        }
+    }
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_FUSION_H
+#define _PICAM_FUSION_H
+
+#include "Image.h"
+
+/**
+ * Maximum number of exposures that can be fused.
+ */
+#define FUSION_MAX_FRAMES 8
+
+/**
+ * Row kernel, see Fusion.c.
+ */
+typedef void (*FuseRowKernel)(const uint8_t *const *values, const uint8_t *const *lumas, uint32_t lumaStep, uint32_t count, uint32_t width, uint8_t *out);
+
+int fuseExposures(const Image *frames, uint32_t count, Image *output);
+
+#endif // _PICAM_FUSION_H
@@ -0,0 +1,112 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <stdlib.h>
+
+#include "Fusion.h"
+
+/**
+ * NEON exposure fusion row kernel.
+ *
+ * This file is compiled with NEON enabled, and the kernel is only called after checking the CPU at
+ * runtime. If NEON is not available to the compiler at all, the kernel is simply left out.
+ */
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+
+void fuseRowNeon(const uint8_t *const *values, const uint8_t *const *lumas, uint32_t lumaStep, uint32_t count, uint32_t width, uint8_t *out);
+
+/**
+ * Fuse one row of a plane, eight samples at a time - see fuseRowGeneric in Fusion.c.
+ *
+ * The division by the total weight is done with a refined reciprocal estimate, which can be out
+ * by one either way, so the quotient is then corrected with integer arithmetic to make it exact.
+ */
+void fuseRowNeon(const uint8_t *const *values, const uint8_t *const *lumas, uint32_t lumaStep, uint32_t count, uint32_t width, uint8_t *out) {
+    const uint8x8_t   mid  = vdup_n_u8(128);
+    const uint8x8_t   peak = vdup_n_u8(129);
+    const uint32x4_t  one  = vdupq_n_u32(1);
+
+    uint32_t x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        uint32x4_t sumLow    = vdupq_n_u32(0);
+        uint32x4_t sumHigh   = vdupq_n_u32(0);
+        uint32x4_t totalLow  = vdupq_n_u32(0);
+        uint32x4_t totalHigh = vdupq_n_u32(0);
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint8x8_t luma   = lumaStep == 1 ? vld1_u8(lumas[i] + x) : vld2_u8(lumas[i] + x * 2).val[0];
+            uint8x8_t value  = vld1_u8(values[i] + x);
+            uint8x8_t weight = vsub_u8(peak, vabd_u8(luma, mid));
+
+            uint16x8_t weighted = vmull_u8(weight, value);
+            uint16x8_t weight16 = vmovl_u8(weight);
+
+            sumLow    = vaddw_u16(sumLow   , vget_low_u16 (weighted));
+            sumHigh   = vaddw_u16(sumHigh  , vget_high_u16(weighted));
+            totalLow  = vaddw_u16(totalLow , vget_low_u16 (weight16));
+            totalHigh = vaddw_u16(totalHigh, vget_high_u16(weight16));
+        }
+
+        float32x4_t divisorLow  = vcvtq_f32_u32(totalLow );
+        float32x4_t divisorHigh = vcvtq_f32_u32(totalHigh);
+
+        float32x4_t reciprocalLow  = vrecpeq_f32(divisorLow );
+        float32x4_t reciprocalHigh = vrecpeq_f32(divisorHigh);
+        reciprocalLow  = vmulq_f32(vrecpsq_f32(divisorLow , reciprocalLow ), reciprocalLow );
+        reciprocalHigh = vmulq_f32(vrecpsq_f32(divisorHigh, reciprocalHigh), reciprocalHigh);
+        reciprocalLow  = vmulq_f32(vrecpsq_f32(divisorLow , reciprocalLow ), reciprocalLow );
+        reciprocalHigh = vmulq_f32(vrecpsq_f32(divisorHigh, reciprocalHigh), reciprocalHigh);
+
+        // Round to nearest as the generic kernel does, then divide - the numerators are well within
+        // the 24 bits a float holds exactly
+        uint32x4_t numeratorLow  = vaddq_u32(sumLow , vshrq_n_u32(totalLow , 1));
+        uint32x4_t numeratorHigh = vaddq_u32(sumHigh, vshrq_n_u32(totalHigh, 1));
+
+        uint32x4_t resultLow  = vcvtq_u32_f32(vmulq_f32(vcvtq_f32_u32(numeratorLow ), reciprocalLow ));
+        uint32x4_t resultHigh = vcvtq_u32_f32(vmulq_f32(vcvtq_f32_u32(numeratorHigh), reciprocalHigh));
+
+        // Comparison masks are all ones, so adding one subtracts 1 and subtracting one adds 1
+        resultLow  = vaddq_u32(resultLow , vcgtq_u32(vmulq_u32(resultLow , totalLow ), numeratorLow ));
+        resultHigh = vaddq_u32(resultHigh, vcgtq_u32(vmulq_u32(resultHigh, totalHigh), numeratorHigh));
+        resultLow  = vsubq_u32(resultLow , vcleq_u32(vmulq_u32(vaddq_u32(resultLow , one), totalLow ), numeratorLow ));
+        resultHigh = vsubq_u32(resultHigh, vcleq_u32(vmulq_u32(vaddq_u32(resultHigh, one), totalHigh), numeratorHigh));
+
+        vst1_u8(out + x, vqmovn_u16(vcombine_u16(vmovn_u32(resultLow), vmovn_u32(resultHigh))));
+    }
+
+    for (; x < width; x++) {
+        uint32_t sum   = 0;
+        uint32_t total = 0;
+
+        for (uint32_t i = 0; i < count; i++) {
+            int32_t  luma   = lumas[i][x * lumaStep];
+            uint32_t weight = 129 - abs(luma - 128);
+
+            sum   += weight * values[i][x];
+            total += weight;
+        }
+
+        out[x] = (uint8_t) ((sum + total / 2) / total);
+    }
+}
+
+#endif
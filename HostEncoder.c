@@ -0,0 +1,532 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <string.h>
+
+#include "HostEncoder.h"
+#include "Log.h"
+
+#include "interface/mmal/util/mmal_default_components.h"
+#include "interface/mmal/util/mmal_util.h"
+#include "interface/mmal/util/mmal_util_params.h"
+
+#define ALIGN_WIDTH  32
+#define ALIGN_HEIGHT 16
+
+/**
+ * Maximum time to wait for an input buffer, or for an encode to finish, in milliseconds.
+ */
+#define ENCODE_TIMEOUT 5000
+
+static int configureHostEncoder(HostEncoder *encoder, uint32_t format, uint32_t width, uint32_t height);
+static void disableHostEncoder(HostEncoder *encoder);
+static int sendInput(HostEncoder *encoder, MMAL_BUFFER_HEADER_T *buffer);
+static void copyFrame(uint32_t format, uint32_t width, uint32_t height, const uint8_t *data, uint32_t stride, uint8_t *destination);
+static uint32_t bytesPerPixel(uint32_t format);
+static void inputBufferCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
+static void outputBufferCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
+
+/**
+ * Create a host encoder.
+ *
+ * The encoder ports are not configured until the first image is encoded, since the format depends
+ * on the size of the image.
+ *
+ * @param encoder encoder state
+ * @param encoding MMAL encoding of the output, e.g. MMAL_ENCODING_JPEG
+ * @param quality JPEG quality factor
+ * @return non-zero on success; zero on error
+ */
+int createHostEncoder(HostEncoder *encoder, uint32_t encoding, uint32_t quality) {
+    if (MMAL_SUCCESS != mmal_component_create(MMAL_COMPONENT_DEFAULT_IMAGE_ENCODER, &encoder->component)) {
+        logError("Failed to create host encoder component");
+        return 0;
+    }
+
+    if (VCOS_SUCCESS != vcos_semaphore_create(&encoder->finished, "picam-host-encoder", 0)) {
+        mmal_component_destroy(encoder->component);
+        encoder->component = NULL;
+        return 0;
+    }
+
+    encoder->encoding  = encoding;
+    encoder->quality   = quality;
+    encoder->format    = 0;
+    encoder->width     = 0;
+    encoder->height    = 0;
+    encoder->input     = NULL;
+    encoder->submitted = 0;
+    encoder->completed = 0;
+    encoder->received  = 0;
+
+    return 1;
+}
+
+/**
+ * Destroy a host encoder and all associated resources.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param encoder encoder state
+ */
+void destroyHostEncoder(HostEncoder *encoder) {
+    if (encoder->component) {
+        if (encoder->input) {
+            mmal_buffer_header_mem_unlock(encoder->input);
+            mmal_buffer_header_release(encoder->input);
+            encoder->input = NULL;
+        }
+
+        disableHostEncoder(encoder);
+
+        mmal_component_destroy(encoder->component);
+        encoder->component = NULL;
+
+        vcos_semaphore_delete(&encoder->finished);
+
+        for (int i = 0; i < HOST_ENCODER_PIPELINE; i++) {
+            freeBytes(&encoder->results[i]);
+        }
+    }
+}
+
+/**
+ * Begin encoding an image.
+ *
+ * An input buffer is acquired from the encoder and described as an image, the caller fills in that
+ * image directly (so no intermediate copy is needed) and then calls finishEncode.
+ *
+ * @param encoder encoder state
+ * @param width image width in pixels, must be even
+ * @param height image height in pixels, must be even
+ * @param input image to describe the input buffer, it must not be freed
+ * @return non-zero on success; zero on error
+ */
+int beginEncode(HostEncoder *encoder, uint32_t width, uint32_t height, Image *input) {
+    if (!configureHostEncoder(encoder, MMAL_ENCODING_I420, width, height)) {
+        return 0;
+    }
+
+    MMAL_BUFFER_HEADER_T *buffer = mmal_queue_timedwait(encoder->inputPool->queue, ENCODE_TIMEOUT);
+    if (!buffer) {
+        logError("Timed-out waiting for host encoder input buffer");
+        return 0;
+    }
+
+    mmal_buffer_header_mem_lock(buffer);
+
+    input->width       = width;
+    input->height      = height;
+    input->stride      = VCOS_ALIGN_UP(width , ALIGN_WIDTH );
+    input->sliceHeight = VCOS_ALIGN_UP(height, ALIGN_HEIGHT);
+    input->data        = buffer->data;
+    input->capacity    = buffer->alloc_size;
+
+    encoder->input = buffer;
+
+    return 1;
+}
+
+/**
+ * Finish encoding the image previously begun with beginEncode.
+ *
+ * This waits for the encoded image, so there must be no other images in the encoder.
+ *
+ * @param encoder encoder state
+ * @param output buffer to receive the encoded image
+ * @return non-zero on success; zero on error
+ */
+int finishEncode(HostEncoder *encoder, Bytes *output) {
+    MMAL_BUFFER_HEADER_T *buffer = encoder->input;
+    if (!buffer) {
+        return 0;
+    }
+
+    encoder->input = NULL;
+
+    mmal_buffer_header_mem_unlock(buffer);
+
+    return sendInput(encoder, buffer) && receiveEncode(encoder, output);
+}
+
+/**
+ * Submit an image to be encoded, without waiting for it.
+ *
+ * The image is copied into an encoder input buffer, so the caller may reuse its memory as soon as
+ * this returns. Up to HOST_ENCODER_PIPELINE images may be in the encoder at once, each one must be
+ * collected with receiveEncode, in order.
+ *
+ * The encoder is reconfigured if the format or size differs from the previous image, which can
+ * only be done when there are no images in the encoder.
+ *
+ * @param encoder encoder state
+ * @param format MMAL encoding of the image, MMAL_ENCODING_I420, MMAL_ENCODING_RGB24 or MMAL_ENCODING_RGBA
+ * @param width image width in pixels, must be even for I420
+ * @param height image height in pixels, must be even for I420
+ * @param data image data, for I420 the planes are contiguous with chroma planes of half the stride
+ * @param stride row stride of the image (or of the luma plane) in bytes
+ * @return non-zero on success; zero on error
+ */
+int submitEncode(HostEncoder *encoder, uint32_t format, uint32_t width, uint32_t height, const uint8_t *data, uint32_t stride) {
+    if (pendingEncodes(encoder) >= HOST_ENCODER_PIPELINE) {
+        logError("Host encoder pipeline is full");
+        return 0;
+    }
+
+    if ((encoder->format != format || encoder->width != width || encoder->height != height) && pendingEncodes(encoder)) {
+        logError("Host encoder can not change format with images in the encoder");
+        return 0;
+    }
+
+    if (!configureHostEncoder(encoder, format, width, height)) {
+        return 0;
+    }
+
+    MMAL_BUFFER_HEADER_T *buffer = mmal_queue_timedwait(encoder->inputPool->queue, ENCODE_TIMEOUT);
+    if (!buffer) {
+        logError("Timed-out waiting for host encoder input buffer");
+        return 0;
+    }
+
+    mmal_buffer_header_mem_lock(buffer);
+    copyFrame(format, width, height, data, stride, buffer->data);
+    mmal_buffer_header_mem_unlock(buffer);
+
+    return sendInput(encoder, buffer);
+}
+
+/**
+ * Wait for the oldest image in the encoder to be encoded, and collect it.
+ *
+ * The output buffer is exchanged with the slot that collected the encoded image rather than being
+ * copied, both keep their memory for reuse.
+ *
+ * @param encoder encoder state
+ * @param output buffer to receive the encoded image
+ * @return non-zero on success; zero on error, or if there is no image in the encoder
+ */
+int receiveEncode(HostEncoder *encoder, Bytes *output) {
+    if (!pendingEncodes(encoder)) {
+        return 0;
+    }
+
+    if (VCOS_SUCCESS != vcos_semaphore_wait_timeout(&encoder->finished, ENCODE_TIMEOUT)) {
+        logError("Timed-out waiting for host encoder");
+        // The encoder is in an unknown state, force it to be reconfigured next time
+        disableHostEncoder(encoder);
+        return 0;
+    }
+
+    uint32_t slot = encoder->received % HOST_ENCODER_PIPELINE;
+
+    Bytes result = encoder->results[slot];
+    encoder->results[slot] = *output;
+    *output = result;
+
+    resetBytes(&encoder->results[slot]);
+
+    encoder->received++;
+
+    return !encoder->failed[slot];
+}
+
+/**
+ * Get the number of images submitted to the encoder that have not yet been received.
+ *
+ * @param encoder encoder state
+ * @return number of images
+ */
+uint32_t pendingEncodes(const HostEncoder *encoder) {
+    return encoder->submitted - encoder->received;
+}
+
+/**
+ * Get the number of bytes in an image submitted to the encoder.
+ *
+ * @param format MMAL encoding of the image
+ * @param width image width in pixels
+ * @param height image height in pixels
+ * @param stride row stride of the image (or of the luma plane) in bytes
+ * @return size in bytes; or zero if the format is not supported or the stride is too small
+ */
+size_t hostFrameSize(uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+    uint32_t bytes = bytesPerPixel(format);
+    if (!bytes || stride < width * bytes) {
+        return 0;
+    }
+    if (format == MMAL_ENCODING_I420) {
+        return (size_t) stride * height + (size_t) (stride / 2) * ((height + 1) / 2) * 2;
+    }
+    return (size_t) stride * height;
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Configure the encoder ports for a particular image size, if they are not already.
+ *
+ * @param encoder encoder state
+ * @param width image width in pixels
+ * @param height image height in pixels
+ * @return non-zero on success; zero on error
+ */
+static int configureHostEncoder(HostEncoder *encoder, uint32_t format, uint32_t width, uint32_t height) {
+    if (encoder->format == format && encoder->width == width && encoder->height == height && encoder->inputPool) {
+        return 1;
+    }
+
+    disableHostEncoder(encoder);
+
+    MMAL_PORT_T *inputPort  = encoder->component->input [0];
+    MMAL_PORT_T *outputPort = encoder->component->output[0];
+
+    inputPort->format->encoding                 = format;
+    inputPort->format->es->video.width          = VCOS_ALIGN_UP(width , ALIGN_WIDTH );
+    inputPort->format->es->video.height         = VCOS_ALIGN_UP(height, ALIGN_HEIGHT);
+    inputPort->format->es->video.crop.x         = 0;
+    inputPort->format->es->video.crop.y         = 0;
+    inputPort->format->es->video.crop.width     = width;
+    inputPort->format->es->video.crop.height    = height;
+    inputPort->format->es->video.frame_rate.num = 0;
+    inputPort->format->es->video.frame_rate.den = 1;
+
+    if (MMAL_SUCCESS != mmal_port_format_commit(inputPort)) {
+        logError("Failed to set host encoder input format for %ux%u", width, height);
+        return 0;
+    }
+
+    // At least two input buffers, so the next image can be copied in while one is being encoded
+    inputPort->buffer_size = vcos_max(inputPort->buffer_size_recommended, inputPort->buffer_size_min);
+    inputPort->buffer_num  = vcos_max(vcos_max(inputPort->buffer_num_recommended, inputPort->buffer_num_min), 2);
+
+    mmal_format_copy(outputPort->format, inputPort->format);
+    outputPort->format->encoding = encoder->encoding;
+
+    if (MMAL_SUCCESS != mmal_port_format_commit(outputPort)) {
+        logError("Failed to set host encoder output format");
+        return 0;
+    }
+
+    outputPort->buffer_size = vcos_max(outputPort->buffer_size_recommended, outputPort->buffer_size_min);
+    outputPort->buffer_num  = vcos_max(outputPort->buffer_num_recommended , outputPort->buffer_num_min );
+
+    if (encoder->encoding == MMAL_ENCODING_JPEG && MMAL_SUCCESS != mmal_port_parameter_set_uint32(outputPort, MMAL_PARAMETER_JPEG_Q_FACTOR, encoder->quality)) {
+        logError("Failed to set host encoder quality");
+        return 0;
+    }
+
+    if (!encoder->component->is_enabled && MMAL_SUCCESS != mmal_component_enable(encoder->component)) {
+        logError("Failed to enable host encoder component");
+        return 0;
+    }
+
+    encoder->inputPool  = mmal_port_pool_create(inputPort , inputPort ->buffer_num, inputPort ->buffer_size);
+    encoder->outputPool = mmal_port_pool_create(outputPort, outputPort->buffer_num, outputPort->buffer_size);
+
+    if (!encoder->inputPool || !encoder->outputPool) {
+        logError("Failed to create host encoder pools");
+        disableHostEncoder(encoder);
+        return 0;
+    }
+
+    inputPort ->userdata = (struct MMAL_PORT_USERDATA_T *) encoder;
+    outputPort->userdata = (struct MMAL_PORT_USERDATA_T *) encoder;
+
+    if (MMAL_SUCCESS != mmal_port_enable(inputPort, inputBufferCallback) || MMAL_SUCCESS != mmal_port_enable(outputPort, outputBufferCallback)) {
+        logError("Failed to enable host encoder ports");
+        disableHostEncoder(encoder);
+        return 0;
+    }
+
+    MMAL_BUFFER_HEADER_T *buffer;
+    while ((buffer = mmal_queue_get(encoder->outputPool->queue))) {
+        if (MMAL_SUCCESS != mmal_port_send_buffer(outputPort, buffer)) {
+            logError("Failed to send buffers to host encoder");
+            disableHostEncoder(encoder);
+            return 0;
+        }
+    }
+
+    encoder->format = format;
+    encoder->width  = width;
+    encoder->height = height;
+
+    return 1;
+}
+
+/**
+ * Disable the encoder ports and release the buffer pools, so the ports can be reconfigured.
+ *
+ * @param encoder encoder state
+ */
+static void disableHostEncoder(HostEncoder *encoder) {
+    MMAL_PORT_T *inputPort  = encoder->component->input [0];
+    MMAL_PORT_T *outputPort = encoder->component->output[0];
+
+    if (inputPort->is_enabled) {
+        mmal_port_disable(inputPort);
+    }
+
+    if (outputPort->is_enabled) {
+        mmal_port_disable(outputPort);
+    }
+
+    if (encoder->inputPool) {
+        mmal_port_pool_destroy(inputPort, encoder->inputPool);
+        encoder->inputPool = NULL;
+    }
+
+    if (encoder->outputPool) {
+        mmal_port_pool_destroy(outputPort, encoder->outputPool);
+        encoder->outputPool = NULL;
+    }
+
+    encoder->format = 0;
+    encoder->width  = 0;
+    encoder->height = 0;
+
+    // Images still in the encoder are lost, discard any stale completion
+    encoder->submitted = 0;
+    encoder->completed = 0;
+    encoder->received  = 0;
+
+    while (vcos_semaphore_trywait(&encoder->finished) == VCOS_SUCCESS);
+}
+
+/**
+ * Send a filled input buffer to the encoder, assigning the next result slot to the image.
+ *
+ * @param encoder encoder state
+ * @param buffer input buffer, not memory locked
+ * @return non-zero on success; zero on error
+ */
+static int sendInput(HostEncoder *encoder, MMAL_BUFFER_HEADER_T *buffer) {
+    MMAL_PORT_T *inputPort = encoder->component->input[0];
+
+    buffer->length = inputPort->buffer_size;
+    buffer->offset = 0;
+    buffer->flags  = MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_EOS;
+    buffer->pts    = buffer->dts = MMAL_TIME_UNKNOWN;
+
+    uint32_t slot = encoder->submitted % HOST_ENCODER_PIPELINE;
+    resetBytes(&encoder->results[slot]);
+    encoder->failed[slot] = false;
+
+    encoder->submitted++;
+
+    if (MMAL_SUCCESS != mmal_port_send_buffer(inputPort, buffer)) {
+        encoder->submitted--;
+        mmal_buffer_header_release(buffer);
+        logError("Failed to send buffer to host encoder");
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Copy an image into an input buffer, with the row stride and plane layout of the input port.
+ *
+ * @param format MMAL encoding of the image
+ * @param width image width in pixels
+ * @param height image height in pixels
+ * @param data image data
+ * @param stride row stride of the image (or of the luma plane) in bytes
+ * @param destination input buffer data
+ */
+static void copyFrame(uint32_t format, uint32_t width, uint32_t height, const uint8_t *data, uint32_t stride, uint8_t *destination) {
+    uint32_t bytes       = bytesPerPixel(format);
+    uint32_t rowLength   = width * bytes;
+    uint32_t inputStride = VCOS_ALIGN_UP(width, ALIGN_WIDTH) * bytes;
+
+    for (uint32_t y = 0; y < height; y++) {
+        memcpy(destination + (size_t) y * inputStride, data + (size_t) y * stride, rowLength);
+    }
+
+    if (format != MMAL_ENCODING_I420) {
+        return;
+    }
+
+    uint32_t sliceHeight = VCOS_ALIGN_UP(height, ALIGN_HEIGHT);
+
+    const uint8_t *source = data        + (size_t) stride      * height;
+    uint8_t       *target = destination + (size_t) inputStride * sliceHeight;
+
+    for (int plane = 0; plane < 2; plane++) {
+        for (uint32_t y = 0; y < (height + 1) / 2; y++) {
+            memcpy(target + (size_t) y * (inputStride / 2), source + (size_t) y * (stride / 2), (width + 1) / 2);
+        }
+        source += (size_t) (stride      / 2) * ((height + 1) / 2);
+        target += (size_t) (inputStride / 2) * (sliceHeight / 2);
+    }
+}
+
+static uint32_t bytesPerPixel(uint32_t format) {
+    switch (format) {
+        case MMAL_ENCODING_I420:
+            return 1;
+        case MMAL_ENCODING_RGB24:
+            return 3;
+        case MMAL_ENCODING_RGBA:
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+static void inputBufferCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    // Returns the buffer to the input pool
+    mmal_buffer_header_release(buffer);
+}
+
+static void outputBufferCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    HostEncoder *encoder = (HostEncoder *) port->userdata;
+
+    bool frameEnd = buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED);
+
+    // Output only belongs to an image if one has been submitted and not yet completed
+    bool     expected = encoder->completed != encoder->submitted;
+    uint32_t slot     = encoder->completed % HOST_ENCODER_PIPELINE;
+
+    if (buffer->length && expected) {
+        mmal_buffer_header_mem_lock(buffer);
+        if (!appendBytes(&encoder->results[slot], buffer->data + buffer->offset, buffer->length)) {
+            encoder->failed[slot] = true;
+        }
+        mmal_buffer_header_mem_unlock(buffer);
+    }
+
+    if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED && expected) {
+        encoder->failed[slot] = true;
+    }
+
+    mmal_buffer_header_release(buffer);
+
+    if (port->is_enabled) {
+        MMAL_BUFFER_HEADER_T *nextBuffer = mmal_queue_get(encoder->outputPool->queue);
+        if (nextBuffer) {
+            mmal_port_send_buffer(port, nextBuffer);
+        }
+    }
+
+    if (frameEnd && expected) {
+        encoder->completed++;
+        vcos_semaphore_post(&encoder->finished);
+    }
+}
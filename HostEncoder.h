@@ -0,0 +1,69 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_HOST_ENCODER_H
+#define _PICAM_HOST_ENCODER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "Bytes.h"
+#include "Image.h"
+
+#include "interface/mmal/mmal.h"
+
+/**
+ * Maximum number of images that can be in the encoder at the same time.
+ */
+#define HOST_ENCODER_PIPELINE 4
+
+/**
+ * A hardware image encoder fed with images from host memory, rather than tunnelled from the camera.
+ *
+ * Images are encoded in the order they are submitted, the encoded output of each one is collected
+ * in its own slot until it is received.
+ */
+typedef struct HostEncoder {
+    MMAL_COMPONENT_T     *component;
+    MMAL_POOL_T          *inputPool;
+    MMAL_POOL_T          *outputPool;
+    uint32_t              encoding;
+    uint32_t              quality;
+    uint32_t              format;
+    uint32_t              width;
+    uint32_t              height;
+    MMAL_BUFFER_HEADER_T *input;
+    Bytes                 results[HOST_ENCODER_PIPELINE];
+    volatile bool         failed[HOST_ENCODER_PIPELINE];
+    volatile uint32_t     submitted;
+    volatile uint32_t     completed;
+    uint32_t              received;
+    VCOS_SEMAPHORE_T      finished;
+} HostEncoder;
+
+int createHostEncoder(HostEncoder *encoder, uint32_t encoding, uint32_t quality);
+void destroyHostEncoder(HostEncoder *encoder);
+int beginEncode(HostEncoder *encoder, uint32_t width, uint32_t height, Image *input);
+int finishEncode(HostEncoder *encoder, Bytes *output);
+int submitEncode(HostEncoder *encoder, uint32_t format, uint32_t width, uint32_t height, const uint8_t *data, uint32_t stride);
+int receiveEncode(HostEncoder *encoder, Bytes *output);
+uint32_t pendingEncodes(const HostEncoder *encoder);
+size_t hostFrameSize(uint32_t format, uint32_t width, uint32_t height, uint32_t stride);
+
+#endif // _PICAM_HOST_ENCODER_H
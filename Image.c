@@ -0,0 +1,218 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Image.h"
+
+static void scalePlane(const uint8_t *source, uint32_t sourceStride, uint32_t sourceWidth, uint32_t sourceHeight, uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint8_t *destination, uint32_t destinationStride, uint32_t destinationWidth, uint32_t destinationHeight);
+
+/**
+ * Allocate (or re-use) the memory for an image.
+ *
+ * Existing memory is kept if it is large enough, so an image that is reused for each capture does
+ * not allocate every time.
+ *
+ * @param image image
+ * @param width visible width in pixels, must be even
+ * @param height visible height in pixels, must be even
+ * @param stride luma row stride in bytes
+ * @param sliceHeight number of luma rows allocated
+ * @return non-zero on success; zero if the memory could not be allocated
+ */
+int allocateImage(Image *image, uint32_t width, uint32_t height, uint32_t stride, uint32_t sliceHeight) {
+    size_t size = (size_t) stride * sliceHeight * 3 / 2;
+
+    if (size > image->capacity) {
+        uint8_t *data = realloc(image->data, size);
+        if (!data) {
+            return 0;
+        }
+        image->data     = data;
+        image->capacity = size;
+    }
+
+    image->width       = width;
+    image->height      = height;
+    image->stride      = stride;
+    image->sliceHeight = sliceHeight;
+
+    return 1;
+}
+
+/**
+ * Free the memory used by an image.
+ *
+ * @param image image
+ */
+void freeImage(Image *image) {
+    free(image->data);
+    memset(image, 0, sizeof(*image));
+}
+
+/**
+ * Get the size in bytes of the image data, including any padding.
+ *
+ * @param image image
+ * @return size in bytes
+ */
+size_t imageSize(const Image *image) {
+    return (size_t) image->stride * image->sliceHeight * 3 / 2;
+}
+
+/**
+ * Get a pointer to the start of a plane.
+ *
+ * @param image image
+ * @param plane IMAGE_PLANE_XXX value
+ * @return pointer to the first byte of the plane
+ */
+uint8_t *imagePlane(const Image *image, int plane) {
+    size_t lumaSize   = (size_t) image->stride * image->sliceHeight;
+    size_t chromaSize = lumaSize / 4;
+    switch (plane) {
+        case IMAGE_PLANE_U:
+            return image->data + lumaSize;
+        case IMAGE_PLANE_V:
+            return image->data + lumaSize + chromaSize;
+        default:
+            return image->data;
+    }
+}
+
+/**
+ * Get the row stride of a plane.
+ *
+ * @param image image
+ * @param plane IMAGE_PLANE_XXX value
+ * @return stride in bytes
+ */
+uint32_t imagePlaneStride(const Image *image, int plane) {
+    return plane == IMAGE_PLANE_Y ? image->stride : image->stride / 2;
+}
+
+/**
+ * Crop a region from an image, scaling it to the size of the destination image.
+ *
+ * The destination must already be allocated, its width and height determine the scaling. If the
+ * sizes match the region is simply copied, otherwise it is resampled with bilinear filtering.
+ *
+ * @param source source image
+ * @param x left edge of the region in pixels, must be even
+ * @param y top edge of the region in pixels, must be even
+ * @param width width of the region in pixels, must be even
+ * @param height height of the region in pixels, must be even
+ * @param destination destination image
+ */
+void cropScaleImage(const Image *source, uint32_t x, uint32_t y, uint32_t width, uint32_t height, Image *destination) {
+    for (int plane = IMAGE_PLANE_Y; plane <= IMAGE_PLANE_V; plane++) {
+        uint32_t shift = plane == IMAGE_PLANE_Y ? 0 : 1;
+        scalePlane(
+            imagePlane(source, plane), imagePlaneStride(source, plane), source->width >> shift, source->height >> shift,
+            x >> shift, y >> shift, width >> shift, height >> shift,
+            imagePlane(destination, plane), imagePlaneStride(destination, plane), destination->width >> shift, destination->height >> shift
+        );
+    }
+}
+
+/**
+ * Interleave the rows of two images of the same size into one image of twice the height.
+ *
+ * Even rows come from the first image, odd rows from the second - the chroma planes are interleaved
+ * the same way, row for row.
+ *
+ * @param first first image
+ * @param second second image, the same size as the first
+ * @param destination destination image, the same width as the first and twice the height
+ */
+void interleaveImages(const Image *first, const Image *second, Image *destination) {
+    for (int plane = IMAGE_PLANE_Y; plane <= IMAGE_PLANE_V; plane++) {
+        uint32_t shift  = plane == IMAGE_PLANE_Y ? 0 : 1;
+        uint32_t width  = first->width  >> shift;
+        uint32_t height = first->height >> shift;
+
+        const uint8_t *firstPlane  = imagePlane(first , plane);
+        const uint8_t *secondPlane = imagePlane(second, plane);
+        uint8_t       *out         = imagePlane(destination, plane);
+
+        uint32_t firstStride  = imagePlaneStride(first , plane);
+        uint32_t secondStride = imagePlaneStride(second, plane);
+        uint32_t outStride    = imagePlaneStride(destination, plane);
+
+        for (uint32_t row = 0; row < height; row++) {
+            memcpy(out + (size_t) (row * 2    ) * outStride, firstPlane  + (size_t) row * firstStride , width);
+            memcpy(out + (size_t) (row * 2 + 1) * outStride, secondPlane + (size_t) row * secondStride, width);
+        }
+    }
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Crop and scale a single plane, using 16.16 fixed-point bilinear interpolation.
+ */
+static void scalePlane(const uint8_t *source, uint32_t sourceStride, uint32_t sourceWidth, uint32_t sourceHeight, uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint8_t *destination, uint32_t destinationStride, uint32_t destinationWidth, uint32_t destinationHeight) {
+    if (width == destinationWidth && height == destinationHeight) {
+        for (uint32_t row = 0; row < height; row++) {
+            memcpy(destination + (size_t) row * destinationStride, source + (size_t) (y + row) * sourceStride + x, width);
+        }
+        return;
+    }
+
+    uint32_t stepX = (uint32_t) (((uint64_t) width  << 16) / destinationWidth );
+    uint32_t stepY = (uint32_t) (((uint64_t) height << 16) / destinationHeight);
+
+    uint32_t maxX = sourceWidth  - 1;
+    uint32_t maxY = sourceHeight - 1;
+
+    // Sample at pixel centres
+    int64_t positionY = ((int64_t) y << 16) + stepY / 2 - 32768;
+
+    for (uint32_t row = 0; row < destinationHeight; row++, positionY += stepY) {
+        int64_t  clampedY = positionY < 0 ? 0 : positionY;
+        uint32_t y0 = (uint32_t) (clampedY >> 16);
+        uint32_t fy = (uint32_t) (clampedY & 0xffff);
+        uint32_t y1 = y0 < maxY ? y0 + 1 : maxY;
+        if (y0 > maxY) {
+            y0 = y1 = maxY;
+        }
+
+        const uint8_t *row0 = source + (size_t) y0 * sourceStride;
+        const uint8_t *row1 = source + (size_t) y1 * sourceStride;
+        uint8_t *out = destination + (size_t) row * destinationStride;
+
+        int64_t positionX = ((int64_t) x << 16) + stepX / 2 - 32768;
+
+        for (uint32_t column = 0; column < destinationWidth; column++, positionX += stepX) {
+            int64_t  clampedX = positionX < 0 ? 0 : positionX;
+            uint32_t x0 = (uint32_t) (clampedX >> 16);
+            uint32_t fx = (uint32_t) (clampedX & 0xffff) >> 8;
+            uint32_t x1 = x0 < maxX ? x0 + 1 : maxX;
+            if (x0 > maxX) {
+                x0 = x1 = maxX;
+            }
+
+            uint32_t top    = row0[x0] * (256 - fx) + row0[x1] * fx;
+            uint32_t bottom = row1[x0] * (256 - fx) + row1[x1] * fx;
+
+            out[column] = (uint8_t) ((top * (256 - (fy >> 8)) + bottom * (fy >> 8) + 32768) >> 16);
+        }
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_IMAGE_H
+#define _PICAM_IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define IMAGE_PLANE_Y 0
+#define IMAGE_PLANE_U 1
+#define IMAGE_PLANE_V 2
+
+/**
+ * An I420 (planar YUV 4:2:0) image.
+ *
+ * The planes are stored contiguously - Y, then U, then V - in the same layout the MMAL ports use,
+ * each chroma plane has half the stride and half the slice height of the luma plane.
+ *
+ * An image may be a view onto memory it does not own (e.g. an MMAL buffer), in which case it must
+ * not be passed to freeImage.
+ */
+typedef struct Image {
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t sliceHeight;
+    uint8_t *data;
+    size_t   capacity;
+} Image;
+
+int allocateImage(Image *image, uint32_t width, uint32_t height, uint32_t stride, uint32_t sliceHeight);
+void freeImage(Image *image);
+size_t imageSize(const Image *image);
+uint8_t *imagePlane(const Image *image, int plane);
+uint32_t imagePlaneStride(const Image *image, int plane);
+void cropScaleImage(const Image *source, uint32_t x, uint32_t y, uint32_t width, uint32_t height, Image *destination);
+void interleaveImages(const Image *first, const Image *second, Image *destination);
+
+#endif // _PICAM_IMAGE_H
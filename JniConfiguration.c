@@ -18,8 +18,9 @@
  */
 
 #include <assert.h>
+#include <stdio.h>
 
-#include "Configuration.h"
+#include "JniConfiguration.h"
 
 /**
  * Java type-names for the enumerations used in the Java camera configuration object.
@@ -31,6 +32,7 @@ static const char ENUM_EXPOSURE_METERING_MODE[]             = "()Luk/co/caprica/
 static const char ENUM_EXPOSURE_MODE[]                      = "()Luk/co/caprica/picam/enums/ExposureMode;";
 static const char ENUM_IMAGE_EFFECT[]                       = "()Luk/co/caprica/picam/enums/ImageEffect;";
 static const char ENUM_MIRROR[]                             = "()Luk/co/caprica/picam/enums/Mirror;";
+static const char ENUM_SCHEDULING_POLICY[]                  = "()Luk/co/caprica/picam/enums/SchedulingPolicy;";
 static const char ENUM_STEREOSCOPIC_MODE[]                  = "()Luk/co/caprica/picam/enums/StereoscopicMode;";
 
 /**
@@ -96,6 +98,29 @@ static int setDouble(ConfigContext *context, const char *name, double *result) {
     return 1;
 }
 
+/**
+ * Set a configuration value from a Java string, truncated if necessary to fit the result.
+ *
+ * @param context
+ * @param name
+ * @param result
+ * @param size size of the result, including the terminator
+ */
+static int setString(ConfigContext *context, const char *name, char *result, size_t size) {
+    JNIEnv *env = context->env;
+    jstring value = (jstring) getObjectValue(context, name, "()Ljava/lang/String;");
+    if (value == NULL) {
+        return 0;
+    }
+    const char *chars = (*env)->GetStringUTFChars(env, value, NULL);
+    if (chars == NULL) {
+        return 0;
+    }
+    snprintf(result, size, "%s", chars);
+    (*env)->ReleaseStringUTFChars(env, value, chars);
+    return 1;
+}
+
 /**
  * Set a configuration value from a Java enumeration.
  * 
@@ -145,6 +170,8 @@ void extractConfiguration(JNIEnv *env, jobject obj, PicamConfig *config) {
     setUInt  (&context, "width"                          , &config->camera.width                                                                    );
     setUInt  (&context, "height"                         , &config->camera.height                                                                   );
     setUInt  (&context, "captureTimeout"                 , &config->camera.captureTimeout                                                           );
+    setUInt  (&context, "captureRetries"                 , &config->camera.captureRetries                                                           );
+    setUInt  (&context, "keepAlive"                      , &config->camera.keepAlive                                                                );
 
     setInt   (&context, "brightness"                     , &config->control.brightness                                                              );
     setInt   (&context, "contrast"                       , &config->control.contrast                                                                );
@@ -169,6 +196,15 @@ void extractConfiguration(JNIEnv *env, jobject obj, PicamConfig *config) {
     setDouble(&context, "cropW"                          , &config->control.cropW                                                                   );
     setDouble(&context, "cropH"                          , &config->control.cropH                                                                   );
 
+    setString(&context, "annotationText"                 ,  config->annotation.text                        , sizeof(config->annotation.text)        );
+    setBool  (&context, "annotationFrameNumber"          , &config->annotation.showFrameNumber                                                      );
+    setUInt  (&context, "annotationTextSize"             , &config->annotation.textSize                                                             );
+    setInt   (&context, "annotationTextColour"           , &config->annotation.textColour                                                           );
+    setInt   (&context, "annotationBackgroundColour"     , &config->annotation.backgroundColour                                                     );
+    setInt   (&context, "annotationJustify"              , &config->annotation.justify                                                              );
+    setUInt  (&context, "annotationX"                    , &config->annotation.x                                                                    );
+    setUInt  (&context, "annotationY"                    , &config->annotation.y                                                                    );
+
     setEnum  (&context, "stereoscopicMode"               , &config->capture.stereoscopicMode               , ENUM_STEREOSCOPIC_MODE                 );
     setBool  (&context, "decimate"                       , &config->capture.decimate                                                                );
     setBool  (&context, "swapEyes"                       , &config->capture.swapEyes                                                                );
@@ -176,4 +212,22 @@ void extractConfiguration(JNIEnv *env, jobject obj, PicamConfig *config) {
     setInt   (&context, "rotation"                       , &config->capture.rotation                                                                );
     setEnum  (&context, "encoding"                       , &config->encoder.encoding                       , ENUM_ENCODING                          );
     setUInt  (&context, "quality"                        , &config->encoder.quality                                                                 );
+    setUInt  (&context, "targetSize"                     , &config->encoder.targetSize                                                              );
+    setUInt  (&context, "minimumQuality"                 , &config->encoder.minimumQuality                                                          );
+    setUInt  (&context, "maximumQuality"                 , &config->encoder.maximumQuality                                                          );
+
+    setUInt  (&context, "recordingWidth"                 , &config->recording.width                                                                 );
+    setUInt  (&context, "recordingHeight"                , &config->recording.height                                                                );
+    setUInt  (&context, "recordingFrameRate"             , &config->recording.frameRate                                                             );
+    setUInt  (&context, "recordingBitrate"               , &config->recording.bitrate                                                               );
+    setUInt  (&context, "recordingIntraPeriod"           , &config->recording.intraPeriod                                                           );
+    setUInt  (&context, "recordingPreRoll"               , &config->recording.preRoll                                                               );
+    setUInt  (&context, "recordingBufferSize"            , &config->recording.bufferSize                                                            );
+
+    setEnum  (&context, "callbackSchedulingPolicy"       , &config->threads.callbackPolicy                 , ENUM_SCHEDULING_POLICY                 );
+    setInt   (&context, "callbackPriority"               , &config->threads.callbackPriority                                                        );
+    setUInt  (&context, "callbackAffinity"               , &config->threads.callbackAffinity                                                        );
+    setEnum  (&context, "workerSchedulingPolicy"         , &config->threads.workerPolicy                   , ENUM_SCHEDULING_POLICY                 );
+    setInt   (&context, "workerPriority"                 , &config->threads.workerPriority                                                          );
+    setUInt  (&context, "workerAffinity"                 , &config->threads.workerAffinity                                                          );
 }
@@ -0,0 +1,85 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <assert.h>
+
+#include "JniStatistics.h"
+
+/**
+ * Statistics context, used internally here to reduce parameter passing.
+ */
+typedef struct {
+    JNIEnv *env;
+    jclass  cls;
+    jobject obj;
+} StatisticsContext;
+
+static void setLong(StatisticsContext *context, const char *name, uint64_t value) {
+    JNIEnv *env = context->env;
+    jfieldID field = (*env)->GetFieldID(env, context->cls, name, "J");
+    assert (field != NULL);
+    (*env)->SetLongField(env, context->obj, field, (jlong) value);
+}
+
+/**
+ * Publish the native statistics to the fields of a Java CameraStatistics object instance.
+ *
+ * @param env
+ * @param obj
+ * @param stats statistics to publish
+ */
+void publishStatistics(JNIEnv *env, jobject obj, const PicamStatistics *stats) {
+
+    StatisticsContext context = {
+        env,
+        (*env)->GetObjectClass(env, obj),
+        obj
+    };
+
+    setLong(&context, "captures"              , stats->captures              );
+    setLong(&context, "captureFailures"       , stats->captureFailures       );
+    setLong(&context, "captureRetries"        , stats->captureRetries        );
+    setLong(&context, "errorEvents"           , stats->errorEvents           );
+    setLong(&context, "stalledCaptures"       , stats->stalledCaptures       );
+    setLong(&context, "discardedBuffers"      , stats->discardedBuffers      );
+    setLong(&context, "recoveries"            , stats->recoveries            );
+    setLong(&context, "recoveryFailures"      , stats->recoveryFailures      );
+    setLong(&context, "lastRecoveryTime"      , stats->lastRecoveryTime      );
+    setLong(&context, "totalRecoveryTime"     , stats->totalRecoveryTime     );
+    setLong(&context, "droppedLogRecords"     , stats->droppedLogRecords     );
+    setLong(&context, "recordingFlushes"      , stats->recordingFlushes      );
+    setLong(&context, "recordingOverruns"     , stats->recordingOverruns     );
+    setLong(&context, "createTime"            , stats->createTime            );
+    setLong(&context, "pipelineReused"        , stats->pipelineReused        );
+    setLong(&context, "lastBracketTime"       , stats->lastBracketTime       );
+    setLong(&context, "lastLowLightTime"      , stats->lastLowLightTime      );
+    setLong(&context, "lastRgbTime"           , stats->lastRgbTime           );
+    setLong(&context, "timelapseFrames"       , stats->timelapseFrames       );
+    setLong(&context, "timelapseSkipped"      , stats->timelapseSkipped      );
+    setLong(&context, "invalidPictures"       , stats->invalidPictures       );
+    setLong(&context, "coalescedCaptures"     , stats->coalescedCaptures     );
+    setLong(&context, "queuedCaptures"        , stats->queuedCaptures        );
+    setLong(&context, "lastQuality"           , stats->lastQuality           );
+    setLong(&context, "targetOverruns"        , stats->targetOverruns        );
+    setLong(&context, "callbackThreads"       , stats->callbackThreads       );
+    setLong(&context, "callbackCpuTime"       , stats->callbackCpuTime       );
+    setLong(&context, "recoveryCpuTime"       , stats->recoveryCpuTime       );
+    setLong(&context, "cacheReaperCpuTime"    , stats->cacheReaperCpuTime    );
+    setLong(&context, "recordingWriterCpuTime", stats->recordingWriterCpuTime);
+}
@@ -0,0 +1,389 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <string.h>
+
+#include "Jpeg.h"
+#include "Log.h"
+
+#define STATE_START        0
+#define STATE_START_MARKER 1
+#define STATE_MARKER       2
+#define STATE_MARKER_CODE  3
+#define STATE_LENGTH_HIGH  4
+#define STATE_LENGTH_LOW   5
+#define STATE_SEGMENT      6
+#define STATE_ENTROPY      7
+#define STATE_ENTROPY_FF   8
+#define STATE_DONE         9
+#define STATE_ERROR        10
+
+#define MARKER_SOI  0xD8
+#define MARKER_EOI  0xD9
+#define MARKER_SOS  0xDA
+#define MARKER_APP1 0xE1
+#define MARKER_TEM  0x01
+
+static void beginMarker(JpegParser *parser, uint8_t marker, uint32_t offset);
+static void beginSegment(JpegParser *parser, uint32_t offset);
+static void endSegment(JpegParser *parser);
+static void parseFrameHeader(JpegParser *parser);
+static void parseExif(JpegParser *parser);
+static bool isFrameMarker(uint8_t marker);
+static bool isStandaloneMarker(uint8_t marker);
+static uint32_t read16(const uint8_t *data, bool little);
+static uint32_t read32(const uint8_t *data, bool little);
+static void fail(JpegParser *parser, const char *reason);
+
+/**
+ * Reset the parser ready for a new picture.
+ *
+ * @param parser parser state
+ * @param enabled true if the picture is a JPEG and should be parsed; false to ignore it
+ */
+void resetJpegParser(JpegParser *parser, bool enabled) {
+    parser->enabled   = enabled;
+    parser->state     = STATE_START;
+    parser->position  = 0;
+    parser->remaining = 0;
+    parser->buffering = false;
+    parser->frameSeen = false;
+    parser->scanSeen  = false;
+    memset(&parser->info, 0, sizeof(parser->info));
+}
+
+/**
+ * Parse the next chunk of a JPEG, as it streams from the encoder.
+ *
+ * Only the marker structure is parsed, the entropy-coded data is skipped with a scan for the next
+ * marker - so the cost is a small fraction of decoding the picture. The segment structure is
+ * verified as it goes, and the frame header and any EXIF data are picked out along the way.
+ *
+ * Chunks may split a marker or segment at any point.
+ *
+ * @param parser parser state
+ * @param data next chunk of data
+ * @param length length of the chunk
+ */
+void parseJpeg(JpegParser *parser, const uint8_t *data, size_t length) {
+    const uint8_t *start = data;
+    const uint8_t *end   = data + length;
+
+    while (data < end && parser->state != STATE_DONE && parser->state != STATE_ERROR) {
+        switch (parser->state) {
+            case STATE_START:
+                if (*data++ != 0xFF) {
+                    fail(parser, "missing SOI");
+                    break;
+                }
+                parser->state = STATE_START_MARKER;
+                break;
+
+            case STATE_START_MARKER:
+                if (*data++ != MARKER_SOI) {
+                    fail(parser, "missing SOI");
+                    break;
+                }
+                parser->state = STATE_MARKER;
+                break;
+
+            case STATE_MARKER:
+                if (*data++ != 0xFF) {
+                    fail(parser, "expected marker");
+                    break;
+                }
+                parser->state = STATE_MARKER_CODE;
+                break;
+
+            case STATE_MARKER_CODE:
+            case STATE_ENTROPY_FF: {
+                uint8_t byte = *data++;
+                if (byte == 0xFF) {
+                    // Fill byte, the marker code is still to come
+                } else if (parser->state == STATE_ENTROPY_FF && (byte == 0x00 || (byte >= 0xD0 && byte <= 0xD7))) {
+                    // Stuffed zero, or a restart marker, within the entropy-coded data
+                    parser->state = STATE_ENTROPY;
+                } else {
+                    beginMarker(parser, byte, parser->position + (data - start) - 2);
+                }
+                break;
+            }
+
+            case STATE_LENGTH_HIGH:
+                parser->remaining = (uint32_t) *data++ << 8;
+                parser->state = STATE_LENGTH_LOW;
+                break;
+
+            case STATE_LENGTH_LOW:
+                parser->remaining |= *data++;
+                beginSegment(parser, parser->position + (data - start));
+                break;
+
+            case STATE_SEGMENT: {
+                uint32_t available = (uint32_t) (end - data);
+                uint32_t count     = parser->remaining < available ? parser->remaining : available;
+                if (parser->buffering) {
+                    memcpy(parser->segment + parser->segmentFill, data, count);
+                    parser->segmentFill += count;
+                }
+                data              += count;
+                parser->remaining -= count;
+                if (!parser->remaining) {
+                    endSegment(parser);
+                }
+                break;
+            }
+
+            case STATE_ENTROPY: {
+                const uint8_t *marker = memchr(data, 0xFF, end - data);
+                if (marker) {
+                    data = marker + 1;
+                    parser->state = STATE_ENTROPY_FF;
+                } else {
+                    data = end;
+                }
+                break;
+            }
+        }
+    }
+
+    parser->position += (uint32_t) length;
+}
+
+/**
+ * Finish parsing a picture, and determine whether it is valid.
+ *
+ * A picture is valid only if it was delivered in full, and its markers were well-formed from the
+ * SOI through to the EOI.
+ *
+ * @param parser parser state
+ * @param failed true if the encoder reported a failure or not all of the data was delivered
+ */
+void finishJpegParser(JpegParser *parser, bool failed) {
+    if (!parser->enabled) {
+        return;
+    }
+
+    JpegInfo *info = &parser->info;
+
+    info->complete  = true;
+    info->truncated = failed || (parser->state != STATE_DONE && parser->state != STATE_ERROR);
+    info->valid     = !failed && parser->state == STATE_DONE;
+
+    if (!info->length) {
+        info->length = parser->position;
+    }
+
+    if (info->valid) {
+        logDebug("JPEG %ux%u, %u components, %u bytes", info->width, info->height, info->components, info->length);
+    } else {
+        logWarn("JPEG is not valid%s after %u bytes", info->truncated ? ", truncated" : "", parser->position);
+    }
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Handle a marker code.
+ *
+ * @param parser parser state
+ * @param marker marker code
+ * @param offset offset of the marker in the picture
+ */
+static void beginMarker(JpegParser *parser, uint8_t marker, uint32_t offset) {
+    if (marker == MARKER_EOI) {
+        if (!parser->scanSeen) {
+            fail(parser, "EOI before any scan");
+            return;
+        }
+        parser->info.length = offset + 2;
+        parser->state = STATE_DONE;
+    } else if (marker == MARKER_SOI || marker == 0x00) {
+        fail(parser, "unexpected marker");
+    } else if (isStandaloneMarker(marker)) {
+        parser->state = STATE_MARKER;
+    } else {
+        parser->marker = marker;
+        parser->state  = STATE_LENGTH_HIGH;
+    }
+}
+
+/**
+ * Begin the payload of a marker segment, once its length is known.
+ *
+ * Only the payloads that are parsed - the frame header and the first EXIF segment - are buffered.
+ *
+ * @param parser parser state
+ * @param offset offset of the payload in the picture
+ */
+static void beginSegment(JpegParser *parser, uint32_t offset) {
+    if (parser->remaining < 2) {
+        fail(parser, "bad segment length");
+        return;
+    }
+
+    parser->remaining   -= 2;
+    parser->segmentStart = offset;
+    parser->segmentFill  = 0;
+    parser->buffering    = isFrameMarker(parser->marker) || (parser->marker == MARKER_APP1 && !parser->info.exifOffset);
+    parser->state        = STATE_SEGMENT;
+
+    if (!parser->remaining) {
+        endSegment(parser);
+    }
+}
+
+/**
+ * Complete a marker segment, parsing its payload if it was buffered.
+ *
+ * @param parser parser state
+ */
+static void endSegment(JpegParser *parser) {
+    parser->state = STATE_MARKER;
+
+    if (isFrameMarker(parser->marker)) {
+        parseFrameHeader(parser);
+    } else if (parser->marker == MARKER_APP1 && parser->buffering) {
+        parseExif(parser);
+    } else if (parser->marker == MARKER_SOS) {
+        if (!parser->frameSeen) {
+            fail(parser, "SOS before SOF");
+            return;
+        }
+        parser->scanSeen = true;
+        parser->state    = STATE_ENTROPY;
+    }
+
+    parser->buffering = false;
+}
+
+static void parseFrameHeader(JpegParser *parser) {
+    const uint8_t *segment = parser->segment;
+    JpegInfo      *info    = &parser->info;
+
+    if (parser->frameSeen) {
+        fail(parser, "more than one SOF");
+        return;
+    }
+
+    if (parser->segmentFill < 6 || segment[5] == 0 || segment[5] > JPEG_MAX_COMPONENTS || parser->segmentFill < 6 + 3u * segment[5]) {
+        fail(parser, "bad SOF");
+        return;
+    }
+
+    info->precision   = segment[0];
+    info->height      = read16(segment + 1, false);
+    info->width       = read16(segment + 3, false);
+    info->components  = segment[5];
+    info->progressive = parser->marker == 0xC2 || parser->marker == 0xC6 || parser->marker == 0xCA || parser->marker == 0xCE;
+
+    for (uint32_t i = 0; i < info->components; i++) {
+        info->componentIds[i] = segment[6 + i * 3    ];
+        info->sampling    [i] = segment[6 + i * 3 + 1];
+    }
+
+    parser->frameSeen = true;
+}
+
+/**
+ * Locate the EXIF data, and the thumbnail embedded in it.
+ *
+ * The thumbnail is described by the JPEGInterchangeFormat tags of the second IFD. A malformed EXIF
+ * block is simply ignored, it does not make the picture invalid.
+ *
+ * @param parser parser state
+ */
+static void parseExif(JpegParser *parser) {
+    const uint8_t *segment = parser->segment;
+    uint32_t       length  = parser->segmentFill;
+
+    if (length < 14 || memcmp(segment, "Exif\0\0", 6) != 0) {
+        return;
+    }
+
+    JpegInfo *info = &parser->info;
+
+    const uint8_t *tiff = segment + 6;
+    length -= 6;
+
+    info->exifOffset = parser->segmentStart + 6;
+    info->exifLength = length;
+
+    bool little = tiff[0] == 'I' && tiff[1] == 'I';
+    if (!little && !(tiff[0] == 'M' && tiff[1] == 'M')) {
+        return;
+    }
+
+    uint32_t ifd0 = read32(tiff + 4, little);
+    if (ifd0 > length - 2) {
+        return;
+    }
+
+    uint32_t next = ifd0 + 2 + read16(tiff + ifd0, little) * 12;
+    if (next > length - 4) {
+        return;
+    }
+
+    uint32_t ifd1 = read32(tiff + next, little);
+    if (!ifd1 || ifd1 > length - 2) {
+        return;
+    }
+
+    uint32_t entries         = read16(tiff + ifd1, little);
+    uint32_t thumbnailOffset = 0;
+    uint32_t thumbnailLength = 0;
+
+    for (uint32_t i = 0; i < entries && ifd1 + 2 + (i + 1) * 12 <= length; i++) {
+        const uint8_t *entry = tiff + ifd1 + 2 + i * 12;
+        switch (read16(entry, little)) {
+            case 0x0201:
+                thumbnailOffset = read32(entry + 8, little);
+                break;
+            case 0x0202:
+                thumbnailLength = read32(entry + 8, little);
+                break;
+        }
+    }
+
+    if (thumbnailOffset && thumbnailLength && thumbnailOffset <= length && thumbnailLength <= length - thumbnailOffset) {
+        info->thumbnailOffset = info->exifOffset + thumbnailOffset;
+        info->thumbnailLength = thumbnailLength;
+    }
+}
+
+static bool isFrameMarker(uint8_t marker) {
+    return marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+}
+
+static bool isStandaloneMarker(uint8_t marker) {
+    return marker == MARKER_TEM || (marker >= 0xD0 && marker <= 0xD7);
+}
+
+static uint32_t read16(const uint8_t *data, bool little) {
+    return little ? (uint32_t) data[0] | (uint32_t) data[1] << 8 : (uint32_t) data[0] << 8 | (uint32_t) data[1];
+}
+
+static uint32_t read32(const uint8_t *data, bool little) {
+    return little ? read16(data, true) | read16(data + 2, true) << 16 : read16(data, false) << 16 | read16(data + 2, false);
+}
+
+static void fail(JpegParser *parser, const char *reason) {
+    logDebug("JPEG parse failed at %u: %s", parser->position, reason);
+    parser->state = STATE_ERROR;
+}
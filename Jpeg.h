@@ -0,0 +1,90 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_JPEG_H
+#define _PICAM_JPEG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Largest marker segment payload, EXIF data must fit in a single APP1 segment.
+ */
+#define JPEG_SEGMENT_MAX 65533
+
+/**
+ * Maximum number of colour components in a frame.
+ */
+#define JPEG_MAX_COMPONENTS 4
+
+/**
+ * Validity and metadata of a JPEG, as determined by the parser.
+ *
+ * Offsets are from the start of the JPEG data, zero if not present.
+ */
+typedef struct JpegInfo {
+    bool     complete;
+    bool     valid;
+    bool     truncated;
+    uint32_t length;
+    uint32_t width;
+    uint32_t height;
+    uint32_t precision;
+    uint32_t components;
+    uint8_t  componentIds[JPEG_MAX_COMPONENTS];
+    uint8_t  sampling[JPEG_MAX_COMPONENTS];
+    bool     progressive;
+    uint32_t exifOffset;
+    uint32_t exifLength;
+    uint32_t thumbnailOffset;
+    uint32_t thumbnailLength;
+} JpegInfo;
+
+/**
+ * Incremental JPEG marker parser state, see Jpeg.c.
+ */
+typedef struct JpegParser {
+    bool     enabled;
+    int      state;
+    uint32_t position;
+    uint8_t  marker;
+    uint32_t remaining;
+    uint32_t segmentStart;
+    uint32_t segmentFill;
+    bool     buffering;
+    bool     frameSeen;
+    bool     scanSeen;
+    uint8_t  segment[JPEG_SEGMENT_MAX];
+    JpegInfo info;
+} JpegParser;
+
+void resetJpegParser(JpegParser *parser, bool enabled);
+void parseJpeg(JpegParser *parser, const uint8_t *data, size_t length);
+void finishJpegParser(JpegParser *parser, bool failed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PICAM_JPEG_H
@@ -0,0 +1,157 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+/*
+ * Loader stub.
+ *
+ * This tiny library is what the Java side actually loads. When it is loaded it works out the best
+ * optimised variant of the real library for the CPU it is running on, loads that variant from the
+ * same directory, and has it register its native methods with the JVM. When it is unloaded, the
+ * variant is unloaded with it.
+ *
+ * Native methods in a library loaded with dlopen are not visible to the JVM's own symbol lookup,
+ * hence the explicit registration.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <jni.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "Cpu.h"
+
+#ifndef PICAM_LIBRARY_NAME
+#error PICAM_LIBRARY_NAME must be defined, e.g. picam-2.0.1
+#endif
+
+static void *library;
+
+static int variantPath(char *path, size_t size, const char *variant);
+static void unloadVariant(JavaVM *jvm, void *reserved, bool loaded);
+
+/**
+ * JNI library initialisation, invoked once when the loader stub is loaded.
+ */
+JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM *jvm, void *reserved) {
+    char path[PATH_MAX];
+
+    const char *variant = cpuVariant();
+
+    if (!variantPath(path, sizeof(path), variant)) {
+        fprintf(stderr, "picam: failed to determine library path for variant %s\n", variant);
+        return JNI_ERR;
+    }
+
+    library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!library) {
+        fprintf(stderr, "picam: failed to load %s: %s\n", path, dlerror());
+        return JNI_ERR;
+    }
+
+    jint (*onLoad)(JavaVM *, void *) = (jint (*)(JavaVM *, void *)) dlsym(library, "JNI_OnLoad");
+    jint (*registerNatives)(JNIEnv *) = (jint (*)(JNIEnv *)) dlsym(library, "picamRegisterNatives");
+
+    if (!onLoad || !registerNatives) {
+        fprintf(stderr, "picam: %s is not a picam library\n", path);
+        unloadVariant(jvm, reserved, false);
+        return JNI_ERR;
+    }
+
+    jint version = onLoad(jvm, reserved);
+    if (version == JNI_ERR || version == 0) {
+        unloadVariant(jvm, reserved, false);
+        return JNI_ERR;
+    }
+
+    // The JVM does not unload a library that failed to load, so the variant must be unloaded here
+    JNIEnv *env;
+    if (JNI_OK != (*jvm)->GetEnv(jvm, (void **) &env, version) || JNI_OK != registerNatives(env)) {
+        fprintf(stderr, "picam: failed to register native methods from %s\n", path);
+        unloadVariant(jvm, reserved, true);
+        return JNI_ERR;
+    }
+
+    return version;
+}
+
+/**
+ * JNI library teardown, invoked once when the loader stub is unloaded.
+ *
+ * The JVM only knows about the loader stub, so the variant library's own teardown must be invoked
+ * from here before the variant is unloaded.
+ */
+JNIEXPORT void JNICALL JNI_OnUnload(JavaVM *jvm, void *reserved) {
+    if (library) {
+        unloadVariant(jvm, reserved, true);
+    }
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Build the full path to a library variant, it is expected to be in the same directory as this
+ * loader stub.
+ *
+ * @param path buffer to receive the path
+ * @param size size of the buffer
+ * @param variant variant name
+ * @return non-zero on success; zero on error
+ */
+static int variantPath(char *path, size_t size, const char *variant) {
+    Dl_info info;
+
+    if (!dladdr((void *) &variantPath, &info) || !info.dli_fname) {
+        return 0;
+    }
+
+    const char *separator = strrchr(info.dli_fname, '/');
+    int directoryLength = separator ? (int) (separator - info.dli_fname) : 0;
+
+    int length;
+    if (separator) {
+        length = snprintf(path, size, "%.*s/%s-%s.so", directoryLength, info.dli_fname, PICAM_LIBRARY_NAME, variant);
+    } else {
+        length = snprintf(path, size, "%s-%s.so", PICAM_LIBRARY_NAME, variant);
+    }
+
+    return length > 0 && (size_t) length < size;
+}
+
+/**
+ * Unload the variant library.
+ *
+ * @param jvm Java virtual machine
+ * @param reserved reserved JNI argument
+ * @param loaded true if the variant's own JNI_OnLoad succeeded, so its JNI_OnUnload must be invoked first
+ */
+static void unloadVariant(JavaVM *jvm, void *reserved, bool loaded) {
+    if (loaded) {
+        void (*onUnload)(JavaVM *, void *) = (void (*)(JavaVM *, void *)) dlsym(library, "JNI_OnUnload");
+        if (onUnload) {
+            onUnload(jvm, reserved);
+        }
+    }
+
+    dlclose(library);
+    library = NULL;
+}
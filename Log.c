@@ -0,0 +1,393 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+/*
+ * Asynchronous native logging.
+ *
+ * Log records are written to a fixed-size lock-free ring by any thread (including MMAL callback
+ * threads) without allocating or blocking, and are drained by a background thread to the current
+ * sink. If the ring is full, the record is dropped and counted rather than making the caller wait.
+ *
+ * The ring is a bounded multi-producer single-consumer queue - each slot carries a sequence number
+ * that tells producers and the consumer whose turn it is to use that slot.
+ *
+ * Logging is process-wide, shared by every camera context, so starting and stopping are counted -
+ * the thread runs from the first start until the matching last stop. The ring, the semaphore and
+ * the sink outlive the thread, so a record logged while the thread is stopping is never lost, and
+ * a sink or log file set by the application is kept however often logging is restarted.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "Log.h"
+#include "Schedule.h"
+
+/**
+ * Number of slots in the ring, must be a power of two.
+ */
+#define LOG_RING_SIZE 256
+
+typedef struct {
+    atomic_uint sequence;
+    LogRecord   record;
+} LogSlot;
+
+static struct {
+    LogSlot         slots[LOG_RING_SIZE];
+    atomic_uint     enqueuePosition;
+    unsigned int    dequeuePosition;
+    atomic_int      level;
+    atomic_ullong   dropped;
+    sem_t           available;
+    pthread_t       thread;
+    pthread_mutex_t lifecycleMutex;
+    unsigned int    users;
+    bool            initialised;
+    pthread_mutex_t sinkMutex;
+    LogSink         sink;
+    void           *sinkUserdata;
+    FILE           *file;
+    volatile bool   stopping;
+    atomic_bool     started;
+} Log = {
+    .level          = LOG_LEVEL_INFO,
+    .lifecycleMutex = PTHREAD_MUTEX_INITIALIZER,
+    .sinkMutex      = PTHREAD_MUTEX_INITIALIZER
+};
+
+static int startLogThread(void);
+static void stopLogThread(void);
+static void *logThread(void *arg);
+static void drainRecords(void);
+static void writeRecord(const LogRecord *record);
+static void formatRecord(LogRecord *record, int level, const char *format, va_list args);
+
+/**
+ * Start the logging thread, if this is the first start not yet matched by a stop.
+ *
+ * Until logging is started (and after it is stopped), records are written directly to stderr.
+ *
+ * @return non-zero on success; zero on error, in which case there is no stop to match
+ */
+int startLogging(void) {
+    pthread_mutex_lock(&Log.lifecycleMutex);
+
+    int result = Log.users || startLogThread();
+    if (result) {
+        Log.users++;
+    }
+
+    pthread_mutex_unlock(&Log.lifecycleMutex);
+
+    return result;
+}
+
+/**
+ * Stop the logging thread after writing any outstanding records, if this matches the first start.
+ *
+ * The sink is kept for when logging is started again.
+ */
+void stopLogging(void) {
+    pthread_mutex_lock(&Log.lifecycleMutex);
+
+    if (Log.users && --Log.users == 0) {
+        stopLogThread();
+    }
+
+    pthread_mutex_unlock(&Log.lifecycleMutex);
+}
+
+/**
+ * Set the minimum level of the records to log, this can be changed at any time.
+ *
+ * @param level LOG_LEVEL_XXX value
+ */
+void setLogLevel(int level) {
+    atomic_store(&Log.level, level);
+}
+
+/**
+ * Get the current minimum log level.
+ *
+ * @return LOG_LEVEL_XXX value
+ */
+int getLogLevel(void) {
+    return atomic_load(&Log.level);
+}
+
+/**
+ * Set the sink that log records are written to.
+ *
+ * A sink is only ever invoked on the logging thread, and never concurrently with itself. The
+ * previous sink is guaranteed not to be in use when this function returns.
+ *
+ * The sink may be set before logging is started, and is kept when logging is stopped.
+ *
+ * @param sink sink function, or NULL to log to stderr
+ * @param userdata opaque data passed to the sink
+ */
+void setLogSink(LogSink sink, void *userdata) {
+    pthread_mutex_lock(&Log.sinkMutex);
+
+    Log.sink         = sink;
+    Log.sinkUserdata = userdata;
+
+    pthread_mutex_unlock(&Log.sinkMutex);
+}
+
+/**
+ * Log to a file, appending to it if it already exists.
+ *
+ * Any previously opened log file is closed.
+ *
+ * @param path file path, or NULL to log to stderr
+ * @return non-zero on success; zero on error
+ */
+int setLogFile(const char *path) {
+    FILE *file = NULL;
+
+    if (path) {
+        file = fopen(path, "a");
+        if (!file) {
+            return 0;
+        }
+    }
+
+    setLogSink(file ? logToStream : NULL, file);
+
+    if (Log.file) {
+        fclose(Log.file);
+    }
+
+    Log.file = file;
+
+    return 1;
+}
+
+/**
+ * Log sink that writes to a stdio stream.
+ *
+ * @param record log record
+ * @param stream FILE pointer
+ */
+void logToStream(const LogRecord *record, void *stream) {
+    time_t seconds = (time_t) (record->timestamp / 1000000);
+    struct tm tm;
+    char timestamp[32];
+
+    localtime_r(&seconds, &tm);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+    fprintf((FILE *) stream, "%s.%06u [%d] %-5s picam: %s\n", timestamp, (unsigned) (record->timestamp % 1000000), record->thread, logLevelName(record->level), record->message);
+    fflush((FILE *) stream);
+}
+
+/**
+ * Get the number of log records that were dropped because the ring was full.
+ *
+ * @return number of dropped records
+ */
+uint64_t logRecordsDropped(void) {
+    return atomic_load(&Log.dropped);
+}
+
+/**
+ * Get a display name for a log level.
+ *
+ * @param level LOG_LEVEL_XXX value
+ * @return name
+ */
+const char *logLevelName(int level) {
+    static const char *names[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR"};
+    return level >= LOG_LEVEL_TRACE && level < LOG_LEVEL_OFF ? names[level] : "?";
+}
+
+/**
+ * Log a message.
+ *
+ * This may be called from any thread, it never blocks and never allocates memory.
+ *
+ * @param level LOG_LEVEL_XXX value
+ * @param format printf-style format string
+ */
+void logMessage(int level, const char *format, ...) {
+    if (level < atomic_load_explicit(&Log.level, memory_order_relaxed) || level >= LOG_LEVEL_OFF) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+
+    if (!atomic_load_explicit(&Log.started, memory_order_acquire)) {
+        LogRecord record;
+        formatRecord(&record, level, format, args);
+        logToStream(&record, stderr);
+        va_end(args);
+        return;
+    }
+
+    unsigned int position = atomic_load_explicit(&Log.enqueuePosition, memory_order_relaxed);
+    LogSlot *slot;
+
+    for (;;) {
+        slot = &Log.slots[position & (LOG_RING_SIZE - 1)];
+        unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int difference = (int) (sequence - position);
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&Log.enqueuePosition, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            // Ring is full
+            atomic_fetch_add_explicit(&Log.dropped, 1, memory_order_relaxed);
+            va_end(args);
+            return;
+        } else {
+            position = atomic_load_explicit(&Log.enqueuePosition, memory_order_relaxed);
+        }
+    }
+
+    formatRecord(&slot->record, level, format, args);
+    va_end(args);
+
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+
+    sem_post(&Log.available);
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Start the logging thread, creating the ring the first time.
+ *
+ * Must only be invoked with the lifecycle mutex held.
+ *
+ * @return non-zero on success; zero on error
+ */
+static int startLogThread(void) {
+    if (!Log.initialised) {
+        for (unsigned int i = 0; i < LOG_RING_SIZE; i++) {
+            atomic_init(&Log.slots[i].sequence, i);
+        }
+
+        atomic_init(&Log.enqueuePosition, 0);
+        Log.dequeuePosition = 0;
+
+        if (sem_init(&Log.available, 0, 0)) {
+            return 0;
+        }
+
+        Log.initialised = true;
+    }
+
+    Log.stopping = false;
+
+    if (pthread_create(&Log.thread, NULL, logThread, NULL)) {
+        return 0;
+    }
+
+    atomic_store_explicit(&Log.started, true, memory_order_release);
+
+    return 1;
+}
+
+/**
+ * Stop the logging thread, after it has written any outstanding records.
+ *
+ * A record logged by a thread that saw logging still started may be left in the ring, it is
+ * written when logging is next started.
+ *
+ * Must only be invoked with the lifecycle mutex held.
+ */
+static void stopLogThread(void) {
+    atomic_store_explicit(&Log.started, false, memory_order_release);
+
+    Log.stopping = true;
+    sem_post(&Log.available);
+    pthread_join(Log.thread, NULL);
+}
+
+static void *logThread(void *arg) {
+    uint32_t scheduled = 0;
+
+    while (!Log.stopping) {
+        sem_wait(&Log.available);
+
+        // The worker schedule is set when a camera is opened, long after this thread started
+        uint32_t generation = workerScheduleGeneration();
+        if (generation != scheduled) {
+            scheduled = generation;
+            applyWorkerSchedule("logging", false);
+        }
+
+        drainRecords();
+    }
+
+    drainRecords();
+
+    return NULL;
+}
+
+/**
+ * Write all of the records currently available in the ring to the sink.
+ */
+static void drainRecords(void) {
+    for (;;) {
+        LogSlot *slot = &Log.slots[Log.dequeuePosition & (LOG_RING_SIZE - 1)];
+        unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if ((int) (sequence - (Log.dequeuePosition + 1)) < 0) {
+            break;
+        }
+
+        writeRecord(&slot->record);
+
+        atomic_store_explicit(&slot->sequence, Log.dequeuePosition + LOG_RING_SIZE, memory_order_release);
+        Log.dequeuePosition++;
+    }
+}
+
+static void writeRecord(const LogRecord *record) {
+    pthread_mutex_lock(&Log.sinkMutex);
+    if (Log.sink) {
+        Log.sink(record, Log.sinkUserdata);
+    } else {
+        logToStream(record, stderr);
+    }
+    pthread_mutex_unlock(&Log.sinkMutex);
+}
+
+static void formatRecord(LogRecord *record, int level, const char *format, va_list args) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    record->timestamp = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+    record->level     = level;
+    record->thread    = (int32_t) syscall(SYS_gettid);
+
+    vsnprintf(record->message, sizeof(record->message), format, args);
+}
@@ -0,0 +1,83 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_LOG_H
+#define _PICAM_LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Export.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Log levels, these values must match the Java LogLevel enumeration.
+ */
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_WARN  3
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_OFF   5
+
+/**
+ * Maximum length of a formatted log message, longer messages are truncated.
+ */
+#define LOG_MESSAGE_SIZE 200
+
+/**
+ * A single log record.
+ */
+typedef struct LogRecord {
+    uint64_t timestamp;
+    int32_t  level;
+    int32_t  thread;
+    char     message[LOG_MESSAGE_SIZE];
+} LogRecord;
+
+/**
+ * Log sink, invoked on the logging thread for each record.
+ */
+typedef void (*LogSink)(const LogRecord *record, void *userdata);
+
+PICAM_EXPORT int startLogging(void);
+PICAM_EXPORT void stopLogging(void);
+PICAM_EXPORT void setLogLevel(int level);
+PICAM_EXPORT int getLogLevel(void);
+PICAM_EXPORT void setLogSink(LogSink sink, void *userdata);
+PICAM_EXPORT int setLogFile(const char *path);
+PICAM_EXPORT void logToStream(const LogRecord *record, void *stream);
+PICAM_EXPORT uint64_t logRecordsDropped(void);
+PICAM_EXPORT const char *logLevelName(int level);
+PICAM_EXPORT void logMessage(int level, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+
+#define logTrace(...) logMessage(LOG_LEVEL_TRACE, __VA_ARGS__)
+#define logDebug(...) logMessage(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define logInfo(...)  logMessage(LOG_LEVEL_INFO , __VA_ARGS__)
+#define logWarn(...)  logMessage(LOG_LEVEL_WARN , __VA_ARGS__)
+#define logError(...) logMessage(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PICAM_LOG_H
@@ -0,0 +1,146 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <string.h>
+
+#include "LowLight.h"
+#include "Camera.h"
+#include "Capture.h"
+#include "Log.h"
+#include "RawCapture.h"
+#include "Stacking.h"
+
+static char *captureLowLightFrames(PicamContext *context, uint32_t count);
+
+/**
+ * Capture a low-light picture by stacking a number of shorter exposures.
+ *
+ * A single long exposure forces the sensor down to a fraction of a frame per second, blocking the
+ * camera for several frame times and producing a noisy picture. Instead the frames are captured
+ * raw back-to-back with a shorter shutter speed, aligned and stacked natively (see Stacking.c),
+ * and the result is delivered to the sink as region index 0. Stacking N frames reduces random
+ * noise by roughly the square root of N.
+ *
+ * The configured exposure is restored afterwards, whether or not the capture succeeded. The total
+ * time taken, including the stacking, is recorded in the statistics.
+ *
+ * @param context global state
+ * @param count number of frames, at most LOW_LIGHT_MAX_FRAMES
+ * @param shutterSpeed shutter speed for each frame in microseconds, zero to keep the current exposure
+ * @param method STACKING_MEAN or STACKING_MEDIAN
+ * @param align true to align the frames before stacking, for hand-held or unsteady cameras
+ * @param encode true to encode the output with the configured encoding; false for I420 data
+ * @param sink receives the output
+ * @param userdata passed to the sink
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *captureLowLight(PicamContext *context, uint32_t count, uint32_t shutterSpeed, int method, bool align, bool encode, RegionSink sink, void *userdata) {
+    if (count == 0 || count > LOW_LIGHT_MAX_FRAMES) {
+        return "Invalid number of low-light frames";
+    }
+
+    uint64_t start = vcos_getmicrosecs64();
+
+    char *captureFailure = NULL;
+
+    if (shutterSpeed && !applyLiveExposure(context, context->config.control.exposureCompensation, shutterSpeed)) {
+        captureFailure = "Failed to apply low-light shutter speed";
+    }
+
+    if (!captureFailure) {
+        captureFailure = captureLowLightFrames(context, count);
+    }
+
+    if (shutterSpeed && !restoreLiveExposure(context)) {
+        logWarn("Failed to restore exposure after low-light capture");
+    }
+
+    if (captureFailure) {
+        return captureFailure;
+    }
+
+    uint64_t captured = vcos_getmicrosecs64();
+
+    if (!stackFrames(context->lowLightFrames, count, method, align, &context->regionImage)) {
+        return "Failed to stack low-light frames";
+    }
+
+    const uint8_t *data   = context->regionImage.data;
+    size_t         length = imageSize(&context->regionImage);
+
+    if (encode) {
+        char *encodeFailure = encodeImage(context, &context->regionImage, &data, &length);
+        if (encodeFailure) {
+            return encodeFailure;
+        }
+    }
+
+    sink(userdata, 0, data, length);
+
+    context->stats.lastLowLightTime = vcos_getmicrosecs64() - start;
+
+    logDebug("Low-light capture of %u frames took %lluus, stacking %lluus", count, (unsigned long long) context->stats.lastLowLightTime, (unsigned long long) (vcos_getmicrosecs64() - captured));
+
+    return NULL;
+}
+
+/**
+ * Destroy the low-light frames.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param context global state
+ */
+void destroyLowLight(PicamContext *context) {
+    for (int i = 0; i < LOW_LIGHT_MAX_FRAMES; i++) {
+        freeImage(&context->lowLightFrames[i]);
+    }
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Capture each frame, copying it out of the raw frame.
+ *
+ * @param context global state
+ * @param count number of frames
+ * @return NULL on success; otherwise a description of the failure
+ */
+static char *captureLowLightFrames(PicamContext *context, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        char *captureFailure = performCaptureWithRetries(context, OUTPUT_RAW, NULL, NULL);
+        if (captureFailure) {
+            return captureFailure;
+        }
+
+        if (!rawFrameComplete(context)) {
+            return "Raw capture did not deliver a complete frame";
+        }
+
+        const Image *frame = &context->rawFrame;
+        Image       *copy  = &context->lowLightFrames[i];
+
+        if (!allocateImage(copy, frame->width, frame->height, frame->stride, frame->sliceHeight)) {
+            return "Failed to allocate low-light frame";
+        }
+
+        memcpy(copy->data, frame->data, imageSize(frame));
+    }
+    return NULL;
+}
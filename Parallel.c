@@ -0,0 +1,94 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "Parallel.h"
+#include "Schedule.h"
+
+/**
+ * A contiguous range of items, processed by one thread.
+ */
+typedef struct ParallelBand {
+    ParallelTask  task;
+    void         *userdata;
+    uint32_t      start;
+    uint32_t      end;
+} ParallelBand;
+
+static void *parallelThread(void *arg);
+
+/**
+ * Split a task into contiguous bands of items, one per processor, and wait for them all.
+ *
+ * The calling thread processes the first band itself, and any band whose thread can not be created
+ * is processed on the calling thread too - so the task always completes.
+ *
+ * @param count number of items, typically image rows
+ * @param granularity every band except the last starts and ends on a multiple of this
+ * @param task processes one band
+ * @param userdata passed to the task
+ */
+void runParallel(uint32_t count, uint32_t granularity, ParallelTask task, void *userdata) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = processors < 1 ? 1 : processors > PARALLEL_MAX_THREADS ? PARALLEL_MAX_THREADS : (uint32_t) processors;
+
+    uint32_t bandSize = (count / threads + granularity) / granularity * granularity;
+
+    ParallelBand bands[PARALLEL_MAX_THREADS];
+    pthread_t    bandThreads[PARALLEL_MAX_THREADS];
+    bool         started[PARALLEL_MAX_THREADS] = {false};
+
+    for (uint32_t i = 0; i < threads; i++) {
+        bands[i].task     = task;
+        bands[i].userdata = userdata;
+        bands[i].start    = i * bandSize < count ? i * bandSize : count;
+        bands[i].end      = (i + 1) * bandSize < count && i + 1 < threads ? (i + 1) * bandSize : count;
+    }
+
+    for (uint32_t i = 1; i < threads; i++) {
+        started[i] = pthread_create(&bandThreads[i], NULL, parallelThread, &bands[i]) == 0;
+    }
+
+    task(userdata, bands[0].start, bands[0].end);
+
+    for (uint32_t i = 1; i < threads; i++) {
+        if (started[i]) {
+            pthread_join(bandThreads[i], NULL);
+        } else {
+            task(userdata, bands[i].start, bands[i].end);
+        }
+    }
+}
+
+// === Private implementation =====================================================================
+
+static void *parallelThread(void *arg) {
+    ParallelBand *band = (ParallelBand *) arg;
+
+    // Band threads are created for every task, so only the first to apply each schedule logs it
+    applyWorkerSchedule("parallel", true);
+
+    if (band->start < band->end) {
+        band->task(band->userdata, band->start, band->end);
+    }
+    return NULL;
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_PARALLEL_H
+#define _PICAM_PARALLEL_H
+
+#include <stdint.h>
+
+/**
+ * Maximum number of threads used for a parallel task, including the calling thread.
+ */
+#define PARALLEL_MAX_THREADS 4
+
+/**
+ * Process the items from start (inclusive) to end (exclusive).
+ */
+typedef void (*ParallelTask)(void *userdata, uint32_t start, uint32_t end);
+
+void runParallel(uint32_t count, uint32_t granularity, ParallelTask task, void *userdata);
+
+#endif // _PICAM_PARALLEL_H
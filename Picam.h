@@ -20,9 +20,20 @@
 #ifndef _PICAM_H
 #define _PICAM_H
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <time.h>
 
+#include "Bytes.h"
 #include "Configuration.h"
+#include "HostEncoder.h"
+#include "Image.h"
+#include "Jpeg.h"
+#include "PicamCore.h"
+#include "Statistics.h"
 
 #include "interface/mmal/mmal.h"
 #include "interface/mmal/util/mmal_connection.h"
@@ -33,21 +44,323 @@
 #define MMAL_CAMERA_CAPTURE_PORT 2
 
 /**
- * Global state.
+ * Camera output port index for the video port.
  */
-typedef struct PicamContext {
+#define MMAL_CAMERA_VIDEO_PORT 1
+
+/**
+ * Capture output modes - encoded by the tunnelled image encoder, or raw I420 delivered to the host.
+ */
+#define OUTPUT_ENCODED 0
+#define OUTPUT_RAW     1
+
+/**
+ * Maximum number of image encoders, one per encoding, kept ready to be switched onto the tunnel.
+ */
+#define ENCODER_CACHE_SIZE 4
+
+/**
+ * An image encoder component and its output buffer pool, see Encoder.c.
+ */
+typedef struct EncoderSlot {
+    MMAL_COMPONENT_T *component;
+    MMAL_POOL_T      *pool;
+    int32_t           encoding;
+    uint32_t          quality;
+    uint64_t          lastUsed;
+} EncoderSlot;
+
+/**
+ * Number of recent JPEG captures remembered for rate control.
+ */
+#define RATE_CONTROL_SAMPLES 8
+
+/**
+ * Quality and encoded size of recent JPEG captures, for rate control, see RateControl.c.
+ */
+typedef struct RateControl {
+    uint32_t quality[RATE_CONTROL_SAMPLES];
+    uint32_t size[RATE_CONTROL_SAMPLES];
+    uint32_t next;
+    uint32_t count;
+    double   slope;
+    double   intercept;
+    bool     predicted;
+} RateControl;
+
+/**
+ * Maximum number of triggered captures whose frames have not yet started.
+ */
+#define CAPTURE_QUEUE_SIZE 8
+
+/**
+ * Capture generation tracking state, see Capture.c.
+ */
+typedef struct CaptureTracker {
+    bool            created;
+    pthread_mutex_t mutex;
+    pthread_cond_t  completed;
+    uint32_t        lastGeneration;
+    uint32_t        pending[CAPTURE_QUEUE_SIZE];
+    uint32_t        pendingHead;
+    uint32_t        pendingCount;
+    uint32_t        frameGeneration;
+    uint32_t        awaitedGeneration;
+    uint32_t        completedGeneration;
+    bool            delivering;
+} CaptureTracker;
+
+/**
+ * Where the encoded picture data of a capture goes, and what was learned about the picture, see
+ * Delivery.c.
+ *
+ * The data goes to the callback as it is produced, or if there is no callback it is collected
+ * natively. A delivery is installed in the context with the pipeline locked, for the duration of a
+ * single capture, so captures requested on different threads never see each other's delivery.
+ */
+typedef struct PictureDelivery {
+    PictureDataCallback   callback;
+    void                 *userdata;
+    Bytes                *data;
+    bool                  raw;
+    uint32_t              length;
+    uint32_t              chunkSize;
+    JpegInfo              info;
+} PictureDelivery;
+
+/**
+ * An encoded capture shared by every request that was coalesced onto it, see CaptureQueue.c.
+ *
+ * The picture data is owned by the capture, and freed when the last request releases it.
+ */
+typedef struct SharedCapture {
+    EncoderConfig         encoder;
+    bool                  started;
+    bool                  done;
+    char                 *failure;
+    Bytes                 data;
+    uint32_t              chunkSize;
+    JpegInfo              info;
+    uint32_t              references;
+    struct SharedCapture *next;
+} SharedCapture;
+
+/**
+ * Queue of encoded captures, in the order they were requested, see CaptureQueue.c.
+ */
+typedef struct CaptureQueue {
+    pthread_mutex_t mutex;
+    pthread_cond_t  changed;
+    SharedCapture  *head;
+    SharedCapture  *tail;
+} CaptureQueue;
+
+/**
+ * Maximum number of encoded chunks, and of keyframes, held in the recording pre-roll buffer.
+ */
+#define RECORDING_CHUNKS    8192
+#define RECORDING_KEYFRAMES 512
+
+/**
+ * A contiguous chunk of the encoded H.264 stream in the recording buffer.
+ */
+typedef struct RecordingChunk {
+    uint32_t offset;
+    uint32_t length;
+    uint64_t time;
+    bool     config;
+    bool     frameEnd;
+} RecordingChunk;
+
+/**
+ * H.264 recording state, see Recorder.c.
+ *
+ * Chunks are identified by a sequence number that increases for the lifetime of the recorder, the
+ * oldest chunk in the buffer has sequence number firstChunk.
+ */
+typedef struct Recorder {
+    bool               active;
+    bool               started;
+    volatile bool      stopping;
+
+    MMAL_COMPONENT_T*  encoderComponent;
+    MMAL_POOL_T*       pool;
+    MMAL_CONNECTION_T* connection;
+
+    pthread_mutex_t    mutex;
+    pthread_cond_t     changed;
+    pthread_t          writerThread;
+
+    uint8_t           *data;
+    uint32_t           capacity;
+    RecordingChunk     chunks[RECORDING_CHUNKS];
+    uint64_t           firstChunk;
+    uint32_t           chunkCount;
+    uint64_t           keyframes[RECORDING_KEYFRAMES];
+    uint32_t           keyframeHead;
+    uint32_t           keyframeCount;
+    bool               frameStart;
+    bool               afterConfig;
+    Bytes              header;
+
+    int                fd;
+    uint64_t           cursor;
+    uint64_t           flushEnd;
+    bool               flushStarted;
+} Recorder;
+
+/**
+ * Timelapse state, see Timelapse.c.
+ *
+ * The wake event is created on first use and kept for the lifetime of the context, so a timelapse
+ * can always be stopped from another thread.
+ */
+typedef struct Timelapse {
+    bool               created;
+    volatile bool      stopping;
+    int                wakeFd;
+} Timelapse;
+
+/**
+ * Capture trace recording state, see Trace.c.
+ *
+ * The active flag is read without the lock, so that nothing at all is done for an event when no
+ * trace is being recorded.
+ */
+typedef struct Trace {
+    volatile bool      active;
+    bool               payload;
+    pthread_mutex_t    mutex;
+    FILE              *file;
+    uint64_t           start;
+} Trace;
+
+/**
+ * Exposure and white balance values, as reported by the camera or as locked.
+ */
+typedef struct ExposureSettings {
+    uint32_t           shutterSpeed;
+    MMAL_RATIONAL_T    analogGain;
+    MMAL_RATIONAL_T    digitalGain;
+    MMAL_RATIONAL_T    redGain;
+    MMAL_RATIONAL_T    blueGain;
+} ExposureSettings;
+
+/**
+ * Exposure and white balance lock state, see ExposureLock.c.
+ *
+ * The camera reports its settings on the control port whenever they change, the latest report is
+ * kept (under the mutex, it arrives on an MMAL thread) so the converged values are at hand when the
+ * exposure is locked.
+ */
+typedef struct ExposureLock {
+    pthread_mutex_t    mutex;
+    bool               reported;
+    ExposureSettings   current;
+    bool               locked;
+    ExposureSettings   settings;
+} ExposureLock;
+
+/**
+ * Background threads owned by the library, see Threads.c.
+ */
+#define OWNED_THREAD_RECOVERY         0
+#define OWNED_THREAD_CACHE_REAPER     1
+#define OWNED_THREAD_RECORDING_WRITER 2
+#define OWNED_THREAD_COUNT            3
+
+/**
+ * CPU time accounting for one owned thread, covering every instance of that thread.
+ */
+typedef struct OwnedThread {
+    bool               running;
+    clockid_t          clock;
+    uint64_t           cpuTime;
+} OwnedThread;
+
+/**
+ * Native thread scheduling and accounting state, see Threads.c.
+ *
+ * The callback counters are updated on MMAL threads, so are atomic rather than locked.
+ */
+typedef struct ThreadAccounting {
+    pthread_mutex_t    mutex;
+    OwnedThread        owned[OWNED_THREAD_COUNT];
+    uint32_t           callbackGeneration;
+    atomic_uint        callbackThreads;
+    atomic_ullong      callbackCpuTime;
+} ThreadAccounting;
+
+/**
+ * Global state, opaque outside of the core library, see PicamCore.h.
+ */
+struct PicamContext {
 
     PicamConfig        config; 
+    pthread_mutex_t    configMutex;
+    bool               logging;
 
+    SensorInfo         sensor;
+    char               annotationText[ANNOTATION_MAX_TEXT];
+
+    EncoderSlot        encoders[ENCODER_CACHE_SIZE];
+    RateControl        rateControl;
     MMAL_COMPONENT_T*  encoderComponent;
-    MMAL_POOL_T*       picturePool;
     MMAL_COMPONENT_T*  cameraComponent;
     MMAL_CONNECTION_T* cameraEncoderConnection;
 
-    VCOS_SEMAPHORE_T   captureFinishedSemaphore;
+    int                outputMode;
+    uint32_t           shutterSpeed;
+    MMAL_POOL_T*       rawPool;
+    Image              rawFrame;
+
+    HostEncoder        hostEncoder;
+    Image              regionImage;
+    Bytes              regionData;
+    Image              eyeImages[2];
+    HostEncoder        frameEncoder;
+    Bytes              frameData;
+    Image              bracketFrames[BRACKET_MAX_FRAMES];
+    Image              lowLightFrames[LOW_LIGHT_MAX_FRAMES];
+
+    CaptureTracker     tracker;
+    CaptureQueue       captureQueue;
+
+    Recorder           recorder;
+
+    Timelapse          timelapse;
+
+    Trace              trace;
+
+    ExposureLock       exposureLock;
+
+    ThreadAccounting   threads;
+
+    PictureDelivery   *delivery;
+
+    VCOS_MUTEX_T       pipelineMutex;
+    VCOS_SEMAPHORE_T   recoverySemaphore;
+    VCOS_THREAD_T      recoveryThread;
+    bool               recoveryStarted;
+    volatile bool      recoveryStopping;
+    volatile bool      recoveryRequested;
+    volatile bool      pipelineReady;
+
+    pthread_mutex_t    cacheMutex;
+    pthread_cond_t     cacheChanged;
+    pthread_t          cacheReaper;
+    bool               cacheReaperStarted;
+    bool               pipelineParked;
+
+    volatile bool      errorPending;
+    volatile uint32_t  bytesDelivered;
+    JpegParser         jpegParser;
+    Bytes              pictureData;
+    Bytes              bayerRaw;
+    Bytes              bayerRgb;
 
-    uint32_t (*pictureDataCallback)(uint8_t*, uint32_t);
+    PicamStatistics    stats;
 
-} PicamContext;
+};
 
 #endif // _PICAM_H
\ No newline at end of file
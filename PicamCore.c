@@ -0,0 +1,608 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Annotation.h"
+#include "Bayer.h"
+#include "Bracket.h"
+#include "Capture.h"
+#include "CaptureQueue.h"
+#include "ExposureLock.h"
+#include "FrameEncoder.h"
+#include "LowLight.h"
+#include "Picam.h"
+#include "PicamCore.h"
+#include "Pipeline.h"
+#include "PipelineCache.h"
+#include "Probes.h"
+#include "RateControl.h"
+#include "Recorder.h"
+#include "Recovery.h"
+#include "Regions.h"
+#include "RgbCapture.h"
+#include "Schedule.h"
+#include "Stacking.h"
+#include "Stereo.h"
+#include "Threads.h"
+#include "Timelapse.h"
+#include "Trace.h"
+
+/**
+ * Create a camera context, the camera itself is not opened.
+ *
+ * Logging is started here if it is not already running, it is process-wide and keeps running
+ * until the last context is released.
+ *
+ * @return context; or NULL on error
+ */
+PicamContext *picamInit(void) {
+    // Logging is process-wide, independent of any camera
+    bool logging = startLogging();
+    if (!logging) {
+        logError("Failed to start logging thread");
+    }
+
+    PicamContext *context = calloc(1, sizeof(PicamContext));
+    if (!context) {
+        logError("Failed to allocate camera context");
+        if (logging) {
+            stopLogging();
+        }
+        return NULL;
+    }
+
+    context->logging = logging;
+
+    pthread_mutex_init(&context->configMutex, NULL);
+
+    initPipelineCache(context);
+    initCaptureQueue(context);
+    initTrace(context);
+    initExposureLock(context);
+    initThreads(context);
+
+    return context;
+}
+
+/**
+ * Release a camera context, destroying any parked pipeline and stopping logging if this is the
+ * last context.
+ *
+ * The camera must already be closed.
+ *
+ * @param context camera context, may be NULL
+ */
+void picamRelease(PicamContext *context) {
+    if (context) {
+        releasePipelineCache(context);
+        destroyTimelapse(context);
+        destroyCaptureQueue(context);
+        destroyTrace(context);
+        destroyExposureLock(context);
+        destroyThreads(context);
+        pthread_mutex_destroy(&context->configMutex);
+        if (context->logging) {
+            stopLogging();
+        }
+        free(context);
+    }
+}
+
+/**
+ * Open the camera, creating all of the native resources necessary for using it.
+ *
+ * A pipeline parked by the previously closed camera is re-used if the configuration allows it.
+ *
+ * @param context camera context
+ * @param config camera configuration, usually starting from setConfigurationDefaults
+ * @return non-zero on success; zero on error
+ */
+int picamOpen(PicamContext *context, const PicamConfig *config) {
+    uint64_t start = vcos_getmicrosecs64();
+
+    memset(&context->stats, 0, sizeof(context->stats));
+    resetRateControl(context);
+
+    bool reused = reattachPipeline(context, config);
+
+    context->recoveryRequested = false;
+    context->errorPending      = false;
+
+    // The capture tracker is kept while a pipeline is parked, since buffers may still arrive
+    if (!context->tracker.created && !createCaptureTracker(context)) {
+        goto error;
+    }
+
+    if (!reused) {
+        // The configuration may be read concurrently, see picamEncoderConfig
+        pthread_mutex_lock(&context->configMutex);
+        context->config = *config;
+        pthread_mutex_unlock(&context->configMutex);
+
+        if (!createPipeline(context)) {
+            goto error;
+        }
+    }
+
+    resetCallbackThreads(context);
+
+    // The logging and parallel threads are process-wide, the camera opened last decides their schedule
+    setWorkerSchedule(context->config.threads.workerPolicy, context->config.threads.workerPriority, context->config.threads.workerAffinity);
+
+    if (!startRecovery(context)) {
+        goto error;
+    }
+
+    context->stats.createTime     = vcos_getmicrosecs64() - start;
+    context->stats.pipelineReused = reused;
+
+    logInfo("Camera %s in %lluus", reused ? "re-attached" : "created", (unsigned long long) context->stats.createTime);
+
+    return 1;
+
+error:
+    picamClose(context);
+    return 0;
+}
+
+/**
+ * Close the camera, releasing all associated resources.
+ *
+ * The pipeline is parked rather than destroyed if keep-alive is configured. It is safe to call
+ * this method no matter what the state is.
+ *
+ * @param context camera context
+ */
+void picamClose(PicamContext *context) {
+    stopTimelapse(context);
+    stopRecovery(context);
+    releaseExposureLock(context);
+
+    bool parked = parkPipeline(context);
+    if (!parked) {
+        destroyPipeline(context);
+    }
+
+    stopRecorder(context);
+    destroyFrameEncoder(context);
+    destroyBayer(context);
+    destroyBracket(context);
+    destroyLowLight(context);
+    destroyStereo(context);
+    destroyRegions(context);
+
+    // The reaper may destroy the parked pipeline at any time once started, so only start it now
+    if (parked) {
+        parked = startCacheReaper(context);
+    }
+
+    if (!parked) {
+        destroyCaptureTracker(context);
+    }
+}
+
+/**
+ * Capture a picture, delivering the encoded data to a callback as it is produced.
+ *
+ * @param context camera context
+ * @param encoder encoding and quality for this capture, or NULL for the configured encoding and quality
+ * @param callback receives the picture data, on an MMAL thread
+ * @param userdata passed to the callback
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *picamCapture(PicamContext *context, const EncoderConfig *encoder, PictureDataCallback callback, void *userdata) {
+    PictureDelivery delivery = {
+        .callback = callback,
+        .userdata = userdata
+    };
+
+    return performCaptureWithRetries(context, OUTPUT_ENCODED, encoder, &delivery);
+}
+
+/**
+ * Capture a picture, may be invoked concurrently from any number of threads.
+ *
+ * Concurrent requests for the same encoding and quality share a single capture, other requests
+ * are queued in order, see CaptureQueue.c. The picture is collected natively, then delivered to
+ * the callback on the calling thread in chunks the size of the encoder buffers - so the callback
+ * sees the same sequence of calls as with picamCapture, and may likewise return short to stop
+ * delivery of the rest of the picture.
+ *
+ * The picture info returned is for the capture this request shared, not for whichever capture
+ * finished last as with picamPictureInfo.
+ *
+ * @param context camera context
+ * @param encoder encoding and quality for this capture, or NULL for the configured encoding and quality
+ * @param callback receives the picture data, on the calling thread
+ * @param userdata passed to the callback
+ * @param info receives the validity and metadata of the picture, may be NULL
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *picamCaptureShared(PicamContext *context, const EncoderConfig *encoder, PictureDataCallback callback, void *userdata, JpegInfo *info) {
+    if (info) {
+        memset(info, 0, sizeof(JpegInfo));
+    }
+
+    SharedCapture *capture = requestCapture(context, encoder);
+    if (!capture) {
+        return "Failed to request capture";
+    }
+
+    char *captureFailure = capture->failure;
+
+    if (info) {
+        *info = capture->info;
+    }
+
+    if (!captureFailure) {
+        const Bytes *data  = &capture->data;
+        size_t       chunk = capture->chunkSize ? capture->chunkSize : data->length;
+        size_t       taken = 0;
+
+        probe1(deferred__begin, data->length);
+
+        for (size_t offset = 0; offset < data->length; offset += chunk) {
+            uint32_t length  = (uint32_t) (data->length - offset < chunk ? data->length - offset : chunk);
+            uint64_t start   = tracing(context) ? traceTime() : 0;
+            uint32_t written = callback(userdata, data->data + offset, length);
+
+            if (start) {
+                TraceRecord record = {
+                    .type     = TRACE_UPCALL,
+                    .length   = length,
+                    .flags    = TRACE_UPCALL_DEFERRED,
+                    .value    = written,
+                    .duration = traceTime() - start
+                };
+                traceRecord(context, &record, NULL);
+            }
+
+            taken += written;
+
+            if (written != length) {
+                break;
+            }
+        }
+
+        probe2(deferred__end, data->length, taken);
+    }
+
+    releaseCapture(context, capture);
+
+    return captureFailure;
+}
+
+/**
+ * Capture a picture into a buffer owned by the context.
+ *
+ * The buffer remains valid until the next capture, or until the camera is closed.
+ *
+ * @param context camera context
+ * @param encoder encoding and quality for this capture, or NULL for the configured encoding and quality
+ * @param data receives the encoded picture data
+ * @param length receives the length of the encoded picture data
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *picamCaptureToBuffer(PicamContext *context, const EncoderConfig *encoder, const uint8_t **data, size_t *length) {
+    PictureDelivery delivery = {
+        .data = &context->pictureData
+    };
+
+    char *captureFailure = performCaptureWithRetries(context, OUTPUT_ENCODED, encoder, &delivery);
+
+    if (!captureFailure) {
+        *data   = context->pictureData.data;
+        *length = context->pictureData.length;
+    }
+
+    return captureFailure;
+}
+
+/**
+ * Capture a picture and deliver one or more regions of interest from it, see Regions.c.
+ *
+ * @param context camera context
+ * @param regions regions to capture
+ * @param count number of regions
+ * @param encode true to encode each region with the configured encoding; false for I420 data
+ * @param sink receives the output for each region, on the calling thread
+ * @param userdata passed to the sink
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *picamCaptureRegions(PicamContext *context, const Region *regions, uint32_t count, bool encode, RegionSink sink, void *userdata) {
+    return captureRegions(context, regions, count, encode, sink, userdata);
+}
+
+/**
+ * Capture a stereoscopic picture and deliver the two eyes, see Stereo.c.
+ *
+ * @param context camera context
+ * @param encode true to encode each eye with the configured encoding; false for I420 data
+ * @param interleave true to deliver one row-interleaved picture; false to deliver each eye separately
+ * @param sink receives the output for each eye, on the calling thread
+ * @param userdata passed to the sink
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *picamCaptureStereo(PicamContext *context, bool encode, bool interleave, RegionSink sink, void *userdata) {
+    return captureStereo(context, encode, interleave, sink, userdata);
+}
+
+/**
+ * Capture an exposure bracket, delivering each frame or the fused picture, see Bracket.c.
+ *
+ * @param context camera context
+ * @param settings exposure settings for each frame
+ * @param count number of frames, at most BRACKET_MAX_FRAMES
+ * @param settle time in milliseconds to let the exposure settle before each frame
+ * @param fuse true to deliver a single fused picture; false to deliver every frame
+ * @param encode true to encode the output with the configured encoding; false for I420 data
+ * @param sink receives the output, on the calling thread
+ * @param userdata passed to the sink
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *picamCaptureBracket(PicamContext *context, const BracketSetting *settings, uint32_t count, uint32_t settle, bool fuse, bool encode, RegionSink sink, void *userdata) {
+    return captureBracket(context, settings, count, settle, fuse, encode, sink, userdata);
+}
+
+/**
+ * Capture a burst of frames and deliver them stacked into a single low-light picture, see
+ * LowLight.c.
+ *
+ * @param context camera context
+ * @param count number of frames, at most LOW_LIGHT_MAX_FRAMES
+ * @param shutterSpeed shutter speed for each frame in microseconds, zero to keep the current exposure
+ * @param median true to take the median of the frames; false for the mean
+ * @param align true to align the frames before stacking
+ * @param encode true to encode the output with the configured encoding; false for I420 data
+ * @param sink receives the output, on the calling thread
+ * @param userdata passed to the sink
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *picamCaptureLowLight(PicamContext *context, uint32_t count, uint32_t shutterSpeed, bool median, bool align, bool encode, RegionSink sink, void *userdata) {
+    return captureLowLight(context, count, shutterSpeed, median ? STACKING_MEDIAN : STACKING_MEAN, align, encode, sink, userdata);
+}
+
+/**
+ * Capture a picture with the sensor-raw Bayer data, see Bayer.c.
+ *
+ * @param context camera context
+ * @param demosaic true to also deliver demosaiced RGB data
+ * @param sink receives the data, on the calling thread
+ * @param userdata passed to the sink
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *picamCaptureBayer(PicamContext *context, bool demosaic, BayerSink sink, void *userdata) {
+    return captureBayer(context, demosaic, sink, userdata);
+}
+
+/**
+ * Capture a picture converted to packed 0xFFRRGGBB pixels, see RgbCapture.c.
+ *
+ * @param context camera context
+ * @param width width of the picture, or zero for the configured width
+ * @param height height of the picture, or zero for the configured height
+ * @param acquire provides the output pixels
+ * @param release gives back the output pixels after the conversion
+ * @param userdata passed to acquire and release
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *picamCaptureRgb(PicamContext *context, uint32_t width, uint32_t height, RgbAcquire acquire, RgbRelease release, void *userdata) {
+    return captureRgb(context, width, height, acquire, release, userdata);
+}
+
+/**
+ * Determine the size of a frame submitted for encoding.
+ *
+ * @param format MMAL encoding of the frame, I420, RGB24 or RGBA
+ * @param width width of the frame in pixels
+ * @param height height of the frame in pixels
+ * @param stride stride of the frame in bytes
+ * @return size of the frame in bytes; or zero if the format is not supported
+ */
+size_t picamFrameSize(uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+    return hostFrameSize(format, width, height, stride);
+}
+
+/**
+ * Submit a frame supplied by the caller for encoding, see FrameEncoder.c.
+ *
+ * @param context camera context
+ * @param encoder encoding and quality of the output
+ * @param format MMAL encoding of the frame, I420, RGB24 or RGBA
+ * @param width width of the frame in pixels
+ * @param height height of the frame in pixels
+ * @param data frame data, at least picamFrameSize bytes
+ * @param stride stride of the frame in bytes
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *picamSubmitFrame(PicamContext *context, const EncoderConfig *encoder, uint32_t format, uint32_t width, uint32_t height, const uint8_t *data, uint32_t stride) {
+    return submitFrame(context, encoder, format, width, height, data, stride);
+}
+
+/**
+ * Receive the next encoded frame, in the order the frames were submitted.
+ *
+ * The data remains valid until the next frame is received.
+ *
+ * @param context camera context
+ * @param data receives the encoded frame data
+ * @param length receives the length of the encoded frame data
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *picamReceiveFrame(PicamContext *context, const uint8_t **data, size_t *length) {
+    return receiveFrame(context, data, length);
+}
+
+/**
+ * Start recording H.264 video into the pre-roll buffer, see Recorder.c.
+ *
+ * @param context camera context
+ * @return non-zero on success; zero on error
+ */
+int picamStartRecording(PicamContext *context) {
+    return startRecorder(context);
+}
+
+/**
+ * Stop recording, discarding the pre-roll buffer.
+ *
+ * @param context camera context
+ */
+void picamStopRecording(PicamContext *context) {
+    stopRecorder(context);
+}
+
+/**
+ * Write the pre-roll buffer, and the video that follows it, to a file.
+ *
+ * @param context camera context
+ * @param path file path
+ * @param postRoll time in milliseconds to keep recording to the file after the flush
+ * @return non-zero on success; zero on error
+ */
+int picamFlushRecording(PicamContext *context, const char *path, uint32_t postRoll) {
+    return flushRecorder(context, path, postRoll);
+}
+
+/**
+ * Run a timelapse on the calling thread, returning when it completes or is stopped, see
+ * Timelapse.c.
+ *
+ * @param context camera context
+ * @param schedule when, and how, to capture the frames
+ * @param sink receives each frame and each skipped slot, on the calling thread
+ * @param userdata passed to the sink
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *picamTimelapse(PicamContext *context, const TimelapseSchedule *schedule, TimelapseSink sink, void *userdata) {
+    return runTimelapse(context, schedule, sink, userdata);
+}
+
+/**
+ * Stop a running timelapse, may be invoked from any thread.
+ *
+ * @param context camera context
+ */
+void picamStopTimelapse(PicamContext *context) {
+    stopTimelapse(context);
+}
+
+/**
+ * Change the text annotated on every frame, without reconfiguring the camera.
+ *
+ * @param context camera context
+ * @param text annotation text, may contain strftime conversions
+ * @return non-zero on success; zero on error
+ */
+int picamAnnotate(PicamContext *context, const char *text) {
+    return setAnnotationText(context, text);
+}
+
+/**
+ * Get the current camera statistics.
+ *
+ * @param context camera context
+ * @return statistics, updated in place by subsequent camera activity
+ */
+const PicamStatistics *picamStatistics(PicamContext *context) {
+    context->stats.droppedLogRecords = logRecordsDropped();
+    updateThreadStatistics(context);
+    return &context->stats;
+}
+
+/**
+ * Get the attached sensor, and the sensor mode in use.
+ *
+ * @param context camera context
+ * @param sensor receives the sensor information
+ */
+void picamSensor(PicamContext *context, SensorInfo *sensor) {
+    *sensor = context->sensor;
+}
+
+/**
+ * Get the configured encoder settings.
+ *
+ * The configuration is copied under a lock, since the camera may be re-opened concurrently.
+ *
+ * @param context camera context
+ * @param encoder receives the encoder configuration
+ */
+void picamEncoderConfig(PicamContext *context, EncoderConfig *encoder) {
+    pthread_mutex_lock(&context->configMutex);
+    *encoder = context->config.encoder;
+    pthread_mutex_unlock(&context->configMutex);
+}
+
+/**
+ * Get the validity and metadata of the most recently captured picture, see Jpeg.c.
+ *
+ * This is whichever capture finished last, on any thread - picamCaptureShared returns the info
+ * with each capture instead.
+ *
+ * @param context camera context
+ * @param info receives the picture information
+ */
+void picamPictureInfo(PicamContext *context, JpegInfo *info) {
+    *info = context->jpegParser.info;
+}
+
+/**
+ * Start recording a trace of capture activity to a file, for offline replay, see Trace.c.
+ *
+ * @param context camera context
+ * @param path trace file path
+ * @param payload true to record the encoded picture data as well as the events
+ * @return non-zero on success; zero on error
+ */
+int picamStartTrace(PicamContext *context, const char *path, bool payload) {
+    return startTrace(context, path, payload);
+}
+
+/**
+ * Stop recording a trace.
+ *
+ * @param context camera context
+ */
+void picamStopTrace(PicamContext *context) {
+    stopTrace(context);
+}
+
+/**
+ * Lock the exposure and white balance at the values the camera has converged on, so every later
+ * capture has identical exposure, see ExposureLock.c.
+ *
+ * @param context camera context
+ * @return non-zero on success; zero on error
+ */
+int picamLockExposure(PicamContext *context) {
+    return lockExposure(context);
+}
+
+/**
+ * Unlock the exposure and white balance, returning to the configured modes.
+ *
+ * @param context camera context
+ * @return non-zero on success; zero on error
+ */
+int picamUnlockExposure(PicamContext *context) {
+    return unlockExposure(context);
+}
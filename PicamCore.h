@@ -0,0 +1,245 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_CORE_H
+#define _PICAM_CORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Configuration.h"
+#include "Defaults.h"
+#include "Export.h"
+#include "Jpeg.h"
+#include "Log.h"
+#include "Statistics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Public C interface to the camera, for use without a JVM.
+ *
+ * This is everything a C or C++ program needs to drive the camera, and is all that is exported by
+ * the picam-core library. The JNI library is a thin wrapper over the same functions.
+ *
+ * Typical use:
+ *
+ *   PicamContext *camera = picamInit();
+ *
+ *   PicamConfig config;
+ *   setConfigurationDefaults(&config);
+ *   config.camera.width  = 1920;
+ *   config.camera.height = 1080;
+ *
+ *   if (picamOpen(camera, &config)) {
+ *       const uint8_t *data;
+ *       size_t         length;
+ *       char *failure = picamCaptureToBuffer(camera, NULL, &data, &length);
+ *       ...
+ *       picamClose(camera);
+ *   }
+ *
+ *   picamRelease(camera);
+ *
+ * Only one context should be used at a time, and the functions for a context must not be called
+ * concurrently from different threads - except for picamCaptureShared, which coalesces captures
+ * requested concurrently, and picamStopTimelapse.
+ */
+typedef struct PicamContext PicamContext;
+
+/**
+ * Receives the encoded picture data as it is produced, on an MMAL thread.
+ *
+ * @param userdata user data passed when the capture was requested
+ * @param data picture data
+ * @param length length of the picture data
+ * @return number of bytes consumed, anything other than length stops delivery of the rest of the picture
+ */
+typedef uint32_t (*PictureDataCallback)(void *userdata, const uint8_t *data, uint32_t length);
+
+/**
+ * Maximum length of a sensor name, including the terminator - as reported by the camera info
+ * component.
+ */
+#define SENSOR_NAME_LENGTH 16
+
+/**
+ * The attached sensor and the sensor mode selected for it.
+ *
+ * A mode of zero means the firmware chooses the mode.
+ */
+typedef struct SensorInfo {
+    char     name[SENSOR_NAME_LENGTH];
+    uint32_t width;
+    uint32_t height;
+    uint32_t mode;
+    uint32_t modeWidth;
+    uint32_t modeHeight;
+    uint32_t binning;
+} SensorInfo;
+
+/**
+ * A region of interest.
+ *
+ * The position and size are normalised to the range 0.0 to 1.0 of the full picture. The target
+ * width and height are in pixels, zero means the region is not scaled.
+ */
+typedef struct Region {
+    double   x;
+    double   y;
+    double   w;
+    double   h;
+    uint32_t width;
+    uint32_t height;
+} Region;
+
+/**
+ * Receives the output for one region - either an encoded picture, or packed I420 pixel data.
+ *
+ * @return non-zero to continue with the next region; zero to stop
+ */
+typedef int (*RegionSink)(void *userdata, uint32_t index, const uint8_t *data, size_t length);
+
+/**
+ * Maximum number of exposures in a bracket.
+ */
+#define BRACKET_MAX_FRAMES 8
+
+/**
+ * Maximum number of frames stacked for a low-light capture.
+ */
+#define LOW_LIGHT_MAX_FRAMES 8
+
+/**
+ * Exposure settings for one frame of a bracket.
+ */
+typedef struct BracketSetting {
+    int32_t  exposureCompensation;
+    uint32_t shutterSpeed;
+} BracketSetting;
+
+/**
+ * Sensor-raw data extracted from a capture.
+ *
+ * The raw data is the Bayer mosaic, one 16-bit value per pixel with the bit depth of the sensor
+ * and the black level not subtracted. The demosaiced data, if requested, is interleaved 16-bit RGB
+ * at the same scale.
+ */
+typedef struct BayerFrame {
+    uint32_t        width;
+    uint32_t        height;
+    uint32_t        bitDepth;
+    uint32_t        bayerOrder;
+    uint32_t        blackLevel;
+    const uint16_t *raw;
+    const uint16_t *rgb;
+} BayerFrame;
+
+/**
+ * Receives the sensor-raw data.
+ */
+typedef void (*BayerSink)(void *userdata, const BayerFrame *frame);
+
+/**
+ * When, and how, to capture the frames of a timelapse.
+ *
+ * All times are in microseconds on the selected clock. The lead is the time before each deadline
+ * used to get the camera ready, so the capture can be triggered on the deadline itself.
+ */
+typedef struct TimelapseSchedule {
+    bool        realtime;
+    uint64_t    start;
+    uint64_t    period;
+    uint32_t    count;
+    uint32_t    lead;
+    bool        encode;
+    const char *directory;
+} TimelapseSchedule;
+
+/**
+ * A frame of a timelapse, or a slot that was skipped because the previous frame overran.
+ *
+ * When the frames are written to files, the data is NULL and the path is set instead.
+ */
+typedef struct TimelapseFrame {
+    uint32_t       index;
+    uint64_t       scheduledTime;
+    uint64_t       actualTime;
+    bool           skipped;
+    const uint8_t *data;
+    size_t         length;
+    const char    *path;
+} TimelapseFrame;
+
+/**
+ * Receives each timelapse frame, and each skipped slot.
+ *
+ * @return non-zero to continue the timelapse; zero to stop
+ */
+typedef int (*TimelapseSink)(void *userdata, const TimelapseFrame *frame);
+
+/**
+ * Provide the output pixels, or NULL if there is nowhere to put them.
+ */
+typedef uint32_t *(*RgbAcquire)(void *userdata, size_t count);
+
+/**
+ * Give back the output pixels, after the conversion.
+ */
+typedef void (*RgbRelease)(void *userdata, uint32_t *pixels);
+
+PICAM_EXPORT PicamContext *picamInit(void);
+PICAM_EXPORT void picamRelease(PicamContext *context);
+PICAM_EXPORT int picamOpen(PicamContext *context, const PicamConfig *config);
+PICAM_EXPORT void picamClose(PicamContext *context);
+PICAM_EXPORT char *picamCapture(PicamContext *context, const EncoderConfig *encoder, PictureDataCallback callback, void *userdata);
+PICAM_EXPORT char *picamCaptureShared(PicamContext *context, const EncoderConfig *encoder, PictureDataCallback callback, void *userdata, JpegInfo *info);
+PICAM_EXPORT char *picamCaptureToBuffer(PicamContext *context, const EncoderConfig *encoder, const uint8_t **data, size_t *length);
+PICAM_EXPORT char *picamCaptureRegions(PicamContext *context, const Region *regions, uint32_t count, bool encode, RegionSink sink, void *userdata);
+PICAM_EXPORT char *picamCaptureStereo(PicamContext *context, bool encode, bool interleave, RegionSink sink, void *userdata);
+PICAM_EXPORT char *picamCaptureBracket(PicamContext *context, const BracketSetting *settings, uint32_t count, uint32_t settle, bool fuse, bool encode, RegionSink sink, void *userdata);
+PICAM_EXPORT char *picamCaptureLowLight(PicamContext *context, uint32_t count, uint32_t shutterSpeed, bool median, bool align, bool encode, RegionSink sink, void *userdata);
+PICAM_EXPORT char *picamCaptureBayer(PicamContext *context, bool demosaic, BayerSink sink, void *userdata);
+PICAM_EXPORT char *picamCaptureRgb(PicamContext *context, uint32_t width, uint32_t height, RgbAcquire acquire, RgbRelease release, void *userdata);
+PICAM_EXPORT size_t picamFrameSize(uint32_t format, uint32_t width, uint32_t height, uint32_t stride);
+PICAM_EXPORT char *picamSubmitFrame(PicamContext *context, const EncoderConfig *encoder, uint32_t format, uint32_t width, uint32_t height, const uint8_t *data, uint32_t stride);
+PICAM_EXPORT char *picamReceiveFrame(PicamContext *context, const uint8_t **data, size_t *length);
+PICAM_EXPORT int picamStartRecording(PicamContext *context);
+PICAM_EXPORT void picamStopRecording(PicamContext *context);
+PICAM_EXPORT int picamFlushRecording(PicamContext *context, const char *path, uint32_t postRoll);
+PICAM_EXPORT char *picamTimelapse(PicamContext *context, const TimelapseSchedule *schedule, TimelapseSink sink, void *userdata);
+PICAM_EXPORT void picamStopTimelapse(PicamContext *context);
+PICAM_EXPORT int picamAnnotate(PicamContext *context, const char *text);
+PICAM_EXPORT const PicamStatistics *picamStatistics(PicamContext *context);
+PICAM_EXPORT void picamSensor(PicamContext *context, SensorInfo *sensor);
+PICAM_EXPORT void picamEncoderConfig(PicamContext *context, EncoderConfig *encoder);
+PICAM_EXPORT void picamPictureInfo(PicamContext *context, JpegInfo *info);
+PICAM_EXPORT int picamStartTrace(PicamContext *context, const char *path, bool payload);
+PICAM_EXPORT void picamStopTrace(PicamContext *context);
+PICAM_EXPORT int picamLockExposure(PicamContext *context);
+PICAM_EXPORT int picamUnlockExposure(PicamContext *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PICAM_CORE_H
@@ -0,0 +1,55 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include "Pipeline.h"
+
+#include "Camera.h"
+#include "Encoder.h"
+#include "RawCapture.h"
+#include "Recorder.h"
+
+/**
+ * Create the complete capture pipeline - the camera, the encoder, and the connection between them,
+ * and the video encoder if recording is active.
+ *
+ * The pipeline is created from the configuration already stored in the context, so this may be
+ * used both for the initial creation and for re-creating the pipeline after a failure.
+ *
+ * @param context global state
+ * @return non-zero on success; zero on error
+ */
+int createPipeline(PicamContext *context) {
+    context->pipelineReady = createCamera(context) && createEncoder(context) && (!context->recorder.active || createRecorderPipeline(context));
+    return context->pipelineReady;
+}
+
+/**
+ * Destroy the capture pipeline.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param context global state
+ */
+void destroyPipeline(PicamContext *context) {
+    context->pipelineReady = false;
+    destroyRawCapture(context);
+    destroyRecorderPipeline(context);
+    destroyEncoder(context);
+    destroyCamera (context);
+}
@@ -0,0 +1,266 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include "PipelineCache.h"
+#include "Camera.h"
+#include "Capture.h"
+#include "Encoder.h"
+#include "Log.h"
+#include "Pipeline.h"
+#include "Sensor.h"
+#include "Threads.h"
+
+static int takeParkedPipeline(PicamContext *context);
+static int compatibleConfiguration(PicamContext *context, const PicamConfig *config);
+static void *reaperThread(void *arg);
+
+/**
+ * Initialise the pipeline cache, once for the process.
+ *
+ * @param context global state
+ */
+void initPipelineCache(PicamContext *context) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    pthread_mutex_init(&context->cacheMutex, NULL);
+    pthread_cond_init(&context->cacheChanged, &attr);
+
+    pthread_condattr_destroy(&attr);
+}
+
+/**
+ * Park the pipeline when the camera is closed, rather than destroying it, so that the next camera
+ * to be opened can re-use it.
+ *
+ * The pipeline is only kept if keep-alive is configured, the pipeline is healthy, and it is not
+ * recording. A parked pipeline is destroyed if it is still idle when the keep-alive time expires,
+ * but the timer only starts with startCacheReaper - so the caller can finish releasing everything
+ * else first, without the pipeline being destroyed underneath it.
+ *
+ * @param context global state
+ * @return non-zero if the pipeline was parked; zero if the caller must destroy it
+ */
+int parkPipeline(PicamContext *context) {
+    uint32_t keepAlive = context->config.camera.keepAlive;
+
+    // Closed again while parked, the reaper may already have destroyed the pipeline
+    if (context->cacheReaperStarted) {
+        pthread_mutex_lock(&context->cacheMutex);
+        bool parked = context->pipelineParked;
+        pthread_mutex_unlock(&context->cacheMutex);
+
+        if (parked) {
+            return 1;
+        }
+
+        pthread_join(context->cacheReaper, NULL);
+        context->cacheReaperStarted = false;
+    }
+
+    if (!keepAlive || !context->pipelineReady || context->recoveryRequested || context->recorder.started) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&context->cacheMutex);
+    context->pipelineParked = true;
+    pthread_mutex_unlock(&context->cacheMutex);
+
+    return 1;
+}
+
+/**
+ * Start the keep-alive timer for a pipeline parked by parkPipeline.
+ *
+ * If the timer can not be started the pipeline is not kept, and is destroyed here.
+ *
+ * @param context global state
+ * @return non-zero if the pipeline is still parked; zero if it was destroyed
+ */
+int startCacheReaper(PicamContext *context) {
+    uint32_t keepAlive = context->config.camera.keepAlive;
+
+    if (context->cacheReaperStarted) {
+        return 1;
+    }
+
+    if (pthread_create(&context->cacheReaper, NULL, reaperThread, context)) {
+        logWarn("Failed to create pipeline cache thread, not keeping pipeline");
+
+        pthread_mutex_lock(&context->cacheMutex);
+        context->pipelineParked = false;
+        pthread_mutex_unlock(&context->cacheMutex);
+
+        destroyPipeline(context);
+        return 0;
+    }
+
+    context->cacheReaperStarted = true;
+
+    logDebug("Pipeline parked for up to %ums", keepAlive);
+
+    return 1;
+}
+
+/**
+ * Re-attach to a parked pipeline when the camera is opened.
+ *
+ * The parked pipeline is re-used only if the new configuration is compatible with it - the same
+ * camera, sensor mode, size and stereoscopic mode - in which case only the parameters that differ
+ * are applied, and the encoder for the configured encoding is selected. Otherwise the parked
+ * pipeline is destroyed.
+ *
+ * The configuration in the context is replaced only if the pipeline was re-used.
+ *
+ * @param context global state
+ * @param config configuration for the camera being opened
+ * @return non-zero if the pipeline was re-used; zero if the caller must create a new pipeline
+ */
+int reattachPipeline(PicamContext *context, const PicamConfig *config) {
+    if (!takeParkedPipeline(context)) {
+        return 0;
+    }
+
+    if (context->recoveryRequested || !compatibleConfiguration(context, config)) {
+        logDebug("Parked pipeline can not be re-used, re-creating");
+        destroyPipeline(context);
+        return 0;
+    }
+
+    PicamConfig previous = context->config;
+
+    pthread_mutex_lock(&context->configMutex);
+    context->config = *config;
+    pthread_mutex_unlock(&context->configMutex);
+
+    if (!updateCameraConfiguration(context, &previous) || !updateEncoderConfiguration(context, &previous)) {
+        logWarn("Failed to update parked pipeline, re-creating");
+        destroyPipeline(context);
+        return 0;
+    }
+
+    resetCaptureTracker(context);
+
+    return 1;
+}
+
+/**
+ * Destroy any parked pipeline, used when the library is unloaded.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param context global state
+ */
+void releasePipelineCache(PicamContext *context) {
+    if (takeParkedPipeline(context)) {
+        destroyPipeline(context);
+    }
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Take ownership of the parked pipeline, if there is one, stopping the reaper thread.
+ *
+ * @param context global state
+ * @return non-zero if a parked pipeline was taken; zero if there was none
+ */
+static int takeParkedPipeline(PicamContext *context) {
+    if (!context->cacheReaperStarted) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&context->cacheMutex);
+    bool parked = context->pipelineParked;
+    context->pipelineParked = false;
+    pthread_cond_broadcast(&context->cacheChanged);
+    pthread_mutex_unlock(&context->cacheMutex);
+
+    pthread_join(context->cacheReaper, NULL);
+    context->cacheReaperStarted = false;
+
+    return parked;
+}
+
+/**
+ * Check whether a configuration can be applied to the parked pipeline without re-creating it.
+ *
+ * @param context global state, holding the configuration of the parked pipeline
+ * @param config new configuration
+ * @return non-zero if compatible; zero if not
+ */
+static int compatibleConfiguration(PicamContext *context, const PicamConfig *config) {
+    const PicamConfig *current = &context->config;
+
+    return
+        config->camera.cameraNumber      == current->camera.cameraNumber      &&
+        config->camera.width             == current->camera.width             &&
+        config->camera.height            == current->camera.height            &&
+        config->capture.stereoscopicMode == current->capture.stereoscopicMode &&
+        config->capture.decimate         == current->capture.decimate         &&
+        config->capture.swapEyes         == current->capture.swapEyes         &&
+        sensorModeFor(context, config)   == context->sensor.mode;
+}
+
+/**
+ * Pipeline cache reaper thread, destroys the parked pipeline if it is not re-used in time.
+ *
+ * @param arg global state
+ * @return NULL
+ */
+static void *reaperThread(void *arg) {
+    PicamContext *context = (PicamContext *) arg;
+
+    beginOwnedThread(context, OWNED_THREAD_CACHE_REAPER);
+
+    uint32_t keepAlive = context->config.camera.keepAlive;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec  += keepAlive / 1000;
+    deadline.tv_nsec += (keepAlive % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&context->cacheMutex);
+
+    while (context->pipelineParked) {
+        if (pthread_cond_timedwait(&context->cacheChanged, &context->cacheMutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    if (context->pipelineParked) {
+        destroyPipeline(context);
+        context->pipelineParked = false;
+        logInfo("Parked pipeline destroyed after %ums idle", keepAlive);
+    }
+
+    pthread_mutex_unlock(&context->cacheMutex);
+
+    endOwnedThread(context, OWNED_THREAD_CACHE_REAPER);
+
+    return NULL;
+}
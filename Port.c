@@ -18,21 +18,22 @@
  */
 
 #include <stdbool.h>
+#include <string.h>
 
 #include "Port.h"
 
 #include "interface/mmal/util/mmal_util_params.h"
 
-int setCameraConfig(MMAL_PORT_T *port, uint32_t width, uint32_t height) {
-    // Preview configuration must be set to something reasonable, even though preview is not used
+int setCameraConfig(MMAL_PORT_T *port, uint32_t width, uint32_t height, uint32_t videoWidth, uint32_t videoHeight) {
+    // Preview configuration must be set to something reasonable, even if preview/video is not used
     MMAL_PARAMETER_CAMERA_CONFIG_T param = {
         {MMAL_PARAMETER_CAMERA_CONFIG, sizeof(param)},
         .max_stills_w                          = width,
         .max_stills_h                          = height,
         .stills_yuv422                         = 0,
         .one_shot_stills                       = 1,
-        .max_preview_video_w                   = 320,
-        .max_preview_video_h                   = 240,
+        .max_preview_video_w                   = videoWidth,
+        .max_preview_video_h                   = videoHeight,
         .num_preview_video_frames              = 3,
         .stills_capture_circular_buffer_height = 0,
         .fast_preview_resume                   = 0,
@@ -113,6 +114,11 @@ int setCrop(MMAL_PORT_T *port, double x, double y, double w, double h) {
    return mmal_port_parameter_set(port, &param.hdr) == MMAL_SUCCESS ? 1 : 0;
 }
 
+int requestParameterChanges(MMAL_PORT_T *port, uint32_t id, bool enable) {
+    MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T param = {{MMAL_PARAMETER_CHANGE_EVENT_REQUEST, sizeof(param)}, id, enable ? 1 : 0};
+    return mmal_port_parameter_set(port, &param.hdr) == MMAL_SUCCESS ? 1 : 0;
+}
+
 int setFpsRange(MMAL_PORT_T *port, uint32_t shutterSpeed) {
     MMAL_PARAMETER_FPS_RANGE_T param = {{MMAL_PARAMETER_FPS_RANGE, sizeof(param)}};
     if (shutterSpeed > 6000000) {
@@ -128,3 +134,34 @@ int setFpsRange(MMAL_PORT_T *port, uint32_t shutterSpeed) {
     }
     return mmal_port_parameter_set(port, &param.hdr) == MMAL_SUCCESS ? 1 : 0;
 }
+
+static void rgbToYuv(int32_t rgb, uint8_t *y, uint8_t *u, uint8_t *v) {
+    // BT.601 full-range, the firmware takes annotation colours as YUV
+    int r = (rgb >> 16) & 0xff;
+    int g = (rgb >>  8) & 0xff;
+    int b =  rgb        & 0xff;
+    *y = (  77 * r + 150 * g +  29 * b) >> 8;
+    *u = ((-43 * r -  85 * g + 128 * b) >> 8) + 128;
+    *v = ((128 * r - 107 * g -  21 * b) >> 8) + 128;
+}
+
+int setAnnotation(MMAL_PORT_T *port, const AnnotationConfig *annotation, const char *text) {
+    MMAL_PARAMETER_CAMERA_ANNOTATE_V4_T param = {{MMAL_PARAMETER_ANNOTATE, sizeof(param)}};
+    param.enable         = text[0] != '\0' || annotation->showFrameNumber;
+    param.show_frame_num = annotation->showFrameNumber;
+    param.text_size      = annotation->textSize;
+    param.justify        = annotation->justify;
+    param.x_offset       = annotation->x;
+    param.y_offset       = annotation->y;
+    if (annotation->textColour >= 0) {
+        param.custom_text_colour = MMAL_TRUE;
+        rgbToYuv(annotation->textColour, &param.custom_text_Y, &param.custom_text_U, &param.custom_text_V);
+    }
+    if (annotation->backgroundColour >= 0) {
+        param.enable_text_background   = MMAL_TRUE;
+        param.custom_background_colour = MMAL_TRUE;
+        rgbToYuv(annotation->backgroundColour, &param.custom_background_Y, &param.custom_background_U, &param.custom_background_V);
+    }
+    strncpy(param.text, text, MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3 - 1);
+    return mmal_port_parameter_set(port, &param.hdr) == MMAL_SUCCESS ? 1 : 0;
+}
@@ -20,9 +20,11 @@
 #ifndef _PICAM_PORT_H
 #define _PICAM_PORT_H
 
+#include "Configuration.h"
+
 #include "interface/mmal/mmal_port.h"
 
-int setCameraConfig(MMAL_PORT_T *port, uint32_t width, uint32_t height);
+int setCameraConfig(MMAL_PORT_T *port, uint32_t width, uint32_t height, uint32_t videoWidth, uint32_t videoHeight);
 int setStereoscopicMode(MMAL_PORT_T *port, int value, bool decimate, bool swapEyes);
 int setRational(MMAL_PORT_T *port, int id, int32_t num, int32_t den);
 int setBoolean(MMAL_PORT_T *port, int id, bool value);
@@ -37,6 +39,8 @@ int setImageEffect(MMAL_PORT_T *port, int value);
 int setColourEffect(MMAL_PORT_T *port, int value, int u, int v);
 int setMirror(MMAL_PORT_T *port, int value);
 int setCrop(MMAL_PORT_T *port, double x, double y, double w, double h);
+int requestParameterChanges(MMAL_PORT_T *port, uint32_t id, bool enable);
 int setFpsRange(MMAL_PORT_T *port, uint32_t shutterSpeed);
+int setAnnotation(MMAL_PORT_T *port, const AnnotationConfig *annotation, const char *text);
 
 #endif // _PICAM_PORT_H
\ No newline at end of file
@@ -0,0 +1,84 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_PROBES_H
+#define _PICAM_PROBES_H
+
+/**
+ * Static tracepoints (USDT probes) on the capture path, for perf and bpftrace, see the scripts in
+ * the bpftrace directory.
+ *
+ * A probe compiles to a single no-op instruction plus a note in the ELF file, so the cost when no
+ * tracer is attached is negligible. Probes are compiled in whenever <sys/sdt.h> is available
+ * (systemtap-sdt-dev on Debian), define PICAM_NO_PROBES to leave them out.
+ *
+ * All probes belong to the "picam" provider:
+ *
+ *   create__begin(component)             camera or encoder creation starts
+ *   create__phase(component, phase)      creation step completed, phase is a string
+ *   create__end(component, result)       creation finished, result non-zero on success
+ *   destroy__begin(component)            camera or encoder destruction starts
+ *   destroy__end(component)              destruction finished
+ *   capture__trigger(generation, encoding)
+ *                                        capture triggered on the camera
+ *   capture__end(generation, failed, bytes)
+ *                                        capture finished, failed non-zero on failure
+ *   buffer__entry(length, flags, pts)    encoder buffer callback entered
+ *   buffer__exit(generation, finished)   encoder buffer callback returning, generation zero if the
+ *                                        buffer was discarded
+ *   upcall__start(length)                picture data about to be delivered during the capture, to
+ *                                        the picamCapture callback or collected natively for a
+ *                                        shared capture
+ *   upcall__end(length, written)         delivery returned
+ *   deferred__begin(length)              natively collected picture about to be handed to the
+ *                                        application, on the requesting thread after the capture
+ *                                        (picamCaptureShared)
+ *   deferred__end(length, written)       application has taken the picture, or stopped early
+ *   jni__upcall__start(length)           Java picture handler about to be called
+ *   jni__upcall__end(length, written)    Java picture handler returned
+ *   jni__attach()                        native thread attached to the JVM
+ *   wait__begin(generation, timeout)     capture thread starts waiting for its frame
+ *   wait__end(generation, result)        capture thread woken, result as WaitResult
+ *   wait__post(generation)               frame completion signalled to waiting captures, zero for
+ *                                        an error
+ *   control__event(cmd, status)          camera control port event
+ *
+ * Component and phase arguments are string pointers, use str() in bpftrace.
+ */
+
+#if !defined(PICAM_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PICAM_PROBES 1
+#endif
+#endif
+
+#ifdef PICAM_PROBES
+#define probe(name)                DTRACE_PROBE(picam, name)
+#define probe1(name, a)            DTRACE_PROBE1(picam, name, a)
+#define probe2(name, a, b)         DTRACE_PROBE2(picam, name, a, b)
+#define probe3(name, a, b, c)      DTRACE_PROBE3(picam, name, a, b, c)
+#else
+#define probe(name)                do { } while (0)
+#define probe1(name, a)            do { } while (0)
+#define probe2(name, a, b)         do { } while (0)
+#define probe3(name, a, b, c)      do { } while (0)
+#endif
+
+#endif // _PICAM_PROBES_H
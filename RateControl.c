@@ -0,0 +1,174 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <math.h>
+
+#include "Log.h"
+#include "RateControl.h"
+
+/**
+ * Slope of log(size) against quality, used until the captures seen so far give a better estimate.
+ *
+ * This is typical for the hardware encoder in the useful range of qualities, where the size roughly
+ * doubles from quality 75 to 90.
+ */
+#define DEFAULT_SLOPE 0.045
+
+/**
+ * Limits for a fitted slope, anything outside these is noise from scene changes.
+ */
+#define MINIMUM_SLOPE 0.01
+#define MAXIMUM_SLOPE 0.15
+
+/**
+ * Minimum spread of quality in the remembered captures, as a sum of squared deviations, before a
+ * slope is fitted rather than assumed.
+ */
+#define MINIMUM_SPREAD 8.0
+
+/**
+ * Difference between the log of the predicted and actual size of a capture that is taken to be a
+ * change of scene, about 25%.
+ */
+#define SCENE_CHANGE 0.22
+
+static uint32_t clampQuality(const EncoderConfig *encoder, double quality);
+
+/**
+ * Forget the captures seen so far, used when the camera is opened since the size of a picture
+ * depends on the resolution and the scene.
+ *
+ * @param context global state
+ */
+void resetRateControl(PicamContext *context) {
+    context->rateControl.next      = 0;
+    context->rateControl.count     = 0;
+    context->rateControl.slope     = DEFAULT_SLOPE;
+    context->rateControl.predicted = false;
+}
+
+/**
+ * Choose the JPEG quality for the next capture, to land the encoded size just under the target.
+ *
+ * The encoded size is modelled as log(size) = a + b * quality. The slope b is fitted by least
+ * squares to the remembered captures - if they are all at much the same quality, as they are once
+ * rate control has settled, the last fitted slope is kept (or one is assumed, if there is none
+ * yet). The intercept a is anchored on the most recent capture alone, so a change of scene is
+ * followed from the very next capture. The first capture uses the configured quality.
+ *
+ * @param context global state
+ * @param encoder encoder configuration, with a non-zero target size
+ * @return quality
+ */
+uint32_t chooseQuality(PicamContext *context, const EncoderConfig *encoder) {
+    RateControl *rate = &context->rateControl;
+
+    if (rate->count == 0) {
+        return clampQuality(encoder, encoder->quality);
+    }
+
+    double meanQuality = 0.0;
+    double meanSize    = 0.0;
+    for (uint32_t i = 0; i < rate->count; i++) {
+        meanQuality += rate->quality[i];
+        meanSize    += log(rate->size[i]);
+    }
+    meanQuality /= rate->count;
+    meanSize    /= rate->count;
+
+    double spread     = 0.0;
+    double covariance = 0.0;
+    for (uint32_t i = 0; i < rate->count; i++) {
+        double dq = rate->quality[i] - meanQuality;
+        spread     += dq * dq;
+        covariance += dq * (log(rate->size[i]) - meanSize);
+    }
+
+    if (spread >= MINIMUM_SPREAD) {
+        rate->slope = fmin(fmax(covariance / spread, MINIMUM_SLOPE), MAXIMUM_SLOPE);
+    }
+
+    double   slope     = rate->slope;
+    uint32_t last      = (rate->next + RATE_CONTROL_SAMPLES - 1) % RATE_CONTROL_SAMPLES;
+    double   intercept = log(rate->size[last]) - slope * rate->quality[last];
+
+    rate->intercept = intercept;
+    rate->predicted = true;
+
+    // Round down, it is better to land a little under the target than over it
+    uint32_t quality = clampQuality(encoder, floor((log(encoder->targetSize) - intercept) / slope));
+
+    logTrace("Rate control chose quality %u for target %u bytes, slope %.4f", quality, encoder->targetSize, slope);
+
+    return quality;
+}
+
+/**
+ * Remember the encoded size of a JPEG capture made with rate control.
+ *
+ * If the size is well off the size the model predicted, the scene has changed, and the captures of
+ * the old scene are forgotten - fitting a slope across two scenes would mistake the change of scene
+ * for the effect of quality.
+ *
+ * @param context global state
+ * @param encoder encoder configuration used for the capture
+ * @param quality quality used for the capture
+ * @param size encoded size in bytes
+ */
+void recordQuality(PicamContext *context, const EncoderConfig *encoder, uint32_t quality, uint32_t size) {
+    RateControl *rate = &context->rateControl;
+
+    if (size == 0) {
+        return;
+    }
+
+    if (rate->predicted && fabs(log(size) - (rate->intercept + rate->slope * quality)) > SCENE_CHANGE) {
+        logDebug("Rate control saw a change of scene, %u bytes at quality %u", size, quality);
+        rate->next  = 0;
+        rate->count = 0;
+    }
+    rate->predicted = false;
+
+    rate->quality[rate->next] = quality;
+    rate->size   [rate->next] = size;
+    rate->next = (rate->next + 1) % RATE_CONTROL_SAMPLES;
+    if (rate->count < RATE_CONTROL_SAMPLES) {
+        rate->count++;
+    }
+
+    context->stats.lastQuality = quality;
+    if (size > encoder->targetSize) {
+        context->stats.targetOverruns++;
+    }
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Clamp a quality to the configured limits, and to the range the encoder accepts.
+ *
+ * @param encoder encoder configuration
+ * @param quality quality
+ * @return clamped quality
+ */
+static uint32_t clampQuality(const EncoderConfig *encoder, double quality) {
+    double minimum = encoder->minimumQuality ? encoder->minimumQuality : 1;
+    double maximum = encoder->maximumQuality ? encoder->maximumQuality : 100;
+    return (uint32_t) fmin(fmax(quality, fmax(minimum, 1)), fmin(maximum, 100));
+}
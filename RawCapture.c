@@ -0,0 +1,234 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <string.h>
+
+#include "RawCapture.h"
+#include "Camera.h"
+#include "Capture.h"
+#include "Encoder.h"
+#include "Log.h"
+#include "Threads.h"
+
+#include "interface/mmal/util/mmal_util.h"
+
+#define ALIGN_WIDTH  32
+#define ALIGN_HEIGHT 16
+
+static int enableRawCapture(PicamContext *context);
+static void disableRawCapture(PicamContext *context);
+static void rawBufferCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
+
+/**
+ * Switch the output of the camera capture port.
+ *
+ * In encoded mode (the default) the capture port is tunnelled to the image encoder. In raw mode
+ * the tunnel is removed and the uncompressed I420 picture is copied into the raw frame in the
+ * context instead, from where it can be processed on the host.
+ *
+ * The pipeline lock must be held.
+ *
+ * @param context global state
+ * @param mode OUTPUT_ENCODED or OUTPUT_RAW
+ * @return non-zero on success; zero on error
+ */
+int setOutputMode(PicamContext *context, int mode) {
+    if (context->outputMode == mode) {
+        return 1;
+    }
+
+    if (mode == OUTPUT_RAW) {
+        if (context->cameraEncoderConnection) {
+            mmal_connection_destroy(context->cameraEncoderConnection);
+            context->cameraEncoderConnection = NULL;
+        }
+
+        if (!enableRawCapture(context)) {
+            logError("Failed to switch camera to raw output");
+            disableRawCapture(context);
+            return 0;
+        }
+    } else {
+        disableRawCapture(context);
+
+        if (!setCapturePortFormat(context, MMAL_ENCODING_OPAQUE) || !connectCameraToEncoder(context)) {
+            logError("Failed to switch camera to encoded output");
+            return 0;
+        }
+    }
+
+    context->outputMode = mode;
+
+    logDebug("Camera output mode is now %s", mode == OUTPUT_RAW ? "raw" : "encoded");
+
+    return 1;
+}
+
+/**
+ * Destroy the raw capture resources, leaving the output mode as encoded.
+ *
+ * This is part of destroying the pipeline, the raw frame memory itself is kept for re-use.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param context global state
+ */
+void destroyRawCapture(PicamContext *context) {
+    disableRawCapture(context);
+    context->outputMode = OUTPUT_ENCODED;
+}
+
+/**
+ * Check whether the last raw capture delivered a complete frame.
+ *
+ * @param context global state
+ * @return non-zero if the raw frame is complete; zero if it is not
+ */
+int rawFrameComplete(PicamContext *context) {
+    return context->rawFrame.data && context->bytesDelivered >= imageSize(&context->rawFrame);
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Set the capture port to I420, and enable it with buffers delivered to the host.
+ *
+ * @param context global state
+ * @return non-zero on success; zero on error
+ */
+static int enableRawCapture(PicamContext *context) {
+    MMAL_PORT_T *capturePort = context->cameraComponent->output[MMAL_CAMERA_CAPTURE_PORT];
+
+    if (!setCapturePortFormat(context, MMAL_ENCODING_I420)) {
+        return 0;
+    }
+
+    capturePort->buffer_size = vcos_max(capturePort->buffer_size_recommended, capturePort->buffer_size_min);
+    capturePort->buffer_num  = vcos_max(capturePort->buffer_num_recommended , capturePort->buffer_num_min );
+
+    context->rawPool = mmal_port_pool_create(capturePort, capturePort->buffer_num, capturePort->buffer_size);
+    if (!context->rawPool) {
+        return 0;
+    }
+
+    uint32_t width  = context->config.camera.width;
+    uint32_t height = context->config.camera.height;
+
+    if (!allocateImage(&context->rawFrame, width, height, VCOS_ALIGN_UP(width, ALIGN_WIDTH), VCOS_ALIGN_UP(height, ALIGN_HEIGHT))) {
+        return 0;
+    }
+
+    capturePort->userdata = (struct MMAL_PORT_USERDATA_T *) context;
+
+    if (MMAL_SUCCESS != mmal_port_enable(capturePort, rawBufferCallback)) {
+        return 0;
+    }
+
+    MMAL_BUFFER_HEADER_T *buffer;
+    while ((buffer = mmal_queue_get(context->rawPool->queue))) {
+        if (MMAL_SUCCESS != mmal_port_send_buffer(capturePort, buffer)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Disable the capture port and destroy the raw buffer pool.
+ *
+ * @param context global state
+ */
+static void disableRawCapture(PicamContext *context) {
+    if (!context->cameraComponent) {
+        return;
+    }
+
+    MMAL_PORT_T *capturePort = context->cameraComponent->output[MMAL_CAMERA_CAPTURE_PORT];
+
+    if (context->rawPool) {
+        if (capturePort->is_enabled) {
+            mmal_port_disable(capturePort);
+        }
+
+        mmal_port_pool_destroy(capturePort, context->rawPool);
+        context->rawPool = NULL;
+    }
+}
+
+/**
+ * Raw capture buffer callback.
+ *
+ * The buffers for a frame are copied, in order, into the raw frame - bytesDelivered is used as the
+ * offset of the next buffer. Buffers are matched to capture generations exactly as they are for
+ * the encoder.
+ *
+ * @param port
+ * @param buffer
+ */
+static void rawBufferCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    bool frameEnd = buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED);
+    uint32_t generation = 0;
+
+    PicamContext *context = (PicamContext *) port->userdata;
+
+    uint64_t cpuStart = enterCallbackThread(context);
+
+    if (buffer->length || frameEnd) {
+        bool current;
+        generation = bufferGeneration(context, &current);
+
+        if (current) {
+            if (buffer->length) {
+                Image *frame = &context->rawFrame;
+
+                uint32_t offset = context->bytesDelivered;
+                uint32_t length = buffer->length;
+                if (offset + length > frame->capacity) {
+                    length = offset < frame->capacity ? frame->capacity - offset : 0;
+                }
+
+                mmal_buffer_header_mem_lock(buffer);
+                memcpy(frame->data + offset, buffer->data + buffer->offset, length);
+                mmal_buffer_header_mem_unlock(buffer);
+
+                context->bytesDelivered += length;
+            }
+        } else if (buffer->length) {
+            context->stats.discardedBuffers++;
+        }
+
+        bufferDone(context);
+    }
+
+    mmal_buffer_header_release(buffer);
+
+    if (port->is_enabled && context->rawPool) {
+        MMAL_BUFFER_HEADER_T *nextBuffer = mmal_queue_get(context->rawPool->queue);
+        if (nextBuffer) {
+            mmal_port_send_buffer(port, nextBuffer);
+        }
+    }
+
+    if (frameEnd) {
+        finishGeneration(context, generation, true);
+    }
+
+    leaveCallbackThread(context, cpuStart);
+}
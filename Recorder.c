@@ -0,0 +1,494 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Recorder.h"
+#include "Capture.h"
+#include "Log.h"
+#include "Pipeline.h"
+#include "Port.h"
+#include "RecordingBuffer.h"
+#include "Recovery.h"
+#include "Threads.h"
+
+#include "interface/mmal/util/mmal_default_components.h"
+#include "interface/mmal/util/mmal_util.h"
+#include "interface/mmal/util/mmal_util_params.h"
+
+#define ALIGN_WIDTH  32
+#define ALIGN_HEIGHT 16
+
+/**
+ * Maximum amount of data the writer thread copies out of the buffer in one go.
+ */
+#define WRITE_BATCH_SIZE (1024 * 1024)
+
+static void reconfigurePipeline(PicamContext *context);
+static int writeFully(int fd, const uint8_t *data, size_t length);
+static void *writerThread(void *arg);
+static void recorderBufferCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
+
+/**
+ * Start recording.
+ *
+ * The camera video port is connected to a hardware H.264 encoder, and the encoded stream is kept in
+ * a fixed-size circular buffer in native memory - at least the configured pre-roll time is kept,
+ * always starting on a keyframe. Nothing is written anywhere until flushRecorder is invoked.
+ *
+ * The pipeline is re-created, since the camera must be reconfigured to allow for the video size.
+ *
+ * @param context global state
+ * @return non-zero on success; zero on error
+ */
+int startRecorder(PicamContext *context) {
+    Recorder *recorder = &context->recorder;
+
+    if (recorder->started) {
+        return 1;
+    }
+
+    recorder->capacity = context->config.recording.bufferSize;
+    recorder->data     = malloc(recorder->capacity);
+    if (!recorder->data) {
+        logError("Failed to allocate %u byte recording buffer", recorder->capacity);
+        return 0;
+    }
+
+    pthread_mutex_init(&recorder->mutex, NULL);
+    pthread_cond_init(&recorder->changed, NULL);
+
+    recorder->firstChunk    = 0;
+    recorder->chunkCount    = 0;
+    recorder->keyframeHead  = 0;
+    recorder->keyframeCount = 0;
+    recorder->frameStart    = true;
+    recorder->afterConfig   = false;
+    recorder->fd            = -1;
+    recorder->stopping      = false;
+
+    if (pthread_create(&recorder->writerThread, NULL, writerThread, context)) {
+        logError("Failed to create recording writer thread");
+        pthread_cond_destroy(&recorder->changed);
+        pthread_mutex_destroy(&recorder->mutex);
+        free(recorder->data);
+        recorder->data = NULL;
+        return 0;
+    }
+
+    recorder->started = true;
+    recorder->active  = true;
+
+    reconfigurePipeline(context);
+
+    if (!context->pipelineReady) {
+        logError("Failed to create recording pipeline");
+        stopRecorder(context);
+        return 0;
+    }
+
+    logInfo("Recording started, %ux%u at %u fps, %ums pre-roll", context->config.recording.width, context->config.recording.height, context->config.recording.frameRate, context->config.recording.preRoll);
+
+    return 1;
+}
+
+/**
+ * Stop recording.
+ *
+ * A flush in progress is cut short, whatever was already written remains in the file.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param context global state
+ */
+void stopRecorder(PicamContext *context) {
+    Recorder *recorder = &context->recorder;
+
+    if (!recorder->started) {
+        return;
+    }
+
+    recorder->active = false;
+
+    // If the camera is being closed the pipeline is already gone, so there is nothing to reconfigure
+    if (context->recoveryStarted) {
+        reconfigurePipeline(context);
+    }
+
+    pthread_mutex_lock(&recorder->mutex);
+    recorder->stopping = true;
+    pthread_cond_broadcast(&recorder->changed);
+    pthread_mutex_unlock(&recorder->mutex);
+
+    pthread_join(recorder->writerThread, NULL);
+
+    pthread_cond_destroy(&recorder->changed);
+    pthread_mutex_destroy(&recorder->mutex);
+
+    free(recorder->data);
+    recorder->data = NULL;
+
+    freeBytes(&recorder->header);
+
+    recorder->started = false;
+
+    logInfo("Recording stopped");
+}
+
+/**
+ * Write the pre-roll, followed by the live stream for the post-roll time, to a file.
+ *
+ * This returns immediately, the file is written by the recording writer thread and is closed when
+ * the post-roll time has elapsed. The file contains a raw H.264 elementary stream starting with a
+ * keyframe.
+ *
+ * @param context global state
+ * @param path file path
+ * @param postRoll time to continue writing the live stream, in milliseconds
+ * @return non-zero on success; zero on error, or if a flush is already in progress
+ */
+int flushRecorder(PicamContext *context, const char *path, uint32_t postRoll) {
+    Recorder *recorder = &context->recorder;
+
+    if (!recorder->started) {
+        return 0;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        logError("Failed to open recording file %s: %s", path, strerror(errno));
+        return 0;
+    }
+
+    pthread_mutex_lock(&recorder->mutex);
+
+    if (recorder->fd >= 0) {
+        pthread_mutex_unlock(&recorder->mutex);
+        close(fd);
+        logWarn("Recording flush to %s ignored, a flush is already in progress", path);
+        return 0;
+    }
+
+    recorder->fd           = fd;
+    recorder->cursor       = recorder->firstChunk;
+    recorder->flushEnd     = vcos_getmicrosecs64() + (uint64_t) postRoll * 1000;
+    recorder->flushStarted = false;
+
+    pthread_cond_broadcast(&recorder->changed);
+
+    pthread_mutex_unlock(&recorder->mutex);
+
+    logInfo("Recording flush to %s started", path);
+
+    return 1;
+}
+
+/**
+ * Create the recording part of the pipeline - the video encoder, connected to the camera video port.
+ *
+ * @param context global state
+ * @return non-zero on success; zero on error
+ */
+int createRecorderPipeline(PicamContext *context) {
+    Recorder        *recorder = &context->recorder;
+    RecordingConfig *config   = &context->config.recording;
+
+    MMAL_PORT_T *cameraVideoPort = context->cameraComponent->output[MMAL_CAMERA_VIDEO_PORT];
+
+    cameraVideoPort->format->encoding                 = MMAL_ENCODING_OPAQUE;
+    cameraVideoPort->format->es->video.width          = VCOS_ALIGN_UP(config->width, ALIGN_WIDTH);
+    cameraVideoPort->format->es->video.height         = VCOS_ALIGN_UP(config->height, ALIGN_HEIGHT);
+    cameraVideoPort->format->es->video.crop.x         = 0;
+    cameraVideoPort->format->es->video.crop.y         = 0;
+    cameraVideoPort->format->es->video.crop.width     = config->width;
+    cameraVideoPort->format->es->video.crop.height    = config->height;
+    cameraVideoPort->format->es->video.frame_rate.num = config->frameRate;
+    cameraVideoPort->format->es->video.frame_rate.den = 1;
+
+    if (MMAL_SUCCESS != mmal_port_format_commit(cameraVideoPort)) {
+        logError("Failed to set camera video port format");
+        return 0;
+    }
+
+    if (MMAL_SUCCESS != mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER, &recorder->encoderComponent)) {
+        logError("Failed to create video encoder component");
+        return 0;
+    }
+
+    MMAL_PORT_T *encoderInputPort  = recorder->encoderComponent->input [0];
+    MMAL_PORT_T *encoderOutputPort = recorder->encoderComponent->output[0];
+
+    mmal_format_copy(encoderOutputPort->format, encoderInputPort->format);
+
+    encoderOutputPort->format->encoding                 = MMAL_ENCODING_H264;
+    encoderOutputPort->format->bitrate                  = config->bitrate;
+    encoderOutputPort->format->es->video.frame_rate.num = 0;
+    encoderOutputPort->format->es->video.frame_rate.den = 1;
+
+    encoderOutputPort->buffer_size = vcos_max(encoderOutputPort->buffer_size_recommended, encoderOutputPort->buffer_size_min);
+    encoderOutputPort->buffer_num  = vcos_max(encoderOutputPort->buffer_num_recommended , encoderOutputPort->buffer_num_min );
+
+    if (MMAL_SUCCESS != mmal_port_format_commit(encoderOutputPort)) {
+        logError("Failed to set video encoder output port format");
+        return 0;
+    }
+
+    // Headers are repeated before every keyframe, so a flush can start at any keyframe
+    if (!setUInt32(encoderOutputPort, MMAL_PARAMETER_INTRAPERIOD, config->intraPeriod) || !setBoolean(encoderOutputPort, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER, true)) {
+        logError("Failed to set video encoder parameters");
+        return 0;
+    }
+
+    if (MMAL_SUCCESS != mmal_component_enable(recorder->encoderComponent)) {
+        logError("Failed to enable video encoder component");
+        return 0;
+    }
+
+    recorder->pool = mmal_port_pool_create(encoderOutputPort, encoderOutputPort->buffer_num, encoderOutputPort->buffer_size);
+    if (!recorder->pool) {
+        logError("Failed to create video encoder pool");
+        return 0;
+    }
+
+    if (MMAL_SUCCESS != mmal_connection_create(&recorder->connection, cameraVideoPort, encoderInputPort, MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT) ||
+        MMAL_SUCCESS != mmal_connection_enable(recorder->connection)) {
+        logError("Failed to connect camera to video encoder");
+        return 0;
+    }
+
+    encoderOutputPort->userdata = (struct MMAL_PORT_USERDATA_T *) context;
+
+    if (MMAL_SUCCESS != mmal_port_enable(encoderOutputPort, recorderBufferCallback)) {
+        logError("Failed to enable video encoder output port");
+        return 0;
+    }
+
+    MMAL_BUFFER_HEADER_T *buffer;
+    while ((buffer = mmal_queue_get(recorder->pool->queue))) {
+        if (MMAL_SUCCESS != mmal_port_send_buffer(encoderOutputPort, buffer)) {
+            logError("Failed to send buffers to video encoder");
+            return 0;
+        }
+    }
+
+    if (!setBoolean(cameraVideoPort, MMAL_PARAMETER_CAPTURE, true)) {
+        logError("Failed to start video capture");
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Destroy the recording part of the pipeline.
+ *
+ * The recording buffer is kept, so a recording continues (after a gap) when the pipeline is
+ * re-created by a recovery.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param context global state
+ */
+void destroyRecorderPipeline(PicamContext *context) {
+    Recorder *recorder = &context->recorder;
+
+    if (recorder->connection) {
+        mmal_connection_destroy(recorder->connection);
+        recorder->connection = NULL;
+    }
+
+    if (recorder->encoderComponent) {
+        MMAL_PORT_T *encoderOutputPort = recorder->encoderComponent->output[0];
+        if (encoderOutputPort->is_enabled) {
+            mmal_port_disable(encoderOutputPort);
+        }
+
+        mmal_component_disable(recorder->encoderComponent);
+
+        if (recorder->pool) {
+            mmal_port_pool_destroy(encoderOutputPort, recorder->pool);
+            recorder->pool = NULL;
+        }
+
+        mmal_component_destroy(recorder->encoderComponent);
+        recorder->encoderComponent = NULL;
+    }
+
+    if (recorder->started) {
+        // Whatever arrives next after a re-creation is the start of a new stream
+        pthread_mutex_lock(&recorder->mutex);
+        recorder->frameStart  = true;
+        recorder->afterConfig = false;
+        pthread_mutex_unlock(&recorder->mutex);
+    }
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Re-create the pipeline to pick up a change in whether recording is active.
+ *
+ * @param context global state
+ */
+static void reconfigurePipeline(PicamContext *context) {
+    lockPipeline(context);
+
+    destroyPipeline(context);
+    resetCaptureTracker(context);
+    createPipeline(context);
+
+    unlockPipeline(context);
+}
+
+static int writeFully(int fd, const uint8_t *data, size_t length) {
+    while (length) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        data   += written;
+        length -= written;
+    }
+    return 1;
+}
+
+/**
+ * Recording writer thread.
+ *
+ * Chunks are copied out of the buffer with the mutex held, and written to the file without it, so
+ * a slow file system never blocks the encoder callback.
+ *
+ * @param arg global state
+ * @return NULL
+ */
+static void *writerThread(void *arg) {
+    PicamContext *context  = (PicamContext *) arg;
+    Recorder     *recorder = &context->recorder;
+
+    Bytes batch = {0};
+
+    beginOwnedThread(context, OWNED_THREAD_RECORDING_WRITER);
+
+    pthread_mutex_lock(&recorder->mutex);
+
+    while (!recorder->stopping) {
+        if (recorder->fd < 0 || recorder->cursor >= recorder->firstChunk + recorder->chunkCount) {
+            pthread_cond_wait(&recorder->changed, &recorder->mutex);
+            continue;
+        }
+
+        resetBytes(&batch);
+
+        // Headers are inline before every keyframe, but the stored copy covers a stream that did not start with them
+        if (!recorder->flushStarted) {
+            if (!recordingChunkAt(recorder, recorder->cursor)->config) {
+                appendBytes(&batch, recorder->header.data, recorder->header.length);
+            }
+            recorder->flushStarted = true;
+        }
+
+        bool finished = false;
+        while (!finished && recorder->cursor < recorder->firstChunk + recorder->chunkCount && batch.length < WRITE_BATCH_SIZE) {
+            RecordingChunk *chunk = recordingChunkAt(recorder, recorder->cursor++);
+            appendBytes(&batch, recorder->data + chunk->offset, chunk->length);
+            finished = chunk->frameEnd && chunk->time >= recorder->flushEnd;
+        }
+
+        int fd = recorder->fd;
+
+        pthread_mutex_unlock(&recorder->mutex);
+        int written = writeFully(fd, batch.data, batch.length);
+        pthread_mutex_lock(&recorder->mutex);
+
+        if (!written) {
+            logError("Failed to write recording: %s", strerror(errno));
+        }
+
+        if (!written || finished) {
+            close(fd);
+            recorder->fd = -1;
+            if (written) {
+                context->stats.recordingFlushes++;
+                logInfo("Recording flush finished");
+            }
+        }
+    }
+
+    if (recorder->fd >= 0) {
+        close(recorder->fd);
+        recorder->fd = -1;
+    }
+
+    pthread_mutex_unlock(&recorder->mutex);
+
+    freeBytes(&batch);
+
+    endOwnedThread(context, OWNED_THREAD_RECORDING_WRITER);
+
+    return NULL;
+}
+
+/**
+ * Video encoder buffer callback.
+ *
+ * Every buffer of the encoded stream is appended to the recording buffer, nothing here ever waits
+ * on the file system or calls into Java.
+ *
+ * @param port
+ * @param buffer
+ */
+static void recorderBufferCallback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+    PicamContext *context  = (PicamContext *) port->userdata;
+    Recorder     *recorder = &context->recorder;
+
+    uint64_t cpuStart = enterCallbackThread(context);
+
+    pthread_mutex_lock(&recorder->mutex);
+
+    if (buffer->length) {
+        mmal_buffer_header_mem_lock(buffer);
+        appendRecordingChunk(context, buffer->data + buffer->offset, buffer->length, buffer->flags, vcos_getmicrosecs64());
+        mmal_buffer_header_mem_unlock(buffer);
+    } else if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) {
+        recorder->frameStart = true;
+        if (recorder->chunkCount) {
+            recordingChunkAt(recorder, recorder->firstChunk + recorder->chunkCount - 1)->frameEnd = true;
+        }
+    }
+
+    pthread_mutex_unlock(&recorder->mutex);
+
+    mmal_buffer_header_release(buffer);
+
+    if (port->is_enabled) {
+        MMAL_BUFFER_HEADER_T *nextBuffer = mmal_queue_get(recorder->pool->queue);
+        if (nextBuffer) {
+            mmal_port_send_buffer(port, nextBuffer);
+        }
+    }
+
+    leaveCallbackThread(context, cpuStart);
+}
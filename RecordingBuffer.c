@@ -0,0 +1,204 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <string.h>
+
+#include "RecordingBuffer.h"
+#include "Log.h"
+
+static int allocateChunk(Recorder *recorder, uint32_t length, uint32_t *offset);
+static int evictGroup(PicamContext *context);
+static uint64_t keyframeAt(Recorder *recorder, uint32_t index);
+
+/**
+ * Append an encoded chunk to the recording buffer, evicting the oldest keyframe groups as needed.
+ *
+ * A keyframe group starts with the inline headers (or a keyframe without headers) and runs up to
+ * the next group. Whole groups are evicted, so the buffer always starts on a keyframe. Groups are
+ * evicted once the next group is older than the pre-roll time, unless a flush still needs them.
+ *
+ * Must only be invoked with the recorder mutex held.
+ *
+ * @param context global state
+ * @param data chunk data
+ * @param length chunk length
+ * @param flags MMAL buffer header flags
+ * @param now current time in microseconds
+ */
+void appendRecordingChunk(PicamContext *context, const uint8_t *data, uint32_t length, uint32_t flags, uint64_t now) {
+    Recorder *recorder = &context->recorder;
+
+    bool config   = flags & MMAL_BUFFER_HEADER_FLAG_CONFIG;
+    bool frameEnd = flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+    bool groupStart = !recorder->afterConfig && (config || (recorder->frameStart && (flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)));
+
+    if (config) {
+        if (!recorder->afterConfig) {
+            resetBytes(&recorder->header);
+        }
+        appendBytes(&recorder->header, data, length);
+    }
+
+    recorder->frameStart  = frameEnd;
+    recorder->afterConfig = config;
+
+    // Make room, for the data and for the index entries
+    uint32_t offset;
+    while (recorder->chunkCount == RECORDING_CHUNKS || (groupStart && recorder->keyframeCount == RECORDING_KEYFRAMES) || !allocateChunk(recorder, length, &offset)) {
+        if (!evictGroup(context)) {
+            break;
+        }
+    }
+
+    // The buffer must always start with a keyframe group
+    if (recorder->chunkCount == 0 && !groupStart) {
+        return;
+    }
+
+    if (!allocateChunk(recorder, length, &offset)) {
+        context->stats.recordingOverruns++;
+        return;
+    }
+
+    uint64_t sequence = recorder->firstChunk + recorder->chunkCount;
+
+    if (groupStart) {
+        recorder->keyframes[(recorder->keyframeHead + recorder->keyframeCount) % RECORDING_KEYFRAMES] = sequence;
+        recorder->keyframeCount++;
+    }
+
+    RecordingChunk *chunk = recordingChunkAt(recorder, sequence);
+    chunk->offset   = offset;
+    chunk->length   = length;
+    chunk->time     = now;
+    chunk->config   = config;
+    chunk->frameEnd = frameEnd;
+
+    memcpy(recorder->data + offset, data, length);
+
+    recorder->chunkCount++;
+
+    uint64_t preRoll = (uint64_t) context->config.recording.preRoll * 1000;
+    while (recorder->keyframeCount > 1) {
+        uint64_t nextGroup = keyframeAt(recorder, 1);
+        if (recordingChunkAt(recorder, nextGroup)->time + preRoll > now || (recorder->fd >= 0 && recorder->cursor < nextGroup)) {
+            break;
+        }
+        evictGroup(context);
+    }
+
+    pthread_cond_broadcast(&recorder->changed);
+}
+
+/**
+ * Get a chunk in the recording buffer.
+ *
+ * @param recorder recorder state
+ * @param sequence chunk sequence number
+ * @return chunk
+ */
+RecordingChunk *recordingChunkAt(Recorder *recorder, uint64_t sequence) {
+    return &recorder->chunks[sequence % RECORDING_CHUNKS];
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Find space for a chunk in the circular data buffer - chunks are always stored contiguously, so
+ * space at the end of the buffer that is too small is skipped.
+ *
+ * @param recorder recorder state
+ * @param length chunk length
+ * @param offset set to the offset of the space for the chunk
+ * @return non-zero if space was found; zero if there is not enough space
+ */
+static int allocateChunk(Recorder *recorder, uint32_t length, uint32_t *offset) {
+    if (recorder->chunkCount == 0) {
+        *offset = 0;
+        return length <= recorder->capacity;
+    }
+
+    RecordingChunk *first = recordingChunkAt(recorder, recorder->firstChunk);
+    RecordingChunk *last  = recordingChunkAt(recorder, recorder->firstChunk + recorder->chunkCount - 1);
+
+    uint32_t head = first->offset;
+    uint32_t tail = last->offset + last->length;
+
+    if (tail > head) {
+        if (recorder->capacity - tail >= length) {
+            *offset = tail;
+            return 1;
+        }
+        if (head >= length) {
+            *offset = 0;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (head - tail >= length) {
+        *offset = tail;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Evict the oldest keyframe group from the buffer.
+ *
+ * If a flush has not yet written the evicted chunks, it skips ahead to the new oldest keyframe
+ * group and the overrun is counted.
+ *
+ * @param context global state
+ * @return non-zero if anything was evicted; zero if the buffer was empty
+ */
+static int evictGroup(PicamContext *context) {
+    Recorder *recorder = &context->recorder;
+
+    if (recorder->chunkCount == 0) {
+        return 0;
+    }
+
+    uint64_t end = recorder->firstChunk + recorder->chunkCount;
+
+    if (recorder->keyframeCount > 1) {
+        end = keyframeAt(recorder, 1);
+    }
+
+    recorder->chunkCount -= end - recorder->firstChunk;
+    recorder->firstChunk  = end;
+
+    if (recorder->keyframeCount) {
+        recorder->keyframeHead = (recorder->keyframeHead + 1) % RECORDING_KEYFRAMES;
+        recorder->keyframeCount--;
+    }
+
+    if (recorder->fd >= 0 && recorder->cursor < recorder->firstChunk) {
+        logWarn("Recording flush overrun, skipped %llu chunks", (unsigned long long) (recorder->firstChunk - recorder->cursor));
+        context->stats.recordingOverruns++;
+        recorder->cursor = recorder->firstChunk;
+    }
+
+    return 1;
+}
+
+static uint64_t keyframeAt(Recorder *recorder, uint32_t index) {
+    return recorder->keyframes[(recorder->keyframeHead + index) % RECORDING_KEYFRAMES];
+}
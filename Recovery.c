@@ -0,0 +1,184 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include "Recovery.h"
+#include "Capture.h"
+#include "Log.h"
+#include "Pipeline.h"
+#include "Threads.h"
+
+static void *recoveryThread(void *arg);
+static void rebuildPipeline(PicamContext *context);
+
+/**
+ * Start the background recovery thread.
+ *
+ * The recovery thread sleeps until a recovery is requested (e.g. because the camera reported an
+ * error event, or a capture stalled), and then tears down and re-creates the pipeline from the
+ * configuration stored in the context.
+ *
+ * @param context global state
+ * @return non-zero on success; zero on error
+ */
+int startRecovery(PicamContext *context) {
+    if (VCOS_SUCCESS != vcos_mutex_create(&context->pipelineMutex, "picam-pipeline")) {
+        return 0;
+    }
+
+    if (VCOS_SUCCESS != vcos_semaphore_create(&context->recoverySemaphore, "picam-recovery", 0)) {
+        vcos_mutex_delete(&context->pipelineMutex);
+        return 0;
+    }
+
+    context->recoveryStopping = false;
+
+    if (VCOS_SUCCESS != vcos_thread_create(&context->recoveryThread, "picam-recovery", NULL, recoveryThread, context)) {
+        vcos_semaphore_delete(&context->recoverySemaphore);
+        vcos_mutex_delete(&context->pipelineMutex);
+        return 0;
+    }
+
+    context->recoveryStarted = true;
+
+    return 1;
+}
+
+/**
+ * Stop the background recovery thread, waiting for any in-progress recovery to finish.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param context global state
+ */
+void stopRecovery(PicamContext *context) {
+    if (context->recoveryStarted) {
+        context->recoveryStopping = true;
+        vcos_semaphore_post(&context->recoverySemaphore);
+        vcos_thread_join(&context->recoveryThread, NULL);
+
+        vcos_semaphore_delete(&context->recoverySemaphore);
+        vcos_mutex_delete(&context->pipelineMutex);
+
+        context->recoveryStarted = false;
+    }
+}
+
+/**
+ * Request that the pipeline be re-created.
+ *
+ * This may be invoked from any thread, including MMAL callback threads - it never blocks.
+ *
+ * @param context global state
+ */
+void requestRecovery(PicamContext *context) {
+    context->recoveryRequested = true;
+    if (context->recoveryStarted) {
+        vcos_semaphore_post(&context->recoverySemaphore);
+    }
+}
+
+/**
+ * Acquire exclusive use of the pipeline.
+ *
+ * If a recovery is pending, or a previous recovery failed, the pipeline is re-created here before
+ * returning, so the caller never has to wait for the recovery thread to get around to it.
+ *
+ * The pipeline is locked on return irrespective of the result, so unlockPipeline must always be
+ * called.
+ *
+ * @param context global state
+ * @return non-zero if the pipeline is ready to use; zero if it is not
+ */
+int lockPipeline(PicamContext *context) {
+    vcos_mutex_lock(&context->pipelineMutex);
+    if (context->recoveryRequested || !context->pipelineReady) {
+        rebuildPipeline(context);
+    }
+    return context->pipelineReady;
+}
+
+/**
+ * Release the pipeline previously acquired by lockPipeline.
+ *
+ * @param context global state
+ */
+void unlockPipeline(PicamContext *context) {
+    vcos_mutex_unlock(&context->pipelineMutex);
+}
+
+// === Private implementation =====================================================================
+
+static void *recoveryThread(void *arg) {
+    PicamContext *context = (PicamContext *) arg;
+
+    beginOwnedThread(context, OWNED_THREAD_RECOVERY);
+
+    for (;;) {
+        vcos_semaphore_wait(&context->recoverySemaphore);
+
+        if (context->recoveryStopping) {
+            break;
+        }
+
+        vcos_mutex_lock(&context->pipelineMutex);
+        if (context->recoveryRequested) {
+            rebuildPipeline(context);
+        }
+        vcos_mutex_unlock(&context->pipelineMutex);
+    }
+
+    endOwnedThread(context, OWNED_THREAD_RECOVERY);
+
+    return NULL;
+}
+
+/**
+ * Tear down and re-create the pipeline.
+ *
+ * Must only be invoked with the pipeline mutex held.
+ *
+ * @param context global state
+ */
+static void rebuildPipeline(PicamContext *context) {
+    uint64_t start = vcos_getmicrosecs64();
+
+    context->recoveryRequested = false;
+
+    destroyPipeline(context);
+
+    // Nothing triggered on the old pipeline can arrive any more
+    resetCaptureTracker(context);
+
+    int result = createPipeline(context);
+
+    uint64_t duration = vcos_getmicrosecs64() - start;
+
+    context->stats.recoveries++;
+    if (!result) {
+        context->stats.recoveryFailures++;
+    }
+    context->stats.lastRecoveryTime   = duration;
+    context->stats.totalRecoveryTime += duration;
+
+    if (result) {
+        logInfo("Pipeline recovered in %lluus", (unsigned long long) duration);
+    } else {
+        logError("Pipeline recovery failed after %lluus", (unsigned long long) duration);
+    }
+}
@@ -0,0 +1,251 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include "Regions.h"
+#include "Capture.h"
+#include "Log.h"
+#include "RawCapture.h"
+
+static void regionRectangle(const Image *frame, const Region *region, uint32_t *x, uint32_t *y, uint32_t *width, uint32_t *height);
+static uint32_t evenSize(uint32_t value, uint32_t limit);
+static char *processRegion(PicamContext *context, const Region *region, bool encode, const uint8_t **data, size_t *length);
+static char *beginRegionEncode(PicamContext *context, uint32_t width, uint32_t height, Image *input);
+static char *finishRegionEncode(PicamContext *context, const uint8_t **data, size_t *length);
+
+/**
+ * Capture a single exposure and deliver one output for each of a number of regions of interest.
+ *
+ * The picture is captured raw, then each region is cropped (and optionally scaled) on the host and
+ * either encoded by a hardware encoder fed from host memory, or delivered as packed I420 data - so
+ * the work done and the data delivered for each region depends on the size of the region, not the
+ * size of the full picture.
+ *
+ * @param context global state
+ * @param regions regions of interest
+ * @param count number of regions
+ * @param encode true to encode each region with the configured encoding; false for I420 data
+ * @param sink receives the output for each region, in order
+ * @param userdata passed to the sink
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *captureRegions(PicamContext *context, const Region *regions, uint32_t count, bool encode, RegionSink sink, void *userdata) {
+    char *captureFailure = performCaptureWithRetries(context, OUTPUT_RAW, NULL, NULL);
+    if (captureFailure) {
+        return captureFailure;
+    }
+
+    if (!rawFrameComplete(context)) {
+        return "Raw capture did not deliver a complete frame";
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t *data;
+        size_t length;
+
+        char *regionFailure = processRegion(context, &regions[i], encode, &data, &length);
+        if (regionFailure) {
+            logWarn("Region %u failed: %s", i, regionFailure);
+            return regionFailure;
+        }
+
+        if (!sink(userdata, i, data, length)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Encode a complete image with the host encoder.
+ *
+ * The host encoder is created the first time it is needed, with the configured encoding and
+ * quality, and is kept for re-use.
+ *
+ * @param context global state
+ * @param image image to encode, must have an even width and height
+ * @param data set to the encoded data, valid until the next image is encoded
+ * @param length set to the length of the encoded data
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *encodeImage(PicamContext *context, const Image *image, const uint8_t **data, size_t *length) {
+    Image input;
+
+    char *encodeFailure = beginRegionEncode(context, image->width, image->height, &input);
+    if (encodeFailure) {
+        return encodeFailure;
+    }
+
+    cropScaleImage(image, 0, 0, image->width, image->height, &input);
+
+    return finishRegionEncode(context, data, length);
+}
+
+/**
+ * Destroy the region processing resources - the host encoder and the working buffers, and the raw
+ * frame they are processed from.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param context global state
+ */
+void destroyRegions(PicamContext *context) {
+    destroyHostEncoder(&context->hostEncoder);
+
+    freeImage(&context->regionImage);
+    freeBytes(&context->regionData);
+    freeImage(&context->rawFrame);
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Crop, scale and optionally encode a single region of the raw frame.
+ *
+ * @param context global state
+ * @param region region of interest
+ * @param encode true to encode the region
+ * @param data set to the output data, valid until the next region is processed
+ * @param length set to the length of the output data
+ * @return NULL on success; otherwise a description of the failure
+ */
+static char *processRegion(PicamContext *context, const Region *region, bool encode, const uint8_t **data, size_t *length) {
+    const Image *frame = &context->rawFrame;
+
+    uint32_t x, y, width, height;
+    regionRectangle(frame, region, &x, &y, &width, &height);
+
+    uint32_t targetWidth  = region->width  ? evenSize(region->width , UINT32_MAX) : width;
+    uint32_t targetHeight = region->height ? evenSize(region->height, UINT32_MAX) : height;
+
+    if (encode) {
+        // Crop straight into the encoder input buffer
+        Image input;
+
+        char *encodeFailure = beginRegionEncode(context, targetWidth, targetHeight, &input);
+        if (encodeFailure) {
+            return encodeFailure;
+        }
+
+        cropScaleImage(frame, x, y, width, height, &input);
+
+        return finishRegionEncode(context, data, length);
+    } else {
+        Image *output = &context->regionImage;
+
+        if (!allocateImage(output, targetWidth, targetHeight, targetWidth, targetHeight)) {
+            return "Failed to allocate region";
+        }
+
+        cropScaleImage(frame, x, y, width, height, output);
+
+        *data   = output->data;
+        *length = imageSize(output);
+    }
+
+    return NULL;
+}
+
+/**
+ * Begin encoding an image with the host encoder, creating the encoder if necessary.
+ *
+ * @param context global state
+ * @param width image width in pixels
+ * @param height image height in pixels
+ * @param input set to describe the encoder input buffer
+ * @return NULL on success; otherwise a description of the failure
+ */
+static char *beginRegionEncode(PicamContext *context, uint32_t width, uint32_t height, Image *input) {
+    HostEncoder *encoder = &context->hostEncoder;
+
+    if (!encoder->component && !createHostEncoder(encoder, context->config.encoder.encoding, context->config.encoder.quality)) {
+        return "Failed to create region encoder";
+    }
+
+    if (!beginEncode(encoder, width, height, input)) {
+        return "Failed to begin encoding region";
+    }
+
+    return NULL;
+}
+
+/**
+ * Finish encoding an image with the host encoder.
+ *
+ * @param context global state
+ * @param data set to the encoded data
+ * @param length set to the length of the encoded data
+ * @return NULL on success; otherwise a description of the failure
+ */
+static char *finishRegionEncode(PicamContext *context, const uint8_t **data, size_t *length) {
+    if (!finishEncode(&context->hostEncoder, &context->regionData)) {
+        return "Failed to encode region";
+    }
+
+    *data   = context->regionData.data;
+    *length = context->regionData.length;
+
+    return NULL;
+}
+
+/**
+ * Convert a normalised region to a pixel rectangle within the frame.
+ *
+ * The rectangle is clamped to the frame, and the position and size are made even so the chroma
+ * planes line up with the luma plane.
+ *
+ * @param frame raw frame
+ * @param region region of interest
+ * @param x set to the left edge in pixels
+ * @param y set to the top edge in pixels
+ * @param width set to the width in pixels
+ * @param height set to the height in pixels
+ */
+static void regionRectangle(const Image *frame, const Region *region, uint32_t *x, uint32_t *y, uint32_t *width, uint32_t *height) {
+    double left   = region->x < 0.0 ? 0.0 : region->x > 1.0 ? 1.0 : region->x;
+    double top    = region->y < 0.0 ? 0.0 : region->y > 1.0 ? 1.0 : region->y;
+    double right  = left + (region->w < 0.0 ? 0.0 : region->w);
+    double bottom = top  + (region->h < 0.0 ? 0.0 : region->h);
+
+    *x = ((uint32_t) (left * frame->width )) & ~1u;
+    *y = ((uint32_t) (top  * frame->height)) & ~1u;
+
+    if (*x > frame->width  - 2) *x = frame->width  - 2;
+    if (*y > frame->height - 2) *y = frame->height - 2;
+
+    *width  = evenSize((uint32_t) ((right  > 1.0 ? 1.0 : right ) * frame->width ) - *x, frame->width  - *x);
+    *height = evenSize((uint32_t) ((bottom > 1.0 ? 1.0 : bottom) * frame->height) - *y, frame->height - *y);
+}
+
+/**
+ * Round a size down to an even number of pixels, at least two and no more than a limit.
+ *
+ * @param value size in pixels
+ * @param limit maximum size in pixels
+ * @return even size
+ */
+static uint32_t evenSize(uint32_t value, uint32_t limit) {
+    if (value > limit) {
+        value = limit;
+    }
+
+    value &= ~1u;
+
+    return value < 2 ? 2 : value;
+}
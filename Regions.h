@@ -0,0 +1,29 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_REGIONS_H
+#define _PICAM_REGIONS_H
+
+#include "Picam.h"
+
+char *captureRegions(PicamContext *context, const Region *regions, uint32_t count, bool encode, RegionSink sink, void *userdata);
+char *encodeImage(PicamContext *context, const Image *image, const uint8_t **data, size_t *length);
+void destroyRegions(PicamContext *context);
+
+#endif // _PICAM_REGIONS_H
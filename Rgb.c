@@ -0,0 +1,132 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include "Rgb.h"
+#include "Cpu.h"
+#include "Parallel.h"
+
+/**
+ * The image being converted, shared by every band.
+ */
+typedef struct RgbTask {
+    const Image  *image;
+    uint32_t     *pixels;
+    uint32_t      stride;
+    RgbRowKernel  kernel;
+} RgbTask;
+
+/**
+ * NEON row kernel, only present if the library was built with the NEON sources.
+ */
+extern void rgbRowNeon(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint32_t width, uint32_t *out) __attribute__((weak));
+
+static RgbRowKernel selectKernel(void);
+static void rgbRowGeneric(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint32_t width, uint32_t *out);
+static void convertBand(void *userdata, uint32_t startRow, uint32_t endRow);
+static uint8_t clampSample(int32_t value);
+
+/**
+ * Convert an I420 image to packed 32-bit RGB pixels, as used by a Java TYPE_INT_RGB (or ARGB)
+ * BufferedImage - each pixel is 0xFFRRGGBB in the native byte order.
+ *
+ * The conversion is full-range BT.601 (JFIF), matching the camera output, with 6-bit fixed-point
+ * coefficients. The work is split into horizontal bands across several threads, and the row
+ * kernel is selected at runtime for the CPU.
+ *
+ * @param image image to convert, with an even width
+ * @param pixels output pixels, at least stride times the image height
+ * @param stride distance between output rows, in pixels
+ */
+void convertToRgb(const Image *image, uint32_t *pixels, uint32_t stride) {
+    RgbTask task = {
+        .image  = image,
+        .pixels = pixels,
+        .stride = stride,
+        .kernel = selectKernel()
+    };
+
+    runParallel(image->height, 2, convertBand, &task);
+}
+
+// === Private implementation =====================================================================
+
+static RgbRowKernel selectKernel(void) {
+    if (rgbRowNeon && cpuHasFeature(CPU_FEATURE_NEON)) {
+        return rgbRowNeon;
+    }
+    return rgbRowGeneric;
+}
+
+/**
+ * Convert one row of pixels.
+ *
+ * The arithmetic must match the SIMD kernels exactly, so results do not depend on the CPU.
+ *
+ * @param y luma row
+ * @param u U row, one sample for every two pixels
+ * @param v V row, one sample for every two pixels
+ * @param width number of pixels in the row
+ * @param out output row
+ */
+static void rgbRowGeneric(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint32_t width, uint32_t *out) {
+    for (uint32_t x = 0; x < width; x++) {
+        int32_t luma = y[x];
+        int32_t cb   = u[x >> 1] - 128;
+        int32_t cr   = v[x >> 1] - 128;
+
+        uint8_t r = clampSample(luma + ((90 * cr + 32) >> 6));
+        uint8_t g = clampSample(luma - ((22 * cb + 46 * cr + 32) >> 6));
+        uint8_t b = clampSample(luma + ((113 * cb + 32) >> 6));
+
+        out[x] = 0xFF000000 | (uint32_t) r << 16 | (uint32_t) g << 8 | b;
+    }
+}
+
+/**
+ * Convert one band of the image.
+ *
+ * @param userdata conversion task
+ * @param startRow first row of the band
+ * @param endRow row after the end of the band
+ */
+static void convertBand(void *userdata, uint32_t startRow, uint32_t endRow) {
+    RgbTask     *task  = (RgbTask *) userdata;
+    const Image *image = task->image;
+
+    const uint8_t *y = imagePlane(image, IMAGE_PLANE_Y);
+    const uint8_t *u = imagePlane(image, IMAGE_PLANE_U);
+    const uint8_t *v = imagePlane(image, IMAGE_PLANE_V);
+
+    uint32_t lumaStride   = imagePlaneStride(image, IMAGE_PLANE_Y);
+    uint32_t chromaStride = imagePlaneStride(image, IMAGE_PLANE_U);
+
+    for (uint32_t row = startRow; row < endRow; row++) {
+        task->kernel(
+            y + (size_t) row * lumaStride,
+            u + (size_t) (row >> 1) * chromaStride,
+            v + (size_t) (row >> 1) * chromaStride,
+            image->width,
+            task->pixels + (size_t) row * task->stride
+        );
+    }
+}
+
+static uint8_t clampSample(int32_t value) {
+    return value < 0 ? 0 : value > 255 ? 255 : (uint8_t) value;
+}
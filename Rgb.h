@@ -0,0 +1,32 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_RGB_H
+#define _PICAM_RGB_H
+
+#include "Image.h"
+
+/**
+ * Row kernel, see Rgb.c.
+ */
+typedef void (*RgbRowKernel)(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint32_t width, uint32_t *out);
+
+void convertToRgb(const Image *image, uint32_t *pixels, uint32_t stride);
+
+#endif // _PICAM_RGB_H
@@ -0,0 +1,119 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include "RgbCapture.h"
+#include "Capture.h"
+#include "Log.h"
+#include "RawCapture.h"
+#include "Rgb.h"
+
+static char *scaleFrame(PicamContext *context, uint32_t width, uint32_t height, const Image **image);
+
+/**
+ * Capture a picture as packed 32-bit RGB pixels, ready for a Java BufferedImage.
+ *
+ * The camera delivers raw I420 from the capture port, optionally scaled to the requested size, and
+ * the colour conversion is done natively (see Rgb.c) straight into the caller's memory - there are
+ * no intermediate copies, and nothing needs to be decoded on the Java side.
+ *
+ * The output pixels are only acquired around the conversion itself, never across the blocking
+ * capture, so the acquire callback may pin Java memory (e.g. with GetPrimitiveArrayCritical).
+ *
+ * @param context global state
+ * @param width width of the output, or zero for the full frame
+ * @param height height of the output, or zero for the full frame
+ * @param acquire provides the output pixels, width times height of them
+ * @param release gives back the output pixels
+ * @param userdata passed to the callbacks
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *captureRgb(PicamContext *context, uint32_t width, uint32_t height, RgbAcquire acquire, RgbRelease release, void *userdata) {
+    uint64_t start = vcos_getmicrosecs64();
+
+    char *captureFailure = performCaptureWithRetries(context, OUTPUT_RAW, NULL, NULL);
+    if (captureFailure) {
+        return captureFailure;
+    }
+
+    if (!rawFrameComplete(context)) {
+        return "Raw capture did not deliver a complete frame";
+    }
+
+    const Image *image;
+
+    char *scaleFailure = scaleFrame(context, width, height, &image);
+    if (scaleFailure) {
+        return scaleFailure;
+    }
+
+    uint32_t *pixels = acquire(userdata, (size_t) image->width * image->height);
+    if (!pixels) {
+        return "Failed to acquire RGB output";
+    }
+
+    uint64_t converting = vcos_getmicrosecs64();
+
+    convertToRgb(image, pixels, image->width);
+
+    release(userdata, pixels);
+
+    context->stats.lastRgbTime = vcos_getmicrosecs64() - start;
+
+    logDebug("RGB capture %ux%u took %lluus, conversion %lluus", image->width, image->height, (unsigned long long) context->stats.lastRgbTime, (unsigned long long) (vcos_getmicrosecs64() - converting));
+
+    return NULL;
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Scale the raw frame to the requested size, if it is not already that size.
+ *
+ * @param context global state
+ * @param width requested width, or zero for the frame width
+ * @param height requested height, or zero for the frame height
+ * @param image set to the image to convert, valid until the next capture
+ * @return NULL on success; otherwise a description of the failure
+ */
+static char *scaleFrame(PicamContext *context, uint32_t width, uint32_t height, const Image **image) {
+    const Image *frame = &context->rawFrame;
+
+    if (!width ) width  = frame->width;
+    if (!height) height = frame->height;
+
+    if (width == frame->width && height == frame->height) {
+        *image = frame;
+        return NULL;
+    }
+
+    if ((width & 1) || (height & 1)) {
+        return "RGB capture size must be even";
+    }
+
+    Image *output = &context->regionImage;
+
+    if (!allocateImage(output, width, height, width, height)) {
+        return "Failed to allocate scaled RGB frame";
+    }
+
+    cropScaleImage(frame, 0, 0, frame->width, frame->height, output);
+
+    *image = output;
+    return NULL;
+}
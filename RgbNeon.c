@@ -0,0 +1,90 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include "Rgb.h"
+
+/**
+ * NEON I420 to RGB row kernel.
+ *
+ * This file is compiled with NEON enabled, and the kernel is only called after checking the CPU at
+ * runtime. If NEON is not available to the compiler at all, the kernel is simply left out.
+ */
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+
+void rgbRowNeon(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint32_t width, uint32_t *out);
+
+/**
+ * Convert one row of pixels, sixteen at a time - see rgbRowGeneric in Rgb.c.
+ *
+ * The chroma terms are computed once for each pair of pixels in 16-bit lanes, which the 6-bit
+ * coefficients never overflow, then duplicated across the pair.
+ */
+void rgbRowNeon(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint32_t width, uint32_t *out) {
+    const uint8x8_t  bias  = vdup_n_u8(128);
+    const uint8x16_t alpha = vdupq_n_u8(0xFF);
+
+    uint32_t x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        uint8x16_t luma = vld1q_u8(y + x);
+        int16x8_t  cb   = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(u + (x >> 1)), bias));
+        int16x8_t  cr   = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(v + (x >> 1)), bias));
+
+        int16x8_t red   = vrshrq_n_s16(vmulq_n_s16(cr, 90), 6);
+        int16x8_t green = vrshrq_n_s16(vmlaq_n_s16(vmulq_n_s16(cb, 22), cr, 46), 6);
+        int16x8_t blue  = vrshrq_n_s16(vmulq_n_s16(cb, 113), 6);
+
+        // Each chroma term covers two adjacent pixels
+        int16x8x2_t redPair   = vzipq_s16(red  , red  );
+        int16x8x2_t greenPair = vzipq_s16(green, green);
+        int16x8x2_t bluePair  = vzipq_s16(blue , blue );
+
+        int16x8_t lumaLow  = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8 (luma)));
+        int16x8_t lumaHigh = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(luma)));
+
+        uint8x16x4_t pixels;
+        pixels.val[0] = vcombine_u8(vqmovun_s16(vaddq_s16(lumaLow, bluePair .val[0])), vqmovun_s16(vaddq_s16(lumaHigh, bluePair .val[1])));
+        pixels.val[1] = vcombine_u8(vqmovun_s16(vsubq_s16(lumaLow, greenPair.val[0])), vqmovun_s16(vsubq_s16(lumaHigh, greenPair.val[1])));
+        pixels.val[2] = vcombine_u8(vqmovun_s16(vaddq_s16(lumaLow, redPair  .val[0])), vqmovun_s16(vaddq_s16(lumaHigh, redPair  .val[1])));
+        pixels.val[3] = alpha;
+
+        // B, G, R, A in memory is 0xAARRGGBB on a little-endian CPU
+        vst4q_u8((uint8_t *) (out + x), pixels);
+    }
+
+    for (; x < width; x++) {
+        int32_t luma = y[x];
+        int32_t cb   = u[x >> 1] - 128;
+        int32_t cr   = v[x >> 1] - 128;
+
+        int32_t r = luma + ((90 * cr + 32) >> 6);
+        int32_t g = luma - ((22 * cb + 46 * cr + 32) >> 6);
+        int32_t b = luma + ((113 * cb + 32) >> 6);
+
+        r = r < 0 ? 0 : r > 255 ? 255 : r;
+        g = g < 0 ? 0 : g > 255 ? 255 : g;
+        b = b < 0 ? 0 : b > 255 ? 255 : b;
+
+        out[x] = 0xFF000000 | (uint32_t) r << 16 | (uint32_t) g << 8 | (uint32_t) b;
+    }
+}
+
+#endif
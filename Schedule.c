@@ -0,0 +1,164 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+/*
+ * Applying a scheduling policy, priority and CPU affinity to the calling thread.
+ *
+ * The worker schedule is kept here process-wide, for the threads that are not owned by a camera
+ * context - the logging thread and the band threads of runParallel. It is set whenever a camera is
+ * opened, and each of those threads applies it to itself: the logging thread when it sees the
+ * schedule has changed, and a band thread when it starts.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Schedule.h"
+#include "Configuration.h"
+#include "Log.h"
+
+/**
+ * The process-wide worker schedule, a generation of zero means none has been set yet.
+ */
+static struct {
+    pthread_mutex_t mutex;
+    int32_t         policy;
+    int32_t         priority;
+    uint32_t        affinity;
+    atomic_uint     generation;
+    atomic_uint     loggedGeneration;
+} WorkerSchedule = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+/**
+ * Apply scheduling to the calling thread.
+ *
+ * Failures are logged and otherwise ignored - a real-time policy in particular needs privileges
+ * (CAP_SYS_NICE or an RLIMIT_RTPRIO) that the process may not have, and the thread is still
+ * perfectly usable without it.
+ *
+ * @param name name of the thread, for logging
+ * @param policy THREAD_POLICY_DEFAULT to leave the policy and priority alone, or the policy to apply
+ * @param priority nice value for THREAD_POLICY_OTHER; otherwise the real-time priority
+ * @param affinity mask of the CPUs the thread may run on, zero to leave the affinity alone
+ * @param log true to log the outcome; false to apply the schedule silently
+ */
+void applySchedule(const char *name, int32_t policy, int32_t priority, uint32_t affinity, bool log) {
+    pid_t tid = (pid_t) syscall(SYS_gettid);
+
+    if (affinity) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu = 0; cpu < 32; cpu++) {
+            if (affinity & (1u << cpu)) {
+                CPU_SET(cpu, &cpus);
+            }
+        }
+
+        int result = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (result && log) {
+            logWarn("Failed to set %s thread %d affinity 0x%x: %s", name, tid, affinity, strerror(result));
+        }
+    }
+
+    if (policy == THREAD_POLICY_DEFAULT) {
+        return;
+    }
+
+    struct sched_param param = {0};
+    int result;
+
+    if (policy == THREAD_POLICY_OTHER) {
+        result = pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+        // On Linux the nice value is per-thread
+        if (!result && setpriority(PRIO_PROCESS, tid, priority)) {
+            result = errno;
+        }
+    } else {
+        param.sched_priority = priority;
+        result = pthread_setschedparam(pthread_self(), policy == THREAD_POLICY_RR ? SCHED_RR : SCHED_FIFO, &param);
+    }
+
+    if (!log) {
+        return;
+    }
+
+    if (result) {
+        logWarn("Failed to set %s thread %d scheduling policy %d priority %d: %s", name, tid, policy, priority, strerror(result));
+    } else {
+        logDebug("Scheduled %s thread %d with policy %d priority %d affinity 0x%x", name, tid, policy, priority, affinity);
+    }
+}
+
+/**
+ * Set the process-wide worker schedule.
+ *
+ * @param policy THREAD_POLICY_XXX value
+ * @param priority nice value for THREAD_POLICY_OTHER; otherwise the real-time priority
+ * @param affinity mask of the CPUs the worker threads may run on, zero for no change
+ */
+void setWorkerSchedule(int32_t policy, int32_t priority, uint32_t affinity) {
+    pthread_mutex_lock(&WorkerSchedule.mutex);
+    WorkerSchedule.policy   = policy;
+    WorkerSchedule.priority = priority;
+    WorkerSchedule.affinity = affinity;
+    atomic_fetch_add(&WorkerSchedule.generation, 1);
+    pthread_mutex_unlock(&WorkerSchedule.mutex);
+}
+
+/**
+ * Get the generation of the worker schedule, this changes each time the schedule is set.
+ *
+ * @return generation, zero if no schedule has been set
+ */
+uint32_t workerScheduleGeneration(void) {
+    return atomic_load(&WorkerSchedule.generation);
+}
+
+/**
+ * Apply the process-wide worker schedule to the calling thread.
+ *
+ * @param name name of the thread, for logging
+ * @param once true to log only for the first thread to apply each schedule, for short-lived threads
+ *             that are created over and over; false to always log
+ */
+void applyWorkerSchedule(const char *name, bool once) {
+    pthread_mutex_lock(&WorkerSchedule.mutex);
+    int32_t  policy     = WorkerSchedule.policy;
+    int32_t  priority   = WorkerSchedule.priority;
+    uint32_t affinity   = WorkerSchedule.affinity;
+    uint32_t generation = atomic_load(&WorkerSchedule.generation);
+    pthread_mutex_unlock(&WorkerSchedule.mutex);
+
+    if (generation == 0) {
+        return;
+    }
+
+    bool log = !once || atomic_exchange(&WorkerSchedule.loggedGeneration, generation) != generation;
+    applySchedule(name, policy, priority, affinity, log);
+}
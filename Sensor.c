@@ -0,0 +1,287 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <string.h>
+
+#include "Sensor.h"
+#include "Log.h"
+
+#include "interface/mmal/util/mmal_default_components.h"
+
+/**
+ * Tolerance used when comparing normalised fields of view.
+ */
+#define FOV_EPSILON 0.001
+
+/**
+ * A sensor mode.
+ *
+ * The area is the size of the region of the sensor that is read out, before any binning, centred
+ * on the sensor. The minimum frame rate determines the longest exposure the mode supports.
+ */
+typedef struct {
+    uint32_t mode;
+    uint32_t width;
+    uint32_t height;
+    uint32_t areaWidth;
+    uint32_t areaHeight;
+    uint32_t binning;
+    double   minFps;
+} SensorMode;
+
+typedef struct {
+    const char       *name;
+    uint32_t          width;
+    uint32_t          height;
+    uint32_t          modeCount;
+    const SensorMode *modes;
+} SensorModel;
+
+/**
+ * OV5647, the v1 camera module.
+ */
+static const SensorMode OV5647_MODES[] = {
+    {1, 1920, 1080, 1920, 1080, 1, 1    },
+    {2, 2592, 1944, 2592, 1944, 1, 1    },
+    {3, 2592, 1944, 2592, 1944, 1, 0.166},
+    {4, 1296,  972, 2592, 1944, 2, 1    },
+    {5, 1296,  730, 2592, 1460, 2, 1    },
+    {6,  640,  480, 2592, 1944, 4, 42.1 },
+    {7,  640,  480, 2592, 1944, 4, 60.1 }
+};
+
+/**
+ * IMX219, the v2 camera module.
+ */
+static const SensorMode IMX219_MODES[] = {
+    {1, 1920, 1080, 1920, 1080, 1, 0.1},
+    {2, 3280, 2464, 3280, 2464, 1, 0.1},
+    {4, 1640, 1232, 3280, 2464, 2, 0.1},
+    {5, 1640,  922, 3280, 1844, 2, 0.1},
+    {6, 1280,  720, 2560, 1440, 2, 40 },
+    {7,  640,  480, 1280,  960, 2, 40 }
+};
+
+/**
+ * IMX477, the HQ camera module.
+ */
+static const SensorMode IMX477_MODES[] = {
+    {1, 2028, 1080, 4056, 2160, 2, 0.1  },
+    {2, 2028, 1520, 4056, 3040, 2, 0.1  },
+    {3, 4056, 3040, 4056, 3040, 1, 0.005},
+    {4, 1332,  990, 2664, 1980, 2, 50.1 }
+};
+
+#define MODE_COUNT(modes) (sizeof(modes) / sizeof(modes[0]))
+
+static const SensorModel SENSOR_MODELS[] = {
+    {"ov5647", 2592, 1944, MODE_COUNT(OV5647_MODES), OV5647_MODES},
+    {"imx219", 3280, 2464, MODE_COUNT(IMX219_MODES), IMX219_MODES},
+    {"imx477", 4056, 3040, MODE_COUNT(IMX477_MODES), IMX477_MODES}
+};
+
+static int detectSensor(PicamContext *context);
+static const SensorModel *findSensorModel(const char *name);
+static const SensorMode *selectSensorMode(const PicamConfig *config, const SensorModel *model);
+
+/**
+ * Determine the sensor mode to use for the camera.
+ *
+ * An explicitly configured sensor mode is always used as-is. Otherwise the attached sensor is
+ * queried, and the mode that covers the requested resolution and field of view (the crop) at the
+ * lowest readout cost is chosen - so for example a 640x480 capture does not read out, and then
+ * downscale, the full sensor.
+ *
+ * If the sensor can not be identified, or automatic selection does not apply (stereoscopic modes),
+ * the choice of mode is left to the firmware.
+ *
+ * The result is stored in the context.
+ *
+ * @param context global state
+ */
+void configureSensorMode(PicamContext *context) {
+    SensorInfo *sensor = &context->sensor;
+
+    memset(sensor, 0, sizeof(*sensor));
+
+    sensor->mode = context->config.camera.customSensorConfig;
+    if (sensor->mode) {
+        return;
+    }
+
+    if (!detectSensor(context)) {
+        return;
+    }
+
+    if (context->config.capture.stereoscopicMode != MMAL_STEREOSCOPIC_MODE_NONE) {
+        return;
+    }
+
+    const SensorModel *model = findSensorModel(sensor->name);
+    if (!model) {
+        logInfo("No sensor mode information for sensor %s, leaving mode selection to firmware", sensor->name);
+        return;
+    }
+
+    const SensorMode *mode = selectSensorMode(&context->config, model);
+
+    sensor->mode       = mode->mode;
+    sensor->modeWidth  = mode->width;
+    sensor->modeHeight = mode->height;
+    sensor->binning    = mode->binning;
+
+    logInfo("Selected %s sensor mode %u (%ux%u, binning %u) for %ux%u", sensor->name, mode->mode, mode->width, mode->height, mode->binning, context->config.camera.width, context->config.camera.height);
+}
+
+/**
+ * Determine the sensor mode that would be used for a configuration, without detecting the sensor
+ * again - the sensor already detected for the context is assumed.
+ *
+ * @param context global state
+ * @param config configuration
+ * @return sensor mode, or zero if the choice of mode would be left to the firmware
+ */
+uint32_t sensorModeFor(PicamContext *context, const PicamConfig *config) {
+    if (config->camera.customSensorConfig) {
+        return config->camera.customSensorConfig;
+    }
+
+    if (config->capture.stereoscopicMode != MMAL_STEREOSCOPIC_MODE_NONE) {
+        return 0;
+    }
+
+    const SensorModel *model = findSensorModel(context->sensor.name);
+    if (!model) {
+        return 0;
+    }
+
+    return selectSensorMode(config, model)->mode;
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Query the camera info component for the attached sensor.
+ *
+ * @param context global state
+ * @return non-zero if the sensor was identified; zero if it was not
+ */
+static int detectSensor(PicamContext *context) {
+    SensorInfo *sensor = &context->sensor;
+
+    MMAL_COMPONENT_T *cameraInfo;
+    if (MMAL_SUCCESS != mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA_INFO, &cameraInfo)) {
+        logWarn("Failed to create camera info component");
+        return 0;
+    }
+
+    MMAL_PARAMETER_CAMERA_INFO_V2_T param = {{MMAL_PARAMETER_CAMERA_INFO, sizeof(param)}};
+
+    int32_t cameraNumber = context->config.camera.cameraNumber;
+    int result = 0;
+
+    if (MMAL_SUCCESS == mmal_port_parameter_get(cameraInfo->control, &param.hdr)) {
+        if (cameraNumber >= 0 && (uint32_t) cameraNumber < param.num_cameras && cameraNumber < MMAL_PARAMETER_CAMERA_INFO_MAX_CAMERAS) {
+            MMAL_PARAMETER_CAMERA_INFO_CAMERA_V2_T *camera = &param.cameras[cameraNumber];
+
+            strncpy(sensor->name, camera->camera_name, sizeof(sensor->name) - 1);
+            sensor->width  = camera->max_width;
+            sensor->height = camera->max_height;
+
+            logDebug("Detected sensor %s (%ux%u) for camera %d", sensor->name, sensor->width, sensor->height, cameraNumber);
+
+            result = 1;
+        } else {
+            logWarn("Camera %d not found, %u camera(s) attached", cameraNumber, param.num_cameras);
+        }
+    } else {
+        logWarn("Failed to get camera info");
+    }
+
+    mmal_component_destroy(cameraInfo);
+
+    return result;
+}
+
+static const SensorModel *findSensorModel(const char *name) {
+    for (uint32_t i = 0; i < MODE_COUNT(SENSOR_MODELS); i++) {
+        if (!strcmp(SENSOR_MODELS[i].name, name)) {
+            return &SENSOR_MODELS[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Select the cheapest sensor mode that satisfies the configuration.
+ *
+ * A mode is suitable if the area it reads out contains the requested crop, it delivers at least the
+ * requested resolution across that crop (so nothing is upscaled), and its frame rate range allows
+ * the requested shutter speed. The cheapest suitable mode is the one that reads out the fewest
+ * pixels. If no mode is suitable, the full resolution mode is used.
+ *
+ * @param config configuration
+ * @param model sensor model
+ * @return selected mode
+ */
+static const SensorMode *selectSensorMode(const PicamConfig *config, const SensorModel *model) {
+    const CameraConfig  *camera  = &config->camera;
+    const ControlConfig *control = &config->control;
+
+    // The output is rotated after readout, so compare against the sensor orientation
+    bool transposed = config->capture.rotation == 90 || config->capture.rotation == 270;
+    double width  = transposed ? camera->height : camera->width;
+    double height = transposed ? camera->width  : camera->height;
+
+    const SensorMode *best = NULL;
+    const SensorMode *full = NULL;
+
+    for (uint32_t i = 0; i < model->modeCount; i++) {
+        const SensorMode *mode = &model->modes[i];
+
+        if (!full || (uint64_t) mode->width * mode->height > (uint64_t) full->width * full->height) {
+            full = mode;
+        }
+
+        // Normalised extent of the centred readout area
+        double areaW = (double) mode->areaWidth  / model->width;
+        double areaH = (double) mode->areaHeight / model->height;
+        double areaX = (1.0 - areaW) / 2;
+        double areaY = (1.0 - areaH) / 2;
+
+        if (control->cropX + FOV_EPSILON < areaX || control->cropX + control->cropW > areaX + areaW + FOV_EPSILON ||
+            control->cropY + FOV_EPSILON < areaY || control->cropY + control->cropH > areaY + areaH + FOV_EPSILON) {
+            continue;
+        }
+
+        if (mode->width * control->cropW / areaW < width || mode->height * control->cropH / areaH < height) {
+            continue;
+        }
+
+        if (control->shutterSpeed && control->shutterSpeed > 1000000.0 / mode->minFps) {
+            continue;
+        }
+
+        if (!best || (uint64_t) mode->width * mode->height < (uint64_t) best->width * best->height) {
+            best = mode;
+        }
+    }
+
+    return best ? best : full;
+}
@@ -0,0 +1,346 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Stacking.h"
+#include "Cpu.h"
+#include "Log.h"
+#include "Parallel.h"
+
+/**
+ * Global translation of a frame relative to the first frame, in luma pixels, always even so the
+ * chroma planes shift by whole samples.
+ */
+typedef struct StackShift {
+    int32_t x;
+    int32_t y;
+} StackShift;
+
+/**
+ * The frames being aligned, shared by every thread.
+ */
+typedef struct AlignTask {
+    const Image *frames;
+    uint32_t    *rows;
+    uint32_t    *columns;
+} AlignTask;
+
+/**
+ * The frames being stacked, shared by every band.
+ */
+typedef struct StackTask {
+    const Image      *frames;
+    const StackShift *shifts;
+    uint32_t          count;
+    Image            *output;
+    StackRowKernel    kernel;
+    StackRowKernel    edgeKernel;
+} StackTask;
+
+/**
+ * NEON row kernels, only present if the library was built with the NEON sources.
+ */
+extern void meanRowNeon(const uint8_t *const *rows, uint32_t count, uint32_t width, uint8_t *out) __attribute__((weak));
+extern void medianRowNeon(const uint8_t *const *rows, uint32_t count, uint32_t width, uint8_t *out) __attribute__((weak));
+
+static StackRowKernel selectKernel(int method);
+static void meanRowGeneric(const uint8_t *const *rows, uint32_t count, uint32_t width, uint8_t *out);
+static void medianRowGeneric(const uint8_t *const *rows, uint32_t count, uint32_t width, uint8_t *out);
+static void projectFrames(void *userdata, uint32_t start, uint32_t end);
+static int32_t findShift(const uint32_t *reference, const uint32_t *projection, uint32_t length);
+static void stackBand(void *userdata, uint32_t startRow, uint32_t endRow);
+static void stackEdgeSample(const StackTask *task, const uint8_t *const *starts, uint32_t shift, int32_t x, int32_t width, uint8_t *out);
+static int32_t clamp(int32_t value, int32_t low, int32_t high);
+
+/**
+ * Stack a number of equally exposed images of the same scene into a single, less noisy, image.
+ *
+ * Unless alignment is disabled, each frame is first registered against the first frame with a
+ * global translation, found by matching the row and column projections (sums) of the luma planes -
+ * cheap, and robust to noise since every projection sums a whole row or column. Samples shifted in
+ * from outside a frame repeat its edge.
+ *
+ * The aligned frames are combined with a mean, or a median which also rejects anything that moved
+ * in only some of the frames. The work is split into horizontal bands across several threads, and
+ * the row kernel is selected at runtime for the CPU.
+ *
+ * @param frames images to stack, all the same size
+ * @param count number of images, at most STACKING_MAX_FRAMES
+ * @param method STACKING_MEAN or STACKING_MEDIAN
+ * @param align true to align the frames before stacking; false to stack them as they are
+ * @param output stacked image, (re-)allocated here
+ * @return non-zero on success; zero on error
+ */
+int stackFrames(const Image *frames, uint32_t count, int method, bool align, Image *output) {
+    if (count == 0 || count > STACKING_MAX_FRAMES) {
+        return 0;
+    }
+
+    uint32_t width  = frames[0].width;
+    uint32_t height = frames[0].height;
+
+    if (!allocateImage(output, width, height, width, height)) {
+        return 0;
+    }
+
+    StackShift shifts[STACKING_MAX_FRAMES] = {{0}};
+
+    if (align && count > 1) {
+        AlignTask task = {
+            .frames  = frames,
+            .rows    = malloc(sizeof(uint32_t) * height * count),
+            .columns = malloc(sizeof(uint32_t) * width  * count)
+        };
+
+        if (task.rows && task.columns) {
+            runParallel(count, 1, projectFrames, &task);
+
+            for (uint32_t i = 1; i < count; i++) {
+                shifts[i].x = findShift(task.columns, task.columns + (size_t) i * width , width );
+                shifts[i].y = findShift(task.rows   , task.rows    + (size_t) i * height, height);
+                logDebug("Stacked frame %u shifted by %d,%d", i, shifts[i].x, shifts[i].y);
+            }
+        } else {
+            logWarn("Failed to allocate projections, stacking without alignment");
+        }
+
+        free(task.rows);
+        free(task.columns);
+    }
+
+    StackTask task = {
+        .frames     = frames,
+        .shifts     = shifts,
+        .count      = count,
+        .output     = output,
+        .kernel     = selectKernel(method),
+        .edgeKernel = method == STACKING_MEDIAN ? medianRowGeneric : meanRowGeneric
+    };
+
+    // Bands must start on an even row so each one owns whole chroma rows
+    runParallel(height, 2, stackBand, &task);
+
+    return 1;
+}
+
+// === Private implementation =====================================================================
+
+static StackRowKernel selectKernel(int method) {
+    bool neon = cpuHasFeature(CPU_FEATURE_NEON);
+    if (method == STACKING_MEDIAN) {
+        return medianRowNeon && neon ? medianRowNeon : medianRowGeneric;
+    }
+    return meanRowNeon && neon ? meanRowNeon : meanRowGeneric;
+}
+
+/**
+ * Average one row, rounding to nearest - this must match the SIMD kernels exactly so results do
+ * not depend on the CPU.
+ *
+ * @param rows row to stack, for each image
+ * @param count number of images
+ * @param width number of samples in the row
+ * @param out output row
+ */
+static void meanRowGeneric(const uint8_t *const *rows, uint32_t count, uint32_t width, uint8_t *out) {
+    for (uint32_t x = 0; x < width; x++) {
+        uint32_t sum = count / 2;
+        for (uint32_t i = 0; i < count; i++) {
+            sum += rows[i][x];
+        }
+        out[x] = (uint8_t) (sum / count);
+    }
+}
+
+/**
+ * Take the median of one row, for an even count the mean of the two middle values rounded up -
+ * this must match the SIMD kernels exactly so results do not depend on the CPU.
+ *
+ * @param rows row to stack, for each image
+ * @param count number of images
+ * @param width number of samples in the row
+ * @param out output row
+ */
+static void medianRowGeneric(const uint8_t *const *rows, uint32_t count, uint32_t width, uint8_t *out) {
+    uint8_t values[STACKING_MAX_FRAMES];
+
+    for (uint32_t x = 0; x < width; x++) {
+        for (uint32_t i = 0; i < count; i++) {
+            uint8_t  value = rows[i][x];
+            uint32_t j     = i;
+            for (; j > 0 && values[j - 1] > value; j--) {
+                values[j] = values[j - 1];
+            }
+            values[j] = value;
+        }
+
+        uint32_t middle = count / 2;
+        out[x] = count & 1 ? values[middle] : (uint8_t) ((values[middle - 1] + values[middle] + 1) >> 1);
+    }
+}
+
+/**
+ * Sum the rows and the columns of the luma plane of some of the frames.
+ *
+ * @param userdata align task
+ * @param start first frame
+ * @param end frame after the last
+ */
+static void projectFrames(void *userdata, uint32_t start, uint32_t end) {
+    AlignTask *task = (AlignTask *) userdata;
+
+    for (uint32_t i = start; i < end; i++) {
+        const Image *frame   = &task->frames[i];
+        uint32_t    *rows    = task->rows    + (size_t) i * frame->height;
+        uint32_t    *columns = task->columns + (size_t) i * frame->width;
+
+        memset(columns, 0, sizeof(uint32_t) * frame->width);
+
+        for (uint32_t y = 0; y < frame->height; y++) {
+            const uint8_t *row = frame->data + (size_t) y * frame->stride;
+            uint32_t       sum = 0;
+            for (uint32_t x = 0; x < frame->width; x++) {
+                sum        += row[x];
+                columns[x] += row[x];
+            }
+            rows[y] = sum;
+        }
+    }
+}
+
+/**
+ * Find the even shift that best matches a projection to the reference projection.
+ *
+ * The cost is the mean absolute difference over the overlapping part, so that shifts with less
+ * overlap are not favoured.
+ *
+ * @param reference projection of the first frame
+ * @param projection projection of the frame being aligned
+ * @param length length of the projections
+ * @return shift, such that projection[k + shift] matches reference[k]
+ */
+static int32_t findShift(const uint32_t *reference, const uint32_t *projection, uint32_t length) {
+    int32_t  limit       = STACKING_MAX_SHIFT < (int32_t) length / 4 ? STACKING_MAX_SHIFT : (int32_t) length / 4;
+    int32_t  best        = 0;
+    uint64_t bestCost    = UINT64_MAX;
+    uint64_t bestOverlap = 1;
+
+    for (int32_t shift = -(limit & ~1); shift <= limit; shift += 2) {
+        uint32_t start   = shift < 0 ? -shift : 0;
+        uint32_t end     = shift > 0 ? length - shift : length;
+        uint64_t cost    = 0;
+
+        for (uint32_t k = start; k < end; k++) {
+            uint32_t a = reference[k];
+            uint32_t b = projection[k + shift];
+            cost += a > b ? a - b : b - a;
+        }
+
+        // cost / overlap < bestCost / bestOverlap, preferring no shift on a tie
+        uint64_t overlap = end - start;
+        if (cost * bestOverlap < bestCost * overlap || (cost * bestOverlap == bestCost * overlap && shift == 0)) {
+            best        = shift;
+            bestCost    = cost;
+            bestOverlap = overlap;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Stack every plane of one band of the output image.
+ *
+ * Where every frame has a sample for the whole row the selected kernel does the work, the columns
+ * at either end that some frame has been shifted away from are done one sample at a time.
+ *
+ * @param userdata stack task
+ * @param startRow first luma row of the band, always even
+ * @param endRow luma row after the end of the band
+ */
+static void stackBand(void *userdata, uint32_t startRow, uint32_t endRow) {
+    StackTask *task = (StackTask *) userdata;
+
+    const uint8_t *rows  [STACKING_MAX_FRAMES];
+    const uint8_t *starts[STACKING_MAX_FRAMES];
+
+    for (int plane = IMAGE_PLANE_Y; plane <= IMAGE_PLANE_V; plane++) {
+        uint32_t shift  = plane == IMAGE_PLANE_Y ? 0 : 1;
+        int32_t  width  = task->output->width  >> shift;
+        int32_t  height = task->output->height >> shift;
+        uint8_t *output = imagePlane(task->output, plane);
+        uint32_t stride = imagePlaneStride(task->output, plane);
+
+        // Columns where every shifted frame is inside its own bounds
+        int32_t left  = 0;
+        int32_t right = width;
+        for (uint32_t i = 0; i < task->count; i++) {
+            int32_t dx = task->shifts[i].x >> shift;
+            left  = -dx > left ? -dx : left;
+            right = width - dx < right ? width - dx : right;
+        }
+        if (right < left) {
+            right = left;
+        }
+
+        for (uint32_t row = startRow >> shift; row < endRow >> shift; row++) {
+            uint8_t *out = output + (size_t) row * stride;
+
+            for (uint32_t i = 0; i < task->count; i++) {
+                const Image *frame = &task->frames[i];
+                int32_t      y     = clamp((int32_t) row + (task->shifts[i].y >> shift), 0, height - 1);
+                starts[i] = imagePlane(frame, plane) + (size_t) y * imagePlaneStride(frame, plane);
+                rows  [i] = starts[i] + left + (task->shifts[i].x >> shift);
+            }
+
+            task->kernel(rows, task->count, right - left, out + left);
+
+            for (int32_t x = 0; x < left; x++) {
+                stackEdgeSample(task, starts, shift, x, width, out);
+            }
+            for (int32_t x = right; x < width; x++) {
+                stackEdgeSample(task, starts, shift, x, width, out);
+            }
+        }
+    }
+}
+
+/**
+ * Stack one sample of a row, repeating the edge of any frame that has been shifted away from it.
+ *
+ * @param task stack task
+ * @param starts start of the row in the plane being stacked, for each image
+ * @param shift chroma subsampling shift for the plane
+ * @param x column
+ * @param width width of the plane
+ * @param out output row
+ */
+static void stackEdgeSample(const StackTask *task, const uint8_t *const *starts, uint32_t shift, int32_t x, int32_t width, uint8_t *out) {
+    const uint8_t *samples[STACKING_MAX_FRAMES];
+    for (uint32_t i = 0; i < task->count; i++) {
+        samples[i] = starts[i] + clamp(x + (task->shifts[i].x >> shift), 0, width - 1);
+    }
+    task->edgeKernel(samples, task->count, 1, out + x);
+}
+
+static int32_t clamp(int32_t value, int32_t low, int32_t high) {
+    return value < low ? low : value > high ? high : value;
+}
@@ -0,0 +1,48 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_STACKING_H
+#define _PICAM_STACKING_H
+
+#include "Image.h"
+
+/**
+ * Maximum number of frames that can be stacked.
+ */
+#define STACKING_MAX_FRAMES 8
+
+/**
+ * Maximum translation, in luma pixels, searched for when aligning frames.
+ */
+#define STACKING_MAX_SHIFT 64
+
+/**
+ * How the aligned frames are combined.
+ */
+#define STACKING_MEAN   0
+#define STACKING_MEDIAN 1
+
+/**
+ * Row kernel, see Stacking.c.
+ */
+typedef void (*StackRowKernel)(const uint8_t *const *rows, uint32_t count, uint32_t width, uint8_t *out);
+
+int stackFrames(const Image *frames, uint32_t count, int method, bool align, Image *output);
+
+#endif // _PICAM_STACKING_H
@@ -0,0 +1,115 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include "Stacking.h"
+
+/**
+ * NEON frame stacking row kernels.
+ *
+ * This file is compiled with NEON enabled, and the kernels are only called after checking the CPU
+ * at runtime. If NEON is not available to the compiler at all, the kernels are simply left out.
+ */
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+
+void meanRowNeon(const uint8_t *const *rows, uint32_t count, uint32_t width, uint8_t *out);
+void medianRowNeon(const uint8_t *const *rows, uint32_t count, uint32_t width, uint8_t *out);
+
+/**
+ * Average one row, sixteen samples at a time - see meanRowGeneric in Stacking.c.
+ *
+ * The division by the count is a multiply by ceil(65536 / count) and a shift, which is exact for
+ * every sum that can occur with up to STACKING_MAX_FRAMES frames.
+ */
+void meanRowNeon(const uint8_t *const *rows, uint32_t count, uint32_t width, uint8_t *out) {
+    const uint16_t reciprocal = (uint16_t) ((65536 + count - 1) / count);
+
+    uint32_t x = 0;
+
+    if (count > 1) {
+        for (; x + 16 <= width; x += 16) {
+            uint16x8_t sumLow  = vdupq_n_u16(count / 2);
+            uint16x8_t sumHigh = vdupq_n_u16(count / 2);
+
+            for (uint32_t i = 0; i < count; i++) {
+                uint8x16_t value = vld1q_u8(rows[i] + x);
+                sumLow  = vaddw_u8(sumLow , vget_low_u8 (value));
+                sumHigh = vaddw_u8(sumHigh, vget_high_u8(value));
+            }
+
+            uint16x8_t meanLow  = vcombine_u16(vshrn_n_u32(vmull_n_u16(vget_low_u16(sumLow ), reciprocal), 16), vshrn_n_u32(vmull_n_u16(vget_high_u16(sumLow ), reciprocal), 16));
+            uint16x8_t meanHigh = vcombine_u16(vshrn_n_u32(vmull_n_u16(vget_low_u16(sumHigh), reciprocal), 16), vshrn_n_u32(vmull_n_u16(vget_high_u16(sumHigh), reciprocal), 16));
+
+            vst1q_u8(out + x, vcombine_u8(vmovn_u16(meanLow), vmovn_u16(meanHigh)));
+        }
+    }
+
+    for (; x < width; x++) {
+        uint32_t sum = count / 2;
+        for (uint32_t i = 0; i < count; i++) {
+            sum += rows[i][x];
+        }
+        out[x] = (uint8_t) (sum / count);
+    }
+}
+
+/**
+ * Take the median of one row, sixteen samples at a time - see medianRowGeneric in Stacking.c.
+ *
+ * The samples for each lane are sorted with an odd-even transposition network of min/max steps,
+ * count passes are enough for count values.
+ */
+void medianRowNeon(const uint8_t *const *rows, uint32_t count, uint32_t width, uint8_t *out) {
+    uint8x16_t values[STACKING_MAX_FRAMES];
+    uint32_t   middle = count / 2;
+
+    uint32_t x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        for (uint32_t i = 0; i < count; i++) {
+            values[i] = vld1q_u8(rows[i] + x);
+        }
+
+        for (uint32_t pass = 0; pass < count; pass++) {
+            for (uint32_t i = pass & 1; i + 1 < count; i += 2) {
+                uint8x16_t low = vminq_u8(values[i], values[i + 1]);
+                values[i + 1]  = vmaxq_u8(values[i], values[i + 1]);
+                values[i]      = low;
+            }
+        }
+
+        vst1q_u8(out + x, count & 1 ? values[middle] : vrhaddq_u8(values[middle - 1], values[middle]));
+    }
+
+    for (; x < width; x++) {
+        uint8_t sorted[STACKING_MAX_FRAMES];
+        for (uint32_t i = 0; i < count; i++) {
+            uint8_t  value = rows[i][x];
+            uint32_t j     = i;
+            for (; j > 0 && sorted[j - 1] > value; j--) {
+                sorted[j] = sorted[j - 1];
+            }
+            sorted[j] = value;
+        }
+        out[x] = count & 1 ? sorted[middle] : (uint8_t) ((sorted[middle - 1] + sorted[middle] + 1) >> 1);
+    }
+}
+
+#endif
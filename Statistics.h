@@ -0,0 +1,69 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_STATISTICS_H
+#define _PICAM_STATISTICS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Runtime statistics, all times are in microseconds.
+ */
+typedef struct PicamStatistics {
+    uint64_t captures;
+    uint64_t captureFailures;
+    uint64_t captureRetries;
+    uint64_t errorEvents;
+    uint64_t stalledCaptures;
+    uint64_t discardedBuffers;
+    uint64_t recoveries;
+    uint64_t recoveryFailures;
+    uint64_t lastRecoveryTime;
+    uint64_t totalRecoveryTime;
+    uint64_t droppedLogRecords;
+    uint64_t recordingFlushes;
+    uint64_t recordingOverruns;
+    uint64_t createTime;
+    uint64_t pipelineReused;
+    uint64_t lastBracketTime;
+    uint64_t lastLowLightTime;
+    uint64_t lastRgbTime;
+    uint64_t timelapseFrames;
+    uint64_t timelapseSkipped;
+    uint64_t invalidPictures;
+    uint64_t coalescedCaptures;
+    uint64_t queuedCaptures;
+    uint64_t lastQuality;
+    uint64_t targetOverruns;
+    uint64_t callbackThreads;
+    uint64_t callbackCpuTime;
+    uint64_t recoveryCpuTime;
+    uint64_t cacheReaperCpuTime;
+    uint64_t recordingWriterCpuTime;
+} PicamStatistics;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PICAM_STATISTICS_H
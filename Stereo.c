@@ -0,0 +1,147 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include "Stereo.h"
+#include "Capture.h"
+#include "RawCapture.h"
+
+static void eyeRegions(PicamContext *context, Region regions[2]);
+
+/**
+ * Capture a stereoscopic picture and deliver each eye as a separate output.
+ *
+ * The combined frame is captured raw and split natively, so each eye is encoded once rather than
+ * the combined picture being encoded, decoded, split and re-encoded. Eyes that were decimated to
+ * fit the combined frame are scaled back to their proper aspect ratio.
+ *
+ * The firmware has already applied any eye swap, so the left (or top) half of the combined frame
+ * is always delivered as the left eye.
+ *
+ * When interleaved, a single output is delivered instead - both eyes in one image of twice the
+ * height, with alternate rows from each eye.
+ *
+ * @param context global state
+ * @param encode true to encode the output with the configured encoding; false for I420 data
+ * @param interleave true to deliver one row-interleaved image; false to deliver each eye separately
+ * @param sink receives the output, tagged STEREO_EYE_LEFT and STEREO_EYE_RIGHT, or zero when interleaved
+ * @param userdata passed to the sink
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *captureStereo(PicamContext *context, bool encode, bool interleave, RegionSink sink, void *userdata) {
+    if (context->config.capture.stereoscopicMode == MMAL_STEREOSCOPIC_MODE_NONE) {
+        return "Stereoscopic mode is not enabled";
+    }
+
+    Region regions[2];
+    eyeRegions(context, regions);
+
+    if (!interleave) {
+        return captureRegions(context, regions, 2, encode, sink, userdata);
+    }
+
+    char *captureFailure = performCaptureWithRetries(context, OUTPUT_RAW, NULL, NULL);
+    if (captureFailure) {
+        return captureFailure;
+    }
+
+    if (!rawFrameComplete(context)) {
+        return "Raw capture did not deliver a complete frame";
+    }
+
+    const Image *frame = &context->rawFrame;
+
+    for (int eye = STEREO_EYE_LEFT; eye <= STEREO_EYE_RIGHT; eye++) {
+        Image *eyeImage = &context->eyeImages[eye];
+
+        uint32_t x      = (uint32_t) (regions[eye].x * frame->width ) & ~1u;
+        uint32_t y      = (uint32_t) (regions[eye].y * frame->height) & ~1u;
+        uint32_t width  = (uint32_t) (regions[eye].w * frame->width ) & ~1u;
+        uint32_t height = (uint32_t) (regions[eye].h * frame->height) & ~1u;
+
+        uint32_t eyeWidth  = regions[eye].width  ? regions[eye].width  : width;
+        uint32_t eyeHeight = regions[eye].height ? regions[eye].height : height;
+
+        if (!allocateImage(eyeImage, eyeWidth, eyeHeight, eyeWidth, eyeHeight)) {
+            return "Failed to allocate eye image";
+        }
+
+        cropScaleImage(frame, x, y, width, height, eyeImage);
+    }
+
+    const Image *left = &context->eyeImages[STEREO_EYE_LEFT];
+
+    Image *pair = &context->regionImage;
+    if (!allocateImage(pair, left->width, left->height * 2, left->width, left->height * 2)) {
+        return "Failed to allocate stereo pair image";
+    }
+
+    interleaveImages(left, &context->eyeImages[STEREO_EYE_RIGHT], pair);
+
+    const uint8_t *data   = pair->data;
+    size_t         length = imageSize(pair);
+
+    if (encode) {
+        char *encodeFailure = encodeImage(context, pair, &data, &length);
+        if (encodeFailure) {
+            return encodeFailure;
+        }
+    }
+
+    sink(userdata, 0, data, length);
+
+    return NULL;
+}
+
+/**
+ * Destroy the stereo working images.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param context global state
+ */
+void destroyStereo(PicamContext *context) {
+    freeImage(&context->eyeImages[STEREO_EYE_LEFT ]);
+    freeImage(&context->eyeImages[STEREO_EYE_RIGHT]);
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Determine the region of the combined frame occupied by each eye.
+ *
+ * A decimated eye is squashed to half size in the combined frame, so it is scaled back up to the
+ * full frame size. An eye that was not decimated is delivered at its native size.
+ *
+ * @param context global state
+ * @param regions set to the left and right eye regions
+ */
+static void eyeRegions(PicamContext *context, Region regions[2]) {
+    bool     sideBySide = context->config.capture.stereoscopicMode == MMAL_STEREOSCOPIC_MODE_SIDE_BY_SIDE;
+    uint32_t width      = context->config.camera.width  & ~1u;
+    uint32_t height     = context->config.camera.height & ~1u;
+
+    for (int eye = STEREO_EYE_LEFT; eye <= STEREO_EYE_RIGHT; eye++) {
+        regions[eye].x      = sideBySide ? eye * 0.5 : 0.0;
+        regions[eye].y      = sideBySide ? 0.0 : eye * 0.5;
+        regions[eye].w      = sideBySide ? 0.5 : 1.0;
+        regions[eye].h      = sideBySide ? 1.0 : 0.5;
+        regions[eye].width  = context->config.capture.decimate ? width  : 0;
+        regions[eye].height = context->config.capture.decimate ? height : 0;
+    }
+}
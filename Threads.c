@@ -0,0 +1,232 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+/*
+ * Scheduling and CPU time accounting for native threads.
+ *
+ * Two kinds of thread are configured separately - the MMAL callback threads, which deliver every
+ * buffer, and the worker threads. The callback threads run the encoder, raw and control callbacks,
+ * including the picture data callback of picamCapture - the Java layer makes no upcalls on them,
+ * it delivers pictures on the calling thread. The worker threads are the background threads owned
+ * by the context (recovery, cache reaper and recording writer), the logging thread (the only
+ * native thread attached to the JVM) and the band threads of runParallel, which do the bulk of the
+ * image processing.
+ *
+ * None of these threads is created with any particular scheduling, instead each thread applies the
+ * configured policy, priority and CPU affinity to itself - the MMAL threads on their first
+ * callback, the owned threads when they start, and the logging and band threads as described in
+ * Schedule.c.
+ *
+ * The CPU time of each owned thread is accounted for its whole life, while for the MMAL threads
+ * (which are shared with the firmware interface) only the time spent inside the callbacks counts.
+ * The logging and band threads are not owned by a context, so are not accounted.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "Threads.h"
+#include "Log.h"
+#include "Schedule.h"
+
+/**
+ * Names of the owned threads, for logging.
+ */
+static const char *const OWNED_THREAD_NAMES[OWNED_THREAD_COUNT] = {
+    "recovery",
+    "cache reaper",
+    "recording writer"
+};
+
+/**
+ * Marks each MMAL callback thread with the generation it was last scheduled for.
+ */
+static pthread_key_t  callbackKey;
+static pthread_once_t callbackKeyOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Source of callback thread generations, unique across every context in the process.
+ */
+static atomic_uint nextGeneration = ATOMIC_VAR_INIT(1);
+
+static void createCallbackKey(void);
+static uint64_t threadCpuTime(clockid_t clock);
+
+/**
+ * Initialise the thread accounting, once for the context.
+ *
+ * @param context global state
+ */
+void initThreads(PicamContext *context) {
+    ThreadAccounting *accounting = &context->threads;
+
+    pthread_once(&callbackKeyOnce, createCallbackKey);
+    pthread_mutex_init(&accounting->mutex, NULL);
+
+    resetCallbackThreads(context);
+}
+
+/**
+ * Destroy the thread accounting.
+ *
+ * Every owned thread must already have ended.
+ *
+ * @param context global state
+ */
+void destroyThreads(PicamContext *context) {
+    pthread_mutex_destroy(&context->threads.mutex);
+}
+
+/**
+ * Re-apply the configured scheduling to each MMAL callback thread on its next callback, and start
+ * counting the callback threads and their CPU time again.
+ *
+ * The MMAL threads may outlive a camera when the pipeline is parked, so this is needed whenever
+ * the camera is opened in case the configuration changed.
+ *
+ * @param context global state
+ */
+void resetCallbackThreads(PicamContext *context) {
+    ThreadAccounting *accounting = &context->threads;
+
+    accounting->callbackGeneration = atomic_fetch_add(&nextGeneration, 1);
+
+    atomic_store(&accounting->callbackThreads, 0);
+    atomic_store(&accounting->callbackCpuTime, 0);
+}
+
+/**
+ * Enter an MMAL callback, scheduling the calling thread if this is its first callback.
+ *
+ * This is cheap enough to call for every buffer, it never blocks.
+ *
+ * @param context global state
+ * @return CPU time of the calling thread on entry, to pass to leaveCallbackThread
+ */
+uint64_t enterCallbackThread(PicamContext *context) {
+    ThreadAccounting *accounting = &context->threads;
+    uintptr_t         generation = accounting->callbackGeneration;
+
+    if ((uintptr_t) pthread_getspecific(callbackKey) != generation) {
+        pthread_setspecific(callbackKey, (void *) generation);
+        atomic_fetch_add(&accounting->callbackThreads, 1);
+
+        ThreadConfig *config = &context->config.threads;
+        applySchedule("MMAL callback", config->callbackPolicy, config->callbackPriority, config->callbackAffinity, true);
+    }
+
+    return threadCpuTime(CLOCK_THREAD_CPUTIME_ID);
+}
+
+/**
+ * Leave an MMAL callback, accounting for the CPU time spent in it.
+ *
+ * @param context global state
+ * @param start value returned by enterCallbackThread
+ */
+void leaveCallbackThread(PicamContext *context, uint64_t start) {
+    atomic_fetch_add(&context->threads.callbackCpuTime, threadCpuTime(CLOCK_THREAD_CPUTIME_ID) - start);
+}
+
+/**
+ * Begin an owned thread, must be invoked on that thread before it does anything else.
+ *
+ * The configured worker scheduling is applied, and the thread CPU time is accounted from here.
+ *
+ * @param context global state
+ * @param thread which owned thread, e.g. OWNED_THREAD_RECOVERY
+ */
+void beginOwnedThread(PicamContext *context, int thread) {
+    ThreadAccounting *accounting = &context->threads;
+    OwnedThread      *owned      = &accounting->owned[thread];
+
+    ThreadConfig *config = &context->config.threads;
+    applySchedule(OWNED_THREAD_NAMES[thread], config->workerPolicy, config->workerPriority, config->workerAffinity, true);
+
+    pthread_mutex_lock(&accounting->mutex);
+    if (pthread_getcpuclockid(pthread_self(), &owned->clock) == 0) {
+        owned->running = true;
+    }
+    pthread_mutex_unlock(&accounting->mutex);
+}
+
+/**
+ * End an owned thread, must be invoked on that thread just before it returns.
+ *
+ * The CPU time used by the thread is kept, since the thread CPU clock goes away with the thread.
+ *
+ * @param context global state
+ * @param thread which owned thread, e.g. OWNED_THREAD_RECOVERY
+ */
+void endOwnedThread(PicamContext *context, int thread) {
+    ThreadAccounting *accounting = &context->threads;
+    OwnedThread      *owned      = &accounting->owned[thread];
+
+    pthread_mutex_lock(&accounting->mutex);
+    if (owned->running) {
+        owned->cpuTime += threadCpuTime(owned->clock);
+        owned->running  = false;
+    }
+    pthread_mutex_unlock(&accounting->mutex);
+}
+
+/**
+ * Update the thread statistics - the callback threads since the camera was opened, and the total
+ * for each owned thread including any previous instances of it.
+ *
+ * @param context global state
+ */
+void updateThreadStatistics(PicamContext *context) {
+    ThreadAccounting *accounting = &context->threads;
+    uint64_t          cpuTime[OWNED_THREAD_COUNT];
+
+    pthread_mutex_lock(&accounting->mutex);
+    for (int i = 0; i < OWNED_THREAD_COUNT; i++) {
+        OwnedThread *owned = &accounting->owned[i];
+        cpuTime[i] = owned->cpuTime + (owned->running ? threadCpuTime(owned->clock) : 0);
+    }
+    pthread_mutex_unlock(&accounting->mutex);
+
+    context->stats.callbackThreads        = atomic_load(&accounting->callbackThreads);
+    context->stats.callbackCpuTime        = atomic_load(&accounting->callbackCpuTime);
+    context->stats.recoveryCpuTime        = cpuTime[OWNED_THREAD_RECOVERY];
+    context->stats.cacheReaperCpuTime     = cpuTime[OWNED_THREAD_CACHE_REAPER];
+    context->stats.recordingWriterCpuTime = cpuTime[OWNED_THREAD_RECORDING_WRITER];
+}
+
+// === Private implementation =====================================================================
+
+static void createCallbackKey(void) {
+    pthread_key_create(&callbackKey, NULL);
+}
+
+/**
+ * Get the CPU time of a thread.
+ *
+ * @param clock thread CPU clock
+ * @return CPU time in microseconds, zero if the clock could not be read
+ */
+static uint64_t threadCpuTime(clockid_t clock) {
+    struct timespec time;
+    if (clock_gettime(clock, &time)) {
+        return 0;
+    }
+    return (uint64_t) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
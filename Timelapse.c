@@ -0,0 +1,368 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Timelapse.h"
+#include "Capture.h"
+#include "Log.h"
+#include "RawCapture.h"
+#include "Regions.h"
+
+static int createTimelapse(PicamContext *context);
+static void drainWake(PicamContext *context);
+static uint64_t clockTime(clockid_t clock);
+static int armTimer(int timerFd, uint64_t first, uint64_t period);
+static void waitUntil(clockid_t clock, uint64_t deadline);
+static char *captureTimelapseFrame(PicamContext *context, const TimelapseSchedule *schedule, TimelapseFrame *frame, char *path);
+static const char *fileExtension(int32_t encoding, bool encode);
+static int writeFile(const char *path, const uint8_t *data, size_t length);
+
+/**
+ * Run a timelapse on the calling thread, until the requested number of slots have passed or it is
+ * stopped.
+ *
+ * The slots are absolute deadlines on the selected clock, start + n * period, tracked by a timer
+ * rather than by sleeping between captures - so the period does not drift with the time taken by
+ * each capture. With no start time, the first slot is the next whole multiple of the period, so
+ * e.g. a one minute period on the realtime clock lands on each minute boundary.
+ *
+ * The timer expires the lead time before each deadline. The lead is used to settle the pipeline -
+ * recovering it if necessary, and switching the camera to raw output - and the capture is then
+ * triggered on the deadline itself, so the exposure starts on the deadline rather than the lead
+ * time early. The time each capture is actually triggered is reported along with its scheduled
+ * time.
+ *
+ * If a capture (or the sink) overruns into following slots, those slots are not captured late -
+ * each one is reported to the sink as skipped, and the timelapse continues with the next slot that
+ * has not yet passed.
+ *
+ * Frames are captured raw and encoded on the host, or delivered as I420 data. When a directory is
+ * given, each frame is written to a file named after its slot index rather than passed to the sink.
+ *
+ * @param context global state
+ * @param schedule timing and output for the timelapse
+ * @param sink receives each frame and each skipped slot
+ * @param userdata passed to the sink
+ * @return NULL on success; otherwise a description of the failure
+ */
+char *runTimelapse(PicamContext *context, const TimelapseSchedule *schedule, TimelapseSink sink, void *userdata) {
+    if (schedule->period == 0) {
+        return "Timelapse period must not be zero";
+    }
+
+    if (!createTimelapse(context)) {
+        return "Failed to create timelapse wake event";
+    }
+
+    context->timelapse.stopping = false;
+    drainWake(context);
+
+    clockid_t clock = schedule->realtime ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+
+    int timerFd = timerfd_create(clock, TFD_CLOEXEC);
+    if (timerFd < 0) {
+        logError("Failed to create timelapse timer: %s", strerror(errno));
+        return "Failed to create timelapse timer";
+    }
+
+    uint64_t now   = clockTime(clock);
+    uint64_t start = schedule->start ? schedule->start : (now / schedule->period + 1) * schedule->period;
+
+    // An explicit start time in the past is honoured, the slots already passed are reported skipped
+    while (!schedule->start && start < now + schedule->lead) {
+        start += schedule->period;
+    }
+
+    uint64_t first = start > schedule->lead ? start - schedule->lead : 1;
+
+    if (!armTimer(timerFd, first, schedule->period)) {
+        logError("Failed to arm timelapse timer: %s", strerror(errno));
+        close(timerFd);
+        return "Failed to arm timelapse timer";
+    }
+
+    logInfo("Timelapse started, first slot at %llu, period %lluus", (unsigned long long) start, (unsigned long long) schedule->period);
+
+    struct pollfd fds[2] = {
+        { .fd = timerFd                   , .events = POLLIN },
+        { .fd = context->timelapse.wakeFd , .events = POLLIN }
+    };
+
+    char     *failure = NULL;
+    bool      more    = true;
+    uint32_t  slot    = 0;
+    char      path[PATH_MAX];
+
+    while (more && !context->timelapse.stopping && (schedule->count == 0 || slot < schedule->count)) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            failure = "Failed to wait for timelapse timer";
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+
+        uint64_t expirations;
+        if (read(timerFd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+            continue;
+        }
+
+        uint64_t actual = clockTime(clock);
+
+        TimelapseFrame frame = {
+            .actualTime = actual
+        };
+
+        // Every expiration but the last is a slot that has already gone by
+        for (; expirations > 1 && more && (schedule->count == 0 || slot < schedule->count); expirations--, slot++) {
+            frame.index         = slot;
+            frame.scheduledTime = start + slot * schedule->period;
+            frame.skipped       = true;
+
+            context->stats.timelapseSkipped++;
+            logWarn("Timelapse slot %u skipped, overrun by %lldus", slot, (long long) (actual - frame.scheduledTime));
+
+            more = sink(userdata, &frame) != 0;
+        }
+
+        if (!more || (schedule->count != 0 && slot >= schedule->count)) {
+            break;
+        }
+
+        frame.index         = slot;
+        frame.scheduledTime = start + slot * schedule->period;
+        frame.skipped       = false;
+
+        // Settle during the lead, then trigger on the deadline - a late slot is triggered at once
+        if (schedule->lead) {
+            prepareCapture(context, OUTPUT_RAW);
+            waitUntil(clock, frame.scheduledTime);
+            frame.actualTime = clockTime(clock);
+        }
+
+        failure = captureTimelapseFrame(context, schedule, &frame, path);
+        if (failure) {
+            break;
+        }
+
+        context->stats.timelapseFrames++;
+
+        more = sink(userdata, &frame) != 0;
+
+        slot++;
+    }
+
+    close(timerFd);
+
+    logInfo("Timelapse finished after %u slots", slot);
+
+    return failure;
+}
+
+/**
+ * Stop a running timelapse, from any thread.
+ *
+ * A capture that is already in progress is completed first.
+ *
+ * @param context global state
+ */
+void stopTimelapse(PicamContext *context) {
+    context->timelapse.stopping = true;
+    if (context->timelapse.created) {
+        uint64_t value = 1;
+        if (write(context->timelapse.wakeFd, &value, sizeof(value)) != sizeof(value)) {
+            logWarn("Failed to wake timelapse");
+        }
+    }
+}
+
+/**
+ * Destroy the timelapse wake event.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param context global state
+ */
+void destroyTimelapse(PicamContext *context) {
+    if (context->timelapse.created) {
+        close(context->timelapse.wakeFd);
+        context->timelapse.created = false;
+    }
+}
+
+// === Private implementation =====================================================================
+
+static int createTimelapse(PicamContext *context) {
+    if (!context->timelapse.created) {
+        context->timelapse.wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (context->timelapse.wakeFd < 0) {
+            logError("Failed to create timelapse wake event: %s", strerror(errno));
+            return 0;
+        }
+        context->timelapse.created = true;
+    }
+    return 1;
+}
+
+/**
+ * Discard a stop request left over from when no timelapse was running.
+ *
+ * @param context global state
+ */
+static void drainWake(PicamContext *context) {
+    uint64_t value;
+    while (read(context->timelapse.wakeFd, &value, sizeof(value)) == sizeof(value)) {
+    }
+}
+
+static uint64_t clockTime(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Arm a timer with an absolute first expiry and a fixed interval.
+ *
+ * The kernel counts every interval that elapses, even if the timer is not read in time, which is
+ * how overruns are detected.
+ *
+ * @param timerFd timer
+ * @param first absolute time of the first expiry, in microseconds
+ * @param period interval in microseconds
+ * @return non-zero on success; zero on error
+ */
+static int armTimer(int timerFd, uint64_t first, uint64_t period) {
+    struct itimerspec spec = {
+        .it_value    = { .tv_sec = first  / 1000000, .tv_nsec = (first  % 1000000) * 1000 },
+        .it_interval = { .tv_sec = period / 1000000, .tv_nsec = (period % 1000000) * 1000 }
+    };
+    return timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL) == 0;
+}
+
+/**
+ * Sleep until an absolute time, returning at once if it has already passed.
+ *
+ * @param clock clock the time is on
+ * @param deadline absolute time in microseconds
+ */
+static void waitUntil(clockid_t clock, uint64_t deadline) {
+    struct timespec time = { .tv_sec = deadline / 1000000, .tv_nsec = (deadline % 1000000) * 1000 };
+    while (clock_nanosleep(clock, TIMER_ABSTIME, &time, NULL) == EINTR) {
+    }
+}
+
+/**
+ * Capture one frame of a timelapse, and either write it to a file or attach the data to the frame.
+ *
+ * @param context global state
+ * @param schedule timing and output for the timelapse
+ * @param frame frame to capture, the output is set here
+ * @param path buffer of PATH_MAX characters for the file name, if writing to a file
+ * @return NULL on success; otherwise a description of the failure
+ */
+static char *captureTimelapseFrame(PicamContext *context, const TimelapseSchedule *schedule, TimelapseFrame *frame, char *path) {
+    char *captureFailure = performCaptureWithRetries(context, OUTPUT_RAW, NULL, NULL);
+    if (captureFailure) {
+        return captureFailure;
+    }
+
+    if (!rawFrameComplete(context)) {
+        return "Raw capture did not deliver a complete frame";
+    }
+
+    frame->data   = context->rawFrame.data;
+    frame->length = imageSize(&context->rawFrame);
+
+    if (schedule->encode) {
+        char *encodeFailure = encodeImage(context, &context->rawFrame, &frame->data, &frame->length);
+        if (encodeFailure) {
+            return encodeFailure;
+        }
+    }
+
+    if (schedule->directory) {
+        snprintf(path, PATH_MAX, "%s/%06u.%s", schedule->directory, frame->index, fileExtension(context->config.encoder.encoding, schedule->encode));
+
+        if (!writeFile(path, frame->data, frame->length)) {
+            logError("Failed to write timelapse frame %s: %s", path, strerror(errno));
+            return "Failed to write timelapse frame";
+        }
+
+        frame->data   = NULL;
+        frame->length = 0;
+        frame->path   = path;
+    }
+
+    return NULL;
+}
+
+static const char *fileExtension(int32_t encoding, bool encode) {
+    if (!encode) {
+        return "yuv";
+    }
+    switch (encoding) {
+        case MMAL_ENCODING_JPEG:
+            return "jpg";
+        case MMAL_ENCODING_PNG:
+            return "png";
+        case MMAL_ENCODING_BMP:
+            return "bmp";
+        case MMAL_ENCODING_GIF:
+            return "gif";
+        default:
+            return "bin";
+    }
+}
+
+static int writeFile(const char *path, const uint8_t *data, size_t length) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return 0;
+    }
+
+    while (length) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return 0;
+        }
+        data   += written;
+        length -= written;
+    }
+
+    return close(fd) == 0;
+}
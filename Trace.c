@@ -0,0 +1,165 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Log.h"
+#include "Trace.h"
+
+/**
+ * Size of the stdio buffer for the trace file, so recording an event is usually just a copy.
+ */
+#define TRACE_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * Initialise the trace recorder, once for the lifetime of the context.
+ *
+ * @param context global state
+ */
+void initTrace(PicamContext *context) {
+    pthread_mutex_init(&context->trace.mutex, NULL);
+    context->trace.active = false;
+    context->trace.file   = NULL;
+}
+
+/**
+ * Destroy the trace recorder, stopping any trace.
+ *
+ * @param context global state
+ */
+void destroyTrace(PicamContext *context) {
+    stopTrace(context);
+    pthread_mutex_destroy(&context->trace.mutex);
+}
+
+/**
+ * Start recording a trace of capture activity to a file, replacing any trace already running.
+ *
+ * Every capture, camera control event, encoder buffer and picture data upcall is recorded with a
+ * timestamp. The data of each encoder buffer is recorded too if payloads are requested, this makes
+ * a much larger trace but lets the replay tool reproduce the exact pictures.
+ *
+ * @param context global state
+ * @param path trace file path
+ * @param payload true to record the encoder buffer data
+ * @return non-zero on success; zero on error
+ */
+int startTrace(PicamContext *context, const char *path, bool payload) {
+    Trace *trace = &context->trace;
+
+    stopTrace(context);
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        logError("Failed to open trace file %s", path);
+        return 0;
+    }
+
+    setvbuf(file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+    TraceHeader header = {
+        .magic     = TRACE_MAGIC,
+        .version   = TRACE_VERSION,
+        .flags     = payload ? TRACE_FLAG_PAYLOAD : 0,
+        .startTime = traceTime()
+    };
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        logError("Failed to write trace file %s", path);
+        fclose(file);
+        return 0;
+    }
+
+    pthread_mutex_lock(&trace->mutex);
+    trace->file    = file;
+    trace->payload = payload;
+    trace->start   = header.startTime;
+    trace->active  = true;
+    pthread_mutex_unlock(&trace->mutex);
+
+    logInfo("Started trace to %s", path);
+
+    return 1;
+}
+
+/**
+ * Stop recording a trace, flushing and closing the file.
+ *
+ * It is safe to call this method no matter what the state is.
+ *
+ * @param context global state
+ */
+void stopTrace(PicamContext *context) {
+    Trace *trace = &context->trace;
+
+    pthread_mutex_lock(&trace->mutex);
+    FILE *file = trace->file;
+    trace->active = false;
+    trace->file   = NULL;
+    pthread_mutex_unlock(&trace->mutex);
+
+    if (file) {
+        fclose(file);
+        logInfo("Stopped trace");
+    }
+}
+
+/**
+ * Record an event in the trace, if one is being recorded.
+ *
+ * The time and payload length of the record are filled in here. This may be invoked from any
+ * thread, including the MMAL callback threads.
+ *
+ * @param context global state
+ * @param record event to record
+ * @param payload data to record after the event, of the record length; or NULL for none
+ */
+void traceRecord(PicamContext *context, TraceRecord *record, const uint8_t *payload) {
+    Trace *trace = &context->trace;
+
+    pthread_mutex_lock(&trace->mutex);
+
+    if (trace->file) {
+        record->time          = traceTime() - trace->start;
+        record->payloadLength = payload && trace->payload ? record->length : 0;
+
+        if (fwrite(record, sizeof(TraceRecord), 1, trace->file) != 1 || (record->payloadLength && fwrite(payload, record->payloadLength, 1, trace->file) != 1)) {
+            // A trace that has lost records is misleading, so give up on it
+            logError("Failed to write trace, stopping");
+            fclose(trace->file);
+            trace->file   = NULL;
+            trace->active = false;
+        }
+    }
+
+    pthread_mutex_unlock(&trace->mutex);
+}
+
+/**
+ * Get the time for a trace record.
+ *
+ * @return monotonic time in microseconds
+ */
+uint64_t traceTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
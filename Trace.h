@@ -0,0 +1,95 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_TRACE_H
+#define _PICAM_TRACE_H
+
+#include "Picam.h"
+
+/**
+ * Trace file format.
+ *
+ * A trace file is a header followed by records, each record optionally followed by a payload, all
+ * in the native byte order of the machine that recorded it. Times are in microseconds from the
+ * start of the trace.
+ */
+#define TRACE_MAGIC   "PCTR"
+#define TRACE_VERSION 1
+
+/**
+ * Trace header flags.
+ */
+#define TRACE_FLAG_PAYLOAD 0x01
+
+/**
+ * Trace record types, and the meaning of the record fields for each.
+ *
+ * TRACE_CAPTURE_BEGIN  value = generation, flags = encoding (zero for raw output)
+ * TRACE_CAPTURE_END    value = generation, flags = non-zero if the capture failed, length = bytes
+ *                      delivered
+ * TRACE_CONTROL_EVENT  value = event command, flags = status for an error event
+ * TRACE_ENCODER_BUFFER value = generation (zero if discarded), flags = buffer flags, length and pts
+ *                      of the buffer, with the buffer data as payload if payloads are recorded
+ * TRACE_UPCALL         value = bytes accepted, length = bytes offered, duration of the upcall,
+ *                      flags = TRACE_UPCALL_DEFERRED for a picture collected natively and handed to
+ *                      the application afterwards on the requesting thread (picamCaptureShared)
+ */
+#define TRACE_CAPTURE_BEGIN  1
+#define TRACE_CAPTURE_END    2
+#define TRACE_CONTROL_EVENT  3
+#define TRACE_ENCODER_BUFFER 4
+#define TRACE_UPCALL         5
+
+/**
+ * Trace upcall record flags.
+ */
+#define TRACE_UPCALL_DEFERRED 0x01
+
+typedef struct TraceHeader {
+    char     magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t startTime;
+} TraceHeader;
+
+typedef struct TraceRecord {
+    uint64_t time;
+    int64_t  pts;
+    uint32_t type;
+    uint32_t length;
+    uint32_t flags;
+    uint32_t value;
+    uint32_t duration;
+    uint32_t payloadLength;
+} TraceRecord;
+
+void initTrace(PicamContext *context);
+void destroyTrace(PicamContext *context);
+int startTrace(PicamContext *context, const char *path, bool payload);
+void stopTrace(PicamContext *context);
+void traceRecord(PicamContext *context, TraceRecord *record, const uint8_t *payload);
+uint64_t traceTime(void);
+
+/**
+ * Check whether a trace is being recorded, cheaply, before doing any work to record an event.
+ */
+#define tracing(context) ((context)->trace.active)
+
+#endif // _PICAM_TRACE_H
@@ -0,0 +1,386 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+/*
+ * Offline replay of a capture trace, see Trace.c.
+ *
+ * The encoder buffers recorded in a trace are fed back through the same delivery code used by the
+ * encoder buffer callback, at the original pace or faster, so the delivery path can be measured
+ * and regression-tested on any Linux machine without a camera:
+ *
+ *   picam-replay [-s speed] [-o directory] [-v] trace-file
+ *
+ *   -s speed      replay speed, 1 for the original pace (the default), 0 for as fast as possible
+ *   -o directory  write each replayed picture to a file in the directory
+ *   -v            report every control event and upcall recorded in the trace
+ *
+ * A trace recorded without payloads replays buffers of the recorded sizes filled with zeroes.
+ *
+ * Upcalls made to the application after a shared capture (picamCaptureShared) happen on the
+ * requesting thread once the capture is over, so they can not be replayed, but the recorded times
+ * are reported separately - this is where a slow Java picture handler shows up.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Delivery.h"
+#include "Log.h"
+#include "Trace.h"
+
+/**
+ * Replay state.
+ */
+typedef struct Replay {
+    double    speed;
+    bool      verbose;
+    const char *directory;
+    FILE     *output;
+    uint64_t  startTime;
+    uint64_t  firstTime;
+    bool      started;
+    bool      inCapture;
+    bool      finished;
+    uint64_t  captureStart;
+    uint32_t  buffers;
+    uint64_t  slowestBuffer;
+    uint64_t  captures;
+    uint64_t  failedCaptures;
+    uint64_t  totalDelivery;
+    uint64_t  totalBytes;
+    uint64_t  discardedBuffers;
+    uint64_t  deferredUpcalls;
+    uint64_t  deferredBytes;
+    uint64_t  deferredTime;
+    uint32_t  slowestDeferred;
+} Replay;
+
+static uint32_t replayPictureData(void *userdata, const uint8_t *data, uint32_t length);
+static void waitForRecord(Replay *replay, const TraceRecord *record);
+static void beginCapture(PicamContext *context, Replay *replay, const TraceRecord *record);
+static void replayBuffer(PicamContext *context, Replay *replay, const TraceRecord *record, const uint8_t *payload);
+static void endCapture(PicamContext *context, Replay *replay, const TraceRecord *record);
+static void reportUpcall(Replay *replay, const TraceRecord *record);
+static void usage(const char *name);
+
+int main(int argc, char **argv) {
+    Replay replay = {
+        .speed = 1.0
+    };
+
+    int option;
+    while ((option = getopt(argc, argv, "s:o:v")) != -1) {
+        switch (option) {
+            case 's':
+                replay.speed = atof(optarg);
+                break;
+            case 'o':
+                replay.directory = optarg;
+                break;
+            case 'v':
+                replay.verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1 || replay.speed < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[optind], "rb");
+    if (!file) {
+        fprintf(stderr, "Failed to open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, 4) != 0 || header.version != TRACE_VERSION) {
+        fprintf(stderr, "%s is not a version %d picam trace\n", argv[optind], TRACE_VERSION);
+        fclose(file);
+        return 1;
+    }
+
+    printf("Replaying %s, %s payloads, at %s\n", argv[optind], header.flags & TRACE_FLAG_PAYLOAD ? "with" : "without", replay.speed > 0 ? "recorded pace" : "full speed");
+    if (replay.speed > 0 && replay.speed != 1.0) {
+        printf("Pace is scaled by %.2f\n", replay.speed);
+    }
+
+    startLogging();
+
+    static PictureDelivery delivery;
+    delivery.callback = replayPictureData;
+    delivery.userdata = &replay;
+
+    static PicamContext context;
+    context.delivery = &delivery;
+
+    Bytes       payload = {0};
+    TraceRecord record;
+
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        // Buffers recorded without payload are replayed as zeroes, so the payload is always sized
+        size_t size = record.type == TRACE_ENCODER_BUFFER ? record.length : record.payloadLength;
+        resetBytes(&payload);
+        if (!reserveBytes(&payload, size ? size : 1)) {
+            fprintf(stderr, "Failed to allocate %zu bytes\n", size);
+            break;
+        }
+        memset(payload.data, 0, size);
+        if (record.payloadLength && fread(payload.data, record.payloadLength, 1, file) != 1) {
+            fprintf(stderr, "Trace is truncated\n");
+            break;
+        }
+
+        waitForRecord(&replay, &record);
+
+        switch (record.type) {
+            case TRACE_CAPTURE_BEGIN:
+                beginCapture(&context, &replay, &record);
+                break;
+            case TRACE_ENCODER_BUFFER:
+                replayBuffer(&context, &replay, &record, payload.data);
+                break;
+            case TRACE_CAPTURE_END:
+                endCapture(&context, &replay, &record);
+                break;
+            case TRACE_CONTROL_EVENT:
+                if (replay.verbose) {
+                    printf("%10" PRIu64 "us control event 0x%08x status %u\n", record.time, record.value, record.flags);
+                }
+                break;
+            case TRACE_UPCALL:
+                reportUpcall(&replay, &record);
+                break;
+            default:
+                break;
+        }
+    }
+
+    fclose(file);
+    freeBytes(&payload);
+    freeBytes(&context.pictureData);
+
+    if (replay.output) {
+        fclose(replay.output);
+    }
+
+    stopLogging();
+
+    printf("%" PRIu64 " captures replayed, %" PRIu64 " failed, %" PRIu64 " invalid pictures, %" PRIu64 " discarded buffers\n",
+        replay.captures, replay.failedCaptures, (uint64_t) context.stats.invalidPictures, replay.discardedBuffers);
+    if (replay.captures) {
+        printf("%" PRIu64 " bytes delivered, mean delivery time %" PRIu64 "us per capture\n", replay.totalBytes, replay.totalDelivery / replay.captures);
+    }
+    if (replay.deferredUpcalls) {
+        printf("%" PRIu64 " recorded deferred upcalls, %" PRIu64 " bytes, mean %" PRIu64 "us, slowest %uus\n",
+            replay.deferredUpcalls, replay.deferredBytes, replay.deferredTime / replay.deferredUpcalls, replay.slowestDeferred);
+    }
+
+    return replay.failedCaptures || context.stats.invalidPictures ? 2 : 0;
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Picture data callback for the replay, writes the picture to a file if requested.
+ *
+ * @param userdata replay state
+ * @param data picture data
+ * @param length length of the picture data
+ * @return number of bytes consumed
+ */
+static uint32_t replayPictureData(void *userdata, const uint8_t *data, uint32_t length) {
+    Replay *replay = (Replay *) userdata;
+    if (replay->output && fwrite(data, length, 1, replay->output) != 1) {
+        return 0;
+    }
+    return length;
+}
+
+/**
+ * Wait until it is time to replay a record, according to the replay speed.
+ *
+ * @param replay replay state
+ * @param record next record
+ */
+static void waitForRecord(Replay *replay, const TraceRecord *record) {
+    if (!replay->started) {
+        replay->startTime = traceTime();
+        replay->firstTime = record->time;
+        replay->started   = true;
+    }
+
+    if (replay->speed <= 0) {
+        return;
+    }
+
+    uint64_t due = replay->startTime + (uint64_t) ((record->time - replay->firstTime) / replay->speed);
+    uint64_t now = traceTime();
+    if (due > now) {
+        uint64_t delay = due - now;
+        struct timespec sleep = { delay / 1000000, (delay % 1000000) * 1000 };
+        while (nanosleep(&sleep, &sleep) && errno == EINTR) {
+        }
+    }
+}
+
+/**
+ * Begin replaying a capture, resetting the delivery state exactly as a real capture does.
+ *
+ * @param context replay context
+ * @param replay replay state
+ * @param record capture begin record
+ */
+static void beginCapture(PicamContext *context, Replay *replay, const TraceRecord *record) {
+    context->bytesDelivered = 0;
+    resetBytes(&context->pictureData);
+    resetJpegParser(&context->jpegParser, record->flags == MMAL_ENCODING_JPEG);
+
+    if (replay->output) {
+        fclose(replay->output);
+        replay->output = NULL;
+    }
+
+    if (replay->directory && record->flags) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/capture-%u.%s", replay->directory, record->value, record->flags == MMAL_ENCODING_JPEG ? "jpg" : "bin");
+        replay->output = fopen(path, "wb");
+        if (!replay->output) {
+            fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        }
+    }
+
+    replay->inCapture     = true;
+    replay->finished      = false;
+    replay->buffers       = 0;
+    replay->slowestBuffer = 0;
+    replay->captureStart  = traceTime();
+}
+
+/**
+ * Replay an encoder buffer through the delivery code, as the encoder buffer callback does.
+ *
+ * @param context replay context
+ * @param replay replay state
+ * @param record encoder buffer record
+ * @param payload buffer data, zeroes if the trace has no payload
+ */
+static void replayBuffer(PicamContext *context, Replay *replay, const TraceRecord *record, const uint8_t *payload) {
+    if (!record->value) {
+        replay->discardedBuffers++;
+        return;
+    }
+
+    if (!replay->inCapture || replay->finished) {
+        return;
+    }
+
+    bool frameEnd = record->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED);
+    bool failed   = record->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED;
+
+    if (record->length) {
+        uint64_t start = traceTime();
+        if (!deliverPictureData(context, payload, record->length)) {
+            frameEnd = true;
+            failed   = true;
+        }
+        uint64_t elapsed = traceTime() - start;
+        if (elapsed > replay->slowestBuffer) {
+            replay->slowestBuffer = elapsed;
+        }
+        replay->buffers++;
+    }
+
+    if (frameEnd) {
+        finishPictureData(context, failed);
+        replay->finished = true;
+    }
+}
+
+/**
+ * Finish replaying a capture, and report on it.
+ *
+ * @param context replay context
+ * @param replay replay state
+ * @param record capture end record
+ */
+static void endCapture(PicamContext *context, Replay *replay, const TraceRecord *record) {
+    if (!replay->inCapture) {
+        return;
+    }
+
+    uint64_t elapsed = traceTime() - replay->captureStart;
+    const JpegInfo *info = &context->jpegParser.info;
+
+    printf("Capture %u: %u bytes in %u buffers (recorded %u bytes%s), %" PRIu64 "us, slowest buffer %" PRIu64 "us%s\n",
+        record->value, context->bytesDelivered, replay->buffers, record->length, record->flags ? ", failed" : "", elapsed, replay->slowestBuffer,
+        context->jpegParser.enabled ? (info->valid ? ", valid JPEG" : ", invalid JPEG") : "");
+
+    replay->captures++;
+    replay->totalDelivery += elapsed;
+    replay->totalBytes    += context->bytesDelivered;
+    if (record->flags || !replay->finished) {
+        replay->failedCaptures++;
+    }
+    replay->inCapture = false;
+}
+
+/**
+ * Report an upcall recorded in the trace.
+ *
+ * Upcalls made during the capture are reported as they were recorded, the replay makes its own.
+ * Deferred upcalls, made after a shared capture, are also totalled for the summary.
+ *
+ * @param replay replay state
+ * @param record upcall record
+ */
+static void reportUpcall(Replay *replay, const TraceRecord *record) {
+    bool deferred = record->flags & TRACE_UPCALL_DEFERRED;
+
+    if (replay->verbose) {
+        printf("%10" PRIu64 "us recorded %supcall %u of %u bytes in %uus\n", record->time, deferred ? "deferred " : "", record->value, record->length, record->duration);
+    }
+
+    if (deferred) {
+        replay->deferredUpcalls++;
+        replay->deferredBytes += record->value;
+        replay->deferredTime  += record->duration;
+        if (record->duration > replay->slowestDeferred) {
+            replay->slowestDeferred = record->duration;
+        }
+    }
+}
+
+/**
+ * Print the command line usage.
+ *
+ * @param name program name
+ */
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-s speed] [-o directory] [-v] trace-file\n", name);
+}
@@ -9,5 +9,5 @@ JNI_INCLUDE=/usr/lib/jvm/default-java/include
 JNI_LIB=/usr/lib/jvm/default-java/lib
 MMAL_INCLUDE=/disks/store/linux/raspi/userland
 OTHER_INCLUDE=/disks/store/linux/raspi/userland/interface/vcos/pthreads
-SRC="uk_co_caprica_picam_Camera.c Camera.c Configuration.c Defaults.c Encoder.c Port.c"
-gcc -I"$JNI_INCLUDE" -I"$JNI_INCLUDE/linux" -I"$OTHER_INCLUDE" -I"$MMAL_INCLUDE" -L"$JNI_LIB" -o $LIBRARY -shared -Wl,-soname,$LIBRARY $SRC -lc
+SRC="uk_co_caprica_picam_Camera.c JniConfiguration.c JniStatistics.c Annotation.c Bayer.c BayerNeon.c BayerUnpack.c Bracket.c Bytes.c Camera.c Capture.c CaptureQueue.c Cpu.c Defaults.c Delivery.c Encoder.c ExposureLock.c FrameEncoder.c Fusion.c FusionNeon.c HostEncoder.c Image.c Jpeg.c Log.c LowLight.c Parallel.c PicamCore.c Pipeline.c PipelineCache.c Port.c RateControl.c RawCapture.c Recorder.c RecordingBuffer.c Recovery.c Regions.c Rgb.c RgbCapture.c RgbNeon.c Schedule.c Sensor.c Stacking.c StackingNeon.c Stereo.c Threads.c Timelapse.c Trace.c"
+gcc -O2 -fvisibility=hidden -I"$JNI_INCLUDE" -I"$JNI_INCLUDE/linux" -I"$OTHER_INCLUDE" -I"$MMAL_INCLUDE" -L"$JNI_LIB" -o $LIBRARY -shared -Wl,-soname,$LIBRARY $SRC -lc -lm
@@ -1,12 +1,8 @@
 #
 # Basic build script for building the shared library on the Pi
 #
-VERSION=2.0.1
-LIBRARY=picam-$VERSION.so
-JNI_INCLUDE=/usr/lib/jvm/java-9-openjdk-armhf/include
-JNI_LIB=/usr/lib/jvm/java-9-openjdk-armhf/lib
-PI_INCLUDE=/opt/vc/include
-PI_LIB=/opt/vc/lib
-LDFLAGS="-lc -lmmal -lmmal_core -lmmal_util"
-SRC="uk_co_caprica_picam_Camera.c Camera.c Configuration.c Defaults.c Encoder.c Port.c"
-gcc -I"$JNI_INCLUDE" -I"$JNI_INCLUDE/linux" -I"$PI_INCLUDE" -L"$PI_LIB" -o $LIBRARY -shared -Wl,-soname,$LIBRARY $SRC $LDFLAGS
+# This is now just a wrapper around the Makefile, which builds an optimised library for the Pi
+# doing the build - see the Makefile for cross-compiling all of the optimised variants.
+#
+JAVA_HOME=/usr/lib/jvm/java-9-openjdk-armhf
+make JAVA_HOME="$JAVA_HOME" PI_INCLUDE=/opt/vc/include PI_LIB=/opt/vc/lib "$@"
@@ -0,0 +1,240 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+/*
+ * Host checks for the raw Bayer header parsing, unpack and demosaic, see BayerUnpack.c.
+ *
+ * Rows of known pixels are packed the way the firmware packs them, including the right padding and
+ * the row alignment, and must unpack to the same pixels. The demosaic is compared against a plain
+ * per-pixel formulation of the same bilinear interpolation. Both go through the kernels selected
+ * for the CPU, so on a CPU with NEON this also checks the NEON kernels match the generic ones.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "BayerUnpack.h"
+#include "Check.h"
+#include "Log.h"
+
+#define HEADER_SIZE 32768
+
+static void checkHeader(void);
+static void checkStride(void);
+static void checkUnpack(uint32_t bitDepth, uint32_t width, uint32_t height, uint32_t paddingRight);
+static void checkDemosaic(uint32_t width, uint32_t height, uint32_t bayerOrder);
+static void packRow(const uint16_t *pixels, uint32_t width, uint32_t bitDepth, uint8_t *packed);
+static uint32_t colourAt(uint32_t bayerOrder, uint32_t x, uint32_t y);
+static uint32_t mirror(int32_t value, uint32_t limit);
+
+int main(void) {
+    setLogLevel(LOG_LEVEL_OFF);
+
+    checkHeader();
+    checkStride();
+
+    const uint32_t paddings[] = { 0, 4, 28 };
+
+    for (uint32_t bitDepth = 10; bitDepth <= 12; bitDepth += 2) {
+        for (uint32_t width = 2; width <= 72; width += 2) {
+            for (uint32_t i = 0; i < sizeof(paddings) / sizeof(paddings[0]); i++) {
+                checkUnpack(bitDepth, width, 3, paddings[i]);
+            }
+        }
+        checkUnpack(bitDepth, 3280, 4, 16);
+    }
+
+    for (uint32_t bayerOrder = BAYER_ORDER_RGGB; bayerOrder <= BAYER_ORDER_GRBG; bayerOrder++) {
+        for (uint32_t width = 2; width <= 40; width++) {
+            checkDemosaic(width, 2 + width % 5, bayerOrder);
+        }
+        checkDemosaic(1014, 7, bayerOrder);
+    }
+
+    return checkResult("bayer");
+}
+
+// === Private implementation =====================================================================
+
+static void checkHeader(void) {
+    static uint8_t block[HEADER_SIZE + 64];
+
+    memset(block, 0, sizeof(block));
+    memcpy(block, "BRCM", 4);
+    memcpy(block + 176, "imx219", 6);
+    block[176 + 32] = 0xD0;
+    block[176 + 33] = 0x0C;
+    block[176 + 34] = 0x98;
+    block[176 + 35] = 0x09;
+    block[176 + 36] = 0x1C;
+    block[176 + 68] = BAYER_ORDER_BGGR;
+
+    BayerHeader header;
+
+    CHECK(readBayerHeader(block, sizeof(block), &header));
+    CHECK(strcmp(header.name, "imx219") == 0);
+    CHECK(header.width == 3280);
+    CHECK(header.height == 2456);
+    CHECK(header.paddingRight == 28);
+    CHECK(header.bayerOrder == BAYER_ORDER_BGGR);
+    CHECK(header.packed == block + HEADER_SIZE);
+    CHECK(header.packedLength == 64);
+
+    // A name filling the whole field is still terminated
+    memset(block + 176, 'x', BAYER_NAME_LENGTH);
+    CHECK(readBayerHeader(block, sizeof(block), &header));
+    CHECK(strlen(header.name) == BAYER_NAME_LENGTH);
+
+    CHECK(readBayerHeader(block, HEADER_SIZE, &header));
+    CHECK(!readBayerHeader(block, HEADER_SIZE - 1, &header));
+}
+
+static void checkStride(void) {
+    BayerHeader header = { .width = 100 };
+
+    CHECK(bayerStride(&header, 10) == 128);
+    CHECK(bayerStride(&header, 12) == 160);
+
+    header.paddingRight = 28;
+    CHECK(bayerStride(&header, 10) == 160);
+    CHECK(bayerStride(&header, 12) == 192);
+
+    // Ov5647 full resolution
+    header.width        = 2592;
+    header.paddingRight = 0;
+    CHECK(bayerStride(&header, 10) == 3264);
+}
+
+/**
+ * Pack random pixels, padding included, and check the visible pixels unpack unchanged.
+ */
+static void checkUnpack(uint32_t bitDepth, uint32_t width, uint32_t height, uint32_t paddingRight) {
+    BayerHeader header = { .width = width, .height = height, .paddingRight = paddingRight };
+
+    uint32_t  stride       = bayerStride(&header, bitDepth);
+    uint32_t  packedWidth  = width + paddingRight;
+    uint16_t *pixels       = malloc(sizeof(uint16_t) * packedWidth * height);
+    uint8_t  *packed       = calloc(stride, height);
+    uint16_t *raw          = malloc(sizeof(uint16_t) * width * height);
+
+    CHECK(stride % 32 == 0);
+    CHECK(stride * 8 >= packedWidth * bitDepth);
+
+    for (uint32_t i = 0; i < packedWidth * height; i++) {
+        pixels[i] = nextRandom() & ((1 << bitDepth) - 1);
+    }
+    for (uint32_t y = 0; y < height; y++) {
+        packRow(pixels + y * packedWidth, packedWidth, bitDepth, packed + y * stride);
+    }
+
+    unpackBayer(packed, stride, width, height, bitDepth, raw);
+
+    bool same = true;
+    for (uint32_t y = 0; y < height; y++) {
+        same = same && memcmp(raw + y * width, pixels + y * packedWidth, sizeof(uint16_t) * width) == 0;
+    }
+    CHECK(same);
+
+    free(pixels);
+    free(packed);
+    free(raw);
+}
+
+/**
+ * Demosaic random pixels, and check every sample against the average of the neighbours of that
+ * colour in the surrounding 3x3 pixels, mirrored at the edges of the image.
+ */
+static void checkDemosaic(uint32_t width, uint32_t height, uint32_t bayerOrder) {
+    uint16_t *raw = malloc(sizeof(uint16_t) * width * height);
+    uint16_t *rgb = malloc(sizeof(uint16_t) * width * height * 3);
+
+    for (uint32_t i = 0; i < width * height; i++) {
+        raw[i] = nextRandom() & 0xFFF;
+    }
+
+    demosaicBayer(raw, width, height, bayerOrder, rgb);
+
+    bool same = true;
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            uint32_t centre = colourAt(bayerOrder, x, y);
+
+            for (uint32_t colour = 0; colour < 3; colour++) {
+                uint32_t expected;
+
+                if (colour == centre) {
+                    expected = raw[y * width + x];
+                } else {
+                    uint32_t sum   = 0;
+                    uint32_t count = 0;
+                    for (int32_t dy = -1; dy <= 1; dy++) {
+                        for (int32_t dx = -1; dx <= 1; dx++) {
+                            uint32_t nx = mirror((int32_t) x + dx, width);
+                            uint32_t ny = mirror((int32_t) y + dy, height);
+                            if ((dx || dy) && colourAt(bayerOrder, nx, ny) == colour) {
+                                sum += raw[ny * width + nx];
+                                count++;
+                            }
+                        }
+                    }
+                    expected = (sum + count / 2) / count;
+                }
+
+                same = same && rgb[(y * width + x) * 3 + colour] == expected;
+            }
+        }
+    }
+    CHECK(same);
+
+    free(raw);
+    free(rgb);
+}
+
+/**
+ * Pack a row the way the firmware does, see the unpack kernels.
+ */
+static void packRow(const uint16_t *pixels, uint32_t width, uint32_t bitDepth, uint8_t *packed) {
+    uint32_t group = bitDepth == 10 ? 4 : 2;
+
+    for (uint32_t x = 0; x < width; x += group, packed += group + 1) {
+        packed[group] = 0;
+        for (uint32_t i = 0; i < group && x + i < width; i++) {
+            packed[i]      = (uint8_t) (pixels[x + i] >> (bitDepth - 8));
+            packed[group] |= (uint8_t) ((pixels[x + i] & ((1 << (bitDepth - 8)) - 1)) << (i * (bitDepth - 8)));
+        }
+    }
+}
+
+/**
+ * Get the colour of a site: 0 red, 1 green, 2 blue.
+ */
+static uint32_t colourAt(uint32_t bayerOrder, uint32_t x, uint32_t y) {
+    // Position of the red site in the top-left 2x2 pixels, for each Bayer order
+    static const uint32_t redX[] = { 0, 0, 1, 1 };
+    static const uint32_t redY[] = { 0, 1, 1, 0 };
+
+    bool redColumn = (x & 1) == redX[bayerOrder];
+    bool redRow    = (y & 1) == redY[bayerOrder];
+
+    return redColumn && redRow ? 0 : !redColumn && !redRow ? 2 : 1;
+}
+
+static uint32_t mirror(int32_t value, uint32_t limit) {
+    return value < 0 ? 1 : value >= (int32_t) limit ? limit - 2 : (uint32_t) value;
+}
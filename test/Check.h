@@ -0,0 +1,76 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+#ifndef _PICAM_CHECK_H
+#define _PICAM_CHECK_H
+
+/**
+ * Minimal support for the host checks, see the check target in the Makefile.
+ *
+ * Each check is a small program that exercises one module without a camera, reports every failed
+ * condition, and exits with a non-zero status if any failed.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Number of failed conditions so far.
+ */
+static int checkFailures;
+
+/**
+ * Check a condition, reporting it if it does not hold - checking carries on regardless.
+ */
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            checkFailures++; \
+        } \
+    } while (0)
+
+/**
+ * Deterministic pseudo-random numbers, so a failure can be reproduced.
+ *
+ * @return next number, in the range 0 to 65535
+ */
+static inline uint32_t nextRandom(void) {
+    static uint32_t state = 12345;
+    state = state * 1103515245 + 12345;
+    return state >> 16;
+}
+
+/**
+ * Report the outcome of a check program.
+ *
+ * @param name name of the check
+ * @return exit status for the check program
+ */
+static inline int checkResult(const char *name) {
+    if (checkFailures) {
+        printf("%s: %d failed\n", name, checkFailures);
+        return EXIT_FAILURE;
+    }
+    printf("%s: ok\n", name);
+    return EXIT_SUCCESS;
+}
+
+#endif // _PICAM_CHECK_H
@@ -0,0 +1,141 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+/*
+ * Host checks for exposure fusion, see Fusion.c.
+ *
+ * Fused images must match a plain per-sample weighted average, for every plane - through the
+ * kernel selected for the CPU, so on a CPU with NEON this also checks the NEON kernel matches the
+ * generic one. Samples whose weighted average lands exactly half way between two values are the
+ * hard case for a kernel that divides with a reciprocal, so some images are built to have many.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Check.h"
+#include "Fusion.h"
+#include "Log.h"
+
+static void checkSingle(void);
+static void checkImages(uint32_t count, uint32_t width, uint32_t height, bool ties);
+static uint8_t expectedSample(const Image *frames, uint32_t count, int plane, uint32_t x, uint32_t y);
+
+int main(void) {
+    setLogLevel(LOG_LEVEL_OFF);
+
+    checkSingle();
+
+    for (uint32_t count = 1; count <= FUSION_MAX_FRAMES; count++) {
+        checkImages(count, 70, 6, false);
+        checkImages(count, 64, 64, true);
+    }
+
+    Image frames[1] = {{0}};
+    Image output    = {0};
+    CHECK(!fuseExposures(frames, 0, &output));
+    CHECK(!fuseExposures(frames, FUSION_MAX_FRAMES + 1, &output));
+
+    return checkResult("fusion");
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Fusing a single image gives back the same image.
+ */
+static void checkSingle(void) {
+    Image frame  = {0};
+    Image output = {0};
+
+    allocateImage(&frame, 48, 4, 48, 4);
+    for (size_t i = 0; i < imageSize(&frame); i++) {
+        frame.data[i] = (uint8_t) nextRandom();
+    }
+
+    CHECK(fuseExposures(&frame, 1, &output));
+    CHECK(memcmp(output.data, frame.data, imageSize(&frame)) == 0);
+
+    freeImage(&frame);
+    freeImage(&output);
+}
+
+/**
+ * Fuse random images, and check every sample of every plane.
+ *
+ * With ties, the images alternate between two lumas with the same weight, with values an odd
+ * distance apart, so about half of the averages of an even number of images are exact halves.
+ */
+static void checkImages(uint32_t count, uint32_t width, uint32_t height, bool ties) {
+    Image frames[FUSION_MAX_FRAMES] = {{0}};
+    Image output = {0};
+
+    for (uint32_t i = 0; i < count; i++) {
+        allocateImage(&frames[i], width, height, width + 32, height);
+        for (size_t j = 0; j < imageSize(&frames[i]); j++) {
+            if (ties) {
+                uint8_t base = (uint8_t) (nextRandom() % 200);
+                frames[i].data[j] = i & 1 ? base + 2 * (j % 7) + 1 : base;
+            } else {
+                frames[i].data[j] = (uint8_t) nextRandom();
+            }
+        }
+    }
+
+    CHECK(fuseExposures(frames, count, &output));
+
+    bool same = true;
+    for (int plane = IMAGE_PLANE_Y; plane <= IMAGE_PLANE_V; plane++) {
+        uint32_t shift = plane == IMAGE_PLANE_Y ? 0 : 1;
+        for (uint32_t y = 0; y < height >> shift; y++) {
+            for (uint32_t x = 0; x < width >> shift; x++) {
+                uint8_t actual = imagePlane(&output, plane)[y * imagePlaneStride(&output, plane) + x];
+                same = same && actual == expectedSample(frames, count, plane, x, y);
+            }
+        }
+    }
+    CHECK(same);
+
+    for (uint32_t i = 0; i < count; i++) {
+        freeImage(&frames[i]);
+    }
+    freeImage(&output);
+}
+
+/**
+ * Average of the samples, weighted by 129 - |luma - 128| of the co-sited luma, rounded to nearest
+ * with halves rounded up.
+ */
+static uint8_t expectedSample(const Image *frames, uint32_t count, int plane, uint32_t x, uint32_t y) {
+    uint32_t shift = plane == IMAGE_PLANE_Y ? 0 : 1;
+    uint32_t sum   = 0;
+    uint32_t total = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const Image *frame  = &frames[i];
+        int32_t      luma   = imagePlane(frame, IMAGE_PLANE_Y)[(y << shift) * imagePlaneStride(frame, IMAGE_PLANE_Y) + (x << shift)];
+        uint32_t     weight = 129 - abs(luma - 128);
+
+        sum   += weight * imagePlane(frame, plane)[y * imagePlaneStride(frame, plane) + x];
+        total += weight;
+    }
+
+    return (uint8_t) ((2 * sum + total) / (2 * total));
+}
@@ -0,0 +1,322 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+/*
+ * Host checks for the streaming JPEG marker parser, see Jpeg.c.
+ *
+ * A small but structurally complete JPEG is built in memory - EXIF with a thumbnail, a frame
+ * header, a scan with stuffed bytes and a restart marker - and fed to the parser whole, a byte at a
+ * time, and split at every position, all of which must give the same result. Truncated and
+ * malformed pictures must be rejected.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "Check.h"
+#include "Jpeg.h"
+#include "Log.h"
+
+/**
+ * A picture being built.
+ */
+typedef struct Builder {
+    uint8_t  data[512];
+    uint32_t length;
+} Builder;
+
+/**
+ * Where things were put in the built picture.
+ */
+typedef struct Layout {
+    uint32_t exifOffset;
+    uint32_t exifLength;
+    uint32_t thumbnailOffset;
+    uint32_t thumbnailLength;
+    uint32_t length;
+} Layout;
+
+static JpegParser parser;
+
+static void buildPicture(Builder *builder, Layout *layout, bool exif);
+static void put8(Builder *builder, uint32_t value);
+static void put16(Builder *builder, uint32_t value);
+static void put16le(Builder *builder, uint32_t value);
+static void put32le(Builder *builder, uint32_t value);
+static void putEntry(Builder *builder, uint32_t tag, uint32_t value);
+static JpegInfo parseWhole(const uint8_t *data, uint32_t length, bool failed);
+static JpegInfo parseSplit(const uint8_t *data, uint32_t length, uint32_t chunk);
+static void checkInfo(const JpegInfo *info, const Layout *layout);
+static void checkPictures(void);
+static void checkTruncated(void);
+static void checkMalformed(void);
+
+int main(void) {
+    setLogLevel(LOG_LEVEL_OFF);
+
+    checkPictures();
+    checkTruncated();
+    checkMalformed();
+    return checkResult("jpeg");
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Build a picture, followed by some trailing data as the camera appends raw data.
+ *
+ * @param builder picture
+ * @param layout set to where things were put
+ * @param exif true to include EXIF data with a thumbnail
+ */
+static void buildPicture(Builder *builder, Layout *layout, bool exif) {
+    memset(builder, 0, sizeof(*builder));
+    memset(layout, 0, sizeof(*layout));
+
+    put16(builder, 0xFFD8);
+
+    if (exif) {
+        // APP1: "Exif\0\0", then a little-endian TIFF header, an empty IFD0 and an IFD1 locating the
+        // thumbnail - which contains markers of its own, to check they are not seen as real ones
+        put16(builder, 0xFFE1);
+        put16(builder, 2 + 6 + 60);
+        memcpy(builder->data + builder->length, "Exif\0\0", 6);
+        builder->length += 6;
+
+        layout->exifOffset      = builder->length;
+        layout->exifLength      = 60;
+        layout->thumbnailOffset = builder->length + 44;
+        layout->thumbnailLength = 16;
+
+        put16(builder, 0x4949);
+        put16le(builder, 42);
+        put32le(builder, 8);
+        put16le(builder, 0);
+        put32le(builder, 14);
+        put16le(builder, 2);
+        putEntry(builder, 0x0201, 44);
+        putEntry(builder, 0x0202, 16);
+        put32le(builder, 0);
+        put16(builder, 0xFFD8);
+        for (int i = 0; i < 12; i++) {
+            put8(builder, 0xFF);
+        }
+        put16(builder, 0xFFD9);
+    }
+
+    // DQT, skipped
+    put16(builder, 0xFFDB);
+    put16(builder, 2 + 5);
+    for (int i = 0; i < 5; i++) {
+        put8(builder, i);
+    }
+
+    // SOF0: 8 bits, 480x640, Y 2x2, Cb and Cr 1x1
+    put16(builder, 0xFFC0);
+    put16(builder, 2 + 6 + 9);
+    put8(builder, 8);
+    put16(builder, 480);
+    put16(builder, 640);
+    put8(builder, 3);
+    put8(builder, 1); put8(builder, 0x22); put8(builder, 0);
+    put8(builder, 2); put8(builder, 0x11); put8(builder, 1);
+    put8(builder, 3); put8(builder, 0x11); put8(builder, 1);
+
+    // SOS, then entropy-coded data with a stuffed zero, fill bytes and a restart marker
+    put16(builder, 0xFFDA);
+    put16(builder, 2 + 10);
+    put8(builder, 3);
+    put16(builder, 0x0100);
+    put16(builder, 0x0211);
+    put16(builder, 0x0311);
+    put8(builder, 0x00);
+    put8(builder, 0x3F);
+    put8(builder, 0x00);
+    put16(builder, 0x1234);
+    put16(builder, 0xFF00);
+    put16(builder, 0x5678);
+    put16(builder, 0xFFD0);
+    put16(builder, 0x9ABC);
+    put16(builder, 0xFFFF);
+    put16(builder, 0xFFD1);
+    put8(builder, 0xDE);
+
+    put16(builder, 0xFFD9);
+    layout->length = builder->length;
+
+    memcpy(builder->data + builder->length, "BRCM", 4);
+    builder->length += 4;
+}
+
+static void put8(Builder *builder, uint32_t value) {
+    builder->data[builder->length++] = (uint8_t) value;
+}
+
+static void put16(Builder *builder, uint32_t value) {
+    put8(builder, value >> 8);
+    put8(builder, value);
+}
+
+static void put16le(Builder *builder, uint32_t value) {
+    put8(builder, value);
+    put8(builder, value >> 8);
+}
+
+static void put32le(Builder *builder, uint32_t value) {
+    put16le(builder, value);
+    put16le(builder, value >> 16);
+}
+
+/**
+ * Add a LONG entry to an IFD.
+ */
+static void putEntry(Builder *builder, uint32_t tag, uint32_t value) {
+    put16le(builder, tag);
+    put16le(builder, 4);
+    put32le(builder, 1);
+    put32le(builder, value);
+}
+
+static JpegInfo parseWhole(const uint8_t *data, uint32_t length, bool failed) {
+    resetJpegParser(&parser, true);
+    parseJpeg(&parser, data, length);
+    finishJpegParser(&parser, failed);
+    return parser.info;
+}
+
+/**
+ * Parse a picture delivered in chunks, the first chunk then one byte at a time if chunk is 1, or the
+ * rest in one go otherwise.
+ */
+static JpegInfo parseSplit(const uint8_t *data, uint32_t length, uint32_t chunk) {
+    resetJpegParser(&parser, true);
+    if (chunk == 1) {
+        for (uint32_t i = 0; i < length; i++) {
+            parseJpeg(&parser, data + i, 1);
+        }
+    } else {
+        parseJpeg(&parser, data, chunk);
+        parseJpeg(&parser, data + chunk, length - chunk);
+    }
+    finishJpegParser(&parser, false);
+    return parser.info;
+}
+
+static void checkInfo(const JpegInfo *info, const Layout *layout) {
+    CHECK(info->complete);
+    CHECK(info->valid);
+    CHECK(!info->truncated);
+    CHECK(info->length == layout->length);
+    CHECK(info->width == 640);
+    CHECK(info->height == 480);
+    CHECK(info->precision == 8);
+    CHECK(info->components == 3);
+    CHECK(info->componentIds[0] == 1 && info->componentIds[1] == 2 && info->componentIds[2] == 3);
+    CHECK(info->sampling[0] == 0x22 && info->sampling[1] == 0x11 && info->sampling[2] == 0x11);
+    CHECK(!info->progressive);
+    CHECK(info->exifOffset == layout->exifOffset);
+    CHECK(info->exifLength == layout->exifLength);
+    CHECK(info->thumbnailOffset == layout->thumbnailOffset);
+    CHECK(info->thumbnailLength == layout->thumbnailLength);
+}
+
+/**
+ * Well-formed pictures, with and without EXIF, however they are split.
+ */
+static void checkPictures(void) {
+    Builder builder;
+    Layout  layout;
+
+    for (int exif = 0; exif <= 1; exif++) {
+        buildPicture(&builder, &layout, exif);
+
+        JpegInfo whole = parseWhole(builder.data, builder.length, false);
+        checkInfo(&whole, &layout);
+
+        JpegInfo bytes = parseSplit(builder.data, builder.length, 1);
+        CHECK(memcmp(&bytes, &whole, sizeof(JpegInfo)) == 0);
+
+        for (uint32_t split = 2; split < builder.length; split++) {
+            JpegInfo info = parseSplit(builder.data, builder.length, split);
+            CHECK(memcmp(&info, &whole, sizeof(JpegInfo)) == 0);
+        }
+
+        // Parsing disabled, as for any other encoding
+        resetJpegParser(&parser, false);
+        parseJpeg(&parser, builder.data, builder.length);
+        finishJpegParser(&parser, false);
+        CHECK(!parser.info.valid);
+    }
+}
+
+/**
+ * A picture cut short anywhere before the end of the EOI, or reported as failed by the encoder,
+ * is never valid.
+ */
+static void checkTruncated(void) {
+    Builder builder;
+    Layout  layout;
+
+    buildPicture(&builder, &layout, true);
+
+    for (uint32_t length = 0; length < layout.length; length++) {
+        JpegInfo info = parseWhole(builder.data, length, false);
+        CHECK(info.complete);
+        CHECK(!info.valid);
+        CHECK(info.truncated);
+    }
+
+    JpegInfo failed = parseWhole(builder.data, builder.length, true);
+    CHECK(!failed.valid);
+    CHECK(failed.truncated);
+}
+
+/**
+ * Pictures that are complete but have a broken marker structure.
+ */
+static void checkMalformed(void) {
+    Builder  builder;
+    Layout   layout;
+    JpegInfo info;
+
+    buildPicture(&builder, &layout, false);
+
+    // Missing SOI
+    builder.data[1] = 0xD9;
+    info = parseWhole(builder.data, builder.length, false);
+    CHECK(!info.valid);
+    CHECK(!info.truncated);
+
+    // Segment length shorter than the length field itself
+    buildPicture(&builder, &layout, false);
+    builder.data[5] = 1;
+    info = parseWhole(builder.data, builder.length, false);
+    CHECK(!info.valid);
+
+    // SOS before SOF, by turning the SOF into an APP segment
+    buildPicture(&builder, &layout, false);
+    builder.data[2 + 2 + 5 + 2 + 1] = 0xE2;
+    info = parseWhole(builder.data, builder.length, false);
+    CHECK(!info.valid);
+
+    // EOI before any scan
+    const uint8_t empty[] = { 0xFF, 0xD8, 0xFF, 0xD9 };
+    info = parseWhole(empty, sizeof(empty), false);
+    CHECK(!info.valid);
+}
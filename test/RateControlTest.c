@@ -0,0 +1,188 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+/*
+ * Host checks for JPEG rate control, see RateControl.c.
+ *
+ * Captures are simulated with a model encoder, whose encoded size grows exponentially with the
+ * quality as the hardware encoder's roughly does, and rate control must settle on the highest
+ * quality that keeps the size under the target - and stay there, including after a change of
+ * scene.
+ */
+
+#include <math.h>
+
+#include "Check.h"
+#include "Log.h"
+#include "RateControl.h"
+
+#define TARGET_SIZE 60000
+
+static PicamContext context;
+
+static uint32_t modelSize(uint32_t quality, double scene);
+static uint32_t capture(EncoderConfig *encoder, double scene);
+static void checkConvergence(void);
+static void checkLimits(void);
+static void checkSlopeLimits(void);
+static void checkRecording(void);
+
+int main(void) {
+    setLogLevel(LOG_LEVEL_OFF);
+
+    checkConvergence();
+    checkLimits();
+    checkSlopeLimits();
+    checkRecording();
+
+    return checkResult("rate-control");
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Encoded size for a quality, 20000 bytes at quality 50 growing by 5% per quality step, scaled by
+ * the detail in the scene.
+ */
+static uint32_t modelSize(uint32_t quality, double scene) {
+    return (uint32_t) lround(scene * 20000.0 * exp(0.05 * ((double) quality - 50.0)));
+}
+
+/**
+ * Make a capture with rate control.
+ *
+ * @return quality chosen for the capture
+ */
+static uint32_t capture(EncoderConfig *encoder, double scene) {
+    uint32_t quality = chooseQuality(&context, encoder);
+    recordQuality(&context, encoder, quality, modelSize(quality, scene));
+    return quality;
+}
+
+/**
+ * The first capture uses the configured quality, after that rate control follows the model, and
+ * follows a change of scene from the very next capture.
+ */
+static void checkConvergence(void) {
+    EncoderConfig encoder = { .quality = 85, .targetSize = TARGET_SIZE };
+
+    resetRateControl(&context);
+
+    CHECK(capture(&encoder, 1.0) == 85);
+
+    // Only one quality seen so far, so the slope is assumed - close, but not exact
+    uint32_t second = capture(&encoder, 1.0);
+    CHECK(second < 85);
+    CHECK(second >= 68 && second <= 72);
+
+    // Fitted from then on, the best quality for the model is 71
+    for (int i = 0; i < 10; i++) {
+        uint32_t quality = capture(&encoder, 1.0);
+        CHECK(quality == 71);
+    }
+    CHECK(modelSize(71, 1.0) <= TARGET_SIZE && modelSize(72, 1.0) > TARGET_SIZE);
+
+    // Twice the detail, the best quality is now 58 - the capture that sees the change is still
+    // made at 71, but from the very next capture the quality must be right and stay right
+    CHECK(capture(&encoder, 2.0) == 71);
+    for (int i = 0; i < 10; i++) {
+        uint32_t quality = capture(&encoder, 2.0);
+        CHECK(quality == 58);
+    }
+    CHECK(modelSize(58, 2.0) <= TARGET_SIZE && modelSize(59, 2.0) > TARGET_SIZE);
+
+    // Opening the camera again forgets the captures
+    resetRateControl(&context);
+    CHECK(chooseQuality(&context, &encoder) == 85);
+}
+
+/**
+ * Qualities are kept within the configured limits, and within what the encoder accepts.
+ */
+static void checkLimits(void) {
+    EncoderConfig encoder = { .quality = 85, .targetSize = 1000, .minimumQuality = 40, .maximumQuality = 90 };
+
+    resetRateControl(&context);
+    capture(&encoder, 1.0);
+    for (int i = 0; i < 4; i++) {
+        CHECK(capture(&encoder, 1.0) == 40);
+    }
+
+    encoder.targetSize = 10000000;
+    for (int i = 0; i < 4; i++) {
+        CHECK(capture(&encoder, 1.0) == 90);
+    }
+
+    EncoderConfig unlimited = { .quality = 0, .targetSize = 1000 };
+
+    resetRateControl(&context);
+    CHECK(chooseQuality(&context, &unlimited) == 1);
+
+    unlimited.quality = 120;
+    CHECK(chooseQuality(&context, &unlimited) == 100);
+}
+
+/**
+ * A fitted slope outside the plausible range is clamped.
+ */
+static void checkSlopeLimits(void) {
+    EncoderConfig encoder = { .quality = 70, .targetSize = TARGET_SIZE };
+
+    // The size does not change with the quality at all, the slope is clamped to the minimum
+    // 0.01, so the quality rises by 18 over the last capture: log(60000 / 50000) / 0.01
+    resetRateControl(&context);
+    recordQuality(&context, &encoder, 70, 50000);
+    recordQuality(&context, &encoder, 80, 50000);
+    CHECK(chooseQuality(&context, &encoder) == 98);
+
+    // The size rises absurdly steeply, the slope is clamped to the maximum 0.15, so the quality
+    // falls by 7 from the last capture: log(60000 / 170000) / 0.15
+    resetRateControl(&context);
+    recordQuality(&context, &encoder, 80, 1000);
+    recordQuality(&context, &encoder, 90, 170000);
+    CHECK(chooseQuality(&context, &encoder) == 83);
+}
+
+/**
+ * Recording a capture, and the statistics it updates.
+ */
+static void checkRecording(void) {
+    EncoderConfig encoder = { .quality = 80, .targetSize = TARGET_SIZE };
+
+    resetRateControl(&context);
+    context.stats.targetOverruns = 0;
+
+    // A failed capture has no size, and is not remembered
+    recordQuality(&context, &encoder, 80, 0);
+    CHECK(context.rateControl.count == 0);
+
+    recordQuality(&context, &encoder, 80, TARGET_SIZE);
+    CHECK(context.stats.lastQuality == 80);
+    CHECK(context.stats.targetOverruns == 0);
+
+    recordQuality(&context, &encoder, 81, TARGET_SIZE + 1);
+    CHECK(context.stats.lastQuality == 81);
+    CHECK(context.stats.targetOverruns == 1);
+
+    for (int i = 0; i < 2 * RATE_CONTROL_SAMPLES; i++) {
+        recordQuality(&context, &encoder, 50 + i, 1000);
+    }
+    CHECK(context.rateControl.count == RATE_CONTROL_SAMPLES);
+    CHECK(context.rateControl.quality[(context.rateControl.next + RATE_CONTROL_SAMPLES - 1) % RATE_CONTROL_SAMPLES] == 50 + 2 * RATE_CONTROL_SAMPLES - 1);
+}
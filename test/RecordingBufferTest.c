@@ -0,0 +1,337 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+/*
+ * Host checks for the H.264 recording buffer, see RecordingBuffer.c.
+ *
+ * Streams of chunks are appended as the encoder would deliver them, and after every append the
+ * buffer must start on a keyframe group, hold every stored chunk intact and contiguous, keep the
+ * pre-roll and respect its limits.
+ */
+
+#include <string.h>
+
+#include "Check.h"
+#include "Log.h"
+#include "RecordingBuffer.h"
+
+#define CAPACITY 65536
+
+#define CONFIG   MMAL_BUFFER_HEADER_FLAG_CONFIG
+#define KEYFRAME (MMAL_BUFFER_HEADER_FLAG_KEYFRAME | MMAL_BUFFER_HEADER_FLAG_FRAME_END)
+#define FRAME    MMAL_BUFFER_HEADER_FLAG_FRAME_END
+
+static PicamContext context;
+
+static uint8_t storage[CAPACITY];
+
+static void resetRecorder(uint32_t capacity, uint32_t preRoll);
+static int append(uint32_t length, uint32_t flags, uint64_t now);
+static void checkBuffer(void);
+static void checkFirstKeyframe(void);
+static void checkPreRoll(void);
+static void checkCapacity(void);
+static void checkIndexLimits(void);
+static void checkFlush(void);
+static void checkOversize(void);
+
+int main(void) {
+    setLogLevel(LOG_LEVEL_OFF);
+
+    checkFirstKeyframe();
+    checkPreRoll();
+    checkCapacity();
+    checkIndexLimits();
+    checkFlush();
+    checkOversize();
+
+    freeBytes(&context.recorder.header);
+
+    return checkResult("recording-buffer");
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Start again with an empty buffer, as a newly created recorder would.
+ *
+ * @param capacity buffer capacity, at most CAPACITY
+ * @param preRoll pre-roll time in milliseconds
+ */
+static void resetRecorder(uint32_t capacity, uint32_t preRoll) {
+    Recorder *recorder = &context.recorder;
+
+    freeBytes(&recorder->header);
+    memset(recorder, 0, sizeof(Recorder));
+    pthread_cond_init(&recorder->changed, NULL);
+
+    recorder->data       = storage;
+    recorder->capacity   = capacity;
+    recorder->frameStart = true;
+    recorder->fd         = -1;
+
+    context.config.recording.preRoll = preRoll;
+    context.stats.recordingOverruns  = 0;
+}
+
+/**
+ * Append a chunk, filled with a pattern that identifies its sequence number, then check the
+ * buffer.
+ *
+ * @param length chunk length
+ * @param flags MMAL buffer header flags
+ * @param now current time in microseconds
+ * @return non-zero if the chunk was stored; zero if it was dropped
+ */
+static int append(uint32_t length, uint32_t flags, uint64_t now) {
+    Recorder *recorder = &context.recorder;
+
+    static uint8_t data[2 * CAPACITY];
+    uint64_t sequence = recorder->firstChunk + recorder->chunkCount;
+    for (uint32_t i = 0; i < length; i++) {
+        data[i] = (uint8_t) (sequence * 7 + i);
+    }
+
+    appendRecordingChunk(&context, data, length, flags, now);
+    checkBuffer();
+
+    return recorder->firstChunk + recorder->chunkCount == sequence + 1;
+}
+
+/**
+ * The buffer starts on a keyframe group, and the chunks are in order, within the buffer, do not
+ * overlap and still hold the data they were stored with.
+ */
+static void checkBuffer(void) {
+    Recorder *recorder = &context.recorder;
+
+    CHECK(recorder->chunkCount <= RECORDING_CHUNKS);
+    CHECK(recorder->keyframeCount <= RECORDING_KEYFRAMES);
+    if (recorder->chunkCount == 0) {
+        CHECK(recorder->keyframeCount == 0);
+        return;
+    }
+
+    CHECK(recorder->keyframeCount > 0);
+    CHECK(recorder->keyframes[recorder->keyframeHead] == recorder->firstChunk);
+
+    uint64_t previousTime = 0;
+    uint32_t used = 0;
+    uint32_t wraps = 0;
+    uint32_t previousEnd = recordingChunkAt(recorder, recorder->firstChunk)->offset;
+    for (uint64_t sequence = recorder->firstChunk; sequence < recorder->firstChunk + recorder->chunkCount; sequence++) {
+        RecordingChunk *chunk = recordingChunkAt(recorder, sequence);
+        CHECK(chunk->offset + chunk->length <= recorder->capacity);
+        CHECK(chunk->time >= previousTime);
+        if (chunk->offset < previousEnd) {
+            wraps++;
+        }
+        for (uint32_t i = 0; i < chunk->length; i++) {
+            if (recorder->data[chunk->offset + i] != (uint8_t) (sequence * 7 + i)) {
+                CHECK(!"chunk data overwritten");
+                break;
+            }
+        }
+        previousTime = chunk->time;
+        previousEnd  = chunk->offset + chunk->length;
+        used += chunk->length;
+    }
+
+    // Chunks wrap around to the start of the buffer at most once, and never reach the oldest
+    RecordingChunk *first = recordingChunkAt(recorder, recorder->firstChunk);
+    CHECK(wraps <= 1);
+    CHECK(wraps == 0 || previousEnd <= first->offset);
+    CHECK(used <= recorder->capacity);
+
+    for (uint32_t i = 1; i < recorder->keyframeCount; i++) {
+        uint64_t keyframe = recorder->keyframes[(recorder->keyframeHead + i) % RECORDING_KEYFRAMES];
+        CHECK(keyframe > recorder->keyframes[(recorder->keyframeHead + i - 1) % RECORDING_KEYFRAMES]);
+        CHECK(keyframe < recorder->firstChunk + recorder->chunkCount);
+    }
+}
+
+/**
+ * Nothing is kept until the first keyframe group, which starts at the inline headers; the
+ * keyframe that follows the headers belongs to the same group.
+ */
+static void checkFirstKeyframe(void) {
+    Recorder *recorder = &context.recorder;
+
+    resetRecorder(CAPACITY, 1000);
+
+    CHECK(!append(100, FRAME, 0));
+    CHECK(!append(100, FRAME, 1000));
+    CHECK(recorder->chunkCount == 0);
+
+    CHECK(append(20, CONFIG, 2000));
+    CHECK(append(10, CONFIG, 2000));
+    CHECK(append(500, KEYFRAME, 2000));
+    CHECK(append(100, FRAME, 3000));
+    CHECK(recorder->chunkCount == 4);
+    CHECK(recorder->keyframeCount == 1);
+    CHECK(recorder->header.length == 30);
+
+    // A keyframe without headers starts a group too, and a new set of headers replaces the old
+    CHECK(append(500, KEYFRAME, 4000));
+    CHECK(recorder->keyframeCount == 2);
+    CHECK(append(24, CONFIG, 5000));
+    CHECK(append(500, KEYFRAME, 5000));
+    CHECK(recorder->keyframeCount == 3);
+    CHECK(recorder->header.length == 24);
+
+    // A keyframe in the middle of a frame does not
+    CHECK(append(100, 0, 6000));
+    CHECK(append(100, MMAL_BUFFER_HEADER_FLAG_KEYFRAME, 6000));
+    CHECK(recorder->keyframeCount == 3);
+}
+
+/**
+ * Keyframe groups are evicted once the next group is older than the pre-roll, so the buffer
+ * always holds at least the pre-roll and not a whole group more.
+ */
+static void checkPreRoll(void) {
+    Recorder *recorder = &context.recorder;
+    uint64_t preRoll = 1000000;
+
+    resetRecorder(CAPACITY, 1000);
+
+    // A group every 500ms, with a frame every 100ms
+    for (uint64_t now = 0; now < 10000000; now += 100000) {
+        if (now % 500000 == 0) {
+            append(16, CONFIG, now);
+            append(200, KEYFRAME, now);
+        } else {
+            append(50, FRAME, now);
+        }
+
+        CHECK(recordingChunkAt(recorder, recorder->firstChunk)->time + (now >= preRoll ? preRoll : now) <= now);
+        if (recorder->keyframeCount > 1) {
+            uint64_t next = recorder->keyframes[(recorder->keyframeHead + 1) % RECORDING_KEYFRAMES];
+            CHECK(recordingChunkAt(recorder, next)->time + preRoll > now);
+        }
+    }
+    CHECK(recorder->keyframeCount == 3);
+    CHECK(context.stats.recordingOverruns == 0);
+}
+
+/**
+ * With a pre-roll longer than the buffer holds, the oldest groups are evicted to make room, and
+ * chunks skip the space at the end of the buffer that is too small for them.
+ */
+static void checkCapacity(void) {
+    Recorder *recorder = &context.recorder;
+
+    resetRecorder(8192, 3600000);
+
+    uint64_t now = 0;
+    for (int i = 0; i < 5000; i++, now += 33333) {
+        if (i % 15 == 0) {
+            append(16, CONFIG, now);
+            append(500 + nextRandom() % 1500, KEYFRAME, now);
+        } else {
+            append(1 + nextRandom() % 400, FRAME, now);
+        }
+        CHECK(recorder->chunkCount > 0);
+    }
+    CHECK(recorder->firstChunk > 0);
+    CHECK(context.stats.recordingOverruns == 0);
+}
+
+/**
+ * The index limits the number of chunks and of keyframe groups in the buffer, however much room
+ * is left for the data.
+ */
+static void checkIndexLimits(void) {
+    Recorder *recorder = &context.recorder;
+
+    resetRecorder(CAPACITY, 3600000);
+    for (int i = 0; i < 3 * RECORDING_CHUNKS; i++) {
+        append(1, i % 1000 == 0 ? KEYFRAME : FRAME, i);
+    }
+    CHECK(recorder->chunkCount > RECORDING_CHUNKS - 1000);
+
+    resetRecorder(CAPACITY, 3600000);
+    for (int i = 0; i < 3 * RECORDING_KEYFRAMES; i++) {
+        append(1, KEYFRAME, i);
+    }
+    CHECK(recorder->keyframeCount == RECORDING_KEYFRAMES);
+    CHECK(recorder->chunkCount == RECORDING_KEYFRAMES);
+    CHECK(context.stats.recordingOverruns == 0);
+}
+
+/**
+ * Groups a flush has not yet written are kept past the pre-roll, until the buffer is full - then
+ * the flush skips ahead to the oldest group left, and the overrun is counted.
+ */
+static void checkFlush(void) {
+    Recorder *recorder = &context.recorder;
+
+    resetRecorder(8192, 100);
+
+    uint64_t now = 0;
+    for (int i = 0; i < 10; i++, now += 1000000) {
+        append(400, KEYFRAME, now);
+    }
+
+    // The newest group alone covers none of the pre-roll, so the one before it is kept too
+    CHECK(recorder->chunkCount == 2);
+
+    recorder->fd     = 0;
+    recorder->cursor = recorder->firstChunk;
+
+    for (int i = 0; i < 10; i++, now += 1000000) {
+        append(400, KEYFRAME, now);
+    }
+    CHECK(recorder->chunkCount == 12);
+    CHECK(recorder->cursor == recorder->firstChunk);
+    CHECK(context.stats.recordingOverruns == 0);
+
+    // Written chunks are no longer needed by the flush, and are evicted
+    recorder->cursor += 5;
+    append(400, KEYFRAME, now);
+    CHECK(recorder->chunkCount == 8);
+    CHECK(recorder->cursor == recorder->firstChunk);
+
+    // Filling the buffer overruns the flush
+    for (int i = 0; i < 20; i++, now += 1000000) {
+        append(400, KEYFRAME, now);
+        CHECK(recorder->cursor >= recorder->firstChunk);
+    }
+    CHECK(context.stats.recordingOverruns > 0);
+    CHECK(recorder->cursor == recorder->firstChunk);
+}
+
+/**
+ * A chunk too big for the whole buffer can not be stored, and is counted as an overrun.
+ */
+static void checkOversize(void) {
+    Recorder *recorder = &context.recorder;
+
+    resetRecorder(4096, 1000);
+
+    CHECK(append(1000, KEYFRAME, 0));
+    CHECK(!append(5000, KEYFRAME, 0));
+    CHECK(recorder->chunkCount == 0);
+    CHECK(context.stats.recordingOverruns == 1);
+
+    CHECK(!append(100, FRAME, 0));
+    CHECK(append(4096, KEYFRAME, 0));
+    CHECK(recorder->chunkCount == 1);
+    CHECK(context.stats.recordingOverruns == 1);
+}
@@ -0,0 +1,149 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+/*
+ * Host checks for the I420 to RGB conversion, see Rgb.c.
+ *
+ * Known colours must convert to the expected pixels, and random images must match a plain per-pixel
+ * conversion - through the kernel selected for the CPU, so on a CPU with NEON this also checks the
+ * NEON kernel matches the generic one.
+ */
+
+#include <stdbool.h>
+
+#include "Check.h"
+#include "Log.h"
+#include "Rgb.h"
+
+static void checkColours(void);
+static void checkImage(uint32_t width, uint32_t height, uint32_t stride);
+static uint32_t convertColour(uint8_t y, uint8_t u, uint8_t v);
+static uint32_t expectedPixel(int32_t y, int32_t u, int32_t v);
+static int32_t clampSample(int32_t value);
+
+int main(void) {
+    setLogLevel(LOG_LEVEL_OFF);
+
+    checkColours();
+
+    for (uint32_t width = 2; width <= 72; width += 2) {
+        checkImage(width, 4, width);
+    }
+    checkImage(70, 6, 80);
+    checkImage(1920, 2, 1920);
+
+    return checkResult("rgb");
+}
+
+// === Private implementation =====================================================================
+
+static void checkColours(void) {
+    CHECK(convertColour(0, 128, 128) == 0xFF000000);
+    CHECK(convertColour(255, 128, 128) == 0xFFFFFFFF);
+    CHECK(convertColour(128, 128, 128) == 0xFF808080);
+
+    // Full-range BT.601 primaries, to within the precision of the coefficients
+    CHECK(convertColour(76, 85, 255) == 0xFFFF0000);
+    CHECK(convertColour(150, 44, 21) == 0xFF00FF02);
+    CHECK(convertColour(29, 255, 107) == 0xFF0000FD);
+
+    // Out of range results saturate
+    CHECK(convertColour(255, 255, 255) == 0xFFFF78FF);
+    CHECK(convertColour(0, 0, 0) == 0xFF008800);
+}
+
+/**
+ * Convert a random image, and check every pixel.
+ */
+static void checkImage(uint32_t width, uint32_t height, uint32_t stride) {
+    Image     image  = {0};
+    uint32_t *pixels = malloc(sizeof(uint32_t) * stride * height);
+
+    allocateImage(&image, width, height, width + 16, height);
+
+    for (size_t i = 0; i < imageSize(&image); i++) {
+        image.data[i] = (uint8_t) nextRandom();
+    }
+
+    convertToRgb(&image, pixels, stride);
+
+    const uint8_t *y = imagePlane(&image, IMAGE_PLANE_Y);
+    const uint8_t *u = imagePlane(&image, IMAGE_PLANE_U);
+    const uint8_t *v = imagePlane(&image, IMAGE_PLANE_V);
+
+    uint32_t lumaStride   = imagePlaneStride(&image, IMAGE_PLANE_Y);
+    uint32_t chromaStride = imagePlaneStride(&image, IMAGE_PLANE_U);
+
+    bool same = true;
+    for (uint32_t row = 0; row < height; row++) {
+        for (uint32_t x = 0; x < width; x++) {
+            uint32_t chroma = (row / 2) * chromaStride + x / 2;
+            same = same && pixels[row * stride + x] == expectedPixel(y[row * lumaStride + x], u[chroma], v[chroma]);
+        }
+    }
+    CHECK(same);
+
+    freeImage(&image);
+    free(pixels);
+}
+
+/**
+ * Convert a flat image of a single colour, wide enough for the vector loop.
+ *
+ * @return converted colour, which must be the same for every pixel
+ */
+static uint32_t convertColour(uint8_t y, uint8_t u, uint8_t v) {
+    Image    image = {0};
+    uint32_t pixels[32 * 2];
+
+    allocateImage(&image, 32, 2, 32, 2);
+
+    for (size_t i = 0; i < imageSize(&image); i++) {
+        image.data[i] = i < 64 ? y : i < 80 ? u : v;
+    }
+
+    convertToRgb(&image, pixels, 32);
+
+    bool flat = true;
+    for (int i = 1; i < 32 * 2; i++) {
+        flat = flat && pixels[i] == pixels[0];
+    }
+    CHECK(flat);
+
+    freeImage(&image);
+    return pixels[0];
+}
+
+/**
+ * Full-range BT.601 with 6-bit fixed-point coefficients, rounded to nearest.
+ */
+static uint32_t expectedPixel(int32_t y, int32_t u, int32_t v) {
+    int32_t cb = u - 128;
+    int32_t cr = v - 128;
+
+    int32_t r = clampSample(y + ((90 * cr + 32) >> 6));
+    int32_t g = clampSample(y - ((22 * cb + 46 * cr + 32) >> 6));
+    int32_t b = clampSample(y + ((113 * cb + 32) >> 6));
+
+    return 0xFF000000 | (uint32_t) r << 16 | (uint32_t) g << 8 | (uint32_t) b;
+}
+
+static int32_t clampSample(int32_t value) {
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
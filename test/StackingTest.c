@@ -0,0 +1,216 @@
+/*
+ * This file is part of picam.
+ *
+ * picam is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * picam is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with picam.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016-2019 Caprica Software Limited.
+ */
+
+/*
+ * Host checks for low-light stacking, see Stacking.c.
+ *
+ * Shifted copies of a textured reference frame must be aligned exactly, so stacking them gives
+ * back the reference. Unaligned stacks of random frames are compared against a plain
+ * per-sample mean and median - through the kernels selected for the CPU, so on a CPU with NEON
+ * this also checks the NEON kernels match the generic ones.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "Check.h"
+#include "Log.h"
+#include "Stacking.h"
+
+#define WIDTH  96
+#define HEIGHT 64
+
+static void checkAlignment(void);
+static void checkCombination(uint32_t count, int method, uint32_t width, uint32_t height);
+static void fillRandom(Image *image);
+static void shiftImage(const Image *source, int32_t dx, int32_t dy, Image *destination);
+static bool sameInterior(const Image *first, const Image *second, int32_t margin);
+static uint8_t expectedSample(const uint8_t *samples, uint32_t count, int method);
+
+int main(void) {
+    setLogLevel(LOG_LEVEL_OFF);
+
+    checkAlignment();
+
+    for (uint32_t count = 1; count <= STACKING_MAX_FRAMES; count++) {
+        checkCombination(count, STACKING_MEAN, 70, 6);
+        checkCombination(count, STACKING_MEDIAN, 70, 6);
+    }
+    checkCombination(STACKING_MAX_FRAMES, STACKING_MEAN, 16, 2);
+    checkCombination(STACKING_MAX_FRAMES, STACKING_MEDIAN, 2, 2);
+
+    return checkResult("stacking");
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Stack shifted copies of a frame, with and without alignment.
+ */
+static void checkAlignment(void) {
+    static const int32_t shifts[][2] = { { 0, 0 }, { 4, -2 }, { -6, 2 }, { 2, 8 } };
+
+    Image frames[4] = {{0}};
+    Image output    = {0};
+
+    allocateImage(&frames[0], WIDTH, HEIGHT, WIDTH, HEIGHT);
+    fillRandom(&frames[0]);
+
+    for (uint32_t i = 1; i < 4; i++) {
+        shiftImage(&frames[0], shifts[i][0], shifts[i][1], &frames[i]);
+    }
+
+    // Aligned, every sample away from the edges comes from the same reference sample in every frame
+    for (int method = STACKING_MEAN; method <= STACKING_MEDIAN; method++) {
+        CHECK(stackFrames(frames, 4, method, true, &output));
+        CHECK(sameInterior(&output, &frames[0], 8));
+    }
+
+    CHECK(stackFrames(frames, 4, STACKING_MEAN, false, &output));
+    CHECK(!sameInterior(&output, &frames[0], 8));
+
+    CHECK(!stackFrames(frames, 0, STACKING_MEAN, true, &output));
+    CHECK(!stackFrames(frames, STACKING_MAX_FRAMES + 1, STACKING_MEAN, true, &output));
+
+    for (uint32_t i = 0; i < 4; i++) {
+        freeImage(&frames[i]);
+    }
+    freeImage(&output);
+}
+
+/**
+ * Stack random frames without alignment, and check every sample of every plane.
+ */
+static void checkCombination(uint32_t count, int method, uint32_t width, uint32_t height) {
+    Image frames[STACKING_MAX_FRAMES] = {{0}};
+    Image output = {0};
+
+    for (uint32_t i = 0; i < count; i++) {
+        // A stride wider than the image, to check it is respected
+        allocateImage(&frames[i], width, height, width + 32, height);
+        fillRandom(&frames[i]);
+    }
+
+    CHECK(stackFrames(frames, count, method, false, &output));
+
+    bool same = true;
+    for (int plane = IMAGE_PLANE_Y; plane <= IMAGE_PLANE_V; plane++) {
+        uint32_t shift = plane == IMAGE_PLANE_Y ? 0 : 1;
+        for (uint32_t y = 0; y < height >> shift; y++) {
+            for (uint32_t x = 0; x < width >> shift; x++) {
+                uint8_t samples[STACKING_MAX_FRAMES];
+                for (uint32_t i = 0; i < count; i++) {
+                    samples[i] = imagePlane(&frames[i], plane)[y * imagePlaneStride(&frames[i], plane) + x];
+                }
+                uint8_t actual = imagePlane(&output, plane)[y * imagePlaneStride(&output, plane) + x];
+                same = same && actual == expectedSample(samples, count, method);
+            }
+        }
+    }
+    CHECK(same);
+
+    for (uint32_t i = 0; i < count; i++) {
+        freeImage(&frames[i]);
+    }
+    freeImage(&output);
+}
+
+/**
+ * Fill every plane with random samples, strongly textured so the alignment has a unique answer.
+ */
+static void fillRandom(Image *image) {
+    for (int plane = IMAGE_PLANE_Y; plane <= IMAGE_PLANE_V; plane++) {
+        uint32_t shift = plane == IMAGE_PLANE_Y ? 0 : 1;
+        for (uint32_t y = 0; y < image->height >> shift; y++) {
+            uint8_t *row = imagePlane(image, plane) + y * imagePlaneStride(image, plane);
+            for (uint32_t x = 0; x < image->width >> shift; x++) {
+                row[x] = (uint8_t) nextRandom();
+            }
+        }
+    }
+}
+
+/**
+ * Make a copy of an image with its content moved right by dx and down by dy (both even), the
+ * samples moved in from outside the image repeat its edge.
+ */
+static void shiftImage(const Image *source, int32_t dx, int32_t dy, Image *destination) {
+    allocateImage(destination, source->width, source->height, source->width, source->height);
+
+    for (int plane = IMAGE_PLANE_Y; plane <= IMAGE_PLANE_V; plane++) {
+        uint32_t shift  = plane == IMAGE_PLANE_Y ? 0 : 1;
+        int32_t  width  = source->width  >> shift;
+        int32_t  height = source->height >> shift;
+        for (int32_t y = 0; y < height; y++) {
+            int32_t sy = y - (dy >> shift);
+            sy = sy < 0 ? 0 : sy >= height ? height - 1 : sy;
+            for (int32_t x = 0; x < width; x++) {
+                int32_t sx = x - (dx >> shift);
+                sx = sx < 0 ? 0 : sx >= width ? width - 1 : sx;
+                imagePlane(destination, plane)[y * imagePlaneStride(destination, plane) + x] = imagePlane(source, plane)[sy * imagePlaneStride(source, plane) + sx];
+            }
+        }
+    }
+}
+
+/**
+ * Test whether two images are the same, away from the edges.
+ */
+static bool sameInterior(const Image *first, const Image *second, int32_t margin) {
+    for (int plane = IMAGE_PLANE_Y; plane <= IMAGE_PLANE_V; plane++) {
+        uint32_t shift  = plane == IMAGE_PLANE_Y ? 0 : 1;
+        int32_t  edge   = margin >> shift;
+        int32_t  width  = first->width  >> shift;
+        int32_t  height = first->height >> shift;
+        for (int32_t y = edge; y < height - edge; y++) {
+            const uint8_t *a = imagePlane(first,  plane) + y * imagePlaneStride(first,  plane);
+            const uint8_t *b = imagePlane(second, plane) + y * imagePlaneStride(second, plane);
+            if (memcmp(a + edge, b + edge, width - 2 * edge) != 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Mean rounded to nearest, or median with the two middle values averaged and rounded up.
+ */
+static uint8_t expectedSample(const uint8_t *samples, uint32_t count, int method) {
+    if (method == STACKING_MEAN) {
+        uint32_t sum = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            sum += samples[i];
+        }
+        return (uint8_t) ((sum + count / 2) / count);
+    }
+
+    uint8_t sorted[STACKING_MAX_FRAMES];
+    memcpy(sorted, samples, count);
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint32_t j = i + 1; j < count; j++) {
+            if (sorted[j] < sorted[i]) {
+                uint8_t swap = sorted[i];
+                sorted[i] = sorted[j];
+                sorted[j] = swap;
+            }
+        }
+    }
+    return count & 1 ? sorted[count / 2] : (uint8_t) ((sorted[count / 2 - 1] + sorted[count / 2] + 1) / 2);
+}
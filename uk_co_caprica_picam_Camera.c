@@ -18,24 +18,110 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "uk_co_caprica_picam_Camera.h"
 
-#include "Camera.h"
-#include "Configuration.h"
 #include "Defaults.h"
-#include "Encoder.h"
-#include "Picam.h"
-
-#include "interface/mmal/util/mmal_util_params.h"
+#include "JniConfiguration.h"
+#include "JniStatistics.h"
+#include "Log.h"
+#include "PicamCore.h"
+#include "Probes.h"
 
 #define REQUIRED_JNI_VERSION JNI_VERSION_1_6
 
+/**
+ * State for delivering picture data to a picture capture handler.
+ */
+typedef struct PictureHandlerContext {
+    JNIEnv    *env;
+    jobject   handler;
+    jmethodID pictureDataMethod;
+} PictureHandlerContext;
+
+/**
+ * State for delivering region data to a region capture handler.
+ */
+typedef struct RegionHandlerContext {
+    JNIEnv    *env;
+    jobject   handler;
+    jmethodID regionDataMethod;
+} RegionHandlerContext;
+
+/**
+ * State for delivering sensor-raw data to a Bayer capture handler.
+ */
+typedef struct BayerHandlerContext {
+    JNIEnv    *env;
+    jobject   handler;
+    jmethodID bayerDataMethod;
+} BayerHandlerContext;
+
+/**
+ * Destination for the pixels of an RGB capture - either a Java int array, or a direct buffer.
+ */
+typedef struct RgbHandlerContext {
+    JNIEnv    *env;
+    jintArray array;
+    jobject   buffer;
+} RgbHandlerContext;
+
+/**
+ * State for delivering timelapse frames to a timelapse handler.
+ */
+typedef struct TimelapseHandlerContext {
+    JNIEnv    *env;
+    jobject   handler;
+    jmethodID frameMethod;
+    jmethodID skippedMethod;
+} TimelapseHandlerContext;
+
+/**
+ * Kinds of capture whose output is delivered to a region capture handler.
+ */
+#define REGION_REQUEST_REGIONS   0
+#define REGION_REQUEST_STEREO    1
+#define REGION_REQUEST_BRACKET   2
+#define REGION_REQUEST_LOW_LIGHT 3
+
+/**
+ * A capture whose output is delivered to a region capture handler - either a list of regions, the
+ * eyes of a stereoscopic picture, the frames of an exposure bracket, or a stacked low-light picture.
+ */
+typedef struct RegionRequest {
+    int             type;
+    Region         *regions;
+    BracketSetting *settings;
+    uint32_t        count;
+    uint32_t        settle;
+    bool            encode;
+    bool            interleave;
+    bool            fuse;
+    uint32_t        shutterSpeed;
+    bool            median;
+    bool            align;
+} RegionRequest;
+
 static void jniThreadDestructor(void *env);
-static void setupJniContext(JNIEnv *env, jobject handler);
-static void cleanupJniContext(JNIEnv *env);
-static uint32_t pictureDataCallback(uint8_t *data, uint32_t length);
-static void cleanup(JNIEnv *env);
+static JNIEnv *attachCurrentThread(void);
+static void javaLogSink(const LogRecord *record, void *handler);
+static void setIntField(JNIEnv *env, jobject obj, const char *name, int32_t value);
+static void setBooleanField(JNIEnv *env, jobject obj, const char *name, bool value);
+static uint32_t pictureDataSink(void *userdata, const uint8_t *data, uint32_t length);
+static jboolean performPictureCapture(JNIEnv *env, jobject handler, const EncoderConfig *encoder, jint delay);
+static jboolean performRegionCapture(JNIEnv *env, jobject handler, RegionRequest *request, jint delay);
+static int regionDataSink(void *userdata, uint32_t index, const uint8_t *data, size_t length);
+static jboolean performRgbCapture(JNIEnv *env, RgbHandlerContext *handlerContext, jint width, jint height, jint delay);
+static uint32_t *rgbAcquire(void *userdata, size_t count);
+static void rgbRelease(void *userdata, uint32_t *pixels);
+static int timelapseFrameSink(void *userdata, const TimelapseFrame *frame);
+static void bayerDataSink(void *userdata, const BayerFrame *frame);
+static jboolean submitFrameData(JNIEnv *env, const uint8_t *data, jlong length, jint format, jint width, jint height, jint stride, jint encoding, jint quality);
+static jshortArray newShortArray(JNIEnv *env, const uint16_t *data, size_t length);
 
 /**
  * Global state pertaining to JNI.
@@ -43,17 +129,57 @@ static void cleanup(JNIEnv *env);
 static struct {
     JavaVM        *jvm;
     pthread_key_t threadKey;
-    jobject       handler;
-    jclass        handlerClass;
-    jmethodID     beginMethod;
-    jmethodID     pictureDataMethod;
-    jmethodID     endMethod;
+    jobject       logHandler;
+    jmethodID     logMethod;
 } JniContext;
 
 /**
  * Global state.
  */
-static PicamContext context;
+static PicamContext *context;
+
+/**
+ * Validity and metadata of the picture most recently captured on each thread, see pictureInfo.
+ */
+static __thread JpegInfo lastPictureInfo;
+
+/**
+ * Native methods, registered explicitly when this library is loaded by the loader stub.
+ *
+ * This must be kept in sync with the native methods declared by the Java Camera class.
+ */
+static const JNINativeMethod nativeMethods[] = {
+    {"create"            , "(Luk/co/caprica/picam/CameraConfiguration;)Z"                     , (void *) Java_uk_co_caprica_picam_Camera_create             },
+    {"capture"           , "(Luk/co/caprica/picam/PictureCaptureHandler;I)Z"                  , (void *) Java_uk_co_caprica_picam_Camera_capture            },
+    {"captureEncoded"    , "(Luk/co/caprica/picam/PictureCaptureHandler;III)Z"                , (void *) Java_uk_co_caprica_picam_Camera_captureEncoded     },
+    {"captureRegions"    , "(Luk/co/caprica/picam/RegionCaptureHandler;[D[IZI)Z"              , (void *) Java_uk_co_caprica_picam_Camera_captureRegions     },
+    {"destroy"           , "()V"                                                              , (void *) Java_uk_co_caprica_picam_Camera_destroy            },
+    {"captureStereo"     , "(Luk/co/caprica/picam/RegionCaptureHandler;ZZI)Z"                 , (void *) Java_uk_co_caprica_picam_Camera_captureStereo      },
+    {"captureBracket"    , "(Luk/co/caprica/picam/RegionCaptureHandler;[I[IIZZI)Z"            , (void *) Java_uk_co_caprica_picam_Camera_captureBracket     },
+    {"startRecording"    , "()Z"                                                              , (void *) Java_uk_co_caprica_picam_Camera_startRecording     },
+    {"stopRecording"     , "()V"                                                              , (void *) Java_uk_co_caprica_picam_Camera_stopRecording      },
+    {"flushRecording"    , "(Ljava/lang/String;I)Z"                                           , (void *) Java_uk_co_caprica_picam_Camera_flushRecording     },
+    {"captureLowLight"   , "(Luk/co/caprica/picam/RegionCaptureHandler;IIZZZI)Z"              , (void *) Java_uk_co_caprica_picam_Camera_captureLowLight    },
+    {"captureRgb"        , "([IIII)Z"                                                         , (void *) Java_uk_co_caprica_picam_Camera_captureRgb         },
+    {"captureRgbBuffer"  , "(Ljava/nio/ByteBuffer;III)Z"                                      , (void *) Java_uk_co_caprica_picam_Camera_captureRgbBuffer   },
+    {"captureBayer"      , "(Luk/co/caprica/picam/BayerCaptureHandler;ZI)Z"                   , (void *) Java_uk_co_caprica_picam_Camera_captureBayer       },
+    {"encodeFrame"       , "(Ljava/nio/ByteBuffer;IIIIII)Z"                                   , (void *) Java_uk_co_caprica_picam_Camera_encodeFrame        },
+    {"encodeFrameAddress", "(JIIIIIII)Z"                                                      , (void *) Java_uk_co_caprica_picam_Camera_encodeFrameAddress },
+    {"receiveFrame"      , "()[B"                                                             , (void *) Java_uk_co_caprica_picam_Camera_receiveFrame       },
+    {"timelapse"         , "(Luk/co/caprica/picam/TimelapseHandler;JJIIZZLjava/lang/String;)Z", (void *) Java_uk_co_caprica_picam_Camera_timelapse          },
+    {"stopTimelapse"     , "()V"                                                              , (void *) Java_uk_co_caprica_picam_Camera_stopTimelapse      },
+    {"annotate"          , "(Ljava/lang/String;)Z"                                            , (void *) Java_uk_co_caprica_picam_Camera_annotate           },
+    {"lockExposure"      , "()Z"                                                              , (void *) Java_uk_co_caprica_picam_Camera_lockExposure       },
+    {"unlockExposure"    , "()Z"                                                              , (void *) Java_uk_co_caprica_picam_Camera_unlockExposure     },
+    {"startTrace"        , "(Ljava/lang/String;Z)Z"                                           , (void *) Java_uk_co_caprica_picam_Camera_startTrace         },
+    {"stopTrace"         , "()V"                                                              , (void *) Java_uk_co_caprica_picam_Camera_stopTrace          },
+    {"statistics"        , "(Luk/co/caprica/picam/CameraStatistics;)V"                        , (void *) Java_uk_co_caprica_picam_Camera_statistics         },
+    {"pictureInfo"       , "(Luk/co/caprica/picam/PictureInfo;)V"                             , (void *) Java_uk_co_caprica_picam_Camera_pictureInfo        },
+    {"sensor"            , "(Luk/co/caprica/picam/CameraSensor;)V"                            , (void *) Java_uk_co_caprica_picam_Camera_sensor             },
+    {"setLogLevel"       , "(I)V"                                                             , (void *) Java_uk_co_caprica_picam_Camera_setLogLevel        },
+    {"setLogFile"        , "(Ljava/lang/String;)Z"                                            , (void *) Java_uk_co_caprica_picam_Camera_setLogFile         },
+    {"setLogHandler"     , "(Luk/co/caprica/picam/LogHandler;)V"                              , (void *) Java_uk_co_caprica_picam_Camera_setLogHandler      }
+};
 
 /**
  * JNI library initialisation, invoked once when the native library is loaded.
@@ -66,15 +192,46 @@ JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM *jvm, void *reserved) {
     // that will be executed when a thread is destroyed (if that thread has set a value for this
     // key - the destruction function is used to detach the previously attached Java thread
     if (pthread_key_create(&(JniContext.threadKey), jniThreadDestructor) < 0) {
-        printf("failed to create threadkey\n");
+        logError("Failed to create thread key");
         return 0;
     }
 
-    context.pictureDataCallback = &pictureDataCallback;
+    context = picamInit();
+    if (!context) {
+        return 0;
+    }
 
     return REQUIRED_JNI_VERSION;
 }
 
+/**
+ * JNI library finalisation, invoked once if the class loader that loaded the library is collected.
+ */
+JNIEXPORT void JNICALL JNI_OnUnload(JavaVM *jvm, void *reserved) {
+    picamRelease(context);
+    context = NULL;
+}
+
+/**
+ * Register the native methods with the JVM.
+ *
+ * This is only needed when the library is loaded by the loader stub rather than directly by the
+ * JVM, since the JVM can not itself see the symbols in a library loaded that way.
+ *
+ * @param env JNI environment
+ * @return JNI_OK on success; JNI_ERR on error
+ */
+JNIEXPORT jint JNICALL picamRegisterNatives(JNIEnv *env) {
+    jclass cameraClass = (*env)->FindClass(env, "uk/co/caprica/picam/Camera");
+    if (!cameraClass) {
+        return JNI_ERR;
+    }
+
+    jint methodCount = sizeof(nativeMethods) / sizeof(nativeMethods[0]);
+
+    return (*env)->RegisterNatives(env, cameraClass, nativeMethods, methodCount) == 0 ? JNI_OK : JNI_ERR;
+}
+
 /**
  * Create all of the native resources necessary for using the camera.
  *
@@ -83,29 +240,14 @@ JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM *jvm, void *reserved) {
  * @param configurationObj camera configuration object reference, may be NULL
  */
 JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_create(JNIEnv *env, jobject cameraObj, jobject configurationObj) {
-    setConfigurationDefaults(&context.config);
+    PicamConfig config;
+    setConfigurationDefaults(&config);
 
     if (configurationObj) {
-        extractConfiguration(env, configurationObj, &context.config);
-    }
-
-    if (VCOS_SUCCESS != vcos_semaphore_create(&context.captureFinishedSemaphore, "picam-capture-finished", 0)) {
-        goto error;
-    }
-
-    if (!createCamera(&context)) {
-        goto error;
-    }
-
-    if (!createEncoder(&context)) {
-        goto error;
+        extractConfiguration(env, configurationObj, &config);
     }
 
-    return true;
-
-error:
-    cleanup(env);
-    return false;
+    return picamOpen(context, &config) ? true : false;
 }
 
 /**
@@ -121,176 +263,1293 @@ error:
  * @throws IllegalArgumentException if handler is null
  */
 JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_capture(JNIEnv *env, jobject obj, jobject handler, jint delay) {
-    if (!handler) {
-        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Handler must not be null");
-        return false;
+    return performPictureCapture(env, handler, NULL, delay);
+}
+
+/**
+ * Capture a picture with a different encoding and/or quality to that configured.
+ *
+ * The configured encoding and quality are unchanged for subsequent captures. Switching between
+ * encodings and qualities from one capture to the next does not rebuild the camera. An explicit
+ * quality turns off any configured rate control for this capture.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @param handler picture capture handler object reference
+ * @param encoding encoding value from the Java Encoding enumeration, or zero for the configured encoding
+ * @param quality quality, or zero for the configured quality
+ * @param delay
+ * @return true if the capture was successfully triggered; false if it was not
+ * @throws IllegalArgumentException if handler is null
+ */
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_captureEncoded(JNIEnv *env, jobject obj, jobject handler, jint encoding, jint quality, jint delay) {
+    EncoderConfig encoder;
+    picamEncoderConfig(context, &encoder);
+
+    if (encoding != 0) {
+        encoder.encoding = encoding;
     }
 
-    // Make sure the JNI global state is property initialised to reflect the supplied handler
-    // object (existing JNI object references will be used where possible)
-    setupJniContext(env, handler);
+    // An explicit quality overrides any configured rate control
+    if (quality > 0) {
+        encoder.quality    = quality;
+        encoder.targetSize = 0;
+    }
 
-    if (delay > 0) {
-        vcos_sleep(delay);
+    return performPictureCapture(env, handler, &encoder, delay);
+}
+
+/**
+ * Capture multiple regions of interest from a single exposure.
+ *
+ * Each region is described by four values in the regions array - x, y, width and height - all
+ * normalised to the range 0.0 to 1.0. The optional sizes array gives a target width and height in
+ * pixels for each region, a zero (or a NULL array) leaves the region unscaled.
+ *
+ * Unlike capture, the handler is invoked on the calling thread, once for each region in order.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @param handler region capture handler object reference
+ * @param regionsArray region positions and sizes, four values per region
+ * @param sizesArray region target sizes, two values per region, may be NULL
+ * @param encode true to encode each region with the configured encoding; false for I420 data
+ * @param delay
+ * @return true if the capture succeeded; false if it did not
+ * @throws IllegalArgumentException if handler or regions is null, or the arrays are inconsistent
+ */
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_captureRegions(JNIEnv *env, jobject obj, jobject handler, jdoubleArray regionsArray, jintArray sizesArray, jboolean encode, jint delay) {
+    jsize count = regionsArray ? (*env)->GetArrayLength(env, regionsArray) / 4 : 0;
+
+    if (!handler || !regionsArray || count == 0 || (*env)->GetArrayLength(env, regionsArray) != count * 4 || (sizesArray && (*env)->GetArrayLength(env, sizesArray) != count * 2)) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Handler and regions must not be null, and there must be four region values and two size values per region");
+        return false;
     }
 
-    // PictureCaptureHandler#begin():void
-    (*env)->CallNonvirtualVoidMethod(env, JniContext.handler, JniContext.handlerClass, JniContext.beginMethod);
-    if ((*env)->ExceptionCheck(env)) {
-        // Caller will see the thrown exception, not this return value
+    Region *regions = calloc(count, sizeof(Region));
+    if (!regions) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/OutOfMemoryError"), "Failed to allocate regions");
         return false;
     }
 
-    char *captureFailure;
+    jdouble *regionValues = (*env)->GetDoubleArrayElements(env, regionsArray, NULL);
+    jint    *sizeValues   = sizesArray ? (*env)->GetIntArrayElements(env, sizesArray, NULL) : NULL;
 
-    if (mmal_port_parameter_set_boolean(context.cameraComponent->output[MMAL_CAMERA_CAPTURE_PORT], MMAL_PARAMETER_CAPTURE, 1) == MMAL_SUCCESS) {
-        if (context.config.camera.captureTimeout > 0) {
-            VCOS_STATUS_T semaphoreResult = vcos_semaphore_wait_timeout(&context.captureFinishedSemaphore, context.config.camera.captureTimeout);
-            if (semaphoreResult == VCOS_SUCCESS) {
-                captureFailure = NULL;
-            } else if (semaphoreResult == VCOS_EAGAIN) {
-                captureFailure = "Timed-out waiting for capture finished semaphore";
-            } else {
-                captureFailure = "General error waiting for capture finished semaphore";
-            }
-        } else {
-            vcos_semaphore_wait(&context.captureFinishedSemaphore);
-            captureFailure = NULL;
+    for (jsize i = 0; i < count; i++) {
+        regions[i].x = regionValues[i * 4    ];
+        regions[i].y = regionValues[i * 4 + 1];
+        regions[i].w = regionValues[i * 4 + 2];
+        regions[i].h = regionValues[i * 4 + 3];
+        if (sizeValues) {
+            regions[i].width  = sizeValues[i * 2    ] > 0 ? sizeValues[i * 2    ] : 0;
+            regions[i].height = sizeValues[i * 2 + 1] > 0 ? sizeValues[i * 2 + 1] : 0;
         }
     }
 
-    // PictureCaptureHandler#end():void
-    (*env)->CallNonvirtualVoidMethod(env, JniContext.handler, JniContext.handlerClass, JniContext.endMethod);
-    if ((*env)->ExceptionCheck(env)) {
-        // Caller will see the thrown exception, not this return value
+    (*env)->ReleaseDoubleArrayElements(env, regionsArray, regionValues, JNI_ABORT);
+    if (sizeValues) {
+        (*env)->ReleaseIntArrayElements(env, sizesArray, sizeValues, JNI_ABORT);
+    }
+
+    RegionRequest request = {
+        .type    = REGION_REQUEST_REGIONS,
+        .regions = regions,
+        .count   = count,
+        .encode  = encode
+    };
+
+    jboolean result = performRegionCapture(env, handler, &request, delay);
+
+    free(regions);
+
+    return result;
+}
+
+/**
+ * Capture a stereoscopic picture, and deliver each eye separately.
+ *
+ * The handler receives region index 0 for the left eye and 1 for the right eye - or, if the eyes
+ * are interleaved, a single region index 0 for an image with alternate rows from each eye.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @param handler region capture handler object reference
+ * @param encode true to encode each output with the configured encoding; false for I420 data
+ * @param interleave true to deliver one row-interleaved image; false for each eye separately
+ * @param delay
+ * @return true if the capture succeeded; false if it did not
+ * @throws IllegalArgumentException if handler is null
+ */
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_captureStereo(JNIEnv *env, jobject obj, jobject handler, jboolean encode, jboolean interleave, jint delay) {
+    if (!handler) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Handler must not be null");
         return false;
     }
 
-    if (captureFailure) {
-        (*env)->ThrowNew(env, (*env)->FindClass(env, "uk/co/caprica/picam/CaptureFailedException"), captureFailure);
+    RegionRequest request = {
+        .type       = REGION_REQUEST_STEREO,
+        .encode     = encode,
+        .interleave = interleave
+    };
+
+    return performRegionCapture(env, handler, &request, delay);
+}
+
+/**
+ * Capture a bracket of differently exposed frames back-to-back, and deliver each frame or a single
+ * natively fused picture.
+ *
+ * The handler receives region index i for the frame taken with the i'th exposure - or, if the
+ * frames are fused, a single region index 0. The total time taken is available afterwards as the
+ * lastBracketTime statistic.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @param handler region capture handler object reference
+ * @param compensationsArray exposure compensation for each frame
+ * @param shutterSpeedsArray shutter speed in microseconds for each frame, may be NULL for automatic
+ * @param settle time to wait, in milliseconds, for each exposure to take effect
+ * @param fuse true to deliver a single fused picture; false to deliver each frame
+ * @param encode true to encode each output with the configured encoding; false for I420 data
+ * @param delay
+ * @return true if the capture succeeded; false if it did not
+ * @throws IllegalArgumentException if handler or compensations is null, or the arrays are inconsistent
+ */
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_captureBracket(JNIEnv *env, jobject obj, jobject handler, jintArray compensationsArray, jintArray shutterSpeedsArray, jint settle, jboolean fuse, jboolean encode, jint delay) {
+    jsize count = compensationsArray ? (*env)->GetArrayLength(env, compensationsArray) : 0;
+
+    if (!handler || count == 0 || count > BRACKET_MAX_FRAMES || (shutterSpeedsArray && (*env)->GetArrayLength(env, shutterSpeedsArray) != count)) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Handler and compensations must not be null, there must be at most eight exposures, and one shutter speed per exposure");
+        return false;
     }
 
-    return (jboolean) (captureFailure == NULL);
+    BracketSetting settings[BRACKET_MAX_FRAMES] = {{0}};
+
+    jint *compensationValues = (*env)->GetIntArrayElements(env, compensationsArray, NULL);
+    jint *shutterSpeedValues = shutterSpeedsArray ? (*env)->GetIntArrayElements(env, shutterSpeedsArray, NULL) : NULL;
+
+    for (jsize i = 0; i < count; i++) {
+        settings[i].exposureCompensation = compensationValues[i];
+        if (shutterSpeedValues) {
+            settings[i].shutterSpeed = shutterSpeedValues[i] > 0 ? shutterSpeedValues[i] : 0;
+        }
+    }
+
+    (*env)->ReleaseIntArrayElements(env, compensationsArray, compensationValues, JNI_ABORT);
+    if (shutterSpeedValues) {
+        (*env)->ReleaseIntArrayElements(env, shutterSpeedsArray, shutterSpeedValues, JNI_ABORT);
+    }
+
+    RegionRequest request = {
+        .type     = REGION_REQUEST_BRACKET,
+        .settings = settings,
+        .count    = count,
+        .settle   = settle > 0 ? settle : 0,
+        .fuse     = fuse,
+        .encode   = encode
+    };
+
+    return performRegionCapture(env, handler, &request, delay);
 }
 
 /**
- * Clean up the camera and all associated resources.
- * 
+ * Capture a low-light picture by stacking a number of shorter exposures, instead of taking one long
+ * exposure.
+ *
+ * The frames are captured raw back-to-back, aligned and stacked natively, and the handler receives
+ * the result as region index 0. The total time taken is available afterwards as the
+ * lastLowLightTime statistic.
+ *
  * @param env JNI environment
  * @param obj camera object reference
+ * @param handler region capture handler object reference
+ * @param count number of frames to stack, at most eight
+ * @param shutterSpeed shutter speed for each frame in microseconds, zero to keep the current exposure
+ * @param median true to take the median of the frames, rejecting anything moving; false for the mean
+ * @param align true to align the frames before stacking; false if the camera is fixed
+ * @param encode true to encode the output with the configured encoding; false for I420 data
+ * @param delay
+ * @return true if the capture succeeded; false if it did not
+ * @throws IllegalArgumentException if handler is null, or count is out of range
  */
-JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_destroy(JNIEnv *env, jobject obj) {
-    cleanup(env);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_captureLowLight(JNIEnv *env, jobject obj, jobject handler, jint count, jint shutterSpeed, jboolean median, jboolean align, jboolean encode, jint delay) {
+    if (!handler || count <= 0 || count > LOW_LIGHT_MAX_FRAMES) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Handler must not be null, and there must be between one and eight frames");
+        return false;
+    }
+
+    RegionRequest request = {
+        .type         = REGION_REQUEST_LOW_LIGHT,
+        .count        = count,
+        .shutterSpeed = shutterSpeed > 0 ? shutterSpeed : 0,
+        .median       = median,
+        .align        = align,
+        .encode       = encode
+    };
+
+    return performRegionCapture(env, handler, &request, delay);
 }
 
-// === Private implementation =====================================================================
+/**
+ * Capture a picture converted natively to RGB, straight into a Java int array.
+ *
+ * Each pixel is 0xFFRRGGBB, so the array can back a TYPE_INT_RGB or TYPE_INT_ARGB BufferedImage
+ * directly. The array is only pinned while the pixels are converted, not during the capture.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @param pixels array to receive the pixels, at least width times height in length
+ * @param width width of the picture, or zero for the configured width
+ * @param height height of the picture, or zero for the configured height
+ * @param delay
+ * @return true if the capture succeeded; false if it did not
+ * @throws IllegalArgumentException if pixels is null or too small, or the size is negative
+ */
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_captureRgb(JNIEnv *env, jobject obj, jintArray pixels, jint width, jint height, jint delay) {
+    if (!pixels || width < 0 || height < 0) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Pixels must not be null, and the size must not be negative");
+        return false;
+    }
+
+    RgbHandlerContext handlerContext = {
+        .env   = env,
+        .array = pixels
+    };
+
+    return performRgbCapture(env, &handlerContext, width, height, delay);
+}
 
 /**
- * Native thread destructor.
- * 
- * Detaches the thread that was attached earlier for the native callback.
+ * Capture a picture converted natively to RGB, straight into a direct buffer - see captureRgb.
+ *
+ * The pixels are 32-bit values in the native byte order, so the buffer should be viewed with
+ * order(ByteOrder.nativeOrder()).asIntBuffer().
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @param buffer direct buffer to receive the pixels, at least four bytes for each pixel
+ * @param width width of the picture, or zero for the configured width
+ * @param height height of the picture, or zero for the configured height
+ * @param delay
+ * @return true if the capture succeeded; false if it did not
+ * @throws IllegalArgumentException if the buffer is not direct, is misaligned or too small, or the size is negative
  */
-static void jniThreadDestructor(void *env) {
-    JavaVM *jvm = JniContext.jvm;
-    (*jvm)->DetachCurrentThread(jvm);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_captureRgbBuffer(JNIEnv *env, jobject obj, jobject buffer, jint width, jint height, jint delay) {
+    const uint8_t *data = buffer ? (*env)->GetDirectBufferAddress(env, buffer) : NULL;
+    if (!data || ((uintptr_t) data & 3) || width < 0 || height < 0) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Buffer must be a direct buffer aligned to four bytes, and the size must not be negative");
+        return false;
+    }
+
+    RgbHandlerContext handlerContext = {
+        .env    = env,
+        .buffer = buffer
+    };
+
+    return performRgbCapture(env, &handlerContext, width, height, delay);
 }
 
 /**
- * Initialise the global JNI context, used to cache various JNI object references.
- * 
- * A JNI global ref must be created for the handler object and its class as we need to keep valid
- * references for use in the native callback thread.
- * 
- * Method ids can be safely kept across threads.
- * 
- * The context must be re-initialised each time the handler instance changes.
- * 
+ * Capture a picture with the sensor-raw Bayer data, and deliver the unpacked data.
+ *
+ * The handler receives the size, bit depth, Bayer order and black level of the sensor, the raw
+ * mosaic with one value per pixel, and - if requested - the demosaiced data as interleaved RGB.
+ * The values are unsigned 16-bit, so must be masked with 0xFFFF when widened in Java.
+ *
  * @param env JNI environment
- * @param handler picture capture handler object reference
+ * @param obj camera object reference
+ * @param handler Bayer capture handler object reference
+ * @param demosaic true to also deliver demosaiced RGB data; false for the raw data only
+ * @param delay
+ * @return true if the capture succeeded; false if it did not
+ * @throws IllegalArgumentException if handler is null
  */
-static void setupJniContext(JNIEnv *env, jobject handler) {
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_captureBayer(JNIEnv *env, jobject obj, jobject handler, jboolean demosaic, jint delay) {
+    if (!handler) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Handler must not be null");
+        return false;
+    }
+
     jclass handlerClass = (*env)->GetObjectClass(env, handler);
 
-    if (JNI_TRUE != (*env)->IsSameObject(env, handler, JniContext.handler)) {
+    BayerHandlerContext handlerContext = {
+        .env             = env,
+        .handler         = handler,
+        // BayerCaptureHandler#bayerData(int,int,int,int,int,short[],short[]):void
+        .bayerDataMethod = (*env)->GetMethodID(env, handlerClass, "bayerData", "(IIIII[S[S)V")
+    };
 
-        if (JNI_TRUE != (*env)->IsSameObject(env, handlerClass, JniContext.handlerClass)) {
-            JniContext.beginMethod       = (*env)->GetMethodID(env, handlerClass, "begin"      , "()V"  );
-            JniContext.pictureDataMethod = (*env)->GetMethodID(env, handlerClass, "pictureData", "([B)I");
-            JniContext.endMethod         = (*env)->GetMethodID(env, handlerClass, "end"        , "()V"  );
+    assert(handlerContext.bayerDataMethod != NULL);
 
-            assert(JniContext.beginMethod       != NULL);
-            assert(JniContext.pictureDataMethod != NULL);
-            assert(JniContext.endMethod         != NULL);
-        }
+    if (delay > 0) {
+        usleep(delay * 1000);
+    }
+
+    // BayerCaptureHandler#begin():void
+    (*env)->CallVoidMethod(env, handler, (*env)->GetMethodID(env, handlerClass, "begin", "()V"));
+    if ((*env)->ExceptionCheck(env)) {
+        // Caller will see the thrown exception, not this return value
+        return false;
+    }
+
+    char *captureFailure = picamCaptureBayer(context, demosaic, bayerDataSink, &handlerContext);
+
+    if (!(*env)->ExceptionCheck(env)) {
+        // BayerCaptureHandler#end():void
+        (*env)->CallVoidMethod(env, handler, (*env)->GetMethodID(env, handlerClass, "end", "()V"));
+    }
 
-        // Now we can delete the old global handler and handler class refs before creating new ones
-        cleanupJniContext(env);
+    if ((*env)->ExceptionCheck(env)) {
+        // Caller will see the thrown exception, not this return value
+        return false;
+    }
 
-        JniContext.handler      = (*env)->NewGlobalRef(env, handler     );
-        JniContext.handlerClass = (*env)->NewGlobalRef(env, handlerClass);
+    if (captureFailure) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "uk/co/caprica/picam/CaptureFailedException"), captureFailure);
     }
+
+    return (jboolean) (captureFailure == NULL);
 }
 
 /**
- * Delete the handler and handler class global references from the global JNI context.
- * 
+ * Submit a frame in a direct byte buffer to the standalone hardware encoder.
+ *
+ * This returns as soon as the frame has been copied to the encoder, several frames may be in flight
+ * at once and the encoded frames are collected with receiveFrame in the order they were submitted.
+ * The standalone encoder does not need the camera to be capturing.
+ *
  * @param env JNI environment
+ * @param obj camera object reference
+ * @param frame direct byte buffer containing the frame
+ * @param format MMAL encoding of the frame, I420, RGB24 or RGBA
+ * @param width frame width in pixels
+ * @param height frame height in pixels
+ * @param stride row stride of the frame (or of the luma plane) in bytes
+ * @param encoding MMAL encoding of the output, zero for the configured encoding
+ * @param quality JPEG quality of the output, zero for the configured quality
+ * @return true if the frame was submitted; false if it was not
+ * @throws IllegalArgumentException if the buffer is not direct or is too small for the frame
  */
-static void cleanupJniContext(JNIEnv *env) {
-    if (JniContext.handler) {
-        (*env)->DeleteGlobalRef(env, JniContext.handler);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_encodeFrame(JNIEnv *env, jobject obj, jobject frame, jint format, jint width, jint height, jint stride, jint encoding, jint quality) {
+    const uint8_t *data = frame ? (*env)->GetDirectBufferAddress(env, frame) : NULL;
+    if (!data) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Frame must be a direct buffer");
+        return false;
     }
 
-    if (JniContext.handlerClass) {
-        (*env)->DeleteGlobalRef(env, JniContext.handlerClass);
+    return submitFrameData(env, data, (*env)->GetDirectBufferCapacity(env, frame), format, width, height, stride, encoding, quality);
+}
+
+/**
+ * Submit a frame in native memory to the standalone hardware encoder, see encodeFrame.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @param address address of the frame in native memory
+ * @param length length of the native memory
+ * @param format MMAL encoding of the frame, I420, RGB24 or RGBA
+ * @param width frame width in pixels
+ * @param height frame height in pixels
+ * @param stride row stride of the frame (or of the luma plane) in bytes
+ * @param encoding MMAL encoding of the output, zero for the configured encoding
+ * @param quality JPEG quality of the output, zero for the configured quality
+ * @return true if the frame was submitted; false if it was not
+ * @throws IllegalArgumentException if the address is zero or the memory is too small for the frame
+ */
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_encodeFrameAddress(JNIEnv *env, jobject obj, jlong address, jint length, jint format, jint width, jint height, jint stride, jint encoding, jint quality) {
+    if (!address) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Address must not be zero");
+        return false;
     }
 
-    JniContext.handler = JniContext.handlerClass = NULL;
+    return submitFrameData(env, (const uint8_t *) (intptr_t) address, length, format, width, height, stride, encoding, quality);
 }
 
-static uint32_t pictureDataCallback(uint8_t *data, uint32_t length) {
-    JavaVM *jvm = JniContext.jvm;
-    JNIEnv *env = NULL;
+/**
+ * Wait for the oldest frame submitted to the standalone hardware encoder, and get the encoded data.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @return encoded frame data; or NULL on failure
+ * @throws CaptureFailedException if no frame is in flight, or the frame could not be encoded
+ */
+JNIEXPORT jbyteArray JNICALL Java_uk_co_caprica_picam_Camera_receiveFrame(JNIEnv *env, jobject obj) {
+    const uint8_t *data;
+    size_t         length;
 
-    // Get a JNI environment for this thread
-    if (JNI_EDETACHED == (*jvm)->GetEnv(jvm, (void**) &env, REQUIRED_JNI_VERSION)) {
-        // There is no JNI environment available, meaning there is no current thread attached, so
-        // attach the thread
-        if (JNI_OK == (*jvm)->AttachCurrentThread(jvm, (void**) &env, NULL)) {
-            // A non-NULL thread-key value must be set for the thread destructor to run later, so
-            // set a value for the key (if one is not already set)
-            if (!pthread_getspecific(JniContext.threadKey)) {
-                if (pthread_setspecific(JniContext.threadKey, env)) {
-                    (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/RuntimeException"), "Failed to set native thread key");
-                    return -1;
-                }
-            }
-        } else {
-            (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/RuntimeException"), "Failed to attach thread");
-            return -1;
-        }
+    char *encodeFailure = picamReceiveFrame(context, &data, &length);
+    if (encodeFailure) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "uk/co/caprica/picam/CaptureFailedException"), encodeFailure);
+        return NULL;
     }
 
     jbyteArray array = (*env)->NewByteArray(env, length);
-    (*env)->SetByteArrayRegion(env, array, 0, length, (jbyte *) data);
-
-    // PictureCaptureHandler#pictureData(byte[]):int
-    jint written = (*env)->CallNonvirtualIntMethod(env, JniContext.handler, JniContext.handlerClass, JniContext.pictureDataMethod, array);
-
-    (*env)->DeleteLocalRef(env, array);
-
-    if ((*env)->ExceptionCheck(env)) {
-        return -1;
+    if (array) {
+        (*env)->SetByteArrayRegion(env, array, 0, length, (const jbyte *) data);
     }
-
-    return written;
+    return array;
 }
 
-static void cleanup(JNIEnv *env) {
-    destroyCamera (&context);
-    destroyEncoder(&context);
+/**
+ * Clean up the camera and all associated resources.
+ * 
+ * @param env JNI environment
+ * @param obj camera object reference
+ */
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_destroy(JNIEnv *env, jobject obj) {
+    picamClose(context);
+}
 
-    vcos_semaphore_delete(&context.captureFinishedSemaphore);
+/**
+ * Start recording H.264 video into the native pre-roll buffer.
+ *
+ * The recording settings are taken from the camera configuration.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @return true on success; false on error
+ */
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_startRecording(JNIEnv *env, jobject obj) {
+    return picamStartRecording(context) ? true : false;
+}
+
+/**
+ * Stop recording.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ */
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_stopRecording(JNIEnv *env, jobject obj) {
+    picamStopRecording(context);
+}
+
+/**
+ * Write the recording pre-roll, followed by the live stream, to a file.
+ *
+ * This returns immediately, the file is written natively in the background.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @param path file path
+ * @param postRoll time to continue writing after the flush, in milliseconds
+ * @return true if the flush was started; false if it was not
+ * @throws IllegalArgumentException if path is null
+ */
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_flushRecording(JNIEnv *env, jobject obj, jstring path, jint postRoll) {
+    if (!path) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Path must not be null");
+        return false;
+    }
+
+    const char *filePath = (*env)->GetStringUTFChars(env, path, NULL);
+
+    jboolean result = picamFlushRecording(context, filePath, postRoll > 0 ? postRoll : 0) ? true : false;
+
+    (*env)->ReleaseStringUTFChars(env, path, filePath);
+
+    return result;
+}
+
+/**
+ * Run a timelapse on the calling thread, returning when it finishes or is stopped.
+ *
+ * Frames are captured at absolute deadlines, start + n * period, on either the monotonic or the
+ * realtime (wall-clock) clock - with no start time, the first deadline is the next whole multiple
+ * of the period. The lead time before each deadline is used to get the camera ready, and the
+ * capture is then triggered on the deadline itself.
+ *
+ * The handler receives each frame with its slot index, scheduled and actual trigger times, and
+ * either its data or, when a directory is given, the file it was written to. A slot missed because
+ * the previous frame overran is reported to the handler as skipped rather than captured late.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @param handler timelapse handler object reference
+ * @param start time of the first slot in microseconds on the selected clock, zero for the next period boundary
+ * @param period period in microseconds
+ * @param count number of slots, zero to run until stopped
+ * @param lead time in microseconds to get the camera ready ahead of each deadline, zero for none
+ * @param realtime true to schedule on the realtime clock; false for the monotonic clock
+ * @param encode true to encode each frame with the configured encoding; false for I420 data
+ * @param directory directory to write each frame to, may be NULL to deliver the data to the handler
+ * @return true if the timelapse completed; false if it did not
+ * @throws IllegalArgumentException if handler is null or period is not positive
+ */
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_timelapse(JNIEnv *env, jobject obj, jobject handler, jlong start, jlong period, jint count, jint lead, jboolean realtime, jboolean encode, jstring directory) {
+    if (!handler || period <= 0) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Handler must not be null and period must be positive");
+        return false;
+    }
+
+    jclass handlerClass = (*env)->GetObjectClass(env, handler);
+
+    TimelapseHandlerContext handlerContext = {
+        .env           = env,
+        .handler       = handler,
+        // TimelapseHandler#frame(int,long,long,byte[],String):void
+        .frameMethod   = (*env)->GetMethodID(env, handlerClass, "frame", "(IJJ[BLjava/lang/String;)V"),
+        // TimelapseHandler#skipped(int,long,long):void
+        .skippedMethod = (*env)->GetMethodID(env, handlerClass, "skipped", "(IJJ)V")
+    };
+
+    assert(handlerContext.frameMethod != NULL);
+    assert(handlerContext.skippedMethod != NULL);
+
+    const char *directoryPath = directory ? (*env)->GetStringUTFChars(env, directory, NULL) : NULL;
+
+    TimelapseSchedule schedule = {
+        .realtime  = realtime,
+        .start     = start > 0 ? start : 0,
+        .period    = period,
+        .count     = count > 0 ? count : 0,
+        .lead      = lead > 0 ? lead : 0,
+        .encode    = encode,
+        .directory = directoryPath
+    };
+
+    char *timelapseFailure = NULL;
+
+    // TimelapseHandler#begin():void
+    (*env)->CallVoidMethod(env, handler, (*env)->GetMethodID(env, handlerClass, "begin", "()V"));
+    if (!(*env)->ExceptionCheck(env)) {
+        timelapseFailure = picamTimelapse(context, &schedule, timelapseFrameSink, &handlerContext);
+
+        if (!(*env)->ExceptionCheck(env)) {
+            // TimelapseHandler#end():void
+            (*env)->CallVoidMethod(env, handler, (*env)->GetMethodID(env, handlerClass, "end", "()V"));
+        }
+    }
+
+    if (directoryPath) {
+        (*env)->ReleaseStringUTFChars(env, directory, directoryPath);
+    }
+
+    if ((*env)->ExceptionCheck(env)) {
+        // Caller will see the thrown exception, not this return value
+        return false;
+    }
+
+    if (timelapseFailure) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "uk/co/caprica/picam/CaptureFailedException"), timelapseFailure);
+    }
+
+    return (jboolean) (timelapseFailure == NULL);
+}
+
+/**
+ * Stop a running timelapse, may be invoked from any thread.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ */
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_stopTimelapse(JNIEnv *env, jobject obj) {
+    picamStopTimelapse(context);
+}
+
+/**
+ * Change the text annotated on every frame, without reconfiguring the camera.
+ *
+ * The text may contain strftime conversions, which are expanded with the local time when each
+ * picture is captured. The other annotation settings are taken from the camera configuration.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @param text annotation text, or null for none
+ * @return true on success; false on error
+ */
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_annotate(JNIEnv *env, jobject obj, jstring text) {
+    const char *annotation = text ? (*env)->GetStringUTFChars(env, text, NULL) : NULL;
+
+    jboolean result = picamAnnotate(context, annotation ? annotation : "") ? true : false;
+
+    if (annotation) {
+        (*env)->ReleaseStringUTFChars(env, text, annotation);
+    }
+
+    return result;
+}
+
+/**
+ * Lock the exposure and white balance at the values the camera has converged on.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @return true on success; false on error
+ */
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_lockExposure(JNIEnv *env, jobject obj) {
+    return picamLockExposure(context) ? true : false;
+}
+
+/**
+ * Unlock the exposure and white balance.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @return true on success; false on error
+ */
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_unlockExposure(JNIEnv *env, jobject obj) {
+    return picamUnlockExposure(context) ? true : false;
+}
+
+/**
+ * Start recording a trace of capture activity to a file, for offline replay with picam-replay.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @param path trace file path
+ * @param payload true to record the encoded picture data as well as the events
+ * @return true if the trace was started; false if it was not
+ * @throws IllegalArgumentException if path is null
+ */
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_startTrace(JNIEnv *env, jobject obj, jstring path, jboolean payload) {
+    if (!path) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Path must not be null");
+        return false;
+    }
+
+    const char *filePath = (*env)->GetStringUTFChars(env, path, NULL);
+
+    jboolean result = picamStartTrace(context, filePath, payload) ? true : false;
+
+    (*env)->ReleaseStringUTFChars(env, path, filePath);
+
+    return result;
+}
+
+/**
+ * Stop recording a trace.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ */
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_stopTrace(JNIEnv *env, jobject obj) {
+    picamStopTrace(context);
+}
+
+/**
+ * Get the current camera statistics.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @param statisticsObj camera statistics object reference to fill with the current values
+ */
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_statistics(JNIEnv *env, jobject obj, jobject statisticsObj) {
+    if (!statisticsObj) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Statistics must not be null");
+        return;
+    }
+
+    publishStatistics(env, statisticsObj, picamStatistics(context));
+}
+
+/**
+ * Get the attached sensor, and the sensor mode in use.
+ *
+ * The sensor mode is reported as zero if the choice of mode was left to the firmware.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @param sensorObj camera sensor object reference to fill with the current values
+ */
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_sensor(JNIEnv *env, jobject obj, jobject sensorObj) {
+    if (!sensorObj) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Sensor must not be null");
+        return;
+    }
+
+    SensorInfo sensorInfo;
+    picamSensor(context, &sensorInfo);
+
+    const SensorInfo *sensor = &sensorInfo;
+
+    jfieldID nameField = (*env)->GetFieldID(env, (*env)->GetObjectClass(env, sensorObj), "name", "Ljava/lang/String;");
+    assert(nameField != NULL);
+    (*env)->SetObjectField(env, sensorObj, nameField, sensor->name[0] ? (*env)->NewStringUTF(env, sensor->name) : NULL);
+
+    setIntField(env, sensorObj, "width"     , sensor->width     );
+    setIntField(env, sensorObj, "height"    , sensor->height    );
+    setIntField(env, sensorObj, "mode"      , sensor->mode      );
+    setIntField(env, sensorObj, "modeWidth" , sensor->modeWidth );
+    setIntField(env, sensorObj, "modeHeight", sensor->modeHeight);
+    setIntField(env, sensorObj, "binning"   , sensor->binning   );
+}
+
+/**
+ * Get the validity and metadata of the picture most recently captured on the calling thread.
+ *
+ * The info belongs to the capture that was made for this thread, even if it was shared with other
+ * threads, and is not affected by captures that other threads make afterwards.
+ *
+ * A JPEG is checked as it streams from the encoder - the marker structure is verified from SOI to
+ * EOI, and the dimensions, component layout and EXIF and thumbnail offsets are picked out along
+ * the way. A picture that was not a JPEG, or a capture that did not complete, is not complete.
+ *
+ * The sampling and component id fields hold one byte per component, the first component in the
+ * least significant byte.
+ *
+ * @param env JNI environment
+ * @param obj camera object reference
+ * @param infoObj picture info object reference to fill with the values
+ */
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_pictureInfo(JNIEnv *env, jobject obj, jobject infoObj) {
+    if (!infoObj) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Info must not be null");
+        return;
+    }
+
+    const JpegInfo *info = &lastPictureInfo;
+
+    int32_t sampling     = 0;
+    int32_t componentIds = 0;
+    for (uint32_t i = 0; i < info->components; i++) {
+        sampling     |= info->sampling    [i] << (i * 8);
+        componentIds |= info->componentIds[i] << (i * 8);
+    }
+
+    setBooleanField(env, infoObj, "complete"       , info->complete       );
+    setBooleanField(env, infoObj, "valid"          , info->valid          );
+    setBooleanField(env, infoObj, "truncated"      , info->truncated      );
+    setIntField    (env, infoObj, "length"         , info->length         );
+    setIntField    (env, infoObj, "width"          , info->width          );
+    setIntField    (env, infoObj, "height"         , info->height         );
+    setIntField    (env, infoObj, "precision"      , info->precision      );
+    setIntField    (env, infoObj, "components"     , info->components     );
+    setIntField    (env, infoObj, "componentIds"   , componentIds         );
+    setIntField    (env, infoObj, "sampling"       , sampling             );
+    setBooleanField(env, infoObj, "progressive"    , info->progressive    );
+    setIntField    (env, infoObj, "exifOffset"     , info->exifOffset     );
+    setIntField    (env, infoObj, "exifLength"     , info->exifLength     );
+    setIntField    (env, infoObj, "thumbnailOffset", info->thumbnailOffset);
+    setIntField    (env, infoObj, "thumbnailLength", info->thumbnailLength);
+}
+
+/**
+ * Set the native log level.
+ *
+ * This may be changed at any time, whether or not a camera is open.
+ *
+ * @param env JNI environment
+ * @param cls camera class reference
+ * @param level log level, one of the values from the Java LogLevel enumeration
+ */
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_setLogLevel(JNIEnv *env, jclass cls, jint level) {
+    setLogLevel(level);
+}
+
+/**
+ * Send native log output to a file, rather than stderr or a Java log handler.
+ *
+ * @param env JNI environment
+ * @param cls camera class reference
+ * @param path file path, or NULL to log to stderr
+ * @return true on success; false if the file could not be opened
+ */
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_setLogFile(JNIEnv *env, jclass cls, jstring path) {
+    const char *filePath = path ? (*env)->GetStringUTFChars(env, path, NULL) : NULL;
+
+    jboolean result = setLogFile(filePath) ? true : false;
+
+    if (filePath) {
+        (*env)->ReleaseStringUTFChars(env, path, filePath);
+    }
+
+    return result;
+}
+
+/**
+ * Send native log output to a Java log handler, rather than stderr or a file.
+ *
+ * The handler is invoked on the native logging thread, never on a camera callback thread.
+ *
+ * @param env JNI environment
+ * @param cls camera class reference
+ * @param handler log handler object reference, or NULL to log to stderr
+ */
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_setLogHandler(JNIEnv *env, jclass cls, jobject handler) {
+    jobject oldHandler = JniContext.logHandler;
+
+    // Revert to the default sink first, so the old handler is guaranteed to no longer be in use by
+    // the logging thread while the method id is replaced
+    setLogSink(NULL, NULL);
+
+    if (handler) {
+        // LogHandler#log(int,long,int,String):void
+        JniContext.logMethod  = (*env)->GetMethodID(env, (*env)->GetObjectClass(env, handler), "log", "(IJILjava/lang/String;)V");
+        assert(JniContext.logMethod != NULL);
+
+        JniContext.logHandler = (*env)->NewGlobalRef(env, handler);
+        setLogSink(javaLogSink, JniContext.logHandler);
+    } else {
+        JniContext.logHandler = NULL;
+    }
+
+    if (oldHandler) {
+        (*env)->DeleteGlobalRef(env, oldHandler);
+    }
+}
+
+// === Private implementation =====================================================================
+
+/**
+ * Native thread destructor.
+ * 
+ * Detaches the thread that was attached earlier for the native callback.
+ */
+static void jniThreadDestructor(void *env) {
+    JavaVM *jvm = JniContext.jvm;
+    (*jvm)->DetachCurrentThread(jvm);
+}
+
+/**
+ * Get a JNI environment for the current native thread, attaching the thread to the JVM if it is
+ * not already attached.
+ *
+ * The thread remains attached until it terminates, when the thread destructor detaches it.
+ *
+ * @return JNI environment, or NULL if the thread could not be attached
+ */
+static JNIEnv *attachCurrentThread(void) {
+    JavaVM *jvm = JniContext.jvm;
+    JNIEnv *env = NULL;
+
+    // Get a JNI environment for this thread
+    if (JNI_EDETACHED == (*jvm)->GetEnv(jvm, (void**) &env, REQUIRED_JNI_VERSION)) {
+        // There is no JNI environment available, meaning there is no current thread attached, so
+        // attach the thread
+        if (JNI_OK == (*jvm)->AttachCurrentThread(jvm, (void**) &env, NULL)) {
+            probe(jni__attach);
+            // A non-NULL thread-key value must be set for the thread destructor to run later, so
+            // set a value for the key (if one is not already set)
+            if (!pthread_getspecific(JniContext.threadKey)) {
+                if (pthread_setspecific(JniContext.threadKey, env)) {
+                    logError("Failed to set native thread key");
+                    return NULL;
+                }
+            }
+        } else {
+            logError("Failed to attach thread");
+            return NULL;
+        }
+    }
+
+    return env;
+}
+
+/**
+ * Log sink that forwards log records to a Java log handler.
+ *
+ * @param record log record
+ * @param handler global reference to the log handler
+ */
+static void javaLogSink(const LogRecord *record, void *handler) {
+    JNIEnv *env = attachCurrentThread();
+    if (!env) {
+        logToStream(record, stderr);
+        return;
+    }
+
+    jstring message = (*env)->NewStringUTF(env, record->message);
+
+    // LogHandler#log(int,long,int,String):void
+    (*env)->CallVoidMethod(env, (jobject) handler, JniContext.logMethod, record->level, (jlong) record->timestamp, record->thread, message);
+
+    // The logging thread has nowhere to report a failure in the handler
+    if ((*env)->ExceptionCheck(env)) {
+        (*env)->ExceptionClear(env);
+    }
+
+    (*env)->DeleteLocalRef(env, message);
+}
+
+static void setIntField(JNIEnv *env, jobject obj, const char *name, int32_t value) {
+    jfieldID field = (*env)->GetFieldID(env, (*env)->GetObjectClass(env, obj), name, "I");
+    assert(field != NULL);
+    (*env)->SetIntField(env, obj, field, value);
+}
+
+static void setBooleanField(JNIEnv *env, jobject obj, const char *name, bool value) {
+    jfieldID field = (*env)->GetFieldID(env, (*env)->GetObjectClass(env, obj), name, "Z");
+    assert(field != NULL);
+    (*env)->SetBooleanField(env, obj, field, value);
+}
+
+static uint32_t pictureDataSink(void *userdata, const uint8_t *data, uint32_t length) {
+    PictureHandlerContext *handlerContext = (PictureHandlerContext *) userdata;
+    JNIEnv *env = handlerContext->env;
+
+    jbyteArray array = (*env)->NewByteArray(env, length);
+    if (!array) {
+        return 0;
+    }
+
+    (*env)->SetByteArrayRegion(env, array, 0, length, (jbyte *) data);
+
+    probe1(jni__upcall__start, length);
+
+    // PictureCaptureHandler#pictureData(byte[]):int
+    jint written = (*env)->CallIntMethod(env, handlerContext->handler, handlerContext->pictureDataMethod, array);
+
+    probe2(jni__upcall__end, length, written);
+
+    (*env)->DeleteLocalRef(env, array);
+
+    if ((*env)->ExceptionCheck(env)) {
+        return 0;
+    }
+
+    return written;
+}
+
+/**
+ * Capture a picture, delivering it to a picture capture handler on the calling thread.
+ *
+ * The picture is collected natively and then passed to the handler in chunks the size of the
+ * encoder buffers, see picamCaptureShared.
+ *
+ * @param env JNI environment
+ * @param handler picture capture handler object reference
+ * @param encoder encoding and quality for this capture, or NULL for the configured values
+ * @param delay
+ * @return true if the capture was successfully triggered; false if it was not
+ */
+static jboolean performPictureCapture(JNIEnv *env, jobject handler, const EncoderConfig *encoder, jint delay) {
+    if (!handler) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Handler must not be null");
+        return false;
+    }
+
+    jclass handlerClass = (*env)->GetObjectClass(env, handler);
+
+    PictureHandlerContext handlerContext = {
+        .env               = env,
+        .handler           = handler,
+        // PictureCaptureHandler#pictureData(byte[]):int
+        .pictureDataMethod = (*env)->GetMethodID(env, handlerClass, "pictureData", "([B)I")
+    };
+
+    assert(handlerContext.pictureDataMethod != NULL);
+
+    if (delay > 0) {
+        usleep(delay * 1000);
+    }
+
+    // PictureCaptureHandler#begin():void
+    (*env)->CallVoidMethod(env, handler, (*env)->GetMethodID(env, handlerClass, "begin", "()V"));
+    if ((*env)->ExceptionCheck(env)) {
+        // Caller will see the thrown exception, not this return value
+        return false;
+    }
+
+    // Captures requested concurrently from other threads may share this one
+    char *captureFailure = picamCaptureShared(context, encoder, pictureDataSink, &handlerContext, &lastPictureInfo);
+
+    if (!(*env)->ExceptionCheck(env)) {
+        // PictureCaptureHandler#end():void
+        (*env)->CallVoidMethod(env, handler, (*env)->GetMethodID(env, handlerClass, "end", "()V"));
+    }
+
+    if ((*env)->ExceptionCheck(env)) {
+        // Caller will see the thrown exception, not this return value
+        return false;
+    }
+
+    if (captureFailure) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "uk/co/caprica/picam/CaptureFailedException"), captureFailure);
+    }
+
+    return (jboolean) (captureFailure == NULL);
+}
+
+/**
+ * Perform a capture whose output is delivered to a region capture handler, on the calling thread.
+ *
+ * @param env JNI environment
+ * @param handler region capture handler object reference
+ * @param request what to capture
+ * @param delay
+ * @return true if the capture succeeded; false if it did not
+ */
+static jboolean performRegionCapture(JNIEnv *env, jobject handler, RegionRequest *request, jint delay) {
+    jclass handlerClass = (*env)->GetObjectClass(env, handler);
+
+    RegionHandlerContext handlerContext = {
+        .env              = env,
+        .handler          = handler,
+        // RegionCaptureHandler#regionData(int,byte[]):void
+        .regionDataMethod = (*env)->GetMethodID(env, handlerClass, "regionData", "(I[B)V")
+    };
+
+    assert(handlerContext.regionDataMethod != NULL);
+
+    if (delay > 0) {
+        usleep(delay * 1000);
+    }
+
+    char *captureFailure = NULL;
+
+    // RegionCaptureHandler#begin():void
+    (*env)->CallVoidMethod(env, handler, (*env)->GetMethodID(env, handlerClass, "begin", "()V"));
+    if ((*env)->ExceptionCheck(env)) {
+        // Caller will see the thrown exception, not this return value
+        return false;
+    }
+
+    switch (request->type) {
+        case REGION_REQUEST_STEREO:
+            captureFailure = picamCaptureStereo(context, request->encode, request->interleave, regionDataSink, &handlerContext);
+            break;
+        case REGION_REQUEST_BRACKET:
+            captureFailure = picamCaptureBracket(context, request->settings, request->count, request->settle, request->fuse, request->encode, regionDataSink, &handlerContext);
+            break;
+        case REGION_REQUEST_LOW_LIGHT:
+            captureFailure = picamCaptureLowLight(context, request->count, request->shutterSpeed, request->median, request->align, request->encode, regionDataSink, &handlerContext);
+            break;
+        default:
+            captureFailure = picamCaptureRegions(context, request->regions, request->count, request->encode, regionDataSink, &handlerContext);
+            break;
+    }
+
+    if (!(*env)->ExceptionCheck(env)) {
+        // RegionCaptureHandler#end():void
+        (*env)->CallVoidMethod(env, handler, (*env)->GetMethodID(env, handlerClass, "end", "()V"));
+    }
+
+    if ((*env)->ExceptionCheck(env)) {
+        // Caller will see the thrown exception, not this return value
+        return false;
+    }
+
+    if (captureFailure) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "uk/co/caprica/picam/CaptureFailedException"), captureFailure);
+    }
+
+    return (jboolean) (captureFailure == NULL);
+}
+
+/**
+ * Capture a raw picture and convert it natively to 0xFFRRGGBB pixels, on the calling thread.
+ *
+ * The destination, a Java int array or a direct buffer, is acquired only for the conversion after
+ * the capture has completed, see rgbAcquire and rgbRelease.
+ *
+ * @param env JNI environment
+ * @param handlerContext destination for the pixels
+ * @param width width of the picture, or zero for the configured width
+ * @param height height of the picture, or zero for the configured height
+ * @param delay
+ * @return true if the capture succeeded; false if it did not
+ */
+static jboolean performRgbCapture(JNIEnv *env, RgbHandlerContext *handlerContext, jint width, jint height, jint delay) {
+    if (delay > 0) {
+        usleep(delay * 1000);
+    }
+
+    char *captureFailure = picamCaptureRgb(context, width, height, rgbAcquire, rgbRelease, handlerContext);
+
+    if ((*env)->ExceptionCheck(env)) {
+        // Caller will see the thrown exception, not this return value
+        return false;
+    }
+
+    if (captureFailure) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "uk/co/caprica/picam/CaptureFailedException"), captureFailure);
+    }
+
+    return (jboolean) (captureFailure == NULL);
+}
+
+/**
+ * Provide the pixels for an RGB capture, pinning the Java array if there is one.
+ *
+ * No other JNI calls may be made until the pixels are released.
+ *
+ * @param userdata RGB handler context
+ * @param count number of pixels required
+ * @return pixels; or NULL, with an exception pending, if the destination is too small
+ */
+static uint32_t *rgbAcquire(void *userdata, size_t count) {
+    RgbHandlerContext *handlerContext = (RgbHandlerContext *) userdata;
+    JNIEnv            *env            = handlerContext->env;
+
+    if (handlerContext->array) {
+        if ((size_t) (*env)->GetArrayLength(env, handlerContext->array) < count) {
+            (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Pixels array is too small for the picture");
+            return NULL;
+        }
+        return (*env)->GetPrimitiveArrayCritical(env, handlerContext->array, NULL);
+    } else {
+        if ((size_t) (*env)->GetDirectBufferCapacity(env, handlerContext->buffer) < count * sizeof(uint32_t)) {
+            (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Buffer is too small for the picture");
+            return NULL;
+        }
+        return (*env)->GetDirectBufferAddress(env, handlerContext->buffer);
+    }
+}
+
+/**
+ * Release the pixels for an RGB capture, copying them back to the Java array if the JVM did not pin it.
+ *
+ * @param userdata RGB handler context
+ * @param pixels pixels provided by rgbAcquire
+ */
+static void rgbRelease(void *userdata, uint32_t *pixels) {
+    RgbHandlerContext *handlerContext = (RgbHandlerContext *) userdata;
+
+    if (handlerContext->array) {
+        (*handlerContext->env)->ReleasePrimitiveArrayCritical(handlerContext->env, handlerContext->array, pixels, 0);
+    }
+}
+
+/**
+ * Region sink that delivers region data to a region capture handler, on the calling thread.
+ *
+ * @param userdata region handler context
+ * @param index region index
+ * @param data region data
+ * @param length length of the region data
+ * @return non-zero to continue with the next region; zero if the handler threw an exception
+ */
+static int regionDataSink(void *userdata, uint32_t index, const uint8_t *data, size_t length) {
+    RegionHandlerContext *handlerContext = (RegionHandlerContext *) userdata;
+    JNIEnv *env = handlerContext->env;
+
+    jbyteArray array = (*env)->NewByteArray(env, length);
+    if (!array) {
+        return 0;
+    }
+
+    (*env)->SetByteArrayRegion(env, array, 0, length, (jbyte *) data);
+
+    (*env)->CallVoidMethod(env, handlerContext->handler, handlerContext->regionDataMethod, (jint) index, array);
+
+    (*env)->DeleteLocalRef(env, array);
+
+    return !(*env)->ExceptionCheck(env);
+}
+
+/**
+ * Timelapse sink that delivers each frame, or skipped slot, to a timelapse handler on the calling
+ * thread.
+ *
+ * @param userdata timelapse handler context
+ * @param frame frame or skipped slot
+ * @return non-zero to continue the timelapse; zero if the handler threw an exception
+ */
+static int timelapseFrameSink(void *userdata, const TimelapseFrame *frame) {
+    TimelapseHandlerContext *handlerContext = (TimelapseHandlerContext *) userdata;
+    JNIEnv *env = handlerContext->env;
+
+    if (frame->skipped) {
+        (*env)->CallVoidMethod(env, handlerContext->handler, handlerContext->skippedMethod, (jint) frame->index, (jlong) frame->scheduledTime, (jlong) frame->actualTime);
+        return !(*env)->ExceptionCheck(env);
+    }
+
+    jbyteArray array = NULL;
+    jstring    file  = NULL;
+
+    if (frame->data) {
+        array = (*env)->NewByteArray(env, frame->length);
+        if (!array) {
+            return 0;
+        }
+        (*env)->SetByteArrayRegion(env, array, 0, frame->length, (jbyte *) frame->data);
+    }
+
+    if (frame->path) {
+        file = (*env)->NewStringUTF(env, frame->path);
+        if (!file) {
+            return 0;
+        }
+    }
+
+    (*env)->CallVoidMethod(env, handlerContext->handler, handlerContext->frameMethod, (jint) frame->index, (jlong) frame->scheduledTime, (jlong) frame->actualTime, array, file);
+
+    if (array) {
+        (*env)->DeleteLocalRef(env, array);
+    }
+    if (file) {
+        (*env)->DeleteLocalRef(env, file);
+    }
+
+    return !(*env)->ExceptionCheck(env);
+}
+
+/**
+ * Bayer sink that delivers the sensor-raw data to a Bayer capture handler, on the calling thread.
+ *
+ * @param userdata Bayer handler context
+ * @param frame raw data
+ */
+static void bayerDataSink(void *userdata, const BayerFrame *frame) {
+    BayerHandlerContext *handlerContext = (BayerHandlerContext *) userdata;
+    JNIEnv *env = handlerContext->env;
+
+    size_t pixels = (size_t) frame->width * frame->height;
+
+    jshortArray raw = newShortArray(env, frame->raw, pixels);
+    if (!raw) {
+        return;
+    }
+
+    jshortArray rgb = NULL;
+    if (frame->rgb) {
+        rgb = newShortArray(env, frame->rgb, pixels * 3);
+        if (!rgb) {
+            (*env)->DeleteLocalRef(env, raw);
+            return;
+        }
+    }
+
+    (*env)->CallVoidMethod(env, handlerContext->handler, handlerContext->bayerDataMethod, (jint) frame->width, (jint) frame->height, (jint) frame->bitDepth, (jint) frame->bayerOrder, (jint) frame->blackLevel, raw, rgb);
+
+    (*env)->DeleteLocalRef(env, raw);
+    if (rgb) {
+        (*env)->DeleteLocalRef(env, rgb);
+    }
+}
+
+static jshortArray newShortArray(JNIEnv *env, const uint16_t *data, size_t length) {
+    jshortArray array = (*env)->NewShortArray(env, length);
+    if (array) {
+        (*env)->SetShortArrayRegion(env, array, 0, length, (const jshort *) data);
+    }
+    return array;
+}
+
+/**
+ * Validate and submit a frame to the standalone hardware encoder.
+ *
+ * @param env JNI environment
+ * @param data frame data
+ * @param length length of the memory containing the frame
+ * @param format MMAL encoding of the frame
+ * @param width frame width in pixels
+ * @param height frame height in pixels
+ * @param stride row stride of the frame in bytes
+ * @param encoding MMAL encoding of the output, zero for the configured encoding
+ * @param quality JPEG quality of the output, zero for the configured quality
+ * @return true if the frame was submitted; false if it was not
+ */
+static jboolean submitFrameData(JNIEnv *env, const uint8_t *data, jlong length, jint format, jint width, jint height, jint stride, jint encoding, jint quality) {
+    size_t size = width > 0 && height > 0 && stride > 0 ? picamFrameSize(format, width, height, stride) : 0;
+
+    if (!size || length < 0 || (size_t) length < size) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "java/lang/IllegalArgumentException"), "Frame format must be I420, RGB24 or RGBA, and the frame must fit the size and stride");
+        return false;
+    }
+
+    EncoderConfig configured;
+    picamEncoderConfig(context, &configured);
+
+    EncoderConfig encoder = {
+        .encoding = encoding != 0 ? encoding           : configured.encoding,
+        .quality  = quality  >  0 ? (uint32_t) quality : configured.quality
+    };
+
+    char *encodeFailure = picamSubmitFrame(context, &encoder, format, width, height, data, stride);
+    if (encodeFailure) {
+        (*env)->ThrowNew(env, (*env)->FindClass(env, "uk/co/caprica/picam/CaptureFailedException"), encodeFailure);
+    }
 
-    cleanupJniContext(env);
+    return (jboolean) (encodeFailure == NULL);
 }
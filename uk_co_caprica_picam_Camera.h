@@ -22,8 +22,37 @@
 
 #include <jni.h>
 
+JNIEXPORT jint JNICALL picamRegisterNatives(JNIEnv *);
+
 JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_create(JNIEnv *, jobject, jobject);
 JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_capture(JNIEnv *, jobject, jobject, jint);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_captureEncoded(JNIEnv *, jobject, jobject, jint, jint, jint);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_captureRegions(JNIEnv *, jobject, jobject, jdoubleArray, jintArray, jboolean, jint);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_captureStereo(JNIEnv *, jobject, jobject, jboolean, jboolean, jint);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_captureBracket(JNIEnv *, jobject, jobject, jintArray, jintArray, jint, jboolean, jboolean, jint);
 JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_destroy(JNIEnv *, jobject);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_startRecording(JNIEnv *, jobject);
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_stopRecording(JNIEnv *, jobject);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_flushRecording(JNIEnv *, jobject, jstring, jint);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_captureLowLight(JNIEnv *, jobject, jobject, jint, jint, jboolean, jboolean, jboolean, jint);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_captureRgb(JNIEnv *, jobject, jintArray, jint, jint, jint);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_captureRgbBuffer(JNIEnv *, jobject, jobject, jint, jint, jint);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_captureBayer(JNIEnv *, jobject, jobject, jboolean, jint);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_encodeFrame(JNIEnv *, jobject, jobject, jint, jint, jint, jint, jint, jint);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_encodeFrameAddress(JNIEnv *, jobject, jlong, jint, jint, jint, jint, jint, jint, jint);
+JNIEXPORT jbyteArray JNICALL Java_uk_co_caprica_picam_Camera_receiveFrame(JNIEnv *, jobject);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_timelapse(JNIEnv *, jobject, jobject, jlong, jlong, jint, jint, jboolean, jboolean, jstring);
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_stopTimelapse(JNIEnv *, jobject);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_annotate(JNIEnv *, jobject, jstring);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_lockExposure(JNIEnv *, jobject);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_unlockExposure(JNIEnv *, jobject);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_startTrace(JNIEnv *, jobject, jstring, jboolean);
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_stopTrace(JNIEnv *, jobject);
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_statistics(JNIEnv *, jobject, jobject);
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_pictureInfo(JNIEnv *, jobject, jobject);
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_sensor(JNIEnv *, jobject, jobject);
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_setLogLevel(JNIEnv *, jclass, jint);
+JNIEXPORT jboolean JNICALL Java_uk_co_caprica_picam_Camera_setLogFile(JNIEnv *, jclass, jstring);
+JNIEXPORT void JNICALL Java_uk_co_caprica_picam_Camera_setLogHandler(JNIEnv *, jclass, jobject);
 
 #endif
\ No newline at end of file